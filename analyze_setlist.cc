@@ -0,0 +1,130 @@
+// Analyzes the tracks of a scripted show ahead of time, for the viewer to
+// follow when they play (see setlist.h):
+//
+//   ./analyze_setlist [options] --output=show.setlist TRACK...
+//
+// TRACKs are audio files in any format aubio reads. Each one is run through
+// the same analysis as live input, so the analysis parameters must match the
+// viewer's. What was found in each is printed as it goes.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+// Disco Wookie includes
+#include "setlist.h"
+
+using std::string;
+using std::vector;
+
+static void PrintUsage(const char *program) {
+  printf("Usage: %s [options] --output=FILE TRACK...\n"
+         "\n"
+         "  --output=FILE            where to write the setlist\n"
+         "  --sample-rate=HZ         the viewer's input sample rate\n"
+         "                           (default 44100)\n"
+         "  --window=N               its FFT window (default 1024)\n"
+         "  --hop=N                  its hop (default 256)\n"
+         "  --low-latency            128-sample hops, as with the viewer's\n"
+         "                           --low-latency\n"
+         "  --help                   show this message\n",
+         program);
+}
+
+// If arg is "--name=value", points value at the value and returns true.
+static bool MatchValue(const char *arg, const char *name, const char **value) {
+  size_t length = strlen(name);
+  if (strncmp(arg, name, length) == 0 && arg[length] == '=') {
+    *value = arg + length + 1;
+    return true;
+  }
+  return false;
+}
+
+// Prints seconds as minutes and seconds, as a DJ would read them.
+static void PrintTime(float seconds) {
+  printf(" %d:%04.1f", (int)seconds / 60, seconds - 60 * ((int)seconds / 60));
+}
+
+int main(int argc, char **argv) {
+  Setlist setlist;
+  string output;
+  int hop_size = 0;
+  bool low_latency = false;
+  vector<string> paths;
+  for (int i = 1; i < argc; ++i) {
+    const char *arg = argv[i];
+    const char *value;
+    if (strcmp(arg, "--help") == 0) {
+      PrintUsage(argv[0]);
+      return 0;
+    } else if (strcmp(arg, "--low-latency") == 0) {
+      low_latency = true;
+    } else if (MatchValue(arg, "--output", &value)) {
+      output = value;
+    } else if (MatchValue(arg, "--sample-rate", &value)) {
+      setlist.config.sample_rate = atoi(value);
+    } else if (MatchValue(arg, "--window", &value)) {
+      setlist.config.win_size = atoi(value);
+    } else if (MatchValue(arg, "--hop", &value)) {
+      hop_size = atoi(value);
+    } else if (arg[0] == '-' && arg[1] == '-') {
+      printf("Unknown option: %s\n\n", arg);
+      PrintUsage(argv[0]);
+      return 1;
+    } else {
+      paths.push_back(arg);
+    }
+  }
+  if (low_latency) {
+    setlist.config.hop_size = AudioConfig::LowLatency().hop_size;
+  }
+  if (hop_size > 0) {
+    setlist.config.hop_size = hop_size;
+  }
+  if (paths.empty() || output.empty()) {
+    PrintUsage(argv[0]);
+    return 1;
+  }
+  if (!setlist.config.Validate()) {
+    return 1;
+  }
+
+  const AudioConfig &config = setlist.config;
+  const float hop_s = (float)config.hop_size / config.sample_rate;
+  for (unsigned int i = 0; i < paths.size(); ++i) {
+    SetlistTrack track;
+    if (AnalyzeTrack(paths[i], config, &track) != 0) {
+      return 1;
+    }
+
+    float tempo = 0.0f;
+    for (unsigned int b = 0; b < track.beats.size(); ++b) {
+      tempo += track.beats[b].tempo_bpm;
+    }
+    if (!track.beats.empty()) {
+      tempo /= track.beats.size();
+    }
+    printf("%d. %s:", i + 1, track.name.c_str());
+    PrintTime(track.levels.size() * hop_s);
+    printf(", %d beats at %.1f bpm, %d onsets\n", (int)track.beats.size(),
+           tempo, (int)track.onsets.size());
+    printf("   sections start at");
+    PrintTime(0.0f);
+    for (unsigned int s = 0; s < track.sections.size(); ++s) {
+      PrintTime(track.sections[s] * hop_s);
+    }
+    printf("\n");
+    setlist.tracks.push_back(track);
+  }
+
+  if (setlist.Save(output) != 0) {
+    return 1;
+  }
+  printf("Wrote %d tracks to %s.\n", (int)setlist.tracks.size(),
+         output.c_str());
+  return 0;
+}
@@ -3,54 +3,366 @@
 // PortAudio includes
 #include "portaudio.h"
 
+#include "channel_pool.h"
+#include "metrics.h"
+#include "setlist_follower.h"
+#include "trace.h"
+
+#include <fcntl.h>
 #include <stdio.h>
+#include <unistd.h>
+
+#include <chrono>
+
+// From a fraction of the shortest hop anyone uses (1.5 ms for 64 samples)
+// to two of the default ones (5.8 ms each).
+static const double kCallbackBounds[] = {
+  0.0001, 0.00025, 0.0005, 0.001, 0.002, 0.003, 0.006, 0.012
+};
+
+// Onset strengths start at the detector's threshold, a little under 0.2.
+static const double kStrengthBounds[] = {
+  0.2, 0.25, 0.3, 0.4, 0.5, 0.6, 0.7, 0.8, 0.9, 1.0
+};
+
+static MetricHistogram callback_seconds(
+    "hallucination_audio_callback_seconds",
+    "Time spent analyzing each hop of audio.", kCallbackBounds,
+    sizeof(kCallbackBounds) / sizeof(kCallbackBounds[0]));
+static MetricCounter hops("hallucination_audio_hops_total",
+                          "Hops of audio analyzed.");
+static MetricCounter input_overflows(
+    "hallucination_audio_input_overflows_total",
+    "Callbacks in which PortAudio reported lost input.");
+static MetricCounter onsets("hallucination_audio_onsets_total",
+                            "Onsets detected.");
+static MetricHistogram onset_strength(
+    "hallucination_audio_onset_strength",
+    "Strength of each onset detected, from 0 to 1.", kStrengthBounds,
+    sizeof(kStrengthBounds) / sizeof(kStrengthBounds[0]));
+static MetricCounter beats("hallucination_audio_beats_total",
+                           "Beats detected.");
+static MetricCounter dropped_events(
+    "hallucination_audio_events_dropped_total",
+    "Onsets and beats detected again before the render thread took the "
+    "last one.");
 
 static int paCallback(const void *inputBuffer, void *outputBuffer,
                       unsigned long framesPerBuffer,
                       const PaStreamCallbackTimeInfo *timeInfo,
                       PaStreamCallbackFlags statusFlags, void *userData) {
+  TRACE_THREAD_NAME("audio");
+  TRACE_SCOPE("paCallback");
+  const std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+
+  // Input the host had no room for is lost before we ever see it.
+  if (statusFlags & paInputOverflow) {
+    input_overflows.Add();
+  }
+
   AudioProcessor *ap = static_cast<AudioProcessor *>(userData);
 
-  float *in = (float *)inputBuffer;
+  ap->ProcessInput((const float *)inputBuffer);
+
+  callback_seconds.Observe(std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count());
+  return 0;
+}
+
+AudioProcessor::AudioProcessor()
+  : num_beats(0),
+    tempo_bpm(0.0f),
+    pitch_hz(0.0f),
+    pitch_confidence(0.0f),
+    silent(true),
+    track(-1),
+    section(-1),
+    tempo_out_(NULL),
+    tempo_obj_(NULL),
+    pitch_out_(NULL),
+    pitch_obj_(NULL),
+    notify_fd_(-1),
+    portaudio_(false),
+    channel_(false),
+    channels_(NULL),
+    setlist_(NULL),
+    advance_s_(0.0f),
+    follower_(NULL) {
+  if (pipe(wakeup_pipe_) != 0) {
+    printf("Unable to create the audio wakeup pipe.\n");
+    wakeup_pipe_[0] = wakeup_pipe_[1] = -1;
+    return;
+  }
+  for (int i = 0; i < 2; ++i) {
+    fcntl(wakeup_pipe_[i], F_SETFL, O_NONBLOCK);
+    fcntl(wakeup_pipe_[i], F_SETFD, FD_CLOEXEC);
+  }
+}
 
-  // TODO(wcraddock): put these in a class.
-  int win_size = 1024;
-  int hop_size = win_size / 4;
+bool AudioConfig::Validate() const {
+  if (win_size < 2 || (win_size & (win_size - 1)) != 0) {
+    printf("Error: window size %u is not a power of two.\n", win_size);
+    return false;
+  }
+  if (hop_size == 0 || hop_size > win_size) {
+    printf("Error: hop size %u must be between 1 and the window size.\n",
+           hop_size);
+    return false;
+  }
+  if (sample_rate < 8000) {
+    printf("Error: sample rate %u is too low.\n", sample_rate);
+    return false;
+  }
+  if (channels < 1 || channels > kMaxChannels) {
+    printf("Error: %d input channels must be between 1 and %d.\n", channels,
+           kMaxChannels);
+    return false;
+  }
+  return true;
+}
 
-  // Run the aubio onset and beat detectors.
-  fvec_t in_vec = { hop_size, in };
-  aubio_onset_do(ap->onset_obj_, &in_vec, ap->onset_out_);
-  aubio_tempo_do(ap->tempo_obj_, &in_vec, ap->tempo_out_);
+void AudioProcessor::ProcessHop(float *in) {
+  fvec_t in_vec = { config_.hop_size, in };
+  const bool was_silent = silent;
+  silent = aubio_silence_detection(&in_vec, kSilenceDb) != 0;
+  if (was_silent && !silent) {
+    Wake();
+  }
 
-  smpl_t is_onset = fvec_get_sample(ap->onset_out_, 0);
-  if (is_onset) {
-    ap->is_onset = true;
+  // Onsets are found in the bands' spectrum, so there is one FFT for both.
+  // While a setlist track is followed, its envelopes are shown instead.
+  const bool was_following = track.load(std::memory_order_relaxed) >= 0;
+  {
+    TRACE_SCOPE("BandAnalyzer::ProcessHop");
+    bands.ProcessHop(in, !was_following);
   }
+  bool onset;
+  {
+    TRACE_SCOPE("OnsetEnsemble::ProcessSpectrum");
+    onset = onset_detector.ProcessSpectrum(bands.spectrum(), silent);
+  }
+  float onset_s = onset_detector.last_onset_s();
+  float strength = onset_detector.strength();
 
-  // If a beat occured in this hop, set the flag in AudioProcessor.
-  // It will be picked up asynchronously by the OpenGL code.
-  // TODO(wcraddock): might be best to use a real thread-safe queue, but I
-  // don't see a synchronization problem with this.
-  smpl_t is_beat = fvec_get_sample(ap->tempo_out_, 0);
-  if (is_beat) {
-    ap->is_beat = true;
+  SetlistCue cue;
+  bool following = false;
+  if (follower_) {
+    TRACE_SCOPE("SetlistFollower::ProcessHop");
+    uint32_t weak_bits;
+    const uint32_t fingerprint =
+        fingerprinter_.ProcessSpectrum(bands.spectrum(), &weak_bits);
+    following = follower_->ProcessHop(fingerprint, weak_bits, &cue);
   }
 
-  return 0;
+  bool beat = false;
+  float beat_s = 0.0f, tempo = 0.0f, confidence = 0.0f;
+  if (following) {
+    // The onset detector keeps running, so that it is ready the moment the
+    // track is lost.
+    onset = cue.onset;
+    onset_s = cue.onset_s;
+    strength = cue.onset_strength;
+    beat = cue.beat;
+    beat_s = cue.beat_s;
+    tempo = cue.tempo_bpm;
+    confidence = cue.beat_confidence;
+    bands.Publish(cue.envelopes);
+    pitch_hz.store(cue.pitch_hz, std::memory_order_relaxed);
+    pitch_confidence.store(cue.pitch_confidence, std::memory_order_relaxed);
+    section.store(cue.section, std::memory_order_relaxed);
+    track.store(cue.track, std::memory_order_relaxed);
+  } else {
+    if (was_following) {
+      track.store(-1, std::memory_order_relaxed);
+      section.store(-1, std::memory_order_relaxed);
+    }
+
+    // Run the aubio beat and pitch detectors.
+    {
+      TRACE_SCOPE("aubio_tempo_do");
+      aubio_tempo_do(tempo_obj_, &in_vec, tempo_out_);
+    }
+
+    {
+      TRACE_SCOPE("aubio_pitch_do");
+      aubio_pitch_do(pitch_obj_, &in_vec, pitch_out_);
+    }
+
+    pitch_hz.store(fvec_get_sample(pitch_out_, 0), std::memory_order_relaxed);
+    pitch_confidence.store(aubio_pitch_get_confidence(pitch_obj_),
+                           std::memory_order_relaxed);
+
+    beat = fvec_get_sample(tempo_out_, 0) != 0;
+    if (beat) {
+      beat_s = aubio_tempo_get_last_s(tempo_obj_);
+      tempo = aubio_tempo_get_bpm(tempo_obj_);
+      confidence = aubio_tempo_get_confidence(tempo_obj_);
+    }
+  }
+
+  // A channel's hops are the mix's too.
+  if (!channel_) {
+    hops.Add();
+    if (onset) {
+      onsets.Add();
+      onset_strength.Observe(strength);
+    }
+    if (beat) {
+      beats.Add();
+      TRACE_COUNTER("tempo_bpm", tempo);
+    }
+  }
+  const int notify_fd = notify_fd_.load(std::memory_order_relaxed);
+
+  if (notify_fd < 0) {
+    if (onset) {
+      ReportOnset(onset_s, strength);
+    }
+    if (beat) {
+      ReportBeat(beat_s, tempo, confidence);
+    }
+    return;
+  }
+
+  const double now = std::chrono::duration<double>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  bool queued = false;
+  if (onset) {
+    AudioEvent event = { false, now, 0.0f, strength };
+    queued |= deferred_.Push(event);
+  }
+  if (beat) {
+    AudioEvent event = { true, now, tempo, confidence };
+    queued |= deferred_.Push(event);
+  }
+  if (queued) {
+    const char byte = 0;
+    ssize_t written = write(notify_fd, &byte, 1);
+    (void)written;
+  }
+}
+
+void AudioProcessor::ProcessInput(const float *in) {
+  if (!channels_) {
+    ProcessHop(const_cast<float *>(in));
+    return;
+  }
+
+  // The workers get their channels first, so that they analyze them while
+  // this thread analyzes the mix.
+  const int num_channels = config_.channels;
+  channels_->Push(in, config_.hop_size);
+
+  // The mean rather than the sum, so that a loud mic on every channel
+  // cannot push the mix past full scale.
+  const float scale = 1.0f / num_channels;
+  for (uint_t i = 0; i < config_.hop_size; ++i) {
+    float sum = 0.0f;
+    for (int c = 0; c < num_channels; ++c) {
+      sum += in[i * num_channels + c];
+    }
+    mix_[i] = sum * scale;
+  }
+  ProcessHop(&mix_[0]);
+}
+
+int AudioProcessor::num_channels() const {
+  return channels_ ? channels_->num_channels() : 0;
+}
+
+AudioProcessor *AudioProcessor::channel(int c) {
+  if (c == 0) {
+    return this;
+  }
+  if (c < 0 || c > num_channels()) {
+    return NULL;
+  }
+  return channels_->channel(c - 1);
+}
+
+void AudioProcessor::Follow(const Setlist *setlist, float advance_s) {
+  setlist_ = setlist;
+  advance_s_ = advance_s;
 }
 
-int AudioProcessor::Init() {
+void AudioProcessor::Defer(int notify_fd) {
+  notify_fd_ = notify_fd;
+}
+
+void AudioProcessor::ReportOnset(float time_s, float strength) {
+  Report report = { time_s, 0.0f, strength };
+  if (!onset_reports_.Push(report)) {
+    dropped_events.Add();
+  }
+
+  // After the push, so that whoever wakes finds it queued.
+  Wake();
+}
+
+void AudioProcessor::ReportBeat(float time_s, float tempo, float confidence) {
+  TRACE_FLOW_BEGIN("beat", num_beats + 1);
+  tempo_bpm.store(tempo, std::memory_order_relaxed);
+  num_beats++;
+  Report report = { time_s, tempo, confidence };
+  if (!beat_reports_.Push(report)) {
+    dropped_events.Add();
+  }
+  Wake();
+}
+
+void AudioProcessor::ReportLevels(const float *envelopes, float pitch,
+                                  float confidence, bool is_silent) {
+  bands.Publish(envelopes);
+  pitch_hz.store(pitch, std::memory_order_relaxed);
+  pitch_confidence.store(confidence, std::memory_order_relaxed);
+  const bool was_silent = silent;
+  silent = is_silent;
+  if (was_silent && !is_silent) {
+    Wake();
+  }
+}
+
+void AudioProcessor::Wake() {
+  if (wakeup_pipe_[1] >= 0) {
+    const char byte = 0;
+    ssize_t written = write(wakeup_pipe_[1], &byte, 1);
+    (void)written;
+  }
+}
+
+void AudioProcessor::JoinMix(const AudioProcessor &mix) {
+  channel_ = true;
+  if (wakeup_pipe_[0] >= 0) {
+    close(wakeup_pipe_[0]);
+    close(wakeup_pipe_[1]);
+  }
+  // Copies of mix's descriptors share its pipe, and its non-blocking flag,
+  // but are closed with this.
+  wakeup_pipe_[0] = wakeup_pipe_[1] = -1;
+  if (mix.wakeup_pipe_[0] >= 0) {
+    wakeup_pipe_[0] = fcntl(mix.wakeup_pipe_[0], F_DUPFD_CLOEXEC, 0);
+    wakeup_pipe_[1] = fcntl(mix.wakeup_pipe_[1], F_DUPFD_CLOEXEC, 0);
+  }
+  if (wakeup_pipe_[0] < 0 || wakeup_pipe_[1] < 0) {
+    if (wakeup_pipe_[0] >= 0) {
+      close(wakeup_pipe_[0]);
+    }
+    if (wakeup_pipe_[1] >= 0) {
+      close(wakeup_pipe_[1]);
+    }
+    wakeup_pipe_[0] = wakeup_pipe_[1] = -1;
+  }
+}
+
+int AudioProcessor::Init(const AudioConfig &config) {
   // Initialize PortAudio
   PaError err = Pa_Initialize();
   if (err != paNoError) {
     printf("PortAudio error: %s\n", Pa_GetErrorText(err));
     return err;
   }
-
-  // TODO(wcraddock): put these parameters into the class constructor.
-  uint_t win_size = 1024;
-  uint_t hop_size = win_size / 4;
-  uint_t sample_rate = 44100;
+  portaudio_ = true;
 
   PaStreamParameters inputParameters;
   inputParameters.device =
@@ -59,20 +371,41 @@ int AudioProcessor::Init() {
     printf("Error: No default input device.\n");
     return paNoDevice;
   }
-  inputParameters.channelCount = 1; /* mono input */
+  const PaDeviceInfo *device = Pa_GetDeviceInfo(inputParameters.device);
+  if (device->maxInputChannels < config.channels) {
+    printf("Error: input device %s has %d channels, not %d.\n", device->name,
+           device->maxInputChannels, config.channels);
+    return paInvalidChannelCount;
+  }
+  inputParameters.channelCount = config.channels;
   inputParameters.sampleFormat = paFloat32;
-  inputParameters.suggestedLatency =
-      Pa_GetDeviceInfo(inputParameters.device)->defaultLowInputLatency;
+  inputParameters.suggestedLatency = device->defaultLowInputLatency;
   inputParameters.hostApiSpecificStreamInfo = NULL;
 
-  // Open an audio I/O stream for one input (microphone).
+  // Not every device can do every rate; say so clearly rather than failing
+  // inside Pa_OpenStream.
+  err = Pa_IsFormatSupported(&inputParameters, NULL, config.sample_rate);
+  if (err != paFormatIsSupported) {
+    printf("Error: input device does not support %u Hz: %s\n",
+           config.sample_rate, Pa_GetErrorText(err));
+    return err;
+  }
+
+  // The detectors must exist before the first callback arrives, and if the
+  // channels cannot be analyzed, there is no stream to close.
+  CreateDetectors(config);
+  if (config.channels > 1 && !channels_) {
+    return paInsufficientMemory;
+  }
+
+  // Open an audio I/O stream for the input (microphone or interface).
   PaStream *stream;
   err = Pa_OpenStream(
       &stream,
-      &inputParameters,          /* mono input */
+      &inputParameters,          /* config.channels, interleaved */
       NULL,                      /* no output channels */
-      sample_rate,
-      hop_size,     /* frames per buffer, i.e. the number
+      config.sample_rate,
+      config.hop_size, /* frames per buffer, i.e. the number
                        of sample frames that PortAudio will
                        request from the callback. Many apps
                        may want to use
@@ -85,53 +418,137 @@ int AudioProcessor::Init() {
   if (err != paNoError)
     return err;
 
+  printf("Audio analysis: %u Hz, %u-sample window, %u-sample hop "
+         "(%.1f ms).\n", config.sample_rate, config.win_size,
+         config.hop_size, 1000.0f * config.hop_size / config.sample_rate);
+
   // Start the input audio stream
   err = Pa_StartStream(stream);
   if (err != paNoError) {
     printf("Error: Could not start stream.\n");
+    Pa_CloseStream(stream);
     return err;
   }
 
-  // Create the aubio onset detector
-  char method[] = "default";
-  onset_out_ = new_fvec(1);
-  onset_obj_ = new_aubio_onset(method, win_size, hop_size, sample_rate);
-  // aubio_onset_set_threshold(onset_obj_, 1.0f);
-  aubio_onset_set_silence(onset_obj_, -40.0f);
-  aubio_onset_set_minioi_s(onset_obj_, 0.01f); 
+  return paNoError;
+}
+
+void AudioProcessor::CreateDetectors(const AudioConfig &config) {
+  DeleteDetectors();
+  config_ = config;
+  uint_t win_size = config.win_size;
+  uint_t hop_size = config.hop_size;
+  uint_t sample_rate = config.sample_rate;
+
+  // Create the band energy analyzer, and the onset detector that shares its
+  // spectrum.
+  bands.Init(win_size, hop_size, sample_rate);
+  onset_detector.Init(win_size, hop_size, sample_rate);
 
   // Create the aubio beat detector.
+  char method[] = "default";
   tempo_out_ = new_fvec(2);
   tempo_obj_ = new_aubio_tempo(method, win_size, hop_size, sample_rate);
   // aubio_tempo_set_threshold(tempo_obj_, -50.0f);
   // aubio_tempo_set_silence (tempo_obj_, -90.0f);
 
-  return paNoError;
+  // Create the pitch detector. yinfft holds up best on the mix of a whole
+  // band in a noisy room.
+  char pitch_method[] = "yinfft";
+  char pitch_unit[] = "Hz";
+  pitch_out_ = new_fvec(1);
+  pitch_obj_ = new_aubio_pitch(pitch_method, win_size, hop_size, sample_rate);
+  aubio_pitch_set_unit(pitch_obj_, pitch_unit);
+  aubio_pitch_set_silence(pitch_obj_, -50.0f);
+
+  // Fingerprints only match those of tracks analyzed the same way.
+  if (setlist_) {
+    const AudioConfig &analyzed = setlist_->config;
+    if (analyzed.sample_rate != sample_rate || analyzed.win_size != win_size ||
+        analyzed.hop_size != hop_size) {
+      printf("Ignoring the setlist: it was analyzed at %u Hz with a "
+             "%u-sample window and %u-sample hop.\n", analyzed.sample_rate,
+             analyzed.win_size, analyzed.hop_size);
+    } else {
+      fingerprinter_.Init(win_size, hop_size, sample_rate);
+      follower_ = new SetlistFollower(
+          *setlist_, (int)(advance_s_ * sample_rate / hop_size + 0.5f));
+    }
+  }
+
+  if (config.channels > 1) {
+    mix_.assign(hop_size, 0.0f);
+    channels_ = new ChannelPool;
+    if (channels_->Start(config.channels, config, *this) != 0) {
+      delete channels_;
+      channels_ = NULL;
+    }
+  }
+}
+
+void AudioProcessor::DeleteDetectors() {
+  // Stops the channels' threads first, as they still use their detectors.
+  delete channels_;
+  channels_ = NULL;
+  delete follower_;
+  follower_ = NULL;
+  track.store(-1, std::memory_order_relaxed);
+  section.store(-1, std::memory_order_relaxed);
+  if (tempo_obj_) {
+    del_aubio_tempo(tempo_obj_);
+    del_fvec(tempo_out_);
+    tempo_obj_ = NULL;
+    tempo_out_ = NULL;
+  }
+  if (pitch_obj_) {
+    del_aubio_pitch(pitch_obj_);
+    del_fvec(pitch_out_);
+    pitch_obj_ = NULL;
+    pitch_out_ = NULL;
+  }
+}
+
+bool AudioProcessor::TakeLatest(ReportQueue *reports, Report *latest) {
+  int taken = 0;
+  while (reports->Pop(latest)) {
+    ++taken;
+  }
+  if (taken > 1) {
+    dropped_events.Add(taken - 1);
+  }
+  return taken > 0;
 }
 
 bool AudioProcessor::IsBeat(float &last_beat_s, float &tempo_bpm,
                             float &confidence) {
-  if (is_beat) {
-    last_beat_s = aubio_tempo_get_last_s(tempo_obj_);
-    tempo_bpm = aubio_tempo_get_bpm(tempo_obj_);
-    confidence = aubio_tempo_get_confidence(tempo_obj_);
-
-    is_beat = 0;
-    return true;
-  } else {
+  Report report;
+  if (!TakeLatest(&beat_reports_, &report)) {
     return false;
   }
+  last_beat_s = report.time_s;
+  tempo_bpm = report.tempo_bpm;
+  confidence = report.confidence;
+  return true;
 }
 
-bool AudioProcessor::IsOnset(float &last_onset_s) {
-  if (is_onset) {
-    last_onset_s = aubio_onset_get_last_s(onset_obj_);
-
-    is_onset = 0;
-    return true;
-  } else {
+bool AudioProcessor::IsOnset(float &last_onset_s, float &strength) {
+  Report report;
+  if (!TakeLatest(&onset_reports_, &report)) {
     return false;
   }
+  last_onset_s = report.time_s;
+  strength = report.confidence;
+  return true;
 }
 
-AudioProcessor::~AudioProcessor() { Pa_Terminate(); }
+AudioProcessor::~AudioProcessor() {
+  // Closes the stream, so that no callback is left to push to the channels.
+  if (portaudio_) {
+    Pa_Terminate();
+  }
+  DeleteDetectors();
+  if (wakeup_pipe_[0] >= 0) {
+    close(wakeup_pipe_[0]);
+    close(wakeup_pipe_[1]);
+  }
+}
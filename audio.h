@@ -6,27 +6,238 @@
 #include <aubio/fvec.h>
 #include <aubio/onset/onset.h>
 
+#include <atomic>
+#include <vector>
+
+// Disco Wookie includes
+#include "bands.h"
+#include "fingerprint.h"
+#include "onset_ensemble.h"
+#include "spsc_queue.h"
+
+// Input below this level, in dB, counts as silence: no onsets are detected
+// in it, and the display may idle.
+static const float kSilenceDb = -40.0f;
+
+// The most input channels analyzed separately; a 16-channel interface
+// covers a drum kit's mics and a band's stage box.
+static const int kMaxChannels = 16;
+
+class ChannelPool;
+class Setlist;
+class SetlistFollower;
+
+// Analysis parameters, shared by the PortAudio stream and every detector.
+struct AudioConfig {
+  AudioConfig()
+    : sample_rate(44100), win_size(1024), hop_size(256), channels(1) {}
+
+  // Small hops over the same window: detection granularity improves without
+  // changing the FFT size. At 44.1 kHz a 128-sample hop is 2.9 ms.
+  static AudioConfig LowLatency() {
+    AudioConfig config;
+    config.hop_size = 128;
+    return config;
+  }
+
+  // Returns false, and prints why, if the parameters cannot work together.
+  bool Validate() const;
+
+  uint_t sample_rate;
+  uint_t win_size;  // FFT size; must be a power of two
+  uint_t hop_size;  // samples per PortAudio callback and per detector step
+
+  // Input channels to open. With more than one, their mix is analyzed as
+  // with a single channel, and each is also analyzed on its own; see
+  // ChannelPool.
+  int channels;
+};
+
+// An onset or beat as the detectors found it.
+struct AudioEvent {
+  bool beat;
+
+  // When it was detected, in seconds on the steady clock.
+  double time;
+
+  // For beats only.
+  float tempo_bpm;
+
+  // For beats, the beat tracker's confidence; for onsets, their strength.
+  float confidence;
+};
+
 class AudioProcessor {
 public:
-  AudioProcessor() {}
+  AudioProcessor();
   ~AudioProcessor();
 
-  int Init();
+  // Creates the detectors and starts listening to the default input device.
+  int Init(const AudioConfig &config);
+
+  // Creates the onset, beat and pitch detectors without opening any audio
+  // device, and for more than one channel, starts analyzing each of them.
+  // Init() calls this; it is public so that tools can feed recorded or
+  // synthetic audio through ProcessHop() or ProcessInput(). Calling it
+  // again, while no stream is running, replaces the detectors.
+  void CreateDetectors(const AudioConfig &config);
+
+  // Runs one hop (config().hop_size samples) through the onset and beat
+  // detectors, and reports an onset or beat if either fired.
+  void ProcessHop(float *in);
+
+  // Takes one hop of input, config().channels samples to a frame,
+  // interleaved: hands each channel to its own analysis, then analyzes
+  // their mix with ProcessHop().
+  void ProcessInput(const float *in);
+
+  // How many input channels are analyzed on their own: 0 for a single
+  // channel, which is only analyzed as the mix.
+  int num_channels() const;
+
+  // The analysis of input channel c, counted from 1; 0 is the mix, which is
+  // this. NULL if there is no such channel.
+  AudioProcessor *channel(int c);
+
+  // From now on, ProcessHop() queues the onsets and beats it detects for
+  // PollDeferred() and writes a byte to notify_fd, instead of reporting
+  // them. Rigs that keep in time with each other (see rig_sync.h) report
+  // them later, at an agreed time.
+  void Defer(int notify_fd);
+
+  // While the input matches one of setlist's tracks, shows the onsets,
+  // beats, bands and pitch analyzed from the track beforehand, advance_s
+  // seconds early, instead of detecting them, and skips the beat and pitch
+  // detectors; see SetlistFollower. Call before Init() or CreateDetectors(),
+  // which ignore the setlist if it was analyzed with other parameters.
+  // setlist must outlive this.
+  void Follow(const Setlist *setlist, float advance_s);
+
+  // Takes the oldest deferred event. Call from one thread only.
+  bool PollDeferred(AudioEvent *event) { return deferred_.Pop(event); }
+
+  // Shows an onset or beat to the visualizers: queues it for IsOnset() or
+  // IsBeat(), counts it, and wakes wakeup_fd(). time_s is when it happened.
+  // Called by ProcessHop() on the audio thread, or, once Defer() is called,
+  // only by the thread that polls the deferred events, as for a rig that
+  // does no analysis of its own and shows what another rig detected.
+  void ReportOnset(float time_s, float strength);
+  void ReportBeat(float time_s, float tempo_bpm, float confidence);
+
+  // Replaces the band envelopes, pitch and silence with another rig's.
+  void ReportLevels(const float *envelopes, float pitch_hz,
+                    float pitch_confidence, bool silent);
+
+  // A descriptor that becomes readable when an onset or beat is detected, or
+  // sound starts after silence, so that an idle render thread can sleep in
+  // poll() until there is something to show. Whoever polls it reads it
+  // empty; -1 if the pipe could not be created.
+  int wakeup_fd() const { return wakeup_pipe_[0]; }
+
+  // Makes this the analysis of one of mix's input channels. It wakes
+  // through mix's wakeup_fd() from now on, instead of a pipe of its own, so
+  // that whoever polls mix's also hears of this one's onsets and beats. It
+  // leaves counting hops, onsets and beats in the metrics to mix, so that
+  // each is counted once. ChannelPool does this for each channel, before it
+  // starts them.
+  void JoinMix(const AudioProcessor &mix);
+
+  const AudioConfig &config() const { return config_; }
+
+  // Take the latest onset or beat reported since the last call, if any,
+  // and drop any before it. Call from the render thread only.
   bool IsBeat(float& last_beat_s, float& tempo_bpm, float& confidence);
-  bool IsOnset(float& last_onset_s);
+  // strength is from OnsetEnsemble::strength().
+  bool IsOnset(float& last_onset_s, float& strength);
 
-  bool is_beat;
-  bool is_onset;
+  // Per-band energy envelopes, updated every hop.
+  BandAnalyzer bands;
 
-  // TODO(wcraddock): try to make these member variables private.
+  // Finds onsets in the spectrum that bands computes.
+  OnsetEnsemble onset_detector;
 
-  // Aubio onset detector and state.
-  fvec_t *onset_out_;
-  aubio_onset_t *onset_obj_;
+  // Counts every beat reported so far. Also used to tie each beat's
+  // detection to its display in traces.
+  std::atomic<unsigned int> num_beats;
+
+  // The tempo at the last beat reported, or 0 before the first.
+  std::atomic<float> tempo_bpm;
+
+  // The pitch of the strongest note in the last window, in Hz, or 0 if the
+  // input is silent or unpitched, and how sure the detector is of it, from
+  // 0 to 1. Updated every hop.
+  std::atomic<float> pitch_hz;
+  std::atomic<float> pitch_confidence;
+
+  // Whether the last hop was below kSilenceDb.
+  std::atomic<bool> silent;
+
+  // The setlist track being followed, and the section of it being played,
+  // both counted from 0, or -1 while the input is analyzed live.
+  std::atomic<int> track;
+  std::atomic<int> section;
+
+  // TODO(wcraddock): try to make these member variables private.
 
   // Aubio beat detector and state.
   fvec_t *tempo_out_;
   aubio_tempo_t *tempo_obj_;
+
+  // Aubio pitch detector and state.
+  fvec_t *pitch_out_;
+  aubio_pitch_t *pitch_obj_;
+
+ private:
+  // Makes wakeup_fd() readable.
+  void Wake();
+
+  // Frees what CreateDetectors() created, if anything. The stream must be
+  // stopped.
+  void DeleteDetectors();
+
+  AudioConfig config_;
+
+  // An onset or beat on its way from ReportOnset() or ReportBeat() to the
+  // render thread. tempo_bpm is for beats only; confidence is an onset's
+  // strength.
+  struct Report {
+    float time_s;
+    float tempo_bpm;
+    float confidence;
+  };
+  typedef SpscQueue<Report, 16> ReportQueue;
+  ReportQueue onset_reports_;
+  ReportQueue beat_reports_;
+
+  // Pops every report, into latest. Only the latest of several reported
+  // within one frame is shown; the rest count as dropped.
+  static bool TakeLatest(ReportQueue *reports, Report *latest);
+
+  // While notify_fd_ >= 0, detections go to deferred_ instead of being
+  // reported. Only the audio thread pushes to deferred_.
+  std::atomic<int> notify_fd_;
+  SpscQueue<AudioEvent, 64> deferred_;
+
+  // Written without blocking by the audio thread; a full pipe already has a
+  // wakeup pending.
+  int wakeup_pipe_[2];
+
+  // Whether Init() initialized PortAudio, and so must terminate it.
+  bool portaudio_;
+
+  // Set by JoinMix().
+  bool channel_;
+
+  // With more than one input channel, their separate analyses, and a hop of
+  // their mix.
+  ChannelPool *channels_;
+  vector<float> mix_;
+
+  // Only while following a setlist.
+  const Setlist *setlist_;
+  float advance_s_;
+  SetlistFollower *follower_;
+  Fingerprinter fingerprinter_;
 };
 
 #endif // __HALLUCINATION_AUDIO_H__
\ No newline at end of file
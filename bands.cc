@@ -0,0 +1,213 @@
+#include "bands.h"
+
+#include <math.h>
+
+#include <algorithm>
+
+// Envelope time constants, in seconds.
+static const float kAttackSeconds = 0.010f;
+static const float kReleaseSeconds = 0.150f;
+static const float kPeakDecaySeconds = 10.0f;
+
+// Band levels are mapped from [kFloorDb, 0] dB (relative to a full-scale
+// sine) onto [0, 1] before envelope following.
+static const float kFloorDb = -60.0f;
+
+// Lowest and highest band edges, in Hz.
+static const float kMinFrequency = 30.0f;
+static const float kMaxFrequency = 16000.0f;
+
+// The normalizing peak never falls below this, so that silence stays dark
+// instead of amplifying the noise floor to full brightness.
+static const float kMinPeak = 0.25f;
+
+static float HzToMel(float hz) { return 2595.0f * log10f(1.0f + hz / 700.0f); }
+static float MelToHz(float mel) {
+  return 700.0f * (powf(10.0f, mel / 2595.0f) - 1.0f);
+}
+
+// Converts a time constant to a one-pole smoothing coefficient per hop.
+static float Coefficient(float seconds, uint_t hop_size, uint_t sample_rate) {
+  return 1.0f - expf(-(float)hop_size / (seconds * sample_rate));
+}
+
+BandAnalyzer::BandAnalyzer()
+  : win_size_(0),
+    hop_size_(0),
+    fft_(NULL),
+    frame_(NULL),
+    compspec_(NULL),
+    attack_(0),
+    release_(0),
+    peak_decay_(0),
+    sequence_(0) {
+  for (int b = 0; b < kNumBands; ++b) {
+    envelope_[b] = 0.0f;
+    peak_[b] = kMinPeak;
+    published_[b].store(0.0f, std::memory_order_relaxed);
+  }
+}
+
+BandAnalyzer::~BandAnalyzer() {
+  if (fft_) {
+    del_aubio_fft(fft_);
+    del_fvec(frame_);
+    del_fvec(compspec_);
+  }
+}
+
+void BandAnalyzer::Init(uint_t win_size, uint_t hop_size, uint_t sample_rate) {
+  win_size_ = win_size;
+  hop_size_ = hop_size;
+
+  if (fft_) {
+    del_aubio_fft(fft_);
+    del_fvec(frame_);
+    del_fvec(compspec_);
+  }
+  fft_ = new_aubio_fft(win_size);
+  frame_ = new_fvec(win_size);
+  compspec_ = new_fvec(win_size);
+
+  history_.Init(win_size);
+  power_.assign(win_size / 2 + 1, 0.0f);
+
+  // Hann window, scaled so that a full-scale sine has a power of about 1 in
+  // its peak bin.
+  window_.resize(win_size);
+  const float scale = 4.0f / win_size;
+  for (uint_t i = 0; i < win_size; ++i) {
+    window_[i] = scale * 0.5f * (1.0f - cosf(2.0f * M_PI * i / win_size));
+  }
+
+  attack_ = Coefficient(kAttackSeconds, hop_size, sample_rate);
+  release_ = Coefficient(kReleaseSeconds, hop_size, sample_rate);
+  peak_decay_ = 1.0f - Coefficient(kPeakDecaySeconds, hop_size, sample_rate);
+
+  ComputeFilters(sample_rate);
+}
+
+void BandAnalyzer::ComputeFilters(uint_t sample_rate) {
+  const int num_bins = win_size_ / 2 + 1;
+  const float bin_hz = (float)sample_rate / win_size_;
+  const float max_hz = std::min(kMaxFrequency, sample_rate / 2.0f);
+
+  // kNumBands triangles need kNumBands + 2 edges, equally spaced in mel.
+  float edges[kNumBands + 2];
+  const float min_mel = HzToMel(kMinFrequency);
+  const float max_mel = HzToMel(max_hz);
+  for (int i = 0; i < kNumBands + 2; ++i) {
+    edges[i] = MelToHz(min_mel + (max_mel - min_mel) * i / (kNumBands + 1));
+  }
+
+  weights_.clear();
+  for (int b = 0; b < kNumBands; ++b) {
+    float low = edges[b], center = edges[b + 1], high = edges[b + 2];
+
+    // Every band covers at least its center bin, even when the low bands are
+    // narrower than one bin.
+    int first = std::min((int)ceilf(low / bin_hz), (int)(center / bin_hz));
+    int last = std::max((int)floorf(high / bin_hz), (int)(center / bin_hz));
+    first = std::max(first, 1);
+    last = std::min(last, num_bins - 1);
+
+    band_start_[b] = first;
+    band_length_[b] = last - first + 1;
+    weight_offset_[b] = weights_.size();
+
+    // Triangular weights, normalized to sum to one so that wide high bands
+    // do not swamp the narrow low ones.
+    float sum = 0.0f;
+    for (int k = first; k <= last; ++k) {
+      float hz = k * bin_hz;
+      float w = (hz < center) ? (hz - low) / (center - low)
+                              : (high - hz) / (high - center);
+      w = std::max(w, 0.05f);
+      weights_.push_back(w);
+      sum += w;
+    }
+    for (int k = 0; k < band_length_[b]; ++k) {
+      weights_[weight_offset_[b] + k] /= sum;
+    }
+  }
+}
+
+void BandAnalyzer::ProcessHop(const float *in, bool publish) {
+  // Slide the analysis window along by one hop. The windowing below reads
+  // straight out of the sliding buffer, so the only copy is the hop itself.
+  history_.Push(in, hop_size_);
+
+  // The loops below are written over plain contiguous arrays so that the
+  // compiler can vectorize them.
+  const float *history = history_.Window();
+  const float *window = &window_[0];
+  float *frame = frame_->data;
+  for (uint_t i = 0; i < win_size_; ++i) {
+    frame[i] = history[i] * window[i];
+  }
+
+  aubio_fft_do_complex(fft_, frame_, compspec_);
+
+  // compspec_ holds the real parts in [0, n/2] and the imaginary parts in
+  // reverse order in [n/2 + 1, n).
+  const float *spec = compspec_->data;
+  const uint_t n = win_size_;
+  float *power = &power_[0];
+  power[0] = spec[0] * spec[0];
+  for (uint_t k = 1; k < n / 2; ++k) {
+    power[k] = spec[k] * spec[k] + spec[n - k] * spec[n - k];
+  }
+  power[n / 2] = spec[n / 2] * spec[n / 2];
+
+  float level[kNumBands];
+  const float *weights = &weights_[0];
+  for (int b = 0; b < kNumBands; ++b) {
+    const float *w = weights + weight_offset_[b];
+    const float *p = power + band_start_[b];
+    const int length = band_length_[b];
+    float energy = 0.0f;
+    for (int k = 0; k < length; ++k) {
+      energy += w[k] * p[k];
+    }
+    level[b] = 10.0f * log10f(energy + 1e-12f);
+  }
+
+  float out[kNumBands];
+  for (int b = 0; b < kNumBands; ++b) {
+    float x = (level[b] - kFloorDb) / -kFloorDb;
+    x = std::min(std::max(x, 0.0f), 1.0f);
+
+    float coefficient = (x > envelope_[b]) ? attack_ : release_;
+    envelope_[b] += coefficient * (x - envelope_[b]);
+
+    peak_[b] = std::max(std::max(envelope_[b], peak_[b] * peak_decay_),
+                        kMinPeak);
+    out[b] = envelope_[b] / peak_[b];
+  }
+
+  if (publish) {
+    Publish(out);
+  }
+}
+
+void BandAnalyzer::Publish(const float *envelopes) {
+  unsigned int sequence = sequence_.load(std::memory_order_relaxed);
+  sequence_.store(sequence + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  for (int b = 0; b < kNumBands; ++b) {
+    published_[b].store(envelopes[b], std::memory_order_relaxed);
+  }
+  sequence_.store(sequence + 2, std::memory_order_release);
+}
+
+void BandAnalyzer::GetEnvelopes(float *out) const {
+  unsigned int before, after;
+  do {
+    before = sequence_.load(std::memory_order_acquire);
+    for (int b = 0; b < kNumBands; ++b) {
+      out[b] = published_[b].load(std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    after = sequence_.load(std::memory_order_relaxed);
+  } while ((before & 1) || before != after);
+}
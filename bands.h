@@ -0,0 +1,89 @@
+#ifndef __BANDS_H__
+#define __BANDS_H__
+
+#include <atomic>
+#include <vector>
+
+// Aubio includes
+#include <aubio/aubio.h>
+
+// Disco Wookie includes
+#include "sliding_window.h"
+
+using std::vector;
+
+// BandAnalyzer splits each hop of audio into a handful of mel-spaced
+// frequency bands and follows the energy in each one with an attack/release
+// envelope. It runs on the audio thread; the envelopes can be read from any
+// other thread without locking.
+//
+// The envelopes are normalized to [0, 1] against a slowly decaying peak, so
+// quiet and loud rooms both produce a useful range of values.
+class BandAnalyzer {
+ public:
+  // Enough to separate kick, bass, low mids, mids, presence and air without
+  // making the hair regions too small to see.
+  static const int kNumBands = 8;
+
+  BandAnalyzer();
+  ~BandAnalyzer();
+
+  void Init(uint_t win_size, uint_t hop_size, uint_t sample_rate);
+
+  // Analyzes one hop of audio. Called from the audio thread. Unless publish
+  // is set, the envelopes are worked out but not shown, for when Publish()
+  // shows some from elsewhere.
+  void ProcessHop(const float *in, bool publish = true);
+
+  // Replaces the envelopes (kNumBands values) with ones analyzed elsewhere.
+  // Called from one thread at a time.
+  void Publish(const float *envelopes);
+
+  // Copies the most recent envelopes (kNumBands values) into out.
+  void GetEnvelopes(float *out) const;
+
+  // The spectrum of the last hop, in the layout of aubio_fft_do_complex(),
+  // for other analyses to share. Valid until the next ProcessHop().
+  const float *spectrum() const { return compspec_->data; }
+
+ private:
+  // Fills band_start_, band_length_ and weights_ with triangular mel filters.
+  void ComputeFilters(uint_t sample_rate);
+
+  uint_t win_size_;
+  uint_t hop_size_;
+
+  aubio_fft_t *fft_;
+  fvec_t *frame_;     // windowed input handed to the FFT
+  fvec_t *compspec_;  // FFT output, see aubio_fft_do_complex()
+
+  // The last win_size_ samples.
+  SlidingWindow history_;
+  vector<float> window_;
+
+  // |X(k)|^2 for k in [0, win_size_ / 2].
+  vector<float> power_;
+
+  // Each band is a triangle over a contiguous range of FFT bins. The weights
+  // for band b are weights_[weight_offset_[b] .. + band_length_[b]] and apply
+  // to bins band_start_[b] onwards.
+  int band_start_[kNumBands];
+  int band_length_[kNumBands];
+  int weight_offset_[kNumBands];
+  vector<float> weights_;
+
+  // Envelope followers. Coefficients are per hop.
+  float attack_;
+  float release_;
+  float peak_decay_;
+  float envelope_[kNumBands];
+  float peak_[kNumBands];
+
+  // The published envelopes, guarded by a sequence lock: the writer makes
+  // sequence_ odd while it updates published_, and readers retry if they saw
+  // an odd or changed sequence number.
+  std::atomic<unsigned int> sequence_;
+  std::atomic<float> published_[kNumBands];
+};
+
+#endif // __BANDS_H__
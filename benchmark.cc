@@ -0,0 +1,454 @@
+// Microbenchmarks for Hallucination's hot paths.
+//
+// Run from the top of the source tree (so that models/ can be found):
+//
+//   ./hallucination_benchmark > results.json
+//
+// Every benchmark reports the mean, minimum and maximum wall-clock time per
+// iteration in microseconds. The output is a single JSON document so results
+// from different builds can be diffed or plotted.
+
+#include <dirent.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Disco Wookie includes
+#include "audio.h"
+#include "fur_renderer.h"
+#include "glow_bake.h"
+#include "hair.h"
+#include "hair_layout.h"
+#include "obj_reader.h"
+#include "power_limiter.h"
+#include "thread_pool.h"
+#include "visualizer.h"
+
+// GLWFW includes
+#include <GLFW/glfw3.h>
+
+using std::string;
+using std::vector;
+
+// The layout used by the viewer: 2400 hairs on the long t-shirt.
+static const char kJacketModel[] = "models/tshirt_long.obj";
+static const int kJacketHairs = 2400;
+
+// A much larger installation, for the effects that have to scale.
+static const int kManyHairs = 100000;
+
+struct BenchmarkResult {
+  string name;
+  int iterations;
+  double mean_us;
+  double min_us;
+  double max_us;
+};
+
+static vector<BenchmarkResult> results;
+
+// Runs fn() the given number of times and records how long each call took.
+static void Measure(const string &name, int iterations,
+                    const std::function<void()> &fn) {
+  typedef std::chrono::steady_clock Clock;
+
+  BenchmarkResult result;
+  result.name = name;
+  result.iterations = iterations;
+  result.min_us = 1e300;
+  result.max_us = 0.0;
+
+  double total_us = 0.0;
+  for (int i = 0; i < iterations; ++i) {
+    Clock::time_point start = Clock::now();
+    fn();
+    Clock::time_point end = Clock::now();
+
+    double us =
+        std::chrono::duration<double, std::micro>(end - start).count();
+    total_us += us;
+    result.min_us = std::min(result.min_us, us);
+    result.max_us = std::max(result.max_us, us);
+  }
+  result.mean_us = total_us / iterations;
+
+  results.push_back(result);
+  std::cerr << name << ": " << result.mean_us << " us" << std::endl;
+}
+
+// Model_OBJ::Load chats on cout, which would corrupt the JSON. This swallows
+// cout for as long as it is in scope.
+class QuietCout {
+ public:
+  QuietCout() : saved_(std::cout.rdbuf(sink_.rdbuf())) {}
+  ~QuietCout() { std::cout.rdbuf(saved_); }
+
+ private:
+  std::ostringstream sink_;
+  std::streambuf *saved_;
+};
+
+static vector<string> ListModels(const string &directory) {
+  vector<string> models;
+  DIR *dir = opendir(directory.c_str());
+  if (!dir) {
+    std::cerr << "Unable to open " << directory << std::endl;
+    return models;
+  }
+
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    string name(entry->d_name);
+    if (name.size() > 4 && name.compare(name.size() - 4, 4, ".obj") == 0) {
+      models.push_back(name);
+    }
+  }
+  closedir(dir);
+
+  std::sort(models.begin(), models.end());
+  return models;
+}
+
+static void BenchmarkModelLoading() {
+  vector<string> models = ListModels("models");
+  for (unsigned int i = 0; i < models.size(); ++i) {
+    string path = "models/" + models[i];
+    Measure("model_load/" + models[i], 5, [&path]() {
+      QuietCout quiet;
+      Model_OBJ obj;
+      obj.Load(path);
+      obj.Release();
+    });
+  }
+}
+
+static void BenchmarkHairGeneration(Model_OBJ &jacket) {
+  const int hair_counts[] = { 300, 600, 1200, 2400 };
+  for (unsigned int i = 0; i < sizeof(hair_counts) / sizeof(int); ++i) {
+    int num_hairs = hair_counts[i];
+    std::ostringstream name;
+    name << "generate_random_hairs/" << num_hairs;
+    Measure(name.str(), 3, [&jacket, num_hairs]() {
+      Fur fur;
+      fur.GenerateRandomHairs(jacket, num_hairs);
+    });
+  }
+}
+
+// Loading a saved layout is the alternative to generating one at startup.
+static void BenchmarkHairLayout(const Fur &fur) {
+  const char path[] = "/tmp/hallucination_benchmark.hairs";
+  if (SaveHairLayout(path, fur, 1) != 0) {
+    return;
+  }
+  Measure("hair_layout/load", 20, [&path]() {
+    Fur loaded;
+    LoadHairLayout(path, &loaded);
+  });
+  unlink(path);
+}
+
+static void BenchmarkVisualizers(Fur *fur, AudioProcessor *audio) {
+  const int frames = 1000;
+  double time = 0.0;
+
+  PhotogrammetryVisualizer photogrammetry(fur);
+  photogrammetry.Reposition();
+  Measure("illuminate/photogrammetry", frames, [&]() {
+    photogrammetry.Illuminate(time);
+    time += 1.0 / 60.0;
+  });
+
+  RandomWaveVisualizer random_waves(fur);
+  random_waves.Reposition();
+  Measure("illuminate/random_waves", frames, [&]() {
+    random_waves.Illuminate(time);
+    time += 1.0 / 60.0;
+  });
+
+  // Every tenth frame carries a beat, so both the flash and the decay paths
+  // are exercised.
+  BeatVisualizer beats(fur, audio);
+  beats.Reposition();
+  int frame = 0;
+  Measure("illuminate/beats", frames, [&]() {
+    if (frame++ % 10 == 0) {
+      audio->ReportBeat(time, 120.0f, 1.0f);
+    }
+    beats.Illuminate(time);
+    time += 1.0 / 60.0;
+  });
+
+  BandVisualizer bands(fur, audio);
+  bands.Reposition();
+  Measure("illuminate/bands", frames, [&]() {
+    bands.Illuminate(time);
+    time += 1.0 / 60.0;
+  });
+
+  // The same look as random_waves, interpreted, and the default effect.
+  const char *effects[] = { "waves", "default" };
+  for (int i = 0; i < 2; ++i) {
+    ExpressionVisualizer effect(fur, audio,
+                                string("effects/") + effects[i] + ".fx");
+    effect.Reposition();
+    effect.Illuminate(time);
+    Measure(string("illuminate/effect_") + effects[i], frames, [&]() {
+      effect.Illuminate(time);
+      time += 1.0 / 60.0;
+    });
+  }
+
+  ThreadPool pool;
+  fur->graph.Build(fur->hairs, HairGraph::kNeighbors);
+  Measure("hair_graph/build", 20, [&]() {
+    fur->graph.Build(fur->hairs, HairGraph::kNeighbors);
+  });
+  DiffusionVisualizer sparks(fur, audio, &pool, DiffusionVisualizer::SPARKS);
+  sparks.Reposition();
+  Measure("illuminate/sparks", frames, [&]() {
+    audio->num_beats += (frame++ % 10 == 0);
+    sparks.Illuminate(time);
+    time += 1.0 / 60.0;
+  });
+  DiffusionVisualizer reaction(fur, audio, &pool,
+                               DiffusionVisualizer::REACTION_DIFFUSION);
+  reaction.Reposition();
+  Measure("illuminate/reaction_diffusion", frames, [&]() {
+    reaction.Illuminate(time);
+    time += 1.0 / 60.0;
+  });
+
+  PitchVisualizer pitch(fur, audio);
+  pitch.Reposition();
+  Measure("illuminate/pitch", frames, [&]() {
+    audio->pitch_hz = 220.0f * (1 + frame++ % 12) / 12.0f + 220.0f;
+    audio->pitch_confidence = 1.0f;
+    pitch.Illuminate(time);
+    time += 1.0 / 60.0;
+  });
+}
+
+// Hairs spread evenly over a jacket-sized cylinder. GenerateRandomHairs()
+// spaces hairs out by rejection, which takes far too long for this many.
+static void ScatterHairs(int num_hairs, Fur *fur) {
+  std::mt19937 random(1);
+  std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+  fur->hairs.resize(num_hairs);
+  for (int i = 0; i < num_hairs; ++i) {
+    float angle = 2.0f * 3.14159265f * uniform(random);
+    Hair &hair = fur->hairs[i];
+    hair.normal = vec3(cosf(angle), 0.0f, sinf(angle));
+    hair.top_center = vec3(0.0f, 0.8f * uniform(random), 0.0f) +
+                      0.2f * hair.normal;
+    hair.led_channel = i;
+    hair.triangle = -1;
+  }
+  fur->colors.assign(num_hairs, MakeRgba(0, 0, 0));
+}
+
+static void BenchmarkDiffusion(AudioProcessor *audio) {
+  Fur fur;
+  ScatterHairs(kManyHairs, &fur);
+  Measure("hair_graph/build_100k", 3, [&fur]() {
+    fur.graph.Build(fur.hairs, HairGraph::kNeighbors);
+  });
+
+  ThreadPool pool;
+  DiffusionVisualizer sparks(&fur, audio, &pool, DiffusionVisualizer::SPARKS);
+  sparks.Reposition();
+  Measure("diffusion_step/sparks_100k", 200, [&sparks]() { sparks.Step(); });
+
+  DiffusionVisualizer reaction(&fur, audio, &pool,
+                               DiffusionVisualizer::REACTION_DIFFUSION);
+  reaction.Reposition();
+  Measure("diffusion_step/reaction_100k", 200,
+          [&reaction]() { reaction.Step(); });
+}
+
+// Every hair at full white, against budgets that force every zone and the
+// total down: the limiter's worst case. The time includes refilling the
+// colors.
+static void BenchmarkPowerLimit(const Fur &jacket) {
+  PowerConfig config;
+  config.zone_size = 600;
+  config.zone_budget_ma = 10000.0f;
+  config.total_budget_ma = 30000.0f;
+
+  Fur many;
+  ScatterHairs(kManyHairs, &many);
+  const Fur *furs[] = { &jacket, &many };
+  const char *names[] = { "power_limit/jacket", "power_limit/100k" };
+  for (int f = 0; f < 2; ++f) {
+    Fur fur;
+    fur.hairs = furs[f]->hairs;
+    PowerLimiter limiter(config);
+    limiter.Reposition(fur);
+    double time = 0.0;
+    Measure(names[f], 200, [&]() {
+      fur.colors.assign(fur.hairs.size(), MakeRgba(255, 255, 255));
+      fur.dirty.AddAll(fur.hairs.size());
+      limiter.Apply(&fur, time);
+      time += 1.0 / 60.0;
+    });
+  }
+}
+
+// The glow of the jacket's hairs on its mesh: baking it, and applying it to
+// every vertex as a frame does, on one thread and on the pool.
+static void BenchmarkGlow(const Model_OBJ &jacket, const Fur &fur) {
+  GlowBake bake;
+  Measure("glow/bake", 10, [&]() { bake.Bake(fur.hairs, jacket); });
+
+  const int num_hairs = bake.num_hairs();
+  const int num_vertices = bake.num_vertices();
+  vector<float> r(num_hairs, 1.0f), g(num_hairs, 0.5f), b(num_hairs, 0.25f);
+  vector<float> out_r(num_vertices), out_g(num_vertices), out_b(num_vertices);
+  Measure("glow/apply", 1000, [&]() {
+    bake.Apply(&r[0], &g[0], &b[0], &out_r[0], &out_g[0], &out_b[0], 0,
+               num_vertices);
+  });
+
+  ThreadPool pool;
+  Measure("glow/apply_parallel", 1000, [&]() {
+    pool.ParallelFor(num_vertices, 1024, [&](int begin, int end) {
+      bake.Apply(&r[0], &g[0], &b[0], &out_r[0], &out_g[0], &out_b[0], begin,
+                 end);
+    });
+  });
+}
+
+static void BenchmarkAudioHop(AudioProcessor *audio) {
+  const int hop_size = audio->config().hop_size;
+  const float sample_rate = audio->config().sample_rate;
+
+  // A 2 Hz click train over a quiet 440 Hz tone, so that every detector has
+  // something to find.
+  vector<float> samples(hop_size * 1024);
+  for (unsigned int i = 0; i < samples.size(); ++i) {
+    float t = i / sample_rate;
+    samples[i] = 0.1f * sinf(2.0f * 3.14159265f * 440.0f * t);
+    if (i % 22050 < 64) {
+      samples[i] += 0.8f;
+    }
+  }
+
+  unsigned int offset = 0;
+  Measure("audio_hop/onset_tempo", 1024, [&]() {
+    audio->ProcessHop(&samples[offset]);
+    offset = (offset + hop_size) % samples.size();
+  });
+
+  Measure("audio_hop/bands", 1024, [&]() {
+    audio->bands.ProcessHop(&samples[offset]);
+    offset = (offset + hop_size) % samples.size();
+  });
+
+  // Onset detection alone, on the spectrum the bands left behind.
+  Measure("audio_hop/onsets", 1024, [&]() {
+    audio->onset_detector.ProcessSpectrum(audio->bands.spectrum(), false);
+  });
+
+  // The same window with the low-latency hop. Per-hop cost is what matters
+  // here: there are twice as many hops per second.
+  AudioProcessor low_latency;
+  low_latency.CreateDetectors(AudioConfig::LowLatency());
+  const int small_hop = low_latency.config().hop_size;
+  Measure("audio_hop/onset_tempo_low_latency", 2048, [&]() {
+    low_latency.ProcessHop(&samples[offset]);
+    offset = (offset + small_hop) % samples.size();
+  });
+}
+
+static void BenchmarkHairDraw(Fur *fur) {
+  if (!glfwInit()) {
+    std::cerr << "Skipping hair drawing: no GLFW." << std::endl;
+    return;
+  }
+
+  // An invisible window gives us a GL context without putting anything on
+  // screen.
+  glfwWindowHint(GLFW_VISIBLE, GL_FALSE);
+  GLFWwindow *window = glfwCreateWindow(640, 480, "benchmark", NULL, NULL);
+  if (!window) {
+    std::cerr << "Skipping hair drawing: no GL context." << std::endl;
+    glfwTerminate();
+    return;
+  }
+  glfwMakeContextCurrent(window);
+  glEnable(GL_LIGHTING);
+
+  FurRenderer renderer;
+  renderer.Reposition(*fur);
+  fur->dirty.AddAll(fur->hairs.size());
+  Measure("hair_draw/convert", 1000, [&]() { renderer.Update(*fur); });
+  Measure("hair_draw/submit", 200, [&]() {
+    renderer.Update(*fur);
+    renderer.Draw();
+    glFinish();
+  });
+
+  // What photogrammetry changes in a frame: two hairs.
+  fur->dirty.Clear();
+  fur->dirty.Add(10);
+  fur->dirty.Add(1000);
+  Measure("hair_draw/submit_two_hairs", 200, [&]() {
+    renderer.Update(*fur);
+    renderer.Draw();
+    glFinish();
+  });
+
+  glfwDestroyWindow(window);
+  glfwTerminate();
+}
+
+static void PrintJSON() {
+  printf("{\n  \"benchmarks\": [\n");
+  for (unsigned int i = 0; i < results.size(); ++i) {
+    const BenchmarkResult &r = results[i];
+    printf("    { \"name\": \"%s\", \"iterations\": %d, \"mean_us\": %.3f, "
+           "\"min_us\": %.3f, \"max_us\": %.3f }%s\n",
+           r.name.c_str(), r.iterations, r.mean_us, r.min_us, r.max_us,
+           (i + 1 < results.size()) ? "," : "");
+  }
+  printf("  ]\n}\n");
+}
+
+int main() {
+  BenchmarkModelLoading();
+
+  Model_OBJ jacket;
+  {
+    QuietCout quiet;
+    jacket.Load(kJacketModel);
+  }
+  BenchmarkHairGeneration(jacket);
+
+  Fur fur;
+  fur.GenerateRandomHairs(jacket, kJacketHairs);
+  BenchmarkHairLayout(fur);
+
+  AudioProcessor audio;
+  audio.CreateDetectors(AudioConfig());
+  BenchmarkVisualizers(&fur, &audio);
+  BenchmarkDiffusion(&audio);
+  BenchmarkPowerLimit(fur);
+  BenchmarkGlow(jacket, fur);
+  BenchmarkAudioHop(&audio);
+  BenchmarkHairDraw(&fur);
+
+  jacket.Release();
+
+  PrintJSON();
+  return 0;
+}
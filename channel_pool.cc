@@ -0,0 +1,142 @@
+#include "channel_pool.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <new>
+
+// Disco Wookie includes
+#include "metrics.h"
+#include "trace.h"
+
+// Hops each channel's ring holds: about a third of a second at the default
+// hop, long enough to ride out a worker being scheduled late.
+static const unsigned int kRingHops = 64;
+
+static MetricCounter channel_overruns(
+    "hallucination_audio_channel_overruns_total",
+    "Hops of a single input channel dropped because its worker fell behind.");
+
+void *ChannelPool::Channel::operator new(size_t size) {
+  void *pointer;
+  if (posix_memalign(&pointer, alignof(Channel), size) != 0) {
+    throw std::bad_alloc();
+  }
+  return pointer;
+}
+
+void ChannelPool::Channel::operator delete(void *pointer) {
+  free(pointer);
+}
+
+ChannelPool::ChannelPool() : hop_size_(0), running_(false) {}
+
+ChannelPool::~ChannelPool() {
+  Stop();
+  for (unsigned int i = 0; i < channels_.size(); ++i) {
+    delete channels_[i];
+  }
+}
+
+int ChannelPool::Start(int num_channels, const AudioConfig &config,
+                       const AudioProcessor &mix) {
+  hop_size_ = config.hop_size;
+  unsigned int ring_size = 1;
+  while (ring_size < kRingHops * hop_size_) {
+    ring_size *= 2;
+  }
+
+  AudioConfig channel_config = config;
+  channel_config.channels = 1;
+  for (int c = 0; c < num_channels; ++c) {
+    Channel *channel = new Channel;
+    channel->processor.CreateDetectors(channel_config);
+    channel->processor.JoinMix(mix);
+    channel->ring.Init(ring_size);
+    channel->hop.resize(hop_size_);
+    channels_.push_back(channel);
+  }
+
+  // The audio and render threads have cores of their own to run on.
+  int num_workers = std::thread::hardware_concurrency();
+  num_workers = std::max(std::min(num_workers - 1, num_channels), 1);
+  running_ = true;
+  for (int w = 0; w < num_workers; ++w) {
+    Worker *worker = new Worker;
+    if (pipe(worker->wake_pipe) != 0) {
+      printf("Unable to create a channel worker's wakeup pipe.\n");
+      delete worker;
+      Stop();
+      return -1;
+    }
+    // Only the audio thread's end must never block.
+    fcntl(worker->wake_pipe[1], F_SETFL, O_NONBLOCK);
+    for (int i = 0; i < 2; ++i) {
+      fcntl(worker->wake_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+    for (int c = w; c < num_channels; c += num_workers) {
+      worker->channels.push_back(c);
+    }
+    workers_.push_back(worker);
+  }
+  for (unsigned int w = 0; w < workers_.size(); ++w) {
+    workers_[w]->thread = std::thread(&ChannelPool::Run, this, workers_[w]);
+  }
+
+  printf("Analyzing %d input channels on %d worker threads.\n", num_channels,
+         num_workers);
+  return 0;
+}
+
+void ChannelPool::Stop() {
+  running_ = false;
+  for (unsigned int w = 0; w < workers_.size(); ++w) {
+    Worker *worker = workers_[w];
+    const char byte = 0;
+    ssize_t written = write(worker->wake_pipe[1], &byte, 1);
+    (void)written;
+    if (worker->thread.joinable()) {
+      worker->thread.join();
+    }
+    close(worker->wake_pipe[0]);
+    close(worker->wake_pipe[1]);
+    delete worker;
+  }
+  workers_.clear();
+}
+
+void ChannelPool::Push(const float *interleaved, unsigned long frames) {
+  TRACE_SCOPE("ChannelPool::Push");
+  const int stride = channels_.size();
+  for (int c = 0; c < stride; ++c) {
+    if (!channels_[c]->ring.Push(interleaved + c, frames, stride)) {
+      channel_overruns.Add();
+    }
+  }
+  for (unsigned int w = 0; w < workers_.size(); ++w) {
+    const char byte = 0;
+    ssize_t written = write(workers_[w]->wake_pipe[1], &byte, 1);
+    (void)written;
+  }
+}
+
+void ChannelPool::Run(Worker *worker) {
+  TRACE_THREAD_NAME("channel worker");
+  char bytes[64];
+  while (running_) {
+    // One read takes every wakeup written since the last, however many.
+    if (read(worker->wake_pipe[0], bytes, sizeof(bytes)) <= 0) {
+      continue;
+    }
+    for (unsigned int i = 0; i < worker->channels.size(); ++i) {
+      Channel *channel = channels_[worker->channels[i]];
+      while (channel->ring.Pop(&channel->hop[0], hop_size_)) {
+        TRACE_SCOPE("ChannelPool::ProcessHop");
+        channel->processor.ProcessHop(&channel->hop[0]);
+      }
+    }
+  }
+}
@@ -0,0 +1,85 @@
+#ifndef __CHANNEL_POOL_H__
+#define __CHANNEL_POOL_H__
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+// Disco Wookie includes
+#include "audio.h"
+#include "sample_ring.h"
+
+using std::vector;
+
+// ChannelPool analyzes each channel of a multi-channel input on its own, so
+// that a layer can follow the kick drum's mic while another follows the
+// vocals, and does it on worker threads, off the audio callback.
+//
+// The callback only copies each channel out of the interleaved input into
+// its own SampleRing, and writes a byte to wake the workers. Each worker
+// owns a fixed share of the channels (channel i belongs to worker i % W),
+// and runs a full AudioProcessor chain for each, hop by hop, as their rings
+// fill. There is one worker per core, up to one per channel, so that sixteen
+// channels spread over a laptop's four cores, and no channel's analysis ever
+// waits on a lock held by another.
+//
+// The callback never blocks or allocates here. A worker that falls a whole
+// ring behind loses its channels' newest hops, which is counted, rather
+// than holding up the audio thread.
+class ChannelPool {
+ public:
+  ChannelPool();
+  ~ChannelPool();
+
+  // Creates an analysis chain for each of num_channels channels, with
+  // config's window, hop and sample rate, and starts the workers. Each
+  // channel's onsets and beats wake mix's wakeup_fd(). Returns 0 on
+  // success.
+  int Start(int num_channels, const AudioConfig &config,
+            const AudioProcessor &mix);
+
+  // Stops and joins the workers. Nothing may call Push() after this.
+  void Stop();
+
+  // Called from the audio thread only. Takes frames frames of interleaved
+  // samples, num_channels() to a frame, and hands each channel to its worker.
+  void Push(const float *interleaved, unsigned long frames);
+
+  int num_channels() const { return channels_.size(); }
+
+  // The analysis of channel c, from 0. Its onsets, beats, bands and pitch
+  // are read the same way as the mix's.
+  AudioProcessor *channel(int c) { return &channels_[c]->processor; }
+
+ private:
+  struct Channel {
+    // The queues in processor and ring keep their ends on separate cache
+    // lines, which plain new does not respect before C++17.
+    static void *operator new(size_t size);
+    static void operator delete(void *pointer);
+
+    AudioProcessor processor;
+    SampleRing ring;
+    vector<float> hop;
+  };
+
+  struct Worker {
+    std::thread thread;
+
+    // The audio thread writes a byte to wake the worker; a full pipe
+    // already has a wakeup pending.
+    int wake_pipe[2];
+
+    // Indices into channels_ of the channels that this worker analyzes.
+    vector<int> channels;
+  };
+
+  void Run(Worker *worker);
+
+  vector<Channel *> channels_;
+  vector<Worker *> workers_;
+  unsigned int hop_size_;
+  std::atomic<bool> running_;
+};
+
+#endif // __CHANNEL_POOL_H__
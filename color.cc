@@ -0,0 +1,100 @@
+#include "color.h"
+
+#include <math.h>
+
+// The sRGB transfer function, and its inverse, on [0, 1].
+static float SrgbToLinearFloat(float value) {
+  if (value <= 0.04045f) {
+    return value / 12.92f;
+  }
+  return powf((value + 0.055f) / 1.055f, 2.4f);
+}
+
+static float LinearToSrgbFloat(float value) {
+  if (value <= 0.0031308f) {
+    return 12.92f * value;
+  }
+  return 1.055f * powf(value, 1.0f / 2.4f) - 0.055f;
+}
+
+Rgba FromHsv(float hue, float saturation, float value) {
+  hue = 6.0f * (hue - floorf(hue));
+  const int sector = (int)hue % 6;
+  const float f = hue - floorf(hue);
+  const float p = value * (1.0f - saturation);
+  const float q = value * (1.0f - saturation * f);
+  const float t = value * (1.0f - saturation * (1.0f - f));
+
+  float r, g, b;
+  switch (sector) {
+    case 0: r = value; g = t; b = p; break;
+    case 1: r = q; g = value; b = p; break;
+    case 2: r = p; g = value; b = t; break;
+    case 3: r = p; g = q; b = value; break;
+    case 4: r = t; g = p; b = value; break;
+    default: r = value; g = p; b = q; break;
+  }
+  return FromFloats(SrgbToLinearFloat(r), SrgbToLinearFloat(g),
+                    SrgbToLinearFloat(b));
+}
+
+namespace {
+
+struct SrgbTable {
+  SrgbTable() {
+    for (int i = 0; i < 256; ++i) {
+      values[i] = (unsigned char)(255.0f * LinearToSrgbFloat(i / 255.0f) +
+                                  0.5f);
+    }
+  }
+  unsigned char values[256];
+};
+
+}  // namespace
+
+const unsigned char *LinearToSrgb() {
+  // Built on first use, by whichever thread gets there first.
+  static const SrgbTable table;
+  return table.values;
+}
+
+Palette::Palette() {
+  for (int i = 0; i < kSize; ++i) {
+    colors_[i] = MakeRgba(0, 0, 0);
+  }
+}
+
+// static
+Palette Palette::Gradient(const Rgba *stops, int num_stops) {
+  Palette palette;
+  for (int i = 0; i < kSize; ++i) {
+    float position = (float)i * (num_stops - 1) / (kSize - 1);
+    int stop = position < num_stops - 1 ? (int)position : num_stops - 2;
+    float blend = position - stop;
+    const Rgba &low = stops[stop];
+    const Rgba &high = stops[stop + 1];
+    palette.colors_[i] = FromFloats(
+        ((1.0f - blend) * low.r + blend * high.r) / 255.0f,
+        ((1.0f - blend) * low.g + blend * high.g) / 255.0f,
+        ((1.0f - blend) * low.b + blend * high.b) / 255.0f);
+  }
+  return palette;
+}
+
+// static
+Palette Palette::Hues() {
+  Palette palette;
+  for (int i = 0; i < kSize; ++i) {
+    palette.colors_[i] = FromHsv((float)i / kSize, 1.0f, 1.0f);
+  }
+  return palette;
+}
+
+// static
+Palette Palette::Fire() {
+  const Rgba stops[] = {
+    MakeRgba(0, 0, 0), MakeRgba(96, 4, 0), MakeRgba(255, 48, 0),
+    MakeRgba(255, 160, 8), MakeRgba(255, 255, 255)
+  };
+  return Gradient(stops, sizeof(stops) / sizeof(stops[0]));
+}
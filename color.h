@@ -0,0 +1,92 @@
+#ifndef __COLOR_H__
+#define __COLOR_H__
+
+// A hair's color, in linear light with 8 bits per channel. Linear values add
+// and scale the way light does, and are what the LED drivers want; only the
+// preview on screen needs them converted, see LinearToSrgb().
+//
+// The bytes are laid out r, g, b, a, so an array of Rgba can be handed to
+// OpenGL as GL_UNSIGNED_BYTE colors. Alpha is unused and kept at 255.
+struct Rgba {
+  unsigned char r;
+  unsigned char g;
+  unsigned char b;
+  unsigned char a;
+};
+
+inline Rgba MakeRgba(unsigned char r, unsigned char g, unsigned char b) {
+  Rgba color = { r, g, b, 255 };
+  return color;
+}
+
+inline bool operator==(Rgba a, Rgba b) {
+  return a.r == b.r && a.g == b.g && a.b == b.b && a.a == b.a;
+}
+inline bool operator!=(Rgba a, Rgba b) { return !(a == b); }
+
+// From [0, 1] per channel, clamped. Written so that NaN, from a division by
+// zero in an effect, comes out dark.
+inline Rgba FromFloats(float r, float g, float b) {
+  float rgb[3] = { r, g, b };
+  unsigned char bytes[3];
+  for (int c = 0; c < 3; ++c) {
+    float value = rgb[c] > 0.0f ? (rgb[c] < 1.0f ? rgb[c] : 1.0f) : 0.0f;
+    bytes[c] = (unsigned char)(255.0f * value + 0.5f);
+  }
+  return MakeRgba(bytes[0], bytes[1], bytes[2]);
+}
+
+// A grey from 0 (off) to 1 (full brightness).
+inline Rgba Grey(float level) { return FromFloats(level, level, level); }
+
+// color with every channel multiplied by level, from 0 to 1.
+inline Rgba Scale(Rgba color, float level) {
+  int scale = (int)(256.0f * level);
+  scale = scale > 0 ? (scale < 256 ? scale : 256) : 0;
+  return MakeRgba((color.r * scale) >> 8, (color.g * scale) >> 8,
+                  (color.b * scale) >> 8);
+}
+
+// A color picked the way people pick them: hue around the color wheel (red
+// at 0, wrapping at 1), saturation and value, all as seen on screen. The
+// result is converted to linear light.
+Rgba FromHsv(float hue, float saturation, float value);
+
+// A 256-entry table that takes a linear channel to its sRGB encoding, for
+// display.
+const unsigned char *LinearToSrgb();
+
+// 256 precomputed colors, so that effects can map a value to a color with a
+// table lookup instead of per-hair color math.
+class Palette {
+ public:
+  static const int kSize = 256;
+
+  // All black.
+  Palette();
+
+  // Blends between at least two stops, spread evenly over the palette, in
+  // linear light.
+  static Palette Gradient(const Rgba *stops, int num_stops);
+
+  // Once around the color wheel at full saturation. Being a cycle, it can be
+  // indexed with any integer, keeping the low eight bits.
+  static Palette Hues();
+
+  // Black through red and yellow to white.
+  static Palette Fire();
+
+  Rgba operator[](int index) const { return colors_[index & (kSize - 1)]; }
+  void set(int index, Rgba color) { colors_[index & (kSize - 1)] = color; }
+
+  // value is clamped to [0, 1], and 1 is the last entry.
+  Rgba Lookup(float value) const {
+    float index = value > 0.0f ? (value < 1.0f ? value : 1.0f) : 0.0f;
+    return colors_[(int)(index * (kSize - 1) + 0.5f)];
+  }
+
+ private:
+  Rgba colors_[kSize];
+};
+
+#endif // __COLOR_H__
@@ -0,0 +1,318 @@
+#include "control_server.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Disco Wookie includes
+#include "metrics.h"
+#include "trace.h"
+
+// Larger than any control message, and than a typical network MTU.
+static const int kMaxPacketSize = 2048;
+
+// Bundles beyond this many messages per packet are truncated.
+static const int kMaxCommandsPerPacket = 32;
+
+// Bundles may nest; deeper nesting than this is rejected.
+static const int kMaxBundleDepth = 4;
+
+static const char kAddressPrefix[] = "/hallucination/";
+
+static MetricCounter commands_received(
+    "hallucination_control_commands_total",
+    "Control commands received.");
+static MetricCounter commands_dropped(
+    "hallucination_control_commands_dropped_total",
+    "Control commands thrown away because the render thread fell behind.");
+
+// OSC strings are NUL-terminated and padded with NULs to a multiple of four
+// bytes. Returns the position just past the padding, or NULL if the string
+// runs off the end of the packet.
+static const char *SkipString(const char *p, const char *end) {
+  const char *nul = (const char *)memchr(p, '\0', end - p);
+  if (!nul) {
+    return NULL;
+  }
+  size_t padded = ((nul - p) / 4 + 1) * 4;
+  if (padded > (size_t)(end - p)) {
+    return NULL;
+  }
+  return p + padded;
+}
+
+// OSC numbers are big-endian.
+static uint32_t ReadBigEndian32(const char *p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return ntohl(value);
+}
+
+// Reads the single numeric argument that every command takes.
+static bool ReadNumber(const char *types, const char *args, const char *end,
+                       float *value) {
+  if (types[0] != ',' || end - args < 4) {
+    return false;
+  }
+  uint32_t bits = ReadBigEndian32(args);
+  if (types[1] == 'f') {
+    memcpy(value, &bits, sizeof(*value));
+    return true;
+  }
+  if (types[1] == 'i') {
+    *value = (float)(int32_t)bits;
+    return true;
+  }
+  return false;
+}
+
+bool ParseControlAddress(const char *address, float value,
+                         ControlCommand *command) {
+  const size_t prefix_length = sizeof(kAddressPrefix) - 1;
+  if (strncmp(address, kAddressPrefix, prefix_length) != 0) {
+    return false;
+  }
+  const char *name = address + prefix_length;
+
+  command->index = 0;
+  command->value = value;
+  if (strcmp(name, "mode") == 0) {
+    command->type = ControlCommand::SET_MODE;
+    command->index = (int)value;
+  } else if (strcmp(name, "brightness") == 0) {
+    command->type = ControlCommand::SET_BRIGHTNESS;
+  } else if (strcmp(name, "tempo") == 0) {
+    command->type = ControlCommand::SET_TEMPO;
+  } else if (strcmp(name, "angle") == 0) {
+    command->type = ControlCommand::SET_MODEL_ANGLE;
+  } else if (strncmp(name, "layer/", 6) == 0) {
+    char *rest;
+    command->index = strtol(name + 6, &rest, 10);
+    if (rest == name + 6) {
+      return false;
+    }
+    if (strcmp(rest, "/opacity") == 0) {
+      command->type = ControlCommand::SET_LAYER_OPACITY;
+    } else if (strcmp(rest, "/channel") == 0) {
+      command->type = ControlCommand::SET_LAYER_CHANNEL;
+    } else {
+      return false;
+    }
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static bool ParseMessage(const char *data, const char *end,
+                         ControlCommand *command) {
+  const char *types = SkipString(data, end);
+  if (!types) {
+    return false;
+  }
+  const char *args = SkipString(types, end);
+  if (!args) {
+    return false;
+  }
+
+  float value;
+  if (!ReadNumber(types, args, end, &value)) {
+    return false;
+  }
+  return ParseControlAddress(data, value, command);
+}
+
+static int ParsePacket(const char *data, const char *end, int depth,
+                       ControlCommand *commands, int max_commands) {
+  if (end - data < 4 || max_commands <= 0) {
+    return 0;
+  }
+
+  if (data[0] == '/') {
+    return ParseMessage(data, end, commands) ? 1 : 0;
+  }
+
+  // A bundle is "#bundle", an 8-byte time tag (ignored: everything is
+  // applied on the next frame), and then size-prefixed elements.
+  static const char kBundle[8] = "#bundle";
+  if (end - data < 16 || memcmp(data, kBundle, sizeof(kBundle)) != 0 ||
+      depth >= kMaxBundleDepth) {
+    return 0;
+  }
+
+  int count = 0;
+  const char *p = data + 16;
+  while (end - p >= 4 && count < max_commands) {
+    uint32_t size = ReadBigEndian32(p);
+    p += 4;
+    if (size > (uint32_t)(end - p)) {
+      break;
+    }
+    count += ParsePacket(p, p + size, depth + 1, commands + count,
+                         max_commands - count);
+    p += size;
+  }
+  return count;
+}
+
+int ParseOscPacket(const char *data, size_t size, ControlCommand *commands,
+                   int max_commands) {
+  return ParsePacket(data, data + size, 0, commands, max_commands);
+}
+
+ControlServer::ControlServer()
+  : udp_fd_(-1),
+    unix_fd_(-1),
+    dropped_(0) {
+  wake_pipe_[0] = -1;
+  wake_pipe_[1] = -1;
+}
+
+ControlServer::~ControlServer() {
+  Stop();
+}
+
+int ControlServer::Start(int udp_port, const string &socket_path) {
+  if (udp_port > 0) {
+    udp_fd_ = socket(AF_INET, SOCK_DGRAM, 0);
+    int reuse = 1;
+    setsockopt(udp_fd_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    // Any interface, so that a phone on the same network can reach us.
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(udp_port);
+    if (udp_fd_ < 0 ||
+        bind(udp_fd_, (struct sockaddr *)&address, sizeof(address)) != 0) {
+      printf("Unable to listen on UDP port %d: %s\n", udp_port,
+             strerror(errno));
+      Stop();
+      return 1;
+    }
+    printf("Listening for OSC on UDP port %d\n", udp_port);
+  }
+
+  if (!socket_path.empty()) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path)) {
+      printf("Control socket path is too long: %s\n", socket_path.c_str());
+      Stop();
+      return 1;
+    }
+    strcpy(address.sun_path, socket_path.c_str());
+
+    // A socket left behind by an earlier run would make bind() fail.
+    unlink(socket_path.c_str());
+    unix_fd_ = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (unix_fd_ < 0 ||
+        bind(unix_fd_, (struct sockaddr *)&address, sizeof(address)) != 0) {
+      printf("Unable to listen on %s: %s\n", socket_path.c_str(),
+             strerror(errno));
+      Stop();
+      return 1;
+    }
+    socket_path_ = socket_path;
+    printf("Listening for OSC on %s\n", socket_path.c_str());
+  }
+
+  if (udp_fd_ < 0 && unix_fd_ < 0) {
+    return 0;
+  }
+
+  if (pipe(wake_pipe_) != 0) {
+    printf("Unable to create control pipe: %s\n", strerror(errno));
+    Stop();
+    return 1;
+  }
+  thread_ = std::thread(&ControlServer::Run, this);
+  return 0;
+}
+
+void ControlServer::Stop() {
+  if (thread_.joinable()) {
+    char byte = 0;
+    if (write(wake_pipe_[1], &byte, 1) != 1) {
+      printf("Unable to stop the control server\n");
+    }
+    thread_.join();
+  }
+
+  int *fds[] = { &udp_fd_, &unix_fd_, &wake_pipe_[0], &wake_pipe_[1] };
+  for (unsigned int i = 0; i < sizeof(fds) / sizeof(fds[0]); ++i) {
+    if (*fds[i] >= 0) {
+      close(*fds[i]);
+      *fds[i] = -1;
+    }
+  }
+
+  if (!socket_path_.empty()) {
+    unlink(socket_path_.c_str());
+    socket_path_.clear();
+  }
+}
+
+void ControlServer::Run() {
+  TRACE_THREAD_NAME("control");
+
+  struct pollfd fds[3];
+  int num_fds = 0;
+  fds[num_fds].fd = wake_pipe_[0];
+  fds[num_fds++].events = POLLIN;
+  if (udp_fd_ >= 0) {
+    fds[num_fds].fd = udp_fd_;
+    fds[num_fds++].events = POLLIN;
+  }
+  if (unix_fd_ >= 0) {
+    fds[num_fds].fd = unix_fd_;
+    fds[num_fds++].events = POLLIN;
+  }
+
+  // Both buffers live on this thread's stack, so nothing is allocated per
+  // packet.
+  char packet[kMaxPacketSize];
+  ControlCommand parsed[kMaxCommandsPerPacket];
+
+  while (true) {
+    if (poll(fds, num_fds, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      printf("Control server stopped: %s\n", strerror(errno));
+      return;
+    }
+    if (fds[0].revents) {
+      return;
+    }
+
+    for (int i = 1; i < num_fds; ++i) {
+      if (!(fds[i].revents & POLLIN)) {
+        continue;
+      }
+      ssize_t size = recv(fds[i].fd, packet, sizeof(packet), MSG_DONTWAIT);
+      if (size <= 0) {
+        continue;
+      }
+
+      TRACE_SCOPE("ControlServer::Parse");
+      int count = ParseOscPacket(packet, size, parsed, kMaxCommandsPerPacket);
+      commands_received.Add(count);
+      for (int c = 0; c < count; ++c) {
+        if (!commands_.Push(parsed[c])) {
+          ++dropped_;
+          commands_dropped.Add();
+        }
+      }
+    }
+  }
+}
@@ -0,0 +1,95 @@
+#ifndef __CONTROL_SERVER_H__
+#define __CONTROL_SERVER_H__
+
+#include <stddef.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+
+// Disco Wookie includes
+#include "spsc_queue.h"
+
+using std::string;
+
+// One parsed control message, ready for the render thread to apply.
+struct ControlCommand {
+  enum Type {
+    SET_MODE,           // index: mode, numbered like the 1-9 keys
+    SET_LAYER_OPACITY,  // index: layer, numbered like the modes; value: 0-1
+    SET_BRIGHTNESS,     // value: 0-1, applied to every layer
+    SET_TEMPO,          // value: beats per minute, or 0 to follow the audio
+    SET_MODEL_ANGLE,    // value: radians
+    SET_LAYER_CHANNEL   // index: layer; value: input channel, 0 for the mix
+  };
+
+  Type type;
+  int index;
+  float value;
+};
+
+// Turns an address and its argument into a command. Returns false if the
+// address is not one of:
+//
+//   /hallucination/mode N
+//   /hallucination/layer/N/opacity X
+//   /hallucination/layer/N/channel C
+//   /hallucination/brightness X
+//   /hallucination/tempo BPM
+//   /hallucination/angle RADIANS
+bool ParseControlAddress(const char *address, float value,
+                         ControlCommand *command);
+
+// Parses one OSC packet, which may be a single message or a bundle, into at
+// most max_commands commands. Returns how many were written. Messages that
+// are malformed or not understood are skipped. Never allocates. Each
+// message takes one int or float argument.
+int ParseOscPacket(const char *data, size_t size, ControlCommand *commands,
+                   int max_commands);
+
+// ControlServer listens for OSC packets on a UDP port and/or a Unix datagram
+// socket, on a thread of its own, and queues the commands they carry for the
+// render thread. The render thread only ever pops from a lock-free queue, so
+// it never waits on the network.
+class ControlServer {
+ public:
+  ControlServer();
+
+  // Stops the server if it is running.
+  ~ControlServer();
+
+  // Starts listening. udp_port = 0 or an empty socket_path leaves that
+  // transport off. Returns 0 on success.
+  int Start(int udp_port, const string &socket_path);
+
+  // Stops listening and joins the server thread.
+  void Stop();
+
+  // Takes the oldest queued command. Call from the render thread only.
+  bool Poll(ControlCommand *command) { return commands_.Pop(command); }
+
+  // Commands thrown away because the render thread fell behind.
+  unsigned int dropped() const { return dropped_; }
+
+ private:
+  void Run();
+
+  int udp_fd_;
+  int unix_fd_;
+  string socket_path_;
+
+  // Writing to wake_pipe_[1] tells the server thread to exit.
+  int wake_pipe_[2];
+
+  std::thread thread_;
+
+  // Enough for several frames of a busy control surface.
+  SpscQueue<ControlCommand, 256> commands_;
+  std::atomic<unsigned int> dropped_;
+
+  // ControlServer owns a thread; it cannot be copied.
+  ControlServer(ControlServer const &);
+  void operator=(ControlServer const &);
+};
+
+#endif // __CONTROL_SERVER_H__
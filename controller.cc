@@ -1,4 +1,5 @@
 #include "controller.h"
+#include "trace.h"
 
 #include <stdio.h>
 
@@ -56,6 +57,35 @@ void Controller::KeyCallback(GLFWwindow *window, int key, int scancode,
     illumination_mode_ = PHOTOGRAMMETRY;
   }
 
+  if (key == GLFW_KEY_4 && (action == GLFW_PRESS || action == GLFW_REPEAT)) {
+    illumination_mode_ = BAND_ENERGY;
+  }
+
+  if (key == GLFW_KEY_5 && (action == GLFW_PRESS || action == GLFW_REPEAT)) {
+    illumination_mode_ = EXPRESSION;
+  }
+
+  if (key == GLFW_KEY_6 && (action == GLFW_PRESS || action == GLFW_REPEAT)) {
+    illumination_mode_ = DIFFUSION;
+  }
+
+  if (key == GLFW_KEY_7 && (action == GLFW_PRESS || action == GLFW_REPEAT)) {
+    illumination_mode_ = REACTION_DIFFUSION;
+  }
+
+  if (key == GLFW_KEY_8 && (action == GLFW_PRESS || action == GLFW_REPEAT)) {
+    illumination_mode_ = PITCH;
+  }
+
+  if (key == GLFW_KEY_9 && (action == GLFW_PRESS || action == GLFW_REPEAT)) {
+    illumination_mode_ = STRUCTURED_LIGHT;
+  }
+
+  // Dump a trace of the last few seconds (only in tracing builds).
+  if (key == GLFW_KEY_T && action == GLFW_PRESS) {
+    TraceRequestDump();
+  }
+
   // // Strafe right
   // if (key == GLFW_KEY_RIGHT &&
   //     (action == GLFW_PRESS || action == GLFW_REPEAT)) {
@@ -110,7 +140,13 @@ void Controller::ComputeMatrices(GLFWwindow *window,
 
   float aspect_ratio =
       static_cast<float>(window_width) / static_cast<float>(window_height);
+  ComputeMatrices(aspect_ratio, projection_matrix, model_matrix, view_matrix);
+}
 
+void Controller::ComputeMatrices(float aspect_ratio,
+                                 glm::mat4 &projection_matrix,
+                                 glm::mat4 &model_matrix,
+                                 glm::mat4 &view_matrix) {
   projection_matrix =
       glm::perspective(field_of_view_angle_, aspect_ratio, 0.1f, 500.0f);
 
@@ -29,7 +29,13 @@ public:
   typedef enum {
     RANDOM_SINE_WAVES = 0,
     PHOTOGRAMMETRY = 1,
-    BEAT_DETECTION = 2
+    BEAT_DETECTION = 2,
+    BAND_ENERGY = 3,
+    EXPRESSION = 4,
+    DIFFUSION = 5,
+    REACTION_DIFFUSION = 6,
+    PITCH = 7,
+    STRUCTURED_LIGHT = 8
   } IlluminationMode;
 
   // Controller is a singleton class; there can be only one instance of it.
@@ -51,10 +57,20 @@ public:
   void ComputeMatrices(GLFWwindow *window, glm::mat4 &projection_matrix,
                        glm::mat4 &model_matrix, glm::mat4 &view_matrix);
 
+  // The same, for a viewport of the given shape rather than the window's.
+  void ComputeMatrices(float aspect_ratio, glm::mat4 &projection_matrix,
+                       glm::mat4 &model_matrix, glm::mat4 &view_matrix);
+
   IlluminationMode GetIlluminationMode() const {
     return illumination_mode_;
   }
 
+  // For remote control; the keyboard does the same through KeyCallback().
+  void SetIlluminationMode(IlluminationMode mode) {
+    illumination_mode_ = mode;
+  }
+  void SetModelAngle(float angle) { model_angle_ = angle; }
+
 private:
   // Controller is a singleton class; you cannot make one yourself. You must use
   // the getInstance() method to obtain the one and only instance.
@@ -0,0 +1,125 @@
+// Finds every LED of the jacket in images of the structured light sequence
+// (mode 9), and prints where each appeared:
+//
+//   ./decode_structured_light [options] IMAGE... > positions.txt
+//
+// IMAGEs are PNG files, one per pattern, or PPM streams as --export-video
+// writes them, in the order they were taken. Each output line holds an LED
+// channel, the x and y of its centroid in pixels from the top left corner,
+// and how many pixels it covered. See structured_light.h.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+// Disco Wookie includes
+#include "structured_light.h"
+
+using std::string;
+using std::vector;
+
+static void PrintUsage(const char *program) {
+  printf("Usage: %s [options] IMAGE... > positions.txt\n"
+         "\n"
+         "  --frames-per-pattern=N   images of each pattern, as in a video;\n"
+         "                           the middle one is used (default 1)\n"
+         "  --skip=N                 images before the all-on pattern\n"
+         "  --channels=N             LED channels on the jacket; later\n"
+         "                           images are ignored\n"
+         "  --help                   show this message\n",
+         program);
+}
+
+// If arg is "--name=value", points value at the value and returns true.
+static bool MatchValue(const char *arg, const char *name, const char **value) {
+  size_t length = strlen(name);
+  if (strncmp(arg, name, length) == 0 && arg[length] == '=') {
+    *value = arg + length + 1;
+    return true;
+  }
+  return false;
+}
+
+int main(int argc, char **argv) {
+  // Only the positions go to stdout; everything else we print moves to
+  // stderr.
+  fflush(stdout);
+  FILE *output = fdopen(dup(STDOUT_FILENO), "w");
+  dup2(STDERR_FILENO, STDOUT_FILENO);
+
+  int frames_per_pattern = 1;
+  int skip = 0;
+  int num_channels = 0;
+  vector<string> paths;
+  for (int i = 1; i < argc; ++i) {
+    const char *arg = argv[i];
+    const char *value;
+    if (strcmp(arg, "--help") == 0) {
+      PrintUsage(argv[0]);
+      return 0;
+    } else if (MatchValue(arg, "--frames-per-pattern", &value)) {
+      frames_per_pattern = atoi(value);
+    } else if (MatchValue(arg, "--skip", &value)) {
+      skip = atoi(value);
+    } else if (MatchValue(arg, "--channels", &value)) {
+      num_channels = atoi(value);
+    } else if (arg[0] == '-' && arg[1] == '-') {
+      printf("Unknown option: %s\n\n", arg);
+      PrintUsage(argv[0]);
+      return 1;
+    } else {
+      paths.push_back(arg);
+    }
+  }
+  if (paths.empty() || frames_per_pattern <= 0 || skip < 0 ||
+      num_channels < 0) {
+    PrintUsage(argv[0]);
+    return 1;
+  }
+
+  vector<GreyImage> images;
+  for (unsigned int i = 0; i < paths.size(); ++i) {
+    if (ReadGreyImages(paths[i], &images) != 0) {
+      return 1;
+    }
+  }
+
+  // The middle image of each pattern is the furthest from the changes.
+  int num_patterns = ((int)images.size() - skip) / frames_per_pattern;
+  if (num_channels > 0) {
+    const int bits = StructuredLightBits(num_channels);
+    const int needed = StructuredLightPatterns(bits);
+    if (num_patterns < needed) {
+      printf("%d channels take %d patterns, but there are only %d\n",
+             num_channels, needed, num_patterns);
+      return 1;
+    }
+    num_patterns = needed;
+  }
+  vector<GreyImage> sequence;
+  for (int p = 0; p < num_patterns; ++p) {
+    sequence.push_back(images[skip + p * frames_per_pattern +
+                              frames_per_pattern / 2]);
+  }
+
+  vector<StructuredLightPoint> points;
+  if (DecodeStructuredLight(sequence, num_channels, &points) != 0) {
+    return 1;
+  }
+
+  fprintf(output, "# channel x y pixels\n");
+  for (unsigned int i = 0; i < points.size(); ++i) {
+    const StructuredLightPoint &point = points[i];
+    fprintf(output, "%d %.2f %.2f %d\n", point.channel, point.x, point.y,
+            point.pixels);
+  }
+  fclose(output);
+
+  printf("Found %d LEDs in %d patterns of %dx%d.\n", (int)points.size(),
+         num_patterns, sequence[0].width, sequence[0].height);
+  return 0;
+}
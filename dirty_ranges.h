@@ -0,0 +1,80 @@
+#ifndef __DIRTY_RANGES_H__
+#define __DIRTY_RANGES_H__
+
+#include <algorithm>
+#include <vector>
+
+using std::vector;
+
+// DirtyRanges records which elements of an array have changed, as a sorted
+// list of disjoint [begin, end) ranges, so that whoever consumes the array
+// can skip the rest.
+//
+// Ranges that come within kMergeGap elements of each other are merged. A
+// change to every element is then a single range, a sparse change a handful
+// of short ones, and each range is worth what it costs its consumer: for the
+// GPU, a call to upload it.
+class DirtyRanges {
+ public:
+  struct Range {
+    int begin;
+    int end;
+  };
+
+  static const int kMergeGap = 16;
+
+  void Clear() { ranges_.clear(); }
+
+  // Marks elements [begin, end) as changed. Cheapest in increasing order.
+  void Add(int begin, int end) {
+    if (begin >= end) {
+      return;
+    }
+
+    // The first range that ends close enough to merge, then every range
+    // after it that starts close enough.
+    vector<Range>::iterator first = std::lower_bound(
+        ranges_.begin(), ranges_.end(), begin - kMergeGap,
+        [](const Range &range, int position) { return range.end < position; });
+    vector<Range>::iterator last = first;
+    while (last != ranges_.end() && last->begin - kMergeGap <= end) {
+      begin = std::min(begin, last->begin);
+      end = std::max(end, last->end);
+      ++last;
+    }
+
+    Range merged = { begin, end };
+    if (first == last) {
+      ranges_.insert(first, merged);
+    } else {
+      *first = merged;
+      ranges_.erase(first + 1, last);
+    }
+  }
+
+  void Add(int i) { Add(i, i + 1); }
+
+  // Marks elements [0, size) as changed.
+  void AddAll(int size) {
+    ranges_.clear();
+    Add(0, size);
+  }
+
+  // Marks everything that other marks.
+  void Add(const DirtyRanges &other) {
+    for (unsigned int r = 0; r < other.ranges_.size(); ++r) {
+      Add(other.ranges_[r].begin, other.ranges_[r].end);
+    }
+  }
+
+  bool empty() const { return ranges_.empty(); }
+
+  // The number of ranges, and each of them, in increasing order.
+  int size() const { return ranges_.size(); }
+  const Range &operator[](int r) const { return ranges_[r]; }
+
+ private:
+  vector<Range> ranges_;
+};
+
+#endif // __DIRTY_RANGES_H__
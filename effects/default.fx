@@ -0,0 +1,13 @@
+# The default effect for mode 5: waves rolling up the jacket, pushed along
+# by the bass, flashing on the beat and tinted by the highs.
+#
+# Edit this file while Hallucination is running; it reloads within half a
+# second of being saved. See expression.h for the language.
+
+let wave = 0.5 + 0.5 * sin(10 * height - 3 * time + 2 * random)
+let flash = 1 - smoothstep(0, 0.3, beat)
+
+brightness = clamp(wave * (0.3 + band0) + 0.5 * flash * step(0.7, random), 0, 1)
+red = 1
+green = 1 - 0.6 * band6
+blue = 0.6 + 0.4 * band6
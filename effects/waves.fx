@@ -0,0 +1,4 @@
+# The random sine waves of mode 1, as an effect. The benchmark compares the
+# two to keep an eye on the cost of interpreting effects.
+
+brightness = 0.5 + 0.5 * sin(5 * random * time + 3.14 * random2)
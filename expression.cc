@@ -0,0 +1,608 @@
+#include "expression.h"
+
+#include <ctype.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <map>
+
+// Registers are addressed by a byte; this leaves plenty of headroom.
+static const int kMaxRegisters = 128;
+
+typedef float Registers[kMaxRegisters][Expression::kBatchSize];
+
+static const char *kUniformNames[Expression::kNumUniforms] = {
+  "time", "beat", "tempo", "count", "band0", "band1", "band2", "band3",
+  "band4", "band5", "band6", "band7", "section"
+};
+
+static const char *kHairInputNames[Expression::kNumHairInputs] = {
+  "x", "y", "z", "nx", "ny", "nz", "height", "index", "random", "random2"
+};
+
+static const char *kOutputNames[Expression::kNumOutputs] = {
+  "brightness", "red", "green", "blue"
+};
+
+static int FindName(const char *const *names, int count, const string &name) {
+  for (int i = 0; i < count; ++i) {
+    if (name == names[i]) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+Expression::Expression() : num_registers_(0) {
+  for (int o = 0; o < kNumOutputs; ++o) {
+    outputs_[o].reg = -1;
+    outputs_[o].source = o;
+    outputs_[o].value = 1.0f;
+  }
+}
+
+// Runs one instruction on a batch. Each case is a plain loop over the batch,
+// which the compiler turns into vector instructions where it can.
+#define LANES(expression)                 \
+  for (int k = 0; k < kBatchSize; ++k) {  \
+    d[k] = (expression);                  \
+  }                                       \
+  break
+
+inline void Expression::Execute(Opcode op, float *d, const float *a,
+                                const float *b, const float *c) {
+  switch (op) {
+    case ADD:
+      LANES(a[k] + b[k]);
+    case SUB:
+      LANES(a[k] - b[k]);
+    case MUL:
+      LANES(a[k] * b[k]);
+    case DIV:
+      LANES(a[k] / b[k]);
+    case MOD:
+      // With the sign of the divisor, as in GLSL.
+      LANES(a[k] - b[k] * floorf(a[k] / b[k]));
+    case NEG:
+      LANES(-a[k]);
+    case LT:
+      LANES(a[k] < b[k] ? 1.0f : 0.0f);
+    case GT:
+      LANES(a[k] > b[k] ? 1.0f : 0.0f);
+    case LE:
+      LANES(a[k] <= b[k] ? 1.0f : 0.0f);
+    case GE:
+      LANES(a[k] >= b[k] ? 1.0f : 0.0f);
+    case SIN:
+      LANES(sinf(a[k]));
+    case COS:
+      LANES(cosf(a[k]));
+    case ABS:
+      LANES(fabsf(a[k]));
+    case FLOOR:
+      LANES(floorf(a[k]));
+    case FRACT:
+      LANES(a[k] - floorf(a[k]));
+    case SQRT:
+      LANES(sqrtf(a[k]));
+    case EXP:
+      LANES(expf(a[k]));
+    case MIN:
+      LANES(a[k] < b[k] ? a[k] : b[k]);
+    case MAX:
+      LANES(a[k] > b[k] ? a[k] : b[k]);
+    case POW:
+      LANES(powf(a[k], b[k]));
+    case CLAMP:
+      LANES(a[k] < b[k] ? b[k] : (a[k] > c[k] ? c[k] : a[k]));
+    case MIX:
+      LANES(a[k] + (b[k] - a[k]) * c[k]);
+    case STEP:
+      LANES(b[k] < a[k] ? 0.0f : 1.0f);
+    case SMOOTHSTEP: {
+      for (int k = 0; k < kBatchSize; ++k) {
+        float t = (c[k] - a[k]) / (b[k] - a[k]);
+        t = t < 0.0f ? 0.0f : (t > 1.0f ? 1.0f : t);
+        d[k] = t * t * (3.0f - 2.0f * t);
+      }
+      break;
+    }
+  }
+}
+
+#undef LANES
+
+// Compiles one program, line by line, with a recursive descent parser that
+// emits code as it goes. Operations on constants are folded on the spot.
+class ExpressionCompiler {
+ public:
+  explicit ExpressionCompiler(Expression *program) : program_(program) {}
+
+  bool Compile(const string &source, string *error);
+
+ private:
+  // An operand: a register, or a constant not yet given one.
+  struct Value {
+    bool constant;
+    float number;
+    int reg;
+  };
+
+  struct Function {
+    const char *name;
+    Expression::Opcode op;
+    int arity;
+  };
+  static const Function kFunctions[];
+  static const int kNumFunctions;
+
+  bool CompileStatement();
+
+  Value ParseComparison();
+  Value ParseAdditive();
+  Value ParseTerm();
+  Value ParseUnary();
+  Value ParsePower();
+  Value ParsePrimary();
+  Value ParseName(const string &name);
+
+  Value Emit(Expression::Opcode op, Value a, Value b, Value c, int arity);
+  int RegisterFor(const Value &value);
+  int NewRegister();
+
+  static Value Constant(float number) {
+    Value value = { true, number, -1 };
+    return value;
+  }
+  static Value InRegister(int reg) {
+    Value value = { false, 0.0f, reg };
+    return value;
+  }
+
+  // Lexing within the current line.
+  void SkipSpaces();
+  bool Accept(const char *token);
+  bool ReadName(string *name);
+  void Fail(const string &message);
+
+  Expression *program_;
+
+  const char *position_;
+  int line_;
+  string error_;
+
+  std::map<string, Value> variables_;
+  std::map<int, int> uniform_registers_;
+  std::map<int, int> hair_input_registers_;
+  // Keyed by each constant's bits: a NaN compares unequal to everything,
+  // itself included, which would break the map's ordering.
+  std::map<uint32_t, int> constant_registers_;
+};
+
+const ExpressionCompiler::Function ExpressionCompiler::kFunctions[] = {
+  { "sin", Expression::SIN, 1 },
+  { "cos", Expression::COS, 1 },
+  { "abs", Expression::ABS, 1 },
+  { "floor", Expression::FLOOR, 1 },
+  { "fract", Expression::FRACT, 1 },
+  { "sqrt", Expression::SQRT, 1 },
+  { "exp", Expression::EXP, 1 },
+  { "min", Expression::MIN, 2 },
+  { "max", Expression::MAX, 2 },
+  { "pow", Expression::POW, 2 },
+  { "clamp", Expression::CLAMP, 3 },
+  { "mix", Expression::MIX, 3 },
+  { "step", Expression::STEP, 2 },
+  { "smoothstep", Expression::SMOOTHSTEP, 3 },
+};
+
+const int ExpressionCompiler::kNumFunctions =
+    sizeof(kFunctions) / sizeof(kFunctions[0]);
+
+bool ExpressionCompiler::Compile(const string &source, string *error) {
+  line_ = 0;
+  size_t start = 0;
+  while (start <= source.size() && error_.empty()) {
+    size_t end = source.find('\n', start);
+    if (end == string::npos) {
+      end = source.size();
+    }
+    string line = source.substr(start, end - start);
+    size_t comment = line.find('#');
+    if (comment != string::npos) {
+      line.resize(comment);
+    }
+    ++line_;
+    position_ = line.c_str();
+    SkipSpaces();
+    if (*position_ != '\0') {
+      CompileStatement();
+    }
+    start = end + 1;
+  }
+
+  if (!error_.empty()) {
+    *error = error_;
+    return false;
+  }
+  return true;
+}
+
+void ExpressionCompiler::Fail(const string &message) {
+  if (error_.empty()) {
+    char prefix[32];
+    snprintf(prefix, sizeof(prefix), "line %d: ", line_);
+    error_ = prefix + message;
+  }
+}
+
+void ExpressionCompiler::SkipSpaces() {
+  while (isspace((unsigned char)*position_)) {
+    ++position_;
+  }
+}
+
+bool ExpressionCompiler::Accept(const char *token) {
+  SkipSpaces();
+  size_t length = strlen(token);
+  if (strncmp(position_, token, length) != 0) {
+    return false;
+  }
+  // "<" must not match the start of "<=".
+  if (length == 1 && (token[0] == '<' || token[0] == '>') &&
+      position_[1] == '=') {
+    return false;
+  }
+  position_ += length;
+  return true;
+}
+
+bool ExpressionCompiler::ReadName(string *name) {
+  SkipSpaces();
+  const char *start = position_;
+  if (!isalpha((unsigned char)*position_) && *position_ != '_') {
+    return false;
+  }
+  while (isalnum((unsigned char)*position_) || *position_ == '_') {
+    ++position_;
+  }
+  name->assign(start, position_ - start);
+  return true;
+}
+
+bool ExpressionCompiler::CompileStatement() {
+  string name;
+  if (!ReadName(&name)) {
+    Fail("expected a statement");
+    return false;
+  }
+
+  bool is_variable = (name == "let");
+  if (is_variable && !ReadName(&name)) {
+    Fail("expected a name after let");
+    return false;
+  }
+
+  int output = FindName(kOutputNames, Expression::kNumOutputs, name);
+  if (!is_variable && output < 0) {
+    Fail("unknown output '" + name + "'; did you mean 'let " + name + "'?");
+    return false;
+  }
+  if (is_variable &&
+      (output >= 0 ||
+       FindName(kUniformNames, Expression::kNumUniforms, name) >= 0 ||
+       FindName(kHairInputNames, Expression::kNumHairInputs, name) >= 0)) {
+    Fail("'" + name + "' is already an input or output");
+    return false;
+  }
+
+  if (!Accept("=")) {
+    Fail("expected '=' after " + name);
+    return false;
+  }
+  Value value = ParseComparison();
+  SkipSpaces();
+  if (*position_ != '\0') {
+    Fail(string("unexpected '") + position_ + "'");
+  }
+  if (!error_.empty()) {
+    return false;
+  }
+
+  if (is_variable) {
+    variables_[name] = value;
+  } else {
+    Expression::Load &out = program_->outputs_[output];
+    out.reg = value.constant ? -1 : value.reg;
+    out.value = value.number;
+  }
+  return true;
+}
+
+ExpressionCompiler::Value ExpressionCompiler::ParseComparison() {
+  Value left = ParseAdditive();
+  static const struct {
+    const char *token;
+    Expression::Opcode op;
+  } kComparisons[] = {
+    { "<=", Expression::LE }, { ">=", Expression::GE },
+    { "<", Expression::LT }, { ">", Expression::GT },
+  };
+  for (int i = 0; i < 4; ++i) {
+    if (Accept(kComparisons[i].token)) {
+      Value right = ParseAdditive();
+      return Emit(kComparisons[i].op, left, right, right, 2);
+    }
+  }
+  return left;
+}
+
+ExpressionCompiler::Value ExpressionCompiler::ParseAdditive() {
+  Value left = ParseTerm();
+  while (error_.empty()) {
+    if (Accept("+")) {
+      Value right = ParseTerm();
+      left = Emit(Expression::ADD, left, right, right, 2);
+    } else if (Accept("-")) {
+      Value right = ParseTerm();
+      left = Emit(Expression::SUB, left, right, right, 2);
+    } else {
+      break;
+    }
+  }
+  return left;
+}
+
+ExpressionCompiler::Value ExpressionCompiler::ParseTerm() {
+  Value left = ParseUnary();
+  while (error_.empty()) {
+    if (Accept("*")) {
+      Value right = ParseUnary();
+      left = Emit(Expression::MUL, left, right, right, 2);
+    } else if (Accept("/")) {
+      Value right = ParseUnary();
+      left = Emit(Expression::DIV, left, right, right, 2);
+    } else if (Accept("%")) {
+      Value right = ParseUnary();
+      left = Emit(Expression::MOD, left, right, right, 2);
+    } else {
+      break;
+    }
+  }
+  return left;
+}
+
+ExpressionCompiler::Value ExpressionCompiler::ParseUnary() {
+  if (Accept("-")) {
+    Value operand = ParseUnary();
+    return Emit(Expression::NEG, operand, operand, operand, 1);
+  }
+  return ParsePower();
+}
+
+ExpressionCompiler::Value ExpressionCompiler::ParsePower() {
+  Value base = ParsePrimary();
+  if (Accept("^")) {
+    // Right associative, and tighter than unary minus on its left:
+    // -2^2 is -4.
+    Value exponent = ParseUnary();
+    return Emit(Expression::POW, base, exponent, exponent, 2);
+  }
+  return base;
+}
+
+ExpressionCompiler::Value ExpressionCompiler::ParsePrimary() {
+  SkipSpaces();
+  if (!error_.empty()) {
+    return Constant(0.0f);
+  }
+
+  if (isdigit((unsigned char)*position_) || *position_ == '.') {
+    char *end;
+    float number = strtof(position_, &end);
+    if (end == position_) {
+      Fail("bad number");
+    }
+    position_ = end;
+    return Constant(number);
+  }
+
+  if (Accept("(")) {
+    Value value = ParseComparison();
+    if (!Accept(")")) {
+      Fail("expected ')'");
+    }
+    return value;
+  }
+
+  string name;
+  if (ReadName(&name)) {
+    return ParseName(name);
+  }
+
+  if (*position_ == '\0') {
+    Fail("unexpected end of line");
+  } else {
+    Fail(string("unexpected '") + *position_ + "'");
+  }
+  return Constant(0.0f);
+}
+
+ExpressionCompiler::Value ExpressionCompiler::ParseName(const string &name) {
+  for (int f = 0; f < kNumFunctions; ++f) {
+    if (name != kFunctions[f].name) {
+      continue;
+    }
+    if (!Accept("(")) {
+      Fail("expected '(' after " + name);
+      return Constant(0.0f);
+    }
+    Value args[3];
+    for (int i = 0; i < kFunctions[f].arity; ++i) {
+      if (i > 0 && !Accept(",")) {
+        char message[64];
+        snprintf(message, sizeof(message), "%s takes %d arguments",
+                 kFunctions[f].name, kFunctions[f].arity);
+        Fail(message);
+        return Constant(0.0f);
+      }
+      args[i] = ParseComparison();
+    }
+    if (!Accept(")")) {
+      Fail("expected ')' after the arguments to " + name);
+      return Constant(0.0f);
+    }
+    for (int i = kFunctions[f].arity; i < 3; ++i) {
+      args[i] = args[0];
+    }
+    return Emit(kFunctions[f].op, args[0], args[1], args[2],
+                kFunctions[f].arity);
+  }
+
+  std::map<string, Value>::const_iterator variable = variables_.find(name);
+  if (variable != variables_.end()) {
+    return variable->second;
+  }
+
+  int uniform = FindName(kUniformNames, Expression::kNumUniforms, name);
+  if (uniform >= 0) {
+    if (!uniform_registers_.count(uniform)) {
+      int reg = NewRegister();
+      uniform_registers_[uniform] = reg;
+      Expression::Load load = { reg, uniform, 0.0f };
+      program_->uniforms_.push_back(load);
+    }
+    return InRegister(uniform_registers_[uniform]);
+  }
+
+  int input = FindName(kHairInputNames, Expression::kNumHairInputs, name);
+  if (input >= 0) {
+    if (!hair_input_registers_.count(input)) {
+      int reg = NewRegister();
+      hair_input_registers_[input] = reg;
+      Expression::Load load = { reg, input, 0.0f };
+      program_->hair_inputs_.push_back(load);
+    }
+    return InRegister(hair_input_registers_[input]);
+  }
+
+  Fail("unknown name '" + name + "'");
+  return Constant(0.0f);
+}
+
+ExpressionCompiler::Value ExpressionCompiler::Emit(Expression::Opcode op,
+                                                   Value a, Value b, Value c,
+                                                   int arity) {
+  if (!error_.empty()) {
+    return Constant(0.0f);
+  }
+
+  // Fold operations on constants by running them on a one-off batch.
+  bool constant = a.constant && (arity < 2 || b.constant) &&
+                  (arity < 3 || c.constant);
+  if (constant) {
+    float lanes[4][Expression::kBatchSize];
+    for (int k = 0; k < Expression::kBatchSize; ++k) {
+      lanes[0][k] = a.number;
+      lanes[1][k] = b.number;
+      lanes[2][k] = c.number;
+    }
+    Expression::Execute(op, lanes[3], lanes[0], lanes[1], lanes[2]);
+    return Constant(lanes[3][0]);
+  }
+
+  Expression::Instruction instruction;
+  instruction.op = op;
+  instruction.a = RegisterFor(a);
+  instruction.b = RegisterFor(b);
+  instruction.c = RegisterFor(c);
+  instruction.dst = NewRegister();
+  program_->code_.push_back(instruction);
+  return InRegister(instruction.dst);
+}
+
+int ExpressionCompiler::RegisterFor(const Value &value) {
+  if (!value.constant) {
+    return value.reg;
+  }
+  uint32_t bits;
+  memcpy(&bits, &value.number, sizeof(bits));
+  std::map<uint32_t, int>::const_iterator found =
+      constant_registers_.find(bits);
+  if (found != constant_registers_.end()) {
+    return found->second;
+  }
+  int reg = NewRegister();
+  constant_registers_[bits] = reg;
+  Expression::Load load = { reg, -1, value.number };
+  program_->constants_.push_back(load);
+  return reg;
+}
+
+int ExpressionCompiler::NewRegister() {
+  if (program_->num_registers_ >= kMaxRegisters) {
+    Fail("expression is too complex");
+    return 0;
+  }
+  return program_->num_registers_++;
+}
+
+bool Expression::Compile(const string &source, string *error) {
+  Expression program;
+  ExpressionCompiler compiler(&program);
+  if (!compiler.Compile(source, error)) {
+    return false;
+  }
+  *this = program;
+  return true;
+}
+
+void Expression::Evaluate(const float uniforms[kNumUniforms],
+                          const float *const hair_inputs[kNumHairInputs],
+                          int num_hairs,
+                          float *const outputs[kNumOutputs]) const {
+  Registers registers;
+
+  for (unsigned int i = 0; i < constants_.size(); ++i) {
+    float *reg = registers[constants_[i].reg];
+    for (int k = 0; k < kBatchSize; ++k) {
+      reg[k] = constants_[i].value;
+    }
+  }
+  for (unsigned int i = 0; i < uniforms_.size(); ++i) {
+    float *reg = registers[uniforms_[i].reg];
+    for (int k = 0; k < kBatchSize; ++k) {
+      reg[k] = uniforms[uniforms_[i].source];
+    }
+  }
+
+  const Instruction *code = code_.empty() ? NULL : &code_[0];
+  const int code_size = code_.size();
+  for (int base = 0; base < num_hairs; base += kBatchSize) {
+    for (unsigned int i = 0; i < hair_inputs_.size(); ++i) {
+      memcpy(registers[hair_inputs_[i].reg],
+             hair_inputs[hair_inputs_[i].source] + base,
+             kBatchSize * sizeof(float));
+    }
+
+    for (int i = 0; i < code_size; ++i) {
+      const Instruction &in = code[i];
+      Execute(in.op, registers[in.dst], registers[in.a], registers[in.b],
+              registers[in.c]);
+    }
+
+    for (int o = 0; o < kNumOutputs; ++o) {
+      float *out = outputs[o] + base;
+      if (outputs_[o].reg >= 0) {
+        memcpy(out, registers[outputs_[o].reg], kBatchSize * sizeof(float));
+      } else {
+        for (int k = 0; k < kBatchSize; ++k) {
+          out[k] = outputs_[o].value;
+        }
+      }
+    }
+  }
+}
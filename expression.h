@@ -0,0 +1,116 @@
+#ifndef __EXPRESSION_H__
+#define __EXPRESSION_H__
+
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+// A small language for per-hair effects, so that new looks can be written
+// and tweaked while the show runs instead of as new Visualizer subclasses.
+//
+// A program is a list of statements, one per line. Each one either names an
+// intermediate value or sets one of the outputs:
+//
+//   # Waves rolling up the jacket, in the colors of the beat.
+//   let wave = 0.5 + 0.5 * sin(8 * height - 4 * time + random)
+//   brightness = wave * (1 - 0.7 * beat)
+//   red = band0
+//   blue = 1 - band0
+//
+// Outputs are brightness, red, green and blue, all from 0 to 1 and all 1 if
+// not set; a hair's color is its brightness times its red, green and blue.
+//
+// Inputs shared by every hair:
+//   time               seconds since start
+//   beat               phase since the last beat, 0 to 1
+//   tempo              beats per minute
+//   count              number of hairs
+//   band0 .. band7     band energies, 0 to 1, bass first
+//   section            section of the setlist track being played, from 0,
+//                      or -1 when the music is not a known track
+//
+// Inputs for each hair:
+//   x, y, z            position, in meters
+//   nx, ny, nz         normal
+//   height             0 at the hem, 1 at the top of the jacket
+//   index              0 to count - 1, in LED order
+//   random, random2    fixed random values, 0 to 1
+//
+// Operators, from loosest to tightest: < > <= >= (1 or 0), + -, * / %,
+// unary -, ^ (power). Functions: sin cos abs floor fract sqrt exp min max
+// pow clamp(x, lo, hi) mix(a, b, t) step(edge, x) smoothstep(lo, hi, x).
+//
+// Programs compile to bytecode for a register machine whose registers hold
+// kBatchSize hairs each, so every instruction is a short loop that the
+// compiler vectorizes, and the interpretation cost is shared by the batch.
+class Expression {
+ public:
+  static const int kBatchSize = 8;
+
+  enum Uniform {
+    TIME, BEAT, TEMPO, COUNT, BAND0, BAND1, BAND2, BAND3, BAND4, BAND5,
+    BAND6, BAND7, SECTION, kNumUniforms
+  };
+
+  enum HairInput {
+    X, Y, Z, NX, NY, NZ, HEIGHT, INDEX, RANDOM, RANDOM2, kNumHairInputs
+  };
+
+  enum Output { BRIGHTNESS, RED, GREEN, BLUE, kNumOutputs };
+
+  Expression();
+
+  // Replaces the program with source. On failure, returns false, sets error
+  // to a message with the line number, and keeps the old program.
+  bool Compile(const string &source, string *error);
+
+  // Evaluates the program for num_hairs hairs. hair_inputs[i] and
+  // outputs[o] are arrays of num_hairs values, padded with room for a
+  // whole number of batches.
+  void Evaluate(const float uniforms[kNumUniforms],
+                const float *const hair_inputs[kNumHairInputs], int num_hairs,
+                float *const outputs[kNumOutputs]) const;
+
+  // Rounds a hair count up to a whole number of batches.
+  static int PaddedSize(int num_hairs) {
+    return (num_hairs + kBatchSize - 1) / kBatchSize * kBatchSize;
+  }
+
+ private:
+  friend class ExpressionCompiler;
+
+  enum Opcode {
+    ADD, SUB, MUL, DIV, MOD, NEG, LT, GT, LE, GE, SIN, COS, ABS, FLOOR, FRACT,
+    SQRT, EXP, MIN, MAX, POW, CLAMP, MIX, STEP, SMOOTHSTEP
+  };
+
+  struct Instruction {
+    Opcode op;
+    unsigned char dst, a, b, c;
+  };
+
+  // Runs one instruction on a batch: d = op(a, b, c).
+  static void Execute(Opcode op, float *d, const float *a, const float *b,
+                      const float *c);
+
+  // Registers filled before running the code: constants and uniforms once
+  // per call, hair inputs once per batch.
+  struct Load {
+    int reg;
+    int source;
+    float value;
+  };
+
+  vector<Instruction> code_;
+  vector<Load> constants_;
+  vector<Load> uniforms_;
+  vector<Load> hair_inputs_;
+
+  // Where each output ends up: a register, or a constant if reg is -1.
+  Load outputs_[kNumOutputs];
+  int num_registers_;
+};
+
+#endif // __EXPRESSION_H__
@@ -0,0 +1,99 @@
+#include "fingerprint.h"
+
+#include <math.h>
+
+#include <algorithm>
+
+static const float kLowestHz = 300.0f;
+static const float kHighestHz = 3000.0f;
+
+static const float kFrameSeconds = 0.37f;
+
+// Keeps the logarithm finite in silence.
+static const float kEnergyFloor = 1e-10f;
+
+Fingerprinter::Fingerprinter() : win_size_(0), frame_hops_(1), hops_(0) {}
+
+void Fingerprinter::Init(uint_t win_size, uint_t hop_size,
+                         uint_t sample_rate) {
+  win_size_ = win_size;
+  frame_hops_ =
+      std::max((int)(kFrameSeconds * sample_rate / hop_size + 0.5f), 1);
+  energies_.assign(2 * frame_hops_ * (kNumBits + 1), 0.0f);
+  hops_ = 0;
+  const float bin_hz = (float)sample_rate / win_size;
+  const int num_bins = win_size / 2 + 1;
+
+  // With small windows the lowest bands are narrower than a bin; each gets
+  // at least one, and the rest move up.
+  edges_.resize(kNumBits + 2);
+  edges_[0] = std::max((int)(kLowestHz / bin_hz + 0.5f), 1);
+  for (int b = 1; b < kNumBits + 2; ++b) {
+    const float hz = kLowestHz * powf(kHighestHz / kLowestHz,
+                                      (float)b / (kNumBits + 1));
+    edges_[b] = std::max((int)(hz / bin_hz + 0.5f), edges_[b - 1] + 1);
+  }
+  for (int b = 0; b < kNumBits + 2; ++b) {
+    edges_[b] = std::min(edges_[b], num_bins - 1);
+  }
+}
+
+uint32_t Fingerprinter::ProcessSpectrum(const float *spectrum,
+                                        uint32_t *weak_bits) {
+  // spectrum holds the real parts in [0, n/2] and the imaginary parts in
+  // reverse order in [n/2 + 1, n).
+  const int n = win_size_;
+  float *energy = &energies_[(hops_ % (2 * frame_hops_)) * (kNumBits + 1)];
+  for (int b = 0; b <= kNumBits; ++b) {
+    energy[b] = 0.0f;
+    for (int k = edges_[b]; k < edges_[b + 1]; ++k) {
+      energy[b] +=
+          spectrum[k] * spectrum[k] + spectrum[n - k] * spectrum[n - k];
+    }
+  }
+  ++hops_;
+
+  // The energy of each band over this frame and the last, which begins
+  // frame_hops_ earlier.
+  float frame[kNumBits + 1], previous[kNumBits + 1];
+  for (int b = 0; b <= kNumBits; ++b) {
+    frame[b] = kEnergyFloor;
+    previous[b] = kEnergyFloor;
+  }
+  for (int age = 0; age < 2 * frame_hops_; ++age) {
+    const float *hop =
+        &energies_[((hops_ - 1 - age) % (2 * frame_hops_)) * (kNumBits + 1)];
+    float *sum = age < frame_hops_ ? frame : previous;
+    for (int b = 0; b <= kNumBits; ++b) {
+      sum[b] += hop[b];
+    }
+  }
+  for (int b = 0; b <= kNumBits; ++b) {
+    frame[b] = logf(frame[b]);
+    previous[b] = logf(previous[b]);
+  }
+
+  uint32_t fingerprint = 0;
+  float changes[kNumBits];
+  for (int m = 0; m < kNumBits; ++m) {
+    changes[m] = (frame[m] - frame[m + 1]) - (previous[m] - previous[m + 1]);
+    if (changes[m] > 0.0f) {
+      fingerprint |= 1u << m;
+    }
+  }
+
+  if (weak_bits) {
+    *weak_bits = 0;
+    for (int w = 0; w < kNumWeakBits; ++w) {
+      int weakest = -1;
+      for (int m = 0; m < kNumBits; ++m) {
+        if (!(*weak_bits & (1u << m)) &&
+            (weakest < 0 || fabsf(changes[m]) < fabsf(changes[weakest]))) {
+          weakest = m;
+        }
+      }
+      *weak_bits |= 1u << weakest;
+    }
+  }
+  return fingerprint;
+}
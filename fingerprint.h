@@ -0,0 +1,72 @@
+#ifndef __FINGERPRINT_H__
+#define __FINGERPRINT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+// Aubio includes
+#include <aubio/aubio.h>
+
+using std::vector;
+
+// Fingerprinter sums up each hop of audio in 32 bits that survive a trip
+// through a PA and a microphone, so that live input can be recognized as a
+// stretch of a known recording (see SetlistFollower).
+//
+// It follows Haitsma and Kalker's scheme: the spectrum between 300 Hz and
+// 3 kHz, where music carries most of its identity and rooms and mics alter
+// the least, is split into 33 log-spaced bands, and bit m is whether the
+// difference in energy between bands m and m + 1 grew from one frame to
+// the next. Energies are compared as logarithms, so a change in level or a
+// fixed tilt in the response, like a mic's, cancels out of every bit.
+//
+// Their frames are 0.37 s long, and so are these: each band's energy is
+// summed over the hops of the last 0.37 s and compared with the 0.37 s
+// before. Comparing single hops instead, a few milliseconds apart, the bits
+// depend on where the hops happen to fall in the music, which is never the
+// same live as in the recording, and sustained notes leave them to chance.
+//
+// The same hop of music, recorded and live, differs in a few bits, or in a
+// quarter of them through a noisy room; unrelated audio in about half of
+// them. Silence has every bit clear. The bits whose energy differences barely
+// changed are the likeliest to differ, so they are pointed out too: a
+// search that also tries them flipped finds far more exact matches.
+class Fingerprinter {
+ public:
+  static const int kNumBits = 32;
+
+  // How many of the least reliable bits are pointed out.
+  static const int kNumWeakBits = 4;
+
+  Fingerprinter();
+
+  void Init(uint_t win_size, uint_t hop_size, uint_t sample_rate);
+
+  // Takes the spectrum of one hop, in the layout of aubio_fft_do_complex(),
+  // and returns its fingerprint. weak_bits, if given, gets a mask of its
+  // kNumWeakBits least reliable bits.
+  uint32_t ProcessSpectrum(const float *spectrum, uint32_t *weak_bits = NULL);
+
+ private:
+  uint_t win_size_;
+
+  // Band b covers the FFT bins from edges_[b] up to edges_[b + 1].
+  vector<int> edges_;
+
+  // The hops in a frame.
+  int frame_hops_;
+
+  // The energy of each band in the last two frames' hops, by hop modulo
+  // 2 * frame_hops_, and how many hops there have been.
+  vector<float> energies_;
+  long hops_;
+};
+
+// How many bits two fingerprints differ in.
+inline int FingerprintDistance(uint32_t a, uint32_t b) {
+  return __builtin_popcount(a ^ b);
+}
+
+#endif // __FINGERPRINT_H__
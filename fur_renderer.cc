@@ -0,0 +1,164 @@
+#include "fur_renderer.h"
+
+#include <algorithm>
+
+// Disco Wookie includes
+#include "hair.h"
+#include "trace.h"
+
+FurRenderer::FurRenderer()
+  : num_hairs_(0),
+    vertex_buffer_(0),
+    color_buffer_(0),
+    index_buffer_(0),
+    index_stride_(0),
+    num_indices_(0),
+    stale_(true),
+    changed_(false) {}
+
+void FurRenderer::Reposition(const Fur &fur) {
+  const vector<Hair> &hairs = fur.hairs;
+  num_hairs_ = hairs.size();
+
+  int num_channels = 0;
+  for (int i = 0; i < num_hairs_; ++i) {
+    num_channels = std::max(num_channels, hairs[i].led_channel + 1);
+  }
+  led_index_.resize(num_hairs_);
+  for (int i = 0; i < num_hairs_; ++i) {
+    led_index_[i] = hairs[i].led_channel;
+  }
+  led_frame_.assign(num_channels, MakeRgba(0, 0, 0));
+  preview_.assign(4 * num_hairs_, MakeRgba(0, 0, 0));
+  stale_ = true;
+  upload_.Clear();
+  index_stride_ = 0;
+
+  vector<GLfloat> vertices(4 * 3 * num_hairs_);
+  for (int i = 0; i < num_hairs_; ++i) {
+    for (int v = 0; v < 4; ++v) {
+      for (int axis = 0; axis < 3; ++axis) {
+        vertices[(4 * i + v) * 3 + axis] = hairs[i].vertices[v][axis];
+      }
+    }
+  }
+
+  if (vertex_buffer_ == 0) {
+    glGenBuffers(1, &vertex_buffer_);
+    glGenBuffers(1, &color_buffer_);
+  }
+  glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer_);
+  glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(GLfloat),
+               vertices.empty() ? NULL : &vertices[0], GL_STATIC_DRAW);
+  glBindBuffer(GL_ARRAY_BUFFER, color_buffer_);
+  glBufferData(GL_ARRAY_BUFFER, preview_.size() * sizeof(Rgba), NULL,
+               GL_STREAM_DRAW);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void FurRenderer::Update(const Fur &fur) {
+  TRACE_SCOPE("FurRenderer::Update");
+  changed_ = false;
+  led_dirty_.Clear();
+  if (num_hairs_ == 0 || (int)fur.colors.size() != num_hairs_) {
+    return;
+  }
+
+  DirtyRanges all;
+  if (stale_) {
+    all.AddAll(num_hairs_);
+    led_dirty_.AddAll(led_frame_.size());
+    stale_ = false;
+  }
+  const DirtyRanges &dirty = all.empty() ? fur.dirty : all;
+  if (dirty.empty()) {
+    return;
+  }
+  changed_ = true;
+  upload_.Add(dirty);
+
+  const unsigned char *srgb = LinearToSrgb();
+  const int *led_index = &led_index_[0];
+  Rgba *preview = &preview_[0];
+  Rgba *led_frame = led_frame_.empty() ? NULL : &led_frame_[0];
+  for (int r = 0; r < dirty.size(); ++r) {
+    const int end = std::min(dirty[r].end, num_hairs_);
+    for (int i = dirty[r].begin; i < end; ++i) {
+      const Rgba color = fur.Output(i);
+      const Rgba display = MakeRgba(srgb[color.r], srgb[color.g],
+                                    srgb[color.b]);
+      preview[4 * i] = display;
+      preview[4 * i + 1] = display;
+      preview[4 * i + 2] = display;
+      preview[4 * i + 3] = display;
+      if (led_index[i] >= 0) {
+        led_frame[led_index[i]] = color;
+        led_dirty_.Add(led_index[i]);
+      }
+    }
+  }
+}
+
+void FurRenderer::Draw(int stride) {
+  TRACE_SCOPE("FurRenderer::Draw");
+  if (num_hairs_ == 0) {
+    return;
+  }
+
+  glPushAttrib(GL_LIGHTING_BIT | GL_CURRENT_BIT);
+  glPushClientAttrib(GL_CLIENT_VERTEX_ARRAY_BIT);
+
+  // The color array drives the emission; everything the lights could add
+  // is black.
+  static const GLfloat black[4] = { 0.0f, 0.0f, 0.0f, 1.0f };
+  glEnable(GL_COLOR_MATERIAL);
+  glColorMaterial(GL_FRONT_AND_BACK, GL_EMISSION);
+  glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE, black);
+  glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, black);
+
+  glBindBuffer(GL_ARRAY_BUFFER, color_buffer_);
+  for (int r = 0; r < upload_.size(); ++r) {
+    const int begin = upload_[r].begin;
+    const int end = std::min(upload_[r].end, num_hairs_);
+    if (end <= begin) {
+      continue;
+    }
+    glBufferSubData(GL_ARRAY_BUFFER, 4 * begin * sizeof(Rgba),
+                    4 * (end - begin) * sizeof(Rgba), &preview_[4 * begin]);
+  }
+  upload_.Clear();
+  glColorPointer(4, GL_UNSIGNED_BYTE, 0, NULL);
+  glEnableClientState(GL_COLOR_ARRAY);
+
+  glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer_);
+  glVertexPointer(3, GL_FLOAT, 0, NULL);
+  glEnableClientState(GL_VERTEX_ARRAY);
+
+  if (stride <= 1) {
+    glDrawArrays(GL_QUADS, 0, 4 * num_hairs_);
+  } else {
+    if (index_buffer_ == 0) {
+      glGenBuffers(1, &index_buffer_);
+    }
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer_);
+    if (stride != index_stride_) {
+      vector<GLuint> indices;
+      indices.reserve(4 * (num_hairs_ / stride + 1));
+      for (int i = 0; i < num_hairs_; i += stride) {
+        for (int v = 0; v < 4; ++v) {
+          indices.push_back(4 * i + v);
+        }
+      }
+      glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLuint),
+                   &indices[0], GL_STATIC_DRAW);
+      index_stride_ = stride;
+      num_indices_ = indices.size();
+    }
+    glDrawElements(GL_QUADS, num_indices_, GL_UNSIGNED_INT, NULL);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+  }
+
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  glPopClientAttrib();
+  glPopAttrib();
+}
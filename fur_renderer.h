@@ -0,0 +1,89 @@
+#ifndef __FUR_RENDERER_H__
+#define __FUR_RENDERER_H__
+
+#include <vector>
+
+// Disco Wookie includes
+#include "color.h"
+#include "dirty_ranges.h"
+
+// GLWFW includes
+#include <GLFW/glfw3.h>
+
+using std::vector;
+
+class Fur;
+
+// FurRenderer turns the fur's colors into what each output needs, in one
+// pass over them: sRGB colors for the preview, four per hair since each hair
+// is a quad, and a linear frame in LED channel order for the jacket. It then
+// draws every hair with a single call, from vertex buffers.
+//
+// Only the hairs in the fur's dirty ranges are converted, and only their
+// colors are uploaded again, so a frame in which little changed costs
+// little.
+//
+// Hairs are drawn as lights rather than surfaces: their color is their
+// emission, and the scene's lights do not touch them.
+class FurRenderer {
+ public:
+  // The buffers are left to go with the GL context, which the owner of a
+  // FurRenderer usually destroys first.
+  FurRenderer();
+
+  // Uploads the hairs' corners. Call from the render thread whenever the
+  // hairs change.
+  void Reposition(const Fur &fur);
+
+  // Converts the colors of the hairs that changed, or of every hair after
+  // Reposition(), for the preview and the LEDs.
+  void Update(const Fur &fur);
+
+  // Whether the last Update() converted any colors.
+  bool changed() const { return changed_; }
+
+  // Draws the hairs in the colors from the last Update(): all of them, or
+  // for a cheaper preview, every stride-th one. The hairs are scattered at
+  // random, so the ones drawn still cover the jacket evenly. The LEDs get
+  // every hair regardless.
+  void Draw(int stride = 1);
+
+  // The size of the vertex buffers, in bytes.
+  long buffer_bytes() const {
+    return num_hairs_ * 4 * (3 * sizeof(GLfloat) + sizeof(Rgba));
+  }
+
+  // The linear color of each LED channel, as of the last Update(). Channels
+  // that no hair is wired to stay black.
+  const vector<Rgba> &led_frame() const { return led_frame_; }
+
+  // The channels of led_frame() that the last Update() changed.
+  const DirtyRanges &led_dirty() const { return led_dirty_; }
+
+ private:
+  int num_hairs_;
+  GLuint vertex_buffer_;
+  GLuint color_buffer_;
+
+  // The corners of every index_stride_-th hair, for Draw() with that
+  // stride; 0 until one is needed.
+  GLuint index_buffer_;
+  int index_stride_;
+  int num_indices_;
+
+  // Where each hair's color goes in led_frame_, or -1 for none.
+  vector<int> led_index_;
+
+  vector<Rgba> preview_;
+  vector<Rgba> led_frame_;
+  DirtyRanges led_dirty_;
+
+  // Set by Reposition(): the next Update() converts every hair.
+  bool stale_;
+  bool changed_;
+
+  // The hairs whose preview colors are not uploaded yet.
+  DirtyRanges upload_;
+};
+
+#endif // __FUR_RENDERER_H__
@@ -0,0 +1,346 @@
+#include "glow_bake.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+
+// Disco Wookie includes
+#include "hair.h"
+#include "trace.h"
+
+// Hairs further than this from a vertex, in meters, do not light it.
+static const float kRadius = 0.12f;
+
+// How far in front of the fabric each hair's light sits, in meters. Also
+// softens the falloff, so a vertex right under a hair is not infinitely lit.
+static const float kStandoff = 0.015f;
+
+// How brightly the fabric glows, from 0 to 1, with every hair at full white,
+// at the vertex that receives more light than kStrengthPercentile of them.
+// Brighter vertices saturate.
+static const float kStrength = 0.35f;
+static const float kStrengthPercentile = 0.9f;
+
+// Bump when the bake changes, so that old caches are not used.
+static const uint32_t kBakeVersion = 1;
+
+static const char kMagic[8] = { 'H', 'A', 'I', 'R', 'G', 'L', 'W', '\0' };
+
+namespace {
+
+struct GlowCacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t num_vertices;
+  uint32_t num_hairs;
+  uint32_t hairs_per_vertex;
+  uint64_t key;
+};
+
+// 64-bit FNV-1a.
+class Hasher {
+ public:
+  Hasher() : hash_(14695981039346656037ULL) {}
+
+  void Add(const void *data, size_t size) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    for (size_t i = 0; i < size; ++i) {
+      hash_ = (hash_ ^ bytes[i]) * 1099511628211ULL;
+    }
+  }
+
+  uint64_t hash() const { return hash_; }
+
+ private:
+  uint64_t hash_;
+};
+
+}  // namespace
+
+// static
+uint64_t GlowBake::Key(const vector<Hair> &hairs, const Model_OBJ &mesh) {
+  Hasher hasher;
+  const uint32_t version = kBakeVersion;
+  const int hairs_per_vertex = kHairsPerVertex;
+  const float parameters[] = { kRadius, kStandoff, kStrength,
+                               kStrengthPercentile };
+  hasher.Add(&version, sizeof(version));
+  hasher.Add(&hairs_per_vertex, sizeof(hairs_per_vertex));
+  hasher.Add(parameters, sizeof(parameters));
+  for (unsigned int i = 0; i < hairs.size(); ++i) {
+    hasher.Add(&hairs[i].normal, sizeof(hairs[i].normal));
+    hasher.Add(hairs[i].vertices, sizeof(hairs[i].vertices));
+  }
+  if (mesh.TotalConnectedTriangles > 0) {
+    hasher.Add(mesh.Faces_Triangles,
+               mesh.TotalConnectedTriangles * sizeof(float));
+  }
+  return hasher.hash();
+}
+
+void GlowBake::BakeOrLoad(const vector<Hair> &hairs, const Model_OBJ &mesh,
+                          const string &cache_dir) {
+  if (cache_dir.empty()) {
+    Bake(hairs, mesh);
+    return;
+  }
+
+  const uint64_t key = Key(hairs, mesh);
+  char name[32];
+  snprintf(name, sizeof(name), "/glow-%016llx.bin", (unsigned long long)key);
+  const string path = cache_dir + name;
+  if (Load(path, key) == 0 && num_vertices_ == mesh.TotalConnectedTriangles / 3 &&
+      num_hairs_ == (int)hairs.size()) {
+    return;
+  }
+
+  Bake(hairs, mesh);
+  if (mkdir(cache_dir.c_str(), 0755) != 0 && errno != EEXIST) {
+    printf("Unable to create %s for the glow cache\n", cache_dir.c_str());
+    return;
+  }
+  Save(path, key);
+}
+
+void GlowBake::Bake(const vector<Hair> &hairs, const Model_OBJ &mesh) {
+  TRACE_SCOPE("GlowBake::Bake");
+  num_vertices_ = mesh.TotalConnectedTriangles / 3;
+  num_hairs_ = hairs.size();
+  const int n = num_vertices_;
+  hairs_.assign((size_t)kHairsPerVertex * n, 0);
+  weights_.assign((size_t)kHairsPerVertex * n, 0.0f);
+  if (n == 0 || num_hairs_ == 0) {
+    return;
+  }
+
+  // Where each hair's light is.
+  vector<vec3> lights(num_hairs_);
+  for (int i = 0; i < num_hairs_; ++i) {
+    const Hair &hair = hairs[i];
+    const vec3 center = 0.25f * (hair.vertices[0] + hair.vertices[1] +
+                                 hair.vertices[2] + hair.vertices[3]);
+    lights[i] = center + kStandoff * hair.normal;
+  }
+
+  // A grid of cells kRadius wide, so that the hairs that can light a vertex
+  // are all in the 27 cells around it. Counting sort of the hairs by cell,
+  // as in HairGraph::Build().
+  vec3 low = lights[0];
+  vec3 high = low;
+  for (int i = 0; i < num_hairs_; ++i) {
+    low = glm::min(low, lights[i]);
+    high = glm::max(high, lights[i]);
+  }
+  int dims[3];
+  for (int axis = 0; axis < 3; ++axis) {
+    dims[axis] = std::min((int)((high[axis] - low[axis]) / kRadius) + 1, 256);
+  }
+  const int num_cells = dims[0] * dims[1] * dims[2];
+  vector<int> cell_start(num_cells + 1, 0);
+  vector<int> cell_of(num_hairs_);
+  for (int i = 0; i < num_hairs_; ++i) {
+    int c[3];
+    for (int axis = 0; axis < 3; ++axis) {
+      c[axis] = std::min((int)((lights[i][axis] - low[axis]) / kRadius),
+                         dims[axis] - 1);
+    }
+    cell_of[i] = (c[2] * dims[1] + c[1]) * dims[0] + c[0];
+    ++cell_start[cell_of[i] + 1];
+  }
+  for (int c = 0; c < num_cells; ++c) {
+    cell_start[c + 1] += cell_start[c];
+  }
+  vector<int> order(num_hairs_);
+  {
+    vector<int> fill(cell_start.begin(), cell_start.end() - 1);
+    for (int i = 0; i < num_hairs_; ++i) {
+      order[fill[cell_of[i]]++] = i;
+    }
+  }
+
+  const float radius2 = kRadius * kRadius;
+  const float standoff2 = kStandoff * kStandoff;
+  vector<float> totals(n, 0.0f);
+  for (int v = 0; v < n; ++v) {
+    // Hairs lie flat on the fabric, with the normal of the triangle they
+    // grew from, so the vertex takes its triangle's normal the same way.
+    const float *corners = &mesh.Faces_Triangles[9 * (v / 3)];
+    const vec3 a(corners[0], corners[1], corners[2]);
+    const vec3 b(corners[3], corners[4], corners[5]);
+    const vec3 c(corners[6], corners[7], corners[8]);
+    const vec3 cross = glm::cross(b - a, c - a);
+    const float area = glm::length(cross);
+    if (!(area > 0.0f)) {
+      continue;
+    }
+    const vec3 normal = cross / area;
+    const float *p = &mesh.Faces_Triangles[3 * v];
+    const vec3 position(p[0], p[1], p[2]);
+
+    // The strongest hairs so far, strongest first.
+    float best_weight[kHairsPerVertex];
+    int best[kHairsPerVertex];
+    int found = 0;
+
+    int cell[3];
+    for (int axis = 0; axis < 3; ++axis) {
+      cell[axis] = (int)floorf((position[axis] - low[axis]) / kRadius);
+    }
+    for (int z = cell[2] - 1; z <= cell[2] + 1; ++z) {
+      for (int y = cell[1] - 1; y <= cell[1] + 1; ++y) {
+        for (int x = cell[0] - 1; x <= cell[0] + 1; ++x) {
+          if (x < 0 || y < 0 || z < 0 || x >= dims[0] || y >= dims[1] ||
+              z >= dims[2]) {
+            continue;
+          }
+          const int index = (z * dims[1] + y) * dims[0] + x;
+          for (int s = cell_start[index]; s < cell_start[index + 1]; ++s) {
+            const int h = order[s];
+            const vec3 d = lights[h] - position;
+            const float distance2 = glm::dot(d, d);
+            if (distance2 >= radius2) {
+              continue;
+            }
+            const float cosine =
+                glm::dot(normal, d) / std::max(sqrtf(distance2), 1e-6f);
+            const float facing = glm::dot(normal, hairs[h].normal);
+            if (cosine <= 0.0f || facing <= 0.0f) {
+              continue;
+            }
+            const float window = 1.0f - distance2 / radius2;
+            const float weight = cosine * facing * window * window *
+                                 standoff2 / (standoff2 + distance2);
+            if (found == kHairsPerVertex &&
+                weight <= best_weight[kHairsPerVertex - 1]) {
+              continue;
+            }
+            int j = (found < kHairsPerVertex) ? found++ : kHairsPerVertex - 1;
+            while (j > 0 && best_weight[j - 1] < weight) {
+              best_weight[j] = best_weight[j - 1];
+              best[j] = best[j - 1];
+              --j;
+            }
+            best_weight[j] = weight;
+            best[j] = h;
+          }
+        }
+      }
+    }
+
+    for (int j = 0; j < found; ++j) {
+      hairs_[(size_t)j * n + v] = best[j];
+      weights_[(size_t)j * n + v] = best_weight[j];
+      totals[v] += best_weight[j];
+    }
+  }
+
+  // Scale by what the well-covered parts of the jacket receive, rather than
+  // by the single brightest vertex.
+  vector<float> sorted(totals);
+  vector<float>::iterator percentile =
+      sorted.begin() + (size_t)(kStrengthPercentile * (n - 1));
+  std::nth_element(sorted.begin(), percentile, sorted.end());
+  if (*percentile > 0.0f) {
+    const float scale = kStrength / *percentile;
+    for (size_t e = 0; e < weights_.size(); ++e) {
+      weights_[e] *= scale;
+    }
+  }
+}
+
+void GlowBake::Apply(const float *r, const float *g, const float *b,
+                     float *out_r, float *out_g, float *out_b, int begin,
+                     int end) const {
+  for (int v = begin; v < end; ++v) {
+    out_r[v] = 0.0f;
+    out_g[v] = 0.0f;
+    out_b[v] = 0.0f;
+  }
+
+  // One slot at a time: the weights, the indices and the sums are
+  // consecutive in v, so the multiply-adds vectorize, and only the hairs'
+  // light is gathered.
+  const int n = num_vertices_;
+  for (int j = 0; j < kHairsPerVertex; ++j) {
+    const int32_t *hair = &hairs_[(size_t)j * n];
+    const float *weight = &weights_[(size_t)j * n];
+    for (int v = begin; v < end; ++v) {
+      const int h = hair[v];
+      const float w = weight[v];
+      out_r[v] += w * r[h];
+      out_g[v] += w * g[h];
+      out_b[v] += w * b[h];
+    }
+  }
+}
+
+int GlowBake::Save(const string &path, uint64_t key) const {
+  FILE *file = fopen(path.c_str(), "wb");
+  if (!file) {
+    printf("Unable to write glow cache %s\n", path.c_str());
+    return 1;
+  }
+
+  GlowCacheHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kBakeVersion;
+  header.num_vertices = num_vertices_;
+  header.num_hairs = num_hairs_;
+  header.hairs_per_vertex = kHairsPerVertex;
+  header.key = key;
+
+  const size_t entries = hairs_.size();
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+  if (ok && entries > 0) {
+    ok = fwrite(&hairs_[0], sizeof(int32_t), entries, file) == entries &&
+         fwrite(&weights_[0], sizeof(float), entries, file) == entries;
+  }
+  if (fclose(file) != 0 || !ok) {
+    printf("Error writing glow cache %s\n", path.c_str());
+    remove(path.c_str());
+    return 1;
+  }
+  return 0;
+}
+
+int GlowBake::Load(const string &path, uint64_t key) {
+  FILE *file = fopen(path.c_str(), "rb");
+  if (!file) {
+    return 1;
+  }
+
+  GlowCacheHeader header;
+  bool ok = fread(&header, sizeof(header), 1, file) == 1 &&
+            memcmp(header.magic, kMagic, sizeof(kMagic)) == 0 &&
+            header.version == kBakeVersion && header.key == key &&
+            header.hairs_per_vertex == kHairsPerVertex;
+  vector<int32_t> hairs;
+  vector<float> weights;
+  if (ok) {
+    const size_t entries = (size_t)kHairsPerVertex * header.num_vertices;
+    hairs.resize(entries);
+    weights.resize(entries);
+    ok = entries == 0 ||
+         (fread(&hairs[0], sizeof(int32_t), entries, file) == entries &&
+          fread(&weights[0], sizeof(float), entries, file) == entries);
+    for (size_t e = 0; ok && e < entries; ++e) {
+      ok = hairs[e] >= 0 && hairs[e] < (int32_t)header.num_hairs;
+    }
+  }
+  fclose(file);
+  if (!ok) {
+    printf("Ignoring glow cache %s\n", path.c_str());
+    return 1;
+  }
+
+  num_vertices_ = header.num_vertices;
+  num_hairs_ = header.num_hairs;
+  hairs_.swap(hairs);
+  weights_.swap(weights);
+  return 0;
+}
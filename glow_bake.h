@@ -0,0 +1,75 @@
+#ifndef __GLOW_BAKE_H__
+#define __GLOW_BAKE_H__
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+// Disco Wookie includes
+#include "color.h"
+
+using std::string;
+using std::vector;
+
+class Hair;
+class Model_OBJ;
+
+// GlowBake precomputes how much of each hair's light reaches each vertex of
+// the jacket mesh, so that the glow of the hairs on the fabric costs a
+// sparse matrix-vector product per frame rather than hairs times vertices.
+//
+// Each hair is taken as a point light a little off the fabric, in front of
+// its center. A vertex receives light from the hairs within kRadius of it,
+// in proportion to the cosine at the vertex (hairs behind its face give
+// none), how closely the hair faces the same way (hairs on the far side of
+// a sleeve give none), and a softened inverse square falloff that reaches
+// zero at kRadius. Only the kHairsPerVertex strongest hairs are kept, and
+// the hairs near each vertex are found with a uniform grid.
+//
+// Baking takes a few hundred milliseconds, so the result is cached on disk,
+// under a key made from the hairs, the mesh and the bake's parameters.
+class GlowBake {
+ public:
+  // How many hairs light each vertex. Every vertex has this many entries;
+  // the ones it does not need have no weight.
+  static const int kHairsPerVertex = 16;
+
+  GlowBake() : num_vertices_(0), num_hairs_(0) {}
+
+  // Bakes the glow of hairs onto every vertex of mesh (each corner of each
+  // of its triangles, in the order it draws them), or loads the bake from
+  // cache_dir if it was done before. An empty cache_dir turns the cache off.
+  void BakeOrLoad(const vector<Hair> &hairs, const Model_OBJ &mesh,
+                  const string &cache_dir);
+
+  // The same, always baking.
+  void Bake(const vector<Hair> &hairs, const Model_OBJ &mesh);
+
+  // For vertices [begin, end): the linear light, from 0 to 1 per channel, of
+  // the hairs' glow, given each hair's light in r, g and b.
+  void Apply(const float *r, const float *g, const float *b, float *out_r,
+             float *out_g, float *out_b, int begin, int end) const;
+
+  int num_vertices() const { return num_vertices_; }
+  int num_hairs() const { return num_hairs_; }
+
+ private:
+  // Identifies the bake of these hairs on this mesh.
+  static uint64_t Key(const vector<Hair> &hairs, const Model_OBJ &mesh);
+
+  // Each returns 0 on success.
+  int Save(const string &path, uint64_t key) const;
+  int Load(const string &path, uint64_t key);
+
+  int num_vertices_;
+  int num_hairs_;
+
+  // Entry j of vertex v is at j * num_vertices_ + v: entries are grouped by
+  // slot rather than by vertex, so that Apply() runs over consecutive
+  // vertices, and the weights and sums, in its inner loop.
+  vector<int32_t> hairs_;
+  vector<float> weights_;
+};
+
+#endif // __GLOW_BAKE_H__
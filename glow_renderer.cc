@@ -0,0 +1,148 @@
+#include "glow_renderer.h"
+
+#include <algorithm>
+#include <atomic>
+
+// Disco Wookie includes
+#include "hair.h"
+#include "thread_pool.h"
+#include "trace.h"
+
+// Vertices per task when applying the bake.
+static const int kApplyGrain = 1024;
+
+GlowRenderer::GlowRenderer()
+  : num_vertices_(0),
+    vertex_buffer_(0),
+    color_buffer_(0),
+    stale_(true),
+    relight_(false),
+    upload_(false),
+    lit_(false) {}
+
+void GlowRenderer::Reposition(const Model_OBJ &mesh, GlowBake *bake) {
+  std::swap(bake_, *bake);
+  num_vertices_ = bake_.num_vertices();
+  hair_r_.assign(bake_.num_hairs(), 0.0f);
+  hair_g_.assign(bake_.num_hairs(), 0.0f);
+  hair_b_.assign(bake_.num_hairs(), 0.0f);
+  glow_r_.assign(num_vertices_, 0.0f);
+  glow_g_.assign(num_vertices_, 0.0f);
+  glow_b_.assign(num_vertices_, 0.0f);
+  colors_.assign(num_vertices_, MakeRgba(0, 0, 0));
+  stale_ = true;
+  relight_ = false;
+  upload_ = false;
+  lit_ = false;
+
+  if (vertex_buffer_ == 0) {
+    glGenBuffers(1, &vertex_buffer_);
+    glGenBuffers(1, &color_buffer_);
+  }
+  glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer_);
+  glBufferData(GL_ARRAY_BUFFER, num_vertices_ * 3 * sizeof(GLfloat),
+               num_vertices_ > 0 ? mesh.Faces_Triangles : NULL,
+               GL_STATIC_DRAW);
+  glBindBuffer(GL_ARRAY_BUFFER, color_buffer_);
+  glBufferData(GL_ARRAY_BUFFER, num_vertices_ * sizeof(Rgba), NULL,
+               GL_STREAM_DRAW);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void GlowRenderer::Update(const Fur &fur) {
+  TRACE_SCOPE("GlowRenderer::Update");
+  const int num_hairs = hair_r_.size();
+  if (num_vertices_ == 0 || (int)fur.colors.size() != num_hairs) {
+    return;
+  }
+
+  DirtyRanges all;
+  if (stale_) {
+    all.AddAll(num_hairs);
+    stale_ = false;
+  }
+  const DirtyRanges &dirty = all.empty() ? fur.dirty : all;
+  if (dirty.empty()) {
+    return;
+  }
+
+  for (int r = 0; r < dirty.size(); ++r) {
+    const int end = std::min(dirty[r].end, num_hairs);
+    for (int i = dirty[r].begin; i < end; ++i) {
+      const Rgba color = fur.Output(i);
+      hair_r_[i] = color.r / 255.0f;
+      hair_g_[i] = color.g / 255.0f;
+      hair_b_[i] = color.b / 255.0f;
+    }
+  }
+  relight_ = true;
+}
+
+void GlowRenderer::Relight(ThreadPool *pool) {
+  TRACE_SCOPE("GlowRenderer::Relight");
+  relight_ = false;
+
+  // Each chunk applies the bake to its vertices and converts them for the
+  // display while they are still in cache.
+  std::atomic<bool> lit(false);
+  const unsigned char *srgb = LinearToSrgb();
+  pool->ParallelFor(num_vertices_, kApplyGrain, [&](int begin, int end) {
+    bake_.Apply(&hair_r_[0], &hair_g_[0], &hair_b_[0], &glow_r_[0],
+                &glow_g_[0], &glow_b_[0], begin, end);
+    bool any = false;
+    for (int v = begin; v < end; ++v) {
+      const Rgba linear = FromFloats(glow_r_[v], glow_g_[v], glow_b_[v]);
+      colors_[v] = MakeRgba(srgb[linear.r], srgb[linear.g], srgb[linear.b]);
+      any = any || linear.r != 0 || linear.g != 0 || linear.b != 0;
+    }
+    if (any) {
+      lit.store(true, std::memory_order_relaxed);
+    }
+  });
+  lit_ = lit.load(std::memory_order_relaxed);
+  upload_ = true;
+}
+
+void GlowRenderer::Draw(ThreadPool *pool) {
+  TRACE_SCOPE("GlowRenderer::Draw");
+  if (relight_) {
+    Relight(pool);
+  }
+  if (num_vertices_ == 0 || !lit_) {
+    return;
+  }
+
+  glPushAttrib(GL_ENABLE_BIT | GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT |
+               GL_POLYGON_BIT | GL_CURRENT_BIT);
+  glPushClientAttrib(GL_CLIENT_VERTEX_ARRAY_BIT);
+
+  // The glow adds to the lit jacket underneath. The triangles are the
+  // jacket's own, pulled slightly forward so that they win the depth test
+  // against it, and they leave the depth buffer alone for the hairs.
+  glDisable(GL_LIGHTING);
+  glDisable(GL_TEXTURE_2D);
+  glEnable(GL_BLEND);
+  glBlendFunc(GL_ONE, GL_ONE);
+  glDepthMask(GL_FALSE);
+  glEnable(GL_POLYGON_OFFSET_FILL);
+  glPolygonOffset(-1.0f, -1.0f);
+
+  glBindBuffer(GL_ARRAY_BUFFER, color_buffer_);
+  if (upload_) {
+    glBufferSubData(GL_ARRAY_BUFFER, 0, num_vertices_ * sizeof(Rgba),
+                    &colors_[0]);
+    upload_ = false;
+  }
+  glColorPointer(4, GL_UNSIGNED_BYTE, 0, NULL);
+  glEnableClientState(GL_COLOR_ARRAY);
+
+  glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer_);
+  glVertexPointer(3, GL_FLOAT, 0, NULL);
+  glEnableClientState(GL_VERTEX_ARRAY);
+
+  glDrawArrays(GL_TRIANGLES, 0, num_vertices_);
+
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  glPopClientAttrib();
+  glPopAttrib();
+}
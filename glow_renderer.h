@@ -0,0 +1,75 @@
+#ifndef __GLOW_RENDERER_H__
+#define __GLOW_RENDERER_H__
+
+#include <vector>
+
+// Disco Wookie includes
+#include "color.h"
+#include "glow_bake.h"
+
+// GLWFW includes
+#include <GLFW/glfw3.h>
+
+using std::vector;
+
+class Fur;
+class Model_OBJ;
+class ThreadPool;
+
+// GlowRenderer lights the jacket with its hairs: each frame drawn after any
+// hair changed, it applies a GlowBake to the hairs' colors, on the thread
+// pool, and it draws the result over the jacket as a second, additive pass
+// of the same triangles, with the glow as their color.
+class GlowRenderer {
+ public:
+  // The buffers are left to go with the GL context, as in FurRenderer.
+  GlowRenderer();
+
+  // Takes over bake, which must have been baked for mesh, and uploads the
+  // mesh's triangles. Call from the render thread.
+  void Reposition(const Model_OBJ &mesh, GlowBake *bake);
+
+  // Takes the colors of the hairs that changed. Call every time the fur
+  // changes, whether or not the frame is drawn.
+  void Update(const Fur &fur);
+
+  // Recomputes the glow if any hair changed since the last call, and adds
+  // it to the jacket, which must be drawn already.
+  void Draw(ThreadPool *pool);
+
+  // The size of the vertex buffers, in bytes.
+  long buffer_bytes() const {
+    return num_vertices_ * (3 * sizeof(GLfloat) + sizeof(Rgba));
+  }
+
+ private:
+  // Applies the bake to the hairs' colors, for every vertex.
+  void Relight(ThreadPool *pool);
+
+  GlowBake bake_;
+  int num_vertices_;
+  GLuint vertex_buffer_;
+  GLuint color_buffer_;
+
+  // Each hair's light, by channel, from 0 to 1.
+  vector<float> hair_r_;
+  vector<float> hair_g_;
+  vector<float> hair_b_;
+
+  // Each vertex's glow, by channel, and as a color for the display.
+  vector<float> glow_r_;
+  vector<float> glow_g_;
+  vector<float> glow_b_;
+  vector<Rgba> colors_;
+
+  // Set by Reposition(): the next Update() converts every hair.
+  bool stale_;
+  // Whether a hair changed since the glow was last computed.
+  bool relight_;
+  // Whether colors_ has changed since it was uploaded.
+  bool upload_;
+  // Whether any vertex glows at all.
+  bool lit_;
+};
+
+#endif // __GLOW_RENDERER_H__
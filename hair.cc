@@ -1,28 +1,11 @@
 #include "hair.h"
 #include "audio.h"
 #include "debug.h"
+#include "trace.h"
 
-#define TOTAL_FLOATS_IN_TRIANGLE 9
-
-void Hair::Draw() const {
-  // Set the emission intensity of the hair.
-  // TODO(wcraddock): this might be slow. Does it matter?
-  glMaterialfv(GL_FRONT_AND_BACK, GL_EMISSION, color);
-
-  // Draw the hair as a rectangle.
-  glBegin(GL_QUADS);
-  glVertex3f(vertices[0].x, vertices[0].y, vertices[0].z);
-  glVertex3f(vertices[1].x, vertices[1].y, vertices[1].z);
-  glVertex3f(vertices[2].x, vertices[2].y, vertices[2].z);
-  glVertex3f(vertices[3].x, vertices[3].y, vertices[3].z);
-  glEnd();
-}
+#include <random>
 
-void Hair::SetGrey(float illumination) {
-  color[0] = illumination;
-  color[1] = illumination;
-  color[2] = illumination;
-}
+#define TOTAL_FLOATS_IN_TRIANGLE 9
 
 // Given a vertex, finds the distance to the nearest hair's top-center
 // vertex. Used to scatter the hairs evenly across the jacket.
@@ -39,13 +22,20 @@ float FindClosestHair(const vector<Hair>& hairs, glm::vec3 &vertex) {
   return min_distance;
 }
 
-void Fur::GenerateRandomHairs(Model_OBJ &obj, int num_hairs) {
-  srand(time(NULL));
+void Fur::GenerateRandomHairs(Model_OBJ &obj, int num_hairs,
+                              unsigned int seed) {
+  TRACE_SCOPE("Fur::GenerateRandomHairs");
+
+  // Mersenne Twister output is specified exactly by the standard, unlike
+  // rand() or the std:: distributions, so a seed gives the same layout on
+  // every platform.
+  std::mt19937 random(seed);
+  const double scale = 1.0 / 4294967296.0;
 
   while (hairs.size() < num_hairs) {
     // Pick a random face
     int total_faces = obj.TotalConnectedTriangles / 9;
-    int face_number = rand() % total_faces;
+    int face_number = random() % total_faces;
 
     // Get the three vertices of the face
     float *vertex =
@@ -55,8 +45,8 @@ void Fur::GenerateRandomHairs(Model_OBJ &obj, int num_hairs) {
     glm::vec3 C(vertex[6], vertex[7], vertex[8]);
 
     // Choose a point somewhere on the face for the hair's location
-    float r1 = ((double)rand() / (RAND_MAX));
-    float r2 = ((double)rand() / (RAND_MAX));
+    float r1 = random() * scale;
+    float r2 = random() * scale;
     glm::vec3 top_center = A + r1 * (B - A) + r2 * (C - A);
 
     // If the point is too close to an existing hair, try again.
@@ -94,11 +84,16 @@ void Fur::GenerateRandomHairs(Model_OBJ &obj, int num_hairs) {
     // Create a Hair object and push it into the list of hairs.
     Hair hair;
     hair.top_center = top_center;
+    hair.normal = normal;
+    hair.led_channel = hairs.size();
+    hair.triangle = face_number;
     hair.vertices[0] = top_left;
     hair.vertices[1] = bottom_left;
     hair.vertices[2] = bottom_right;
     hair.vertices[3] = top_right;
     hairs.push_back(hair);
   }
+
+  colors.assign(hairs.size(), MakeRgba(0, 0, 0));
 }
 
@@ -5,7 +5,10 @@
 
 // Disco Wookie includes
 #include "audio.h"
+#include "color.h"
 #include "controller.h"
+#include "dirty_ranges.h"
+#include "hair_graph.h"
 #include "obj_reader.h"
 
 // GLM includes
@@ -19,27 +22,68 @@ using std::vector;
 
 class Hair {
  public:
-  // Render the hair in OpenGL.
-  void Draw() const;
-
-  // Set a grey scale color.
-  void SetGrey(float illumination);
-
-  // Modified by visualizers to control lighting.
-  GLfloat color[3];
-
   // Modified only by Fur only once after instantiation.
   vec3 top_center;
+  vec3 normal;
   vec3 vertices[4];
+
+  // Which LED on the physical jacket this hair is wired to.
+  int led_channel;
+
+  // The jacket triangle the hair is attached to, or -1 if unknown (for
+  // example, for measured positions).
+  int triangle;
 };
 
 // Fur is a collection of Hairs
 class Fur {
  public:
-  // Given some model object, create a bunch of hairs all over it.
-  void GenerateRandomHairs(Model_OBJ &obj, int num_hairs);
+  Fur() : gain(256), repaint(true) {}
+
+  // Given some model object, create a bunch of hairs all over it. The same
+  // seed always produces the same layout on the same model.
+  void GenerateRandomHairs(Model_OBJ &obj, int num_hairs,
+                           unsigned int seed = 1);
 
   vector<Hair> hairs;
+
+  // Set by visualizers: the color of each hair, in the same order as hairs.
+  // Kept apart from the hairs so that the colors are contiguous for the
+  // passes that read them all every frame.
+  vector<Rgba> colors;
+
+  // What the outputs dim every color by, in 256ths: the brightness and the
+  // visualizer's opacity, set by Visualizer::Update(). The colors are left
+  // as the visualizer set them, so that it can tell the hairs that changed
+  // by comparing against them.
+  int gain;
+
+  // What the outputs dim each hair's color by on top of gain, in 256ths, to
+  // keep the LEDs within their power budget; set by PowerLimiter::Apply().
+  // Empty while no limiter runs.
+  vector<unsigned short> limit;
+
+  // The color hair i is shown in, on screen and on the LEDs.
+  Rgba Output(int i) const {
+    const Rgba color = colors[i];
+    const int scale = limit.empty() ? gain << 8 : gain * limit[i];
+    return MakeRgba((color.r * scale) >> 16, (color.g * scale) >> 16,
+                    (color.b * scale) >> 16);
+  }
+
+  // The hairs whose colors changed this frame. Visualizer::Update() starts
+  // it afresh, and anything that changes colors adds to it, so that the
+  // stages that consume the colors can skip the hairs that did not change.
+  DirtyRanges dirty;
+
+  // Set when the colors no longer hold what the visualizer last gave them:
+  // the hairs were replaced, or another visualizer took over. The next
+  // Visualizer::Update() then sets every hair.
+  bool repaint;
+
+  // Each hair's nearest neighbors, for effects that spread between hairs.
+  // Built from the hairs once they are laid out; see HairGraph::Build().
+  HairGraph graph;
 };
 
 #endif // __HAIR_H__
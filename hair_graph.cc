@@ -0,0 +1,197 @@
+#include "hair_graph.h"
+
+#include <math.h>
+
+#include <algorithm>
+
+// Disco Wookie includes
+#include "hair.h"
+#include "trace.h"
+
+// Enough for any effect; keeps the per-hair search state on the stack.
+static const int kMaxNeighbors = 32;
+
+void HairGraph::Build(const vector<Hair> &hairs, int k) {
+  TRACE_SCOPE("HairGraph::Build");
+  const int n = hairs.size();
+  k = std::min(std::min(k, kMaxNeighbors), n - 1);
+
+  offsets.assign(n + 1, 0);
+  neighbors.clear();
+  weights.clear();
+  degree = 0;
+  if (k <= 0) {
+    return;
+  }
+  degree = k;
+
+  vec3 low = hairs[0].top_center;
+  vec3 high = low;
+  for (int i = 0; i < n; ++i) {
+    low = glm::min(low, hairs[i].top_center);
+    high = glm::max(high, hairs[i].top_center);
+  }
+  vec3 extent = high - low;
+
+  // Hairs cover a surface, so size the cells for about k hairs each if the
+  // largest face of the bounding box were that surface. A solid cloud of
+  // points gets at least one point per cell on average instead.
+  float largest_face = std::max(std::max(extent.x * extent.y,
+                                         extent.y * extent.z),
+                                extent.z * extent.x);
+  float volume = extent.x * extent.y * extent.z;
+  float cell = std::max(sqrtf(largest_face * k / n), cbrtf(volume / n));
+  if (!(cell > 0.0f)) {
+    cell = 1.0f;
+  }
+
+  int dims[3];
+  for (int axis = 0; axis < 3; ++axis) {
+    dims[axis] = (int)(extent[axis] / cell) + 1;
+  }
+  const int num_cells = dims[0] * dims[1] * dims[2];
+
+  // Counting sort of the hairs by cell, so that each cell's hairs, and
+  // their positions, are contiguous.
+  vector<int> cell_of(n);
+  vector<int> cell_start(num_cells + 1, 0);
+  for (int i = 0; i < n; ++i) {
+    vec3 p = (hairs[i].top_center - low) / cell;
+    int c[3];
+    for (int axis = 0; axis < 3; ++axis) {
+      c[axis] = std::min((int)p[axis], dims[axis] - 1);
+    }
+    cell_of[i] = (c[2] * dims[1] + c[1]) * dims[0] + c[0];
+    ++cell_start[cell_of[i] + 1];
+  }
+  for (int c = 0; c < num_cells; ++c) {
+    cell_start[c + 1] += cell_start[c];
+  }
+  vector<int> order(n);
+  vector<vec3> sorted(n);
+  {
+    vector<int> fill(cell_start.begin(), cell_start.end() - 1);
+    for (int i = 0; i < n; ++i) {
+      int slot = fill[cell_of[i]]++;
+      order[slot] = i;
+      sorted[slot] = hairs[i].top_center;
+    }
+  }
+
+  neighbors.resize((size_t)n * k);
+  weights.resize((size_t)n * k);
+  const int max_radius = std::max(std::max(dims[0], dims[1]), dims[2]);
+
+  for (int i = 0; i < n; ++i) {
+    const vec3 center = hairs[i].top_center;
+    const int cz = cell_of[i] / (dims[0] * dims[1]);
+    const int cy = cell_of[i] / dims[0] % dims[1];
+    const int cx = cell_of[i] % dims[0];
+
+    // The k best so far, nearest first.
+    float best_distance[kMaxNeighbors];
+    int best[kMaxNeighbors];
+    int found = 0;
+
+    // Search shells of cells at growing Chebyshev distance r. Anything in
+    // shell r + 1 is at least r cells away, so once the k-th best is closer
+    // than that, the search is over.
+    for (int r = 0; r <= max_radius; ++r) {
+      for (int dz = -r; dz <= r; ++dz) {
+        int z = cz + dz;
+        if (z < 0 || z >= dims[2]) {
+          continue;
+        }
+        for (int dy = -r; dy <= r; ++dy) {
+          int y = cy + dy;
+          if (y < 0 || y >= dims[1]) {
+            continue;
+          }
+          // Inside the shell only its two x faces are new.
+          bool on_face = (abs(dz) == r || abs(dy) == r);
+          for (int dx = -r; dx <= r; dx += (on_face || r == 0) ? 1 : 2 * r) {
+            int x = cx + dx;
+            if (x < 0 || x >= dims[0]) {
+              continue;
+            }
+            int c = (z * dims[1] + y) * dims[0] + x;
+            for (int s = cell_start[c]; s < cell_start[c + 1]; ++s) {
+              if (order[s] == i) {
+                continue;
+              }
+              vec3 d = sorted[s] - center;
+              float distance = glm::dot(d, d);
+              if (found == k && distance >= best_distance[k - 1]) {
+                continue;
+              }
+              int j = (found < k) ? found++ : k - 1;
+              while (j > 0 && best_distance[j - 1] > distance) {
+                best_distance[j] = best_distance[j - 1];
+                best[j] = best[j - 1];
+                --j;
+              }
+              best_distance[j] = distance;
+              best[j] = order[s];
+            }
+          }
+        }
+      }
+      float reach = r * cell;
+      if (found == k && best_distance[k - 1] <= reach * reach) {
+        break;
+      }
+    }
+
+    // Gaussian weights on the scale of the k-th neighbor's distance, so
+    // nearer hairs pass on more light in sparse and dense regions alike.
+    const float scale = 1.0f / std::max(best_distance[k - 1], 1e-12f);
+    float total = 0.0f;
+    for (int j = 0; j < k; ++j) {
+      float w = expf(-best_distance[j] * scale);
+      neighbors[(size_t)i * k + j] = best[j];
+      weights[(size_t)i * k + j] = w;
+      total += w;
+    }
+    for (int j = 0; j < k; ++j) {
+      weights[(size_t)i * k + j] /= total;
+    }
+    offsets[i + 1] = (i + 1) * k;
+  }
+}
+
+// Rows of a length known at compile time unroll completely. Four separate
+// sums let the multiply-adds overlap instead of each waiting for the last.
+template <int kDegree>
+static void MultiplyFixed(const int *neighbor, const float *weight,
+                          const float *in, float *out, int begin, int end) {
+  static_assert(kDegree % 4 == 0, "rows are summed four at a time");
+  for (int i = begin; i < end; ++i) {
+    const int *n = neighbor + i * kDegree;
+    const float *w = weight + i * kDegree;
+    float sum[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+    for (int j = 0; j < kDegree; j += 4) {
+      for (int lane = 0; lane < 4; ++lane) {
+        sum[lane] += w[j + lane] * in[n[j + lane]];
+      }
+    }
+    out[i] = (sum[0] + sum[1]) + (sum[2] + sum[3]);
+  }
+}
+
+void HairGraph::Multiply(const float *in, float *out, int begin,
+                         int end) const {
+  const int *offset = &offsets[0];
+  const int *neighbor = &neighbors[0];
+  const float *weight = &weights[0];
+  if (degree == kNeighbors) {
+    MultiplyFixed<kNeighbors>(neighbor, weight, in, out, begin, end);
+    return;
+  }
+  for (int i = begin; i < end; ++i) {
+    float sum = 0.0f;
+    for (int e = offset[i]; e < offset[i + 1]; ++e) {
+      sum += weight[e] * in[neighbor[e]];
+    }
+    out[i] = sum;
+  }
+}
@@ -0,0 +1,43 @@
+#ifndef __HAIR_GRAPH_H__
+#define __HAIR_GRAPH_H__
+
+#include <vector>
+
+using std::vector;
+
+class Hair;
+
+// HairGraph links every hair to its k nearest neighbors, so that effects can
+// spread light from hair to hair.
+//
+// The graph is stored in compressed sparse row form: the neighbors of hair i
+// are neighbors[offsets[i]] up to (but not including) neighbors[offsets[i + 1]],
+// with matching weights. Each hair's weights sum to one, so multiplying by
+// the graph replaces every value with a weighted average of its neighbors'.
+class HairGraph {
+ public:
+  // Enough neighbors for light to spread smoothly over a surface.
+  static const int kNeighbors = 8;
+
+  HairGraph() : degree(0) {}
+
+  // Finds each hair's k nearest neighbors, by the distance between their top
+  // centers. Hairs are bucketed into a uniform grid first, so each search
+  // only visits the cells around the hair: the build takes O(n k) time
+  // rather than O(n^2).
+  void Build(const vector<Hair> &hairs, int k);
+
+  // out[i] = sum over j of weight(i, j) * in[j], for hairs [begin, end).
+  void Multiply(const float *in, float *out, int begin, int end) const;
+
+  int size() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+
+  // The number of neighbors of every hair, or 0 if they differ.
+  int degree;
+
+  vector<int> offsets;
+  vector<int> neighbors;
+  vector<float> weights;
+};
+
+#endif // __HAIR_GRAPH_H__
@@ -0,0 +1,153 @@
+#include "hair_layout.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char kMagic[8] = { 'H', 'A', 'I', 'R', 'L', 'A', 'Y', '\0' };
+
+// Converts between the file's little-endian byte order and the host's, either
+// way: nothing to do on a little-endian host.
+static uint32_t FileOrder(uint32_t value) {
+  const uint16_t one = 1;
+  unsigned char first;
+  memcpy(&first, &one, 1);
+  if (first == 1) {
+    return value;
+  }
+  return (value >> 24) | ((value >> 8) & 0xff00) | ((value << 8) & 0xff0000) |
+         (value << 24);
+}
+
+static int32_t FileOrder(int32_t value) {
+  return (int32_t)FileOrder((uint32_t)value);
+}
+
+static float FileOrder(float value) {
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  bits = FileOrder(bits);
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+static void CopyVec3(const vec3 &v, float *out) {
+  out[0] = FileOrder(v.x);
+  out[1] = FileOrder(v.y);
+  out[2] = FileOrder(v.z);
+}
+
+static vec3 ReadVec3(const float *in) {
+  return vec3(FileOrder(in[0]), FileOrder(in[1]), FileOrder(in[2]));
+}
+
+int SaveHairLayout(const string &path, const Fur &fur, uint32_t seed) {
+  FILE *file = fopen(path.c_str(), "wb");
+  if (!file) {
+    printf("Unable to write hair layout %s\n", path.c_str());
+    return 1;
+  }
+
+  HairLayoutHeader header;
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = FileOrder(kHairLayoutVersion);
+  header.num_hairs = FileOrder((uint32_t)fur.hairs.size());
+  header.record_size = FileOrder((uint32_t)sizeof(HairLayoutRecord));
+  header.seed = FileOrder(seed);
+
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+  for (unsigned int i = 0; ok && i < fur.hairs.size(); ++i) {
+    const Hair &hair = fur.hairs[i];
+    HairLayoutRecord record;
+    CopyVec3(hair.top_center, record.top_center);
+    CopyVec3(hair.normal, record.normal);
+    for (int v = 0; v < 4; ++v) {
+      CopyVec3(hair.vertices[v], record.vertices[v]);
+    }
+    record.led_channel = FileOrder((int32_t)hair.led_channel);
+    record.triangle = FileOrder((int32_t)hair.triangle);
+    ok = fwrite(&record, sizeof(record), 1, file) == 1;
+  }
+
+  if (fclose(file) != 0 || !ok) {
+    printf("Error writing hair layout %s\n", path.c_str());
+    return 1;
+  }
+  return 0;
+}
+
+int LoadHairLayout(const string &path, Fur *fur) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    printf("Unable to open hair layout %s\n", path.c_str());
+    return 1;
+  }
+
+  struct stat info;
+  if (fstat(fd, &info) != 0 || info.st_size < (off_t)sizeof(HairLayoutHeader)) {
+    printf("Hair layout %s is truncated\n", path.c_str());
+    close(fd);
+    return 1;
+  }
+
+  size_t size = info.st_size;
+  void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    printf("Unable to map hair layout %s\n", path.c_str());
+    return 1;
+  }
+
+  const HairLayoutHeader *header = (const HairLayoutHeader *)data;
+  const HairLayoutRecord *records = (const HairLayoutRecord *)(header + 1);
+  const uint32_t version = FileOrder(header->version);
+  const uint32_t num_hairs = FileOrder(header->num_hairs);
+  int result = 1;
+
+  if (memcmp(header->magic, kMagic, sizeof(kMagic)) != 0) {
+    printf("%s is not a hair layout\n", path.c_str());
+  } else if (version != kHairLayoutVersion ||
+             FileOrder(header->record_size) != sizeof(HairLayoutRecord)) {
+    printf("Hair layout %s has unsupported version %u\n", path.c_str(),
+           version);
+  } else if (size < sizeof(HairLayoutHeader) +
+                        (size_t)num_hairs * sizeof(HairLayoutRecord)) {
+    printf("Hair layout %s is truncated\n", path.c_str());
+  } else {
+    // Buffers are sized by the highest channel, so each hair must have a
+    // channel of its own among the first num_hairs.
+    vector<Hair> hairs(num_hairs);
+    vector<bool> taken(num_hairs, false);
+    result = 0;
+    for (unsigned int i = 0; i < hairs.size(); ++i) {
+      const HairLayoutRecord &record = records[i];
+      const int32_t channel = FileOrder(record.led_channel);
+      if (channel < 0 || (uint32_t)channel >= num_hairs || taken[channel]) {
+        printf("Hair layout %s gives hair %u LED channel %d, which is out of "
+               "range or already taken\n", path.c_str(), i, channel);
+        result = 1;
+        break;
+      }
+      taken[channel] = true;
+
+      Hair &hair = hairs[i];
+      hair.top_center = ReadVec3(record.top_center);
+      hair.normal = ReadVec3(record.normal);
+      for (int v = 0; v < 4; ++v) {
+        hair.vertices[v] = ReadVec3(record.vertices[v]);
+      }
+      hair.led_channel = channel;
+      hair.triangle = FileOrder(record.triangle);
+    }
+    if (result == 0) {
+      fur->hairs.swap(hairs);
+      fur->colors.assign(fur->hairs.size(), MakeRgba(0, 0, 0));
+    }
+  }
+
+  munmap(data, size);
+  return result;
+}
@@ -0,0 +1,48 @@
+#ifndef __HAIR_LAYOUT_H__
+#define __HAIR_LAYOUT_H__
+
+#include <stdint.h>
+
+#include <string>
+
+// Disco Wookie includes
+#include "hair.h"
+
+using std::string;
+
+// A hair layout file stores where every hair sits on the jacket, so that the
+// preview shows the same layout as the physical jacket on every launch, and
+// so that positions measured on the real jacket can replace generated ones.
+//
+// The file is a HairLayoutHeader followed by num_hairs HairLayoutRecords, all
+// little-endian, with no padding, whatever the host's byte order. Other tools
+// may write it too. Each hair's LED channel must be in [0, num_hairs), and no
+// two hairs may share one.
+struct HairLayoutHeader {
+  char magic[8];         // "HAIRLAY\0"
+  uint32_t version;      // kHairLayoutVersion
+  uint32_t num_hairs;
+  uint32_t record_size;  // sizeof(HairLayoutRecord)
+  uint32_t seed;         // the seed the layout was generated with, if any
+};
+
+struct HairLayoutRecord {
+  float top_center[3];
+  float normal[3];
+  float vertices[4][3];  // top left, bottom left, bottom right, top right
+  int32_t led_channel;
+  int32_t triangle;      // jacket triangle, or -1 if measured
+};
+
+static const uint32_t kHairLayoutVersion = 1;
+
+// Writes fur's hairs to path. Returns 0 on success.
+int SaveHairLayout(const string &path, const Fur &fur, uint32_t seed);
+
+// Replaces fur's hairs with the ones in path. The file is mapped rather than
+// read, so even large layouts load in well under a millisecond. Returns 0 on
+// success; on failure, including a layout whose LED channels break the rules
+// above, fur is left untouched.
+int LoadHairLayout(const string &path, Fur *fur);
+
+#endif // __HAIR_LAYOUT_H__
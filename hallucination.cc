@@ -1,35 +1,316 @@
 #include "hallucination.h"
 
-Hallucination::Hallucination()
-  : window_width_(1024),
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+// Disco Wookie includes
+#include "metrics.h"
+
+// Everything that loads in the background: five models and the hairs.
+static const int kLoadingSteps = 7;
+
+// Number of hairs to scatter over the jacket.
+static const int kNumHairs = 2400;
+
+// The cells coarser levels of detail cluster corners into, as fractions of
+// the diagonal of a model's bounding box; see Model_OBJ::Simplify().
+static const float kLodCellFractions[kMeshLods - 1] = { 0.015f, 0.03f };
+
+// Modes are numbered like the keys that select them.
+static const Controller::IlluminationMode kModes[kSyncLayers] = {
+  Controller::RANDOM_SINE_WAVES, Controller::BEAT_DETECTION,
+  Controller::PHOTOGRAMMETRY, Controller::BAND_ENERGY,
+  Controller::EXPRESSION, Controller::DIFFUSION,
+  Controller::REACTION_DIFFUSION, Controller::PITCH,
+  Controller::STRUCTURED_LIGHT
+};
+
+// Around the refresh periods of 144, 120, 60 and 30 Hz displays.
+static const double kFrameBounds[] = {
+  0.004, 0.007, 0.0085, 0.0167, 0.02, 0.0334, 0.05, 0.1, 0.25, 1.0
+};
+
+static MetricHistogram frame_seconds(
+    "hallucination_frame_seconds",
+    "Time from one frame to the next, except after idle frames.",
+    kFrameBounds, sizeof(kFrameBounds) / sizeof(kFrameBounds[0]));
+static MetricGauge idle_gauge("hallucination_idle",
+                              "1 while the viewer idles through silence.");
+static MetricGauge hairs_gauge("hallucination_hairs", "Hairs on the jacket.");
+static MetricGauge mesh_bytes_gauge(
+    "hallucination_mesh_bytes",
+    "Vertex data of the loaded models and the hairs, in bytes.");
+
+Hallucination::Hallucination(const Options &options)
+  : options_(options),
+    window_width_(1024),
     window_height_(768),
-    human_display_list_(0),
+    hairs_ready_(false),
+    hairs_installed_(false),
+    glow_ready_(false),
+    glow_installed_(false),
+    loading_done_(-1),
     photogrammetry_(&fur_),
     random_waves_(&fur_),
-    beats_(&fur_, &audio_processor_) {}
+    beats_(&fur_, &audio_processor_),
+    bands_(&fur_, &audio_processor_),
+    effect_(&fur_, &audio_processor_, options.effect),
+    sparks_(&fur_, &audio_processor_, &thread_pool_,
+            DiffusionVisualizer::SPARKS),
+    reaction_(&fur_, &audio_processor_, &thread_pool_,
+              DiffusionVisualizer::REACTION_DIFFUSION),
+    pitch_(&fur_, &audio_processor_),
+    structured_light_(&fur_),
+    last_visualizer_(NULL),
+    power_limiter_(options.power),
+    brightness_(1.0f),
+    quality_governor_(options.frame_budget_ms / 1000.0) {}
 
 void Hallucination::Init() {
-  LoadModels();
-  CreateOpenGLWindow();
+  TRACE_THREAD_NAME("render");
+  TraceInstallSignalHandler();
+
+  // Models load on worker threads while the window opens; the main loop
+  // shows each one as soon as it arrives.
+  StartLoading();
+  CreateOpenGLWindow(true);
   SetupLighting();
   StartAudioProcessor();
+  rig_sync_.Start(options_.sync, &audio_processor_);
+  control_server_.Start(options_.osc_port, options_.control_socket);
+  metrics_server_.Start(options_.metrics_port, options_.metrics_socket);
+  if (!options_.led_output.empty()) {
+    led_output_.Open(options_.led_output, options_.led_rate);
+  }
 }
 
-void Hallucination::LoadModels() {
+void Hallucination::LoadModel(SceneModel *model, const char *path) {
+  model->obj.Load(path);
+
+  // The simplified meshes we ship have no texture coordinates, so wrap the
+  // texture around them instead.
+  if (model->texture_tile >= 0 && !model->obj.texcoords) {
+    model->obj.GenerateCylindricalTexcoords();
+  }
+
+  // Cells in proportion to the model's size, so that every model loses
+  // about as much of its shape at each level.
+  if (model->num_lods > 1 && model->obj.TotalConnectedTriangles > 0) {
+    const float *corners = model->obj.Faces_Triangles;
+    vec3 lowest(corners[0], corners[1], corners[2]);
+    vec3 highest = lowest;
+    for (long i = 0; i < model->obj.TotalConnectedTriangles; i += 3) {
+      const vec3 corner(corners[i], corners[i + 1], corners[i + 2]);
+      lowest = glm::min(lowest, corner);
+      highest = glm::max(highest, corner);
+    }
+    const float diagonal = glm::length(highest - lowest);
+    for (int i = 1; i < model->num_lods; ++i) {
+      model->obj.Simplify(diagonal * kLodCellFractions[i - 1],
+                          &model->coarse[i - 1]);
+    }
+  }
+
+  model->loaded = true;
+}
+
+void Hallucination::StartLoading() {
   // Load OBJ model files for the human body, jacket, etc.
   std::cout << "Loading OBJ files..." << std::endl;
-  human_body_obj_.Load("models/male1591.obj");
-  eyes_obj_.Load("models/high-poly.obj");
-  jacket_obj_.Load("models/tshirt_long.obj");
-  jeans_obj_.Load("models/jeans01.obj");
-  shoes_obj_.Load("models/shoes02.obj");
+
+  // Only diffuse maps are used. The normal maps in textures/ would need a
+  // shader; the fixed-function pipeline cannot apply them.
+  shoes_.texture_tile =
+      textures_.Add("textures/classicshoes_texture_diffuse.png");
+  jacket_.texture_tile = textures_.Add("textures/tshirt_texture_white.png");
+
+  // The jacket is always drawn in full, since the hairs sit on it and the
+  // glow is baked onto its vertices; the eyes are not drawn at all.
+  human_body_.num_lods = kMeshLods;
+  jeans_.num_lods = kMeshLods;
+  shoes_.num_lods = kMeshLods;
+
+  // The jacket goes first, since the hairs are waiting for it. A saved
+  // layout does not need the mesh, so its hairs can appear straight away;
+  // otherwise generation follows on the same worker as soon as the mesh is in.
+  // The glow needs both the hairs and the mesh, so it comes last. It works
+  // on a copy of the hairs, since the render thread may take pending_fur_ as
+  // soon as it is ready.
+  thread_pool_.Submit([this]() {
+    vector<Hair> hairs;
+    bool have_layout = !options_.hair_layout.empty() &&
+                       LoadHairLayout(options_.hair_layout, &pending_fur_) == 0;
+    if (have_layout) {
+      pending_fur_.graph.Build(pending_fur_.hairs, HairGraph::kNeighbors);
+      hairs = pending_fur_.hairs;
+      hairs_ready_ = true;
+    }
+
+    LoadModel(&jacket_, "models/tshirt_long.obj");
+
+    if (!have_layout) {
+      pending_fur_.GenerateRandomHairs(jacket_.obj, kNumHairs,
+                                       options_.hair_seed);
+      if (!options_.save_hair_layout.empty()) {
+        SaveHairLayout(options_.save_hair_layout, pending_fur_,
+                       options_.hair_seed);
+      }
+      pending_fur_.graph.Build(pending_fur_.hairs, HairGraph::kNeighbors);
+      hairs = pending_fur_.hairs;
+      hairs_ready_ = true;
+    }
+
+    pending_glow_.BakeOrLoad(hairs, jacket_.obj, options_.glow_cache);
+    glow_ready_ = true;
+  });
+  thread_pool_.Submit([this]() {
+    LoadModel(&human_body_, "models/male1591.obj");
+  });
+  thread_pool_.Submit([this]() {
+    LoadModel(&jeans_, "models/jeans01.obj");
+  });
+  thread_pool_.Submit([this]() {
+    LoadModel(&shoes_, "models/shoes02.obj");
+  });
+  thread_pool_.Submit([this]() {
+    LoadModel(&eyes_, "models/high-poly.obj");
+  });
+
+  // Textures queue up behind the models, so they never delay the first
+  // frame; textured models are recompiled once the atlas arrives.
+  textures_.Load(&thread_pool_);
+}
+
+void Hallucination::UploadModel(SceneModel *model, const GLfloat color[3],
+                                const GLfloat textured_color[3]) {
+  if (!model->loaded) {
+    return;
+  }
+
+  // Recompile once the texture atlas is ready.
+  bool textured = textures_.ready() && textures_.HasTile(model->texture_tile);
+  if (model->display_lists[0] != 0 && model->textured == textured) {
+    return;
+  }
+  if (model->display_lists[0] != 0) {
+    glDeleteLists(model->display_lists[0], model->num_lods);
+  }
+  if (textured) {
+    textures_.MapToTile(model->texture_tile, &model->obj);
+    for (int i = 1; i < model->num_lods; ++i) {
+      textures_.MapToTile(model->texture_tile, &model->coarse[i - 1]);
+    }
+    model->textured = true;
+  }
+
+  model->display_lists[0] = glGenLists(model->num_lods);
+  for (int i = 0; i < model->num_lods; ++i) {
+    model->display_lists[i] = model->display_lists[0] + i;
+    glNewList(model->display_lists[i], GL_COMPILE);
+
+    // Set the emission of these polygons to zero; they'll be lit by diffuse
+    // and ambient light.
+    GLfloat black[3] = { 0.0f, 0.0f, 0.0f };
+    glMaterialfv(GL_FRONT_AND_BACK, GL_EMISSION, black);
+    glColorMaterial(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE);
+    glColor3fv(textured ? textured_color : color);
+    if (i == 0) {
+      model->obj.Draw();
+    } else {
+      model->coarse[i - 1].Draw();
+    }
+
+    glEndList();
+  }
+}
+
+void Hallucination::FinishLoading() {
+  if (loading_done_ == kLoadingSteps && textures_.ready()) {
+    return;
+  }
+
+  textures_.Update();
+
+  // The body in a skin-tone color, the jeans in blue, and the jacket and
+  // shoes in a dark charcoal color. Once textured, the jacket keeps its
+  // charcoal (its texture is white fabric), but the shoes take their color
+  // from their texture. The eyes are loaded but not drawn.
+  static const GLfloat skin[3] = { 1.0f, 0.86f, 0.69f };
+  static const GLfloat denim[3] = { 0.14f, 0.25f, 0.32f };
+  static const GLfloat charcoal[3] = { 0.25f, 0.25f, 0.25f };
+  static const GLfloat white[3] = { 1.0f, 1.0f, 1.0f };
+  UploadModel(&human_body_, skin, skin);
+  UploadModel(&jeans_, denim, denim);
+  UploadModel(&jacket_, charcoal, charcoal);
+  UploadModel(&shoes_, charcoal, white);
+
+  if (hairs_ready_ && !hairs_installed_) {
+    fur_.hairs.swap(pending_fur_.hairs);
+    fur_.colors.swap(pending_fur_.colors);
+    std::swap(fur_.graph, pending_fur_.graph);
+    fur_.repaint = true;
+    fur_renderer_.Reposition(fur_);
+    power_limiter_.Reposition(fur_);
+    photogrammetry_.Reposition();
+    random_waves_.Reposition();
+    beats_.Reposition();
+    bands_.Reposition();
+    effect_.Reposition();
+    sparks_.Reposition();
+    reaction_.Reposition();
+    pitch_.Reposition();
+    structured_light_.Reposition();
+    hairs_installed_ = true;
+  }
+
+  if (glow_ready_ && hairs_installed_ && !glow_installed_) {
+    glow_renderer_.Reposition(jacket_.obj, &pending_glow_);
+    glow_installed_ = true;
+  }
+
+  int done = human_body_.loaded + eyes_.loaded + jacket_.loaded +
+             jeans_.loaded + shoes_.loaded + hairs_installed_ +
+             glow_installed_;
+  if (done == loading_done_ || loading_done_ == kLoadingSteps) {
+    return;
+  }
+  loading_done_ = done;
+
+  hairs_gauge.Set(fur_.hairs.size());
+  SceneModel *models[] = { &human_body_, &eyes_, &jacket_, &jeans_, &shoes_ };
+  long mesh_bytes =
+      fur_renderer_.buffer_bytes() + glow_renderer_.buffer_bytes();
+  for (unsigned int i = 0; i < sizeof(models) / sizeof(models[0]); ++i) {
+    if (models[i]->loaded) {
+      mesh_bytes += models[i]->obj.MeshBytes();
+      for (int j = 1; j < models[i]->num_lods; ++j) {
+        mesh_bytes += models[i]->coarse[j - 1].MeshBytes();
+      }
+    }
+  }
+  mesh_bytes_gauge.Set(mesh_bytes);
+
+  if (done < kLoadingSteps) {
+    char title[64];
+    snprintf(title, sizeof(title), "Hallucination (loading %d/%d)", done,
+             kLoadingSteps);
+    glfwSetWindowTitle(window, title);
+  } else {
+    // GLFW's clock starts in glfwInit(), moments after loading started.
+    glfwSetWindowTitle(window, "Hallucination");
+    printf("Loaded everything in %.2f s.\n", glfwGetTime());
+  }
 }
 
-void Hallucination::CreateOpenGLWindow() {
+void Hallucination::CreateOpenGLWindow(bool visible) {
   if (!glfwInit())
     exit(EXIT_FAILURE);
 
-  glfwWindowHint(GLFW_SAMPLES, 4);
+  // With the governor, antialiasing is done in preview_target_'s
+  // framebuffer, where it can be turned down.
+  glfwWindowHint(GLFW_SAMPLES, options_.frame_budget_ms > 0 ? 0 : 4);
+  glfwWindowHint(GLFW_VISIBLE, visible ? GL_TRUE : GL_FALSE);
 
   window = glfwCreateWindow(window_width_, window_height_, "Hallucination",
                             NULL, NULL);
@@ -74,94 +355,452 @@ void Hallucination::SetupLighting() {
   glEnable(GL_LIGHTING);
 }
 
-void Hallucination::Display() {
+void Hallucination::Illuminate(double time) {
+  TRACE_SCOPE("Hallucination::Illuminate");
+
+  // When the LEDs show this frame: as soon as it is drawn, or, with other
+  // rigs, at the same moment as theirs.
+  bool event = false;
+  const double due = rig_sync_.TakeFrameDue(&event);
+
+  // Upload anything that finished loading since the last frame. Until
+  // everything is in, the scene fills in piece by piece.
+  FinishLoading();
+
+  const Controller& controller(Controller::getInstance());
+  Controller::IlluminationMode mode = controller.GetIlluminationMode();
+  Visualizer *visualizer = NULL;
+  if (mode == Controller::PHOTOGRAMMETRY) {
+    visualizer = &photogrammetry_;
+  } else if (mode == Controller::RANDOM_SINE_WAVES) {
+    visualizer = &random_waves_;
+  } else if (mode == Controller::BEAT_DETECTION) {
+    visualizer = &beats_;
+  } else if (mode == Controller::BAND_ENERGY) {
+    visualizer = &bands_;
+  } else if (mode == Controller::EXPRESSION) {
+    visualizer = &effect_;
+  } else if (mode == Controller::DIFFUSION) {
+    visualizer = &sparks_;
+  } else if (mode == Controller::REACTION_DIFFUSION) {
+    visualizer = &reaction_;
+  } else if (mode == Controller::PITCH) {
+    visualizer = &pitch_;
+  } else if (mode == Controller::STRUCTURED_LIGHT) {
+    visualizer = &structured_light_;
+  } else {
+    assert(false);
+  }
+  if (visualizer != last_visualizer_) {
+    fur_.repaint = true;
+    last_visualizer_ = visualizer;
+  }
+
+  // Each stage only touches the hairs that changed; with nothing changed,
+  // the LEDs are left alone.
+  visualizer->Update(time, brightness_);
+  power_limiter_.Apply(&fur_, time);
+  fur_renderer_.Update(fur_);
+  led_output_.Publish(fur_renderer_.led_frame(), fur_renderer_.led_dirty(),
+                      due, event);
+
+  // The glow only takes the colors here; it is lit when drawn, so frames
+  // the preview skips cost nothing, and lose no changes.
+  glow_renderer_.Update(fur_);
+}
+
+void Hallucination::Draw(const QualitySettings &quality) {
+  TRACE_SCOPE("Hallucination::Draw");
   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-  // Create a display list for the human body and jacket objects,
-  // which never change.
-  if (human_display_list_ == 0) {
-    printf("Creating jacket and body display list...\n");
-    human_display_list_ = glGenLists(1);
-    glNewList(human_display_list_, GL_COMPILE);
+  // Draw the human (and clothing), then the hairs. Models that are still
+  // loading have no display list yet. Textured models come last, so the
+  // atlas is bound at most once per frame.
+  SceneModel *models[] = { &human_body_, &jeans_, &jacket_, &shoes_ };
+  bool texturing = false;
+  for (unsigned int i = 0; i < sizeof(models) / sizeof(models[0]); ++i) {
+    if (models[i]->display_lists[0] == 0) {
+      continue;
+    }
+    if (models[i]->textured != texturing) {
+      texturing = models[i]->textured;
+      if (texturing) {
+        glEnable(GL_TEXTURE_2D);
+        glBindTexture(GL_TEXTURE_2D, textures_.texture());
+      } else {
+        glDisable(GL_TEXTURE_2D);
+      }
+    }
+    const int lod = std::min(quality.mesh_lod, models[i]->num_lods - 1);
+    glCallList(models[i]->display_lists[lod]);
+  }
+  if (texturing) {
+    glDisable(GL_TEXTURE_2D);
+  }
 
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  glow_renderer_.Draw(&thread_pool_);
+  fur_renderer_.Draw(quality.hair_stride);
+}
 
-    // Set the emission of these polygons to zero; they'll be lit by diffuse
-    // and ambient light.
-    GLfloat black[3] = { 0.0f, 0.0f, 0.0f };
-    glMaterialfv(GL_FRONT_AND_BACK, GL_EMISSION, black);
-    glColorMaterial(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE);
+void Hallucination::Display(double time) {
+  static const QualitySettings kBest = { 1.0f, 0, 0, 1, 1 };
+  Illuminate(time);
+  Draw(kBest);
+}
 
-    // Draw the body in a skin-tone color.
-    glColor3f(1.0f, 0.86f, 0.69f);
-    human_body_obj_.Draw();
+void Hallucination::StartAudioProcessor() {
+  // A follower shows what its leader hears, and does no analysis at all.
+  if (options_.sync.role == SyncConfig::FOLLOWER) {
+    return;
+  }
+  LoadSetlist();
+  audio_processor_.Init(options_.audio);
+  for (int i = 0; i < kSyncLayers; ++i) {
+    if (options_.layer_channel[i] != 0) {
+      SubscribeLayer(i, options_.layer_channel[i]);
+    }
+  }
+}
+
+void Hallucination::LoadSetlist() {
+  if (options_.setlist.empty() || setlist_.Load(options_.setlist) != 0) {
+    return;
+  }
+  printf("Following %u tracks from %s.\n", (unsigned int)setlist_.tracks.size(),
+         options_.setlist.c_str());
+  audio_processor_.Follow(&setlist_, options_.setlist_advance_ms / 1000.0f);
+}
+
+void Hallucination::SubscribeLayer(int index, int channel) {
+  AudioProcessor *audio = audio_processor_.channel(channel);
+  if (!audio) {
+    printf("Layer %d cannot follow input channel %d; %d are analyzed.\n",
+           index + 1, channel, audio_processor_.num_channels());
+    return;
+  }
+  Visualizer *layers[kSyncLayers];
+  GetLayers(layers);
+  layers[index]->Subscribe(audio);
+}
 
-    // // Draw the eyes in a ??? color.
-    // glColor3f(1.0f, 1.0f, 1.0f);
-    // eyes_obj.Draw();
+int Hallucination::ApplyControlCommands() {
+  int applied = 0;
+  ControlCommand command;
+  while (control_server_.Poll(&command)) {
+    ApplyControlCommand(command);
+    ++applied;
+  }
+  return applied;
+}
 
-    // Draw the jeans in a blue color.
-    glColor3f(0.14f, 0.25f, 0.32f);
-    jeans_obj_.Draw();
+void Hallucination::GetLayers(Visualizer *layers[kSyncLayers]) {
+  Visualizer *all[kSyncLayers] = { &random_waves_, &beats_, &photogrammetry_,
+                                   &bands_, &effect_, &sparks_, &reaction_,
+                                   &pitch_, &structured_light_ };
+  std::copy(all, all + kSyncLayers, layers);
+}
 
-    // Draw the jacket in a dark charcoal color.
-    glColor3f(0.25f, 0.25f, 0.25f);
-    jacket_obj_.Draw();
+void Hallucination::ApplyControlCommand(const ControlCommand &command) {
+  // Layers are numbered like the modes.
+  Visualizer *layers[kSyncLayers];
+  GetLayers(layers);
 
-    // Draw the jacket in a dark charcoal color.
-    glColor3f(0.25f, 0.25f, 0.25f);
-    shoes_obj_.Draw();
+  Controller &controller = Controller::getInstance();
+  const int index = command.index - 1;
+  const bool valid_index = index >= 0 && index < kSyncLayers;
+  switch (command.type) {
+    case ControlCommand::SET_MODE:
+      if (valid_index) {
+        controller.SetIlluminationMode(kModes[index]);
+      }
+      break;
+    case ControlCommand::SET_LAYER_OPACITY:
+      if (valid_index) {
+        layers[index]->set_opacity(command.value);
+      }
+      break;
+    case ControlCommand::SET_BRIGHTNESS:
+      brightness_ = command.value;
+      break;
+    case ControlCommand::SET_TEMPO:
+      beats_.set_tempo_override(command.value);
+      break;
+    case ControlCommand::SET_MODEL_ANGLE:
+      controller.SetModelAngle(command.value);
+      break;
+    case ControlCommand::SET_LAYER_CHANNEL:
+      if (valid_index) {
+        SubscribeLayer(index, (int)command.value);
+      }
+      break;
+  }
+}
 
-    glEndList();
+int Hallucination::ExchangeSyncParameters() {
+  Visualizer *layers[kSyncLayers];
+  GetLayers(layers);
 
-    // Create the randomized hairs
-    fur_.GenerateRandomHairs(jacket_obj_, 2400);
-    photogrammetry_.Reposition();
-    random_waves_.Reposition();
-    beats_.Reposition();
+  if (options_.sync.role == SyncConfig::LEADER) {
+    SyncParameters parameters;
+    const Controller::IlluminationMode mode =
+        Controller::getInstance().GetIlluminationMode();
+    parameters.mode =
+        std::find(kModes, kModes + kSyncLayers, mode) - kModes + 1;
+    parameters.brightness = brightness_;
+    parameters.tempo_override = beats_.tempo_override();
+    for (int i = 0; i < kSyncLayers; ++i) {
+      parameters.opacity[i] = layers[i]->opacity();
+    }
+    rig_sync_.SetParameters(parameters);
+    return 0;
   }
 
-  // Draw the human (and clothing), then the hairs.
-  glCallList(human_display_list_);
-  const Controller& controller(Controller::getInstance());
-  Controller::IlluminationMode mode = controller.GetIlluminationMode();
-  const double time = glfwGetTime();
-  if (mode == Controller::PHOTOGRAMMETRY) {
-    photogrammetry_.Draw(time);
-  } else if (mode == Controller::RANDOM_SINE_WAVES) {
-    random_waves_.Draw(time);
-  } else if (mode == Controller::BEAT_DETECTION) {
-    beats_.Draw(time);
-  } else {
-    assert(false);
+  // Only what the leader changed is applied, so that a follower's own
+  // settings hold until the leader touches the same one.
+  SyncParameters parameters;
+  if (!rig_sync_.PollParameters(&parameters)) {
+    return 0;
+  }
+  int applied = 0;
+  ControlCommand command;
+  if (parameters.mode != sync_parameters_.mode) {
+    command.type = ControlCommand::SET_MODE;
+    command.index = parameters.mode;
+    ApplyControlCommand(command);
+    ++applied;
+  }
+  if (parameters.brightness != sync_parameters_.brightness) {
+    command.type = ControlCommand::SET_BRIGHTNESS;
+    command.value = parameters.brightness;
+    ApplyControlCommand(command);
+    ++applied;
+  }
+  if (parameters.tempo_override != sync_parameters_.tempo_override) {
+    command.type = ControlCommand::SET_TEMPO;
+    command.value = parameters.tempo_override;
+    ApplyControlCommand(command);
+    ++applied;
   }
+  for (int i = 0; i < kSyncLayers; ++i) {
+    if (parameters.opacity[i] != sync_parameters_.opacity[i]) {
+      command.type = ControlCommand::SET_LAYER_OPACITY;
+      command.index = i + 1;
+      command.value = parameters.opacity[i];
+      ApplyControlCommand(command);
+      ++applied;
+    }
+  }
+  sync_parameters_ = parameters;
+  return applied;
 }
 
-void Hallucination::StartAudioProcessor() {
-  audio_processor_.Init();
+bool Hallucination::LoadMatrices(float aspect_ratio) {
+  glm::mat4 projection_matrix, view_matrix, model_matrix;
+  Controller::getInstance().ComputeMatrices(aspect_ratio, projection_matrix,
+                                            model_matrix, view_matrix);
+
+  // Set the model-view and projection matrices.
+  glMatrixMode(GL_PROJECTION);
+  glLoadMatrixf(&projection_matrix[0][0]);
+  glMatrixMode(GL_MODELVIEW);
+  glm::mat4 MV = view_matrix * model_matrix;
+  glLoadMatrixf(&MV[0][0]);
+
+  const bool changed =
+      projection_matrix != projection_matrix_ || MV != model_view_matrix_;
+  projection_matrix_ = projection_matrix;
+  model_view_matrix_ = MV;
+  return changed;
 }
 
 void Hallucination::MainLoop() {
   printf("Entering main loop...\n");
+  double last_frame_time = glfwGetTime();
+  IdleScheduler scheduler(audio_processor_.wakeup_fd());
+  bool idled = false;
+  const bool governed = options_.frame_budget_ms > 0;
+  unsigned int frame = 0;
   while (!glfwWindowShouldClose(window)) {
-    glm::mat4 projection_matrix, view_matrix, model_matrix;
-    Controller::getInstance().ComputeMatrices(window, projection_matrix,
-                                              model_matrix, view_matrix);
-
-    // Set the model-view and projection matrices.
-    glMatrixMode(GL_PROJECTION);
-    glLoadMatrixf(&projection_matrix[0][0]);
-    glMatrixMode(GL_MODELVIEW);
-    glm::mat4 MV = view_matrix * model_matrix;
-    glLoadMatrixf(&MV[0][0]);
-
-    Display();
-    glfwSwapBuffers(window);
+    // Remote commands go first, so that they show up in this frame. A leader
+    // passes on what they changed.
+    int applied = ApplyControlCommands();
+    applied += ExchangeSyncParameters();
+    const bool commands = applied > 0;
+
+    int width, height;
+    glfwGetWindowSize(window, &width, &height);
+    const bool moved = LoadMatrices((float)width / height);
+    int framebuffer_width, framebuffer_height;
+    glfwGetFramebufferSize(window, &framebuffer_width, &framebuffer_height);
+
+    // Silence only idles the loop once everything is loaded, and only while
+    // nothing moves: not the hairs, nor the camera.
+    const bool loading = loading_done_ < kLoadingSteps || !textures_.ready();
+    const bool silent = audio_processor_.silent;
+    const double frame_time = glfwGetTime();
+
+    // The hairs are lit, and the LEDs fed, every time around; only the
+    // preview is drawn less often, or in less detail, to keep to the budget.
+    const QualitySettings quality = quality_governor_.settings();
+    const bool drawn = frame++ % quality.preview_divisor == 0;
+    quality_governor_.BeginFrame();
+    Illuminate(frame_time);
+    if (drawn) {
+      preview_target_.Bind(framebuffer_width, framebuffer_height,
+                           governed ? quality.render_scale : 1.0f,
+                           governed ? quality.samples : 0);
+      Draw(quality);
+      preview_target_.Present();
+    }
+    quality_governor_.EndFrame(drawn && !loading);
+    const bool active = !silent || loading || commands || moved ||
+                        fur_renderer_.changed() || !options_.idle;
+    if (drawn) {
+      // Time spent here is time spent waiting for vsync.
+      TRACE_SCOPE("glfwSwapBuffers");
+      glfwSwapBuffers(window);
+    } else {
+      // Without a swap to wait for, the budget paces the loop instead.
+      const double rest =
+          frame_time + options_.frame_budget_ms / 1000.0 - glfwGetTime();
+      if (rest > 0) {
+        std::this_thread::sleep_for(std::chrono::duration<double>(rest));
+      }
+    }
     glfwPollEvents();
+
+    // Frame-to-frame time. Spikes above the refresh period are missed vsyncs.
+    const double now = glfwGetTime();
+    TRACE_COUNTER("frame_ms", 1000.0 * (now - last_frame_time));
+    if (!idled) {
+      frame_seconds.Observe(now - last_frame_time);
+    }
+    last_frame_time = now;
+
+    TraceDumpIfRequested();
+
+    scheduler.FrameDone(frame_time, active);
+    idled = scheduler.idle();
+    idle_gauge.Set(idled ? 1 : 0);
+    scheduler.Wait(now);
   }
+
+  PrintPowerUse();
+}
+
+void Hallucination::PrintPowerUse() const {
+  printf("LEDs used %.2f Wh, peaking at %.0f mA.\n",
+         power_limiter_.energy_wh(), power_limiter_.peak_ma());
+}
+
+int Hallucination::ExportVideo() {
+  TRACE_THREAD_NAME("render");
+  TraceInstallSignalHandler();
+
+  // The same scene as the viewer, in a window that is never shown.
+  StartLoading();
+  CreateOpenGLWindow(false);
+  SetupLighting();
+
+  // aubio reads the file at its own rate, and mixes it down to mono.
+  aubio_source_t *source = new_aubio_source(
+      (char_t *)options_.export_audio.c_str(), 0, options_.audio.hop_size);
+  if (!source) {
+    printf("Unable to read %s\n", options_.export_audio.c_str());
+    return 1;
+  }
+  AudioConfig config = options_.audio;
+  config.sample_rate = aubio_source_get_samplerate(source);
+  if (!config.Validate()) {
+    del_aubio_source(source);
+    return 1;
+  }
+  LoadSetlist();
+  audio_processor_.CreateDetectors(config);
+
+  Timeline timeline;
+  if (!options_.export_timeline.empty() &&
+      timeline.Load(options_.export_timeline) != 0) {
+    del_aubio_source(source);
+    return 1;
+  }
+
+  VideoExporter exporter;
+  if (exporter.Open(options_.export_video, options_.export_width,
+                    options_.export_height, options_.export_fps) != 0) {
+    del_aubio_source(source);
+    return 1;
+  }
+
+  // Unlike the viewer, the video must not start with a half-loaded scene.
+  while (loading_done_ < kLoadingSteps || !textures_.ready()) {
+    FinishLoading();
+    glfwPollEvents();
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+
+  printf("Exporting %s at %dx%d, %d fps...\n", options_.export_video.c_str(),
+         options_.export_width, options_.export_height, options_.export_fps);
+  const double start_time = glfwGetTime();
+
+  // Frames are rendered on a fixed clock, and the audio is analyzed hop by
+  // hop up to each frame's time, so every frame sees the events that the
+  // live input would have delivered by then.
+  fvec_t *hop = new_fvec(config.hop_size);
+  unsigned long samples_analyzed = 0;
+  bool audio_done = false;
+  int frame = 0;
+  for (; !audio_done; ++frame) {
+    TRACE_SCOPE("Hallucination::ExportFrame");
+    const double time = (double)frame / options_.export_fps;
+
+    while (!audio_done && samples_analyzed < time * config.sample_rate) {
+      uint_t read = 0;
+      aubio_source_do(source, hop, &read);
+      if (read < config.hop_size) {
+        // Pad the last hop with silence.
+        for (uint_t i = read; i < config.hop_size; ++i) {
+          hop->data[i] = 0.0f;
+        }
+        audio_done = true;
+      }
+      audio_processor_.ProcessHop(hop->data);
+      samples_analyzed += config.hop_size;
+    }
+
+    ControlCommand command;
+    while (timeline.Next(time, &command)) {
+      ApplyControlCommand(command);
+    }
+
+    exporter.Bind();
+    LoadMatrices((float)options_.export_width / options_.export_height);
+    Display(time);
+    exporter.CaptureFrame();
+
+    // Progress every ten seconds of video.
+    if (frame % (10 * options_.export_fps) == 0) {
+      printf("%.0f s exported\n", time);
+    }
+    TraceDumpIfRequested();
+  }
+
+  int result = exporter.Close();
+  del_fvec(hop);
+  del_aubio_source(source);
+
+  const double elapsed = glfwGetTime() - start_time;
+  const double duration = (double)frame / options_.export_fps;
+  printf("Exported %d frames (%.1f s of video) in %.1f s, %.1fx real time.\n",
+         frame, duration, elapsed, duration / elapsed);
+  PrintPowerUse();
+  return result;
 }
 
 Hallucination::~Hallucination() {
+  // The pool outlives the window, so stop it writing into GL's memory first.
+  textures_.Cancel();
+
   // Tear down GLFW
   glfwDestroyWindow(window);
   glfwTerminate();
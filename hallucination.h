@@ -1,12 +1,32 @@
 #ifndef __HALLUCINATION_H__
 #define __HALLUCINATION_H__
 
+#include <atomic>
 #include <vector>
 
 // Disco Wookie includes
 #include "audio.h"
+#include "control_server.h"
 #include "controller.h"
+#include "fur_renderer.h"
+#include "glow_bake.h"
+#include "glow_renderer.h"
 #include "hair.h"
+#include "hair_layout.h"
+#include "idle_scheduler.h"
+#include "led_output.h"
+#include "metrics.h"
+#include "options.h"
+#include "power_limiter.h"
+#include "preview_target.h"
+#include "quality_governor.h"
+#include "rig_sync.h"
+#include "setlist.h"
+#include "texture.h"
+#include "thread_pool.h"
+#include "timeline.h"
+#include "trace.h"
+#include "video_export.h"
 #include "visualizer.h"
 
 // GLWFW includes
@@ -36,37 +56,146 @@ using namespace glm;
 #include <aubio/fvec.h>
 #include <aubio/onset/onset.h>
 
+// Levels of detail a model can be drawn at; see QualitySettings::mesh_lod.
+static const int kMeshLods = 3;
+
+// A model that is loaded in the background and uploaded to the GPU by the
+// render thread once it is ready.
+struct SceneModel {
+  SceneModel() : loaded(false), num_lods(1), texture_tile(-1),
+                 textured(false) {
+    for (int i = 0; i < kMeshLods; ++i) {
+      display_lists[i] = 0;
+    }
+  }
+
+  Model_OBJ obj;
+
+  // Coarser copies of obj, for levels of detail 1 and up.
+  Model_OBJ coarse[kMeshLods - 1];
+
+  // Set by the loading task once obj, and its coarse copies, are complete.
+  std::atomic<bool> loaded;
+
+  // How many levels of detail the model has, obj included. Models that
+  // other things are fitted to, like the jacket, only have obj.
+  int num_lods;
+
+  // 0 until the render thread has compiled each level of detail into a
+  // display list.
+  GLuint display_lists[kMeshLods];
+
+  // The model's tile in the texture atlas, or -1 if it is untextured.
+  int texture_tile;
+
+  // True once the display lists have been compiled with the atlas applied.
+  bool textured;
+};
+
 class Hallucination {
 public:
-  Hallucination();
+  explicit Hallucination(const Options &options);
   ~Hallucination();
 
   void Init();
   void MainLoop();
 
+  // Renders options.export_video instead of running the viewer; use
+  // instead of Init() and MainLoop(). Returns an exit status.
+  int ExportVideo();
+
 private:
-  void LoadModels();
-  void CreateOpenGLWindow();
+  void StartLoading();
+  void CreateOpenGLWindow(bool visible);
   void SetupLighting();
   void StartAudioProcessor();
 
-  void Display();
+  // Loads options_.setlist, if given, for audio_processor_ to follow.
+  void LoadSetlist();
+
+  // Makes a layer, numbered from 0, listen to an input channel, or to the
+  // mix for 0. Prints an error if there is no such channel.
+  void SubscribeLayer(int index, int channel);
+
+  // Applies every command that arrived from the control server since the
+  // last frame, and returns how many there were.
+  int ApplyControlCommands();
+  void ApplyControlCommand(const ControlCommand &command);
+
+  // Fills layers with the visualizers, numbered like the modes.
+  void GetLayers(Visualizer *layers[kSyncLayers]);
+
+  // A leader hands its parameters to rig_sync_; a follower applies those
+  // that its leader changed. Returns how many were applied.
+  int ExchangeSyncParameters();
+
+  // Loads the camera and model matrices for a viewport of the given shape.
+  // Returns whether they differ from the last ones loaded.
+  bool LoadMatrices(float aspect_ratio);
+
+  // Uploads whatever finished loading since the last frame, and keeps the
+  // window title up to date while loading is in progress.
+  void FinishLoading();
+  // Compiles a display list for a loaded model, in the given color. Once the
+  // texture atlas is ready, textured models are recompiled in
+  // textured_color, which modulates the texture.
+  void UploadModel(SceneModel *model, const GLfloat color[3],
+                   const GLfloat textured_color[3]);
+  void LoadModel(SceneModel *model, const char *path);
+
+  // Works out the hairs' colors at the given time, in seconds, and sends
+  // them to the LEDs. Runs every frame, whatever the preview's quality.
+  void Illuminate(double time);
+
+  // Draws the scene as Illuminate() left it, with the given quality.
+  void Draw(const QualitySettings &quality);
+
+  // Illuminates and draws the scene at the given time, at full quality.
+  void Display(double time);
+
+  // Reports the LEDs' energy use and peak current.
+  void PrintPowerUse() const;
+
+  Options options_;
 
   int window_width_;
   int window_height_;
 
+  // The matrices LoadMatrices() loaded last.
+  glm::mat4 projection_matrix_;
+  glm::mat4 model_view_matrix_;
+
   // OpenGL window object.
   GLFWwindow *window;
 
-  // The display list for the whole human model (and clothes).
-  GLuint human_display_list_;
-
   // Models for the human body and for the jacket.
-  Model_OBJ human_body_obj_;
-  Model_OBJ eyes_obj_;
-  Model_OBJ jacket_obj_;
-  Model_OBJ jeans_obj_;
-  Model_OBJ shoes_obj_;
+  SceneModel human_body_;
+  SceneModel eyes_;
+  SceneModel jacket_;
+  SceneModel jeans_;
+  SceneModel shoes_;
+
+  // Diffuse textures for the garments, all in one atlas.
+  TextureAtlas textures_;
+
+  // Hairs are generated into pending_fur_ by a worker as soon as the jacket
+  // is loaded, then swapped into fur_ by the render thread.
+  Fur pending_fur_;
+  std::atomic<bool> hairs_ready_;
+  bool hairs_installed_;
+
+  // The hairs' glow on the jacket, baked by the same worker once it has both,
+  // then handed to glow_renderer_.
+  GlowBake pending_glow_;
+  std::atomic<bool> glow_ready_;
+  bool glow_installed_;
+
+  // How much of the loading was done at the last frame.
+  int loading_done_;
+
+  // The show's tracks, analyzed beforehand, if options_.setlist names them.
+  // Declared before audio_processor_, which follows them.
+  Setlist setlist_;
 
   AudioProcessor   audio_processor_;
 
@@ -78,6 +207,47 @@ private:
 
   RandomWaveVisualizer random_waves_;
   BeatVisualizer beats_;
+  BandVisualizer bands_;
+  ExpressionVisualizer effect_;
+  DiffusionVisualizer sparks_;
+  DiffusionVisualizer reaction_;
+  PitchVisualizer pitch_;
+  StructuredLightVisualizer structured_light_;
+
+  // The visualizer that set the colors last frame.
+  Visualizer *last_visualizer_;
+
+  // Keeps the LEDs within the supply's limits, then draws the hairs in
+  // whatever colors the current visualizer gave them.
+  PowerLimiter power_limiter_;
+  FurRenderer fur_renderer_;
+
+  // Lights the jacket with the hairs' colors.
+  GlowRenderer glow_renderer_;
+
+  // Sends what was drawn to the LEDs, from a thread of its own.
+  LedOutput led_output_;
+
+  // Remote control, and the master brightness it sets.
+  ControlServer control_server_;
+  float brightness_;
+
+  // Holds the viewer to options_.frame_budget_ms by lowering the preview's
+  // quality, and the framebuffer that lets it lower the resolution.
+  QualityGovernor quality_governor_;
+  PreviewTarget preview_target_;
+
+  // Serves the health metrics; see metrics.h.
+  MetricsServer metrics_server_;
+
+  // Keeps this rig in time with others, and the leader's parameters as a
+  // follower last applied them.
+  RigSync rig_sync_;
+  SyncParameters sync_parameters_;
+
+  // Runs background work such as model loading. Declared last so that it is
+  // destroyed (and its tasks finished) before anything they write to.
+  ThreadPool thread_pool_;
 };
 
 #endif // __HALLUCINIATION_H__
@@ -0,0 +1,69 @@
+#include "idle_scheduler.h"
+
+#include <math.h>
+#include <poll.h>
+#include <unistd.h>
+
+// Disco Wookie includes
+#include "trace.h"
+
+// How long nothing has to happen before the loop goes idle, in seconds. Long
+// enough to ride out the gaps between notes.
+static const double kIdleSeconds = 0.5;
+
+// Frames per second while idle.
+static const double kIdleFps = 10.0;
+
+IdleScheduler::IdleScheduler(int wakeup_fd)
+  : wakeup_fd_(wakeup_fd),
+    idle_(false),
+    last_active_(-1),
+    last_frame_(0) {}
+
+void IdleScheduler::FrameDone(double time, bool active) {
+  last_frame_ = time;
+  if (active || last_active_ < 0) {
+    last_active_ = time;
+    idle_ = false;
+  } else if (!idle_ && time - last_active_ >= kIdleSeconds) {
+    // The wakeup descriptor is left alone: an event that arrived after this
+    // frame looked for one must still wake the next Wait().
+    idle_ = true;
+  }
+  TRACE_COUNTER("idle", idle_ ? 1 : 0);
+}
+
+void IdleScheduler::Wait(double time) {
+  if (!idle_) {
+    return;
+  }
+  TRACE_SCOPE("IdleScheduler::Wait");
+
+  const double remaining = last_frame_ + 1.0 / kIdleFps - time;
+  if (remaining <= 0) {
+    return;
+  }
+  const int timeout_ms = (int)ceil(1000.0 * remaining);
+  struct pollfd fd = { wakeup_fd_, POLLIN, 0 };
+  if (wakeup_fd_ < 0) {
+    poll(NULL, 0, timeout_ms);
+    return;
+  }
+  if (poll(&fd, 1, timeout_ms) <= 0 || !(fd.revents & POLLIN)) {
+    return;
+  }
+
+  // Drawn next, the frame finds every event whose byte this reads. It may be
+  // one from before the loop went idle, already shown; then the frame stays
+  // inactive, and the loop idle. Otherwise FrameDone() brings it back.
+  Drain();
+}
+
+void IdleScheduler::Drain() {
+  if (wakeup_fd_ < 0) {
+    return;
+  }
+  char bytes[64];
+  while (read(wakeup_fd_, bytes, sizeof(bytes)) > 0) {
+  }
+}
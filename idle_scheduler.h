@@ -0,0 +1,47 @@
+#ifndef __IDLE_SCHEDULER_H__
+#define __IDLE_SCHEDULER_H__
+
+// IdleScheduler slows the main loop down while there is nothing to show, so
+// that a jacket waiting between songs does not keep a laptop's GPU and CPU
+// busy.
+//
+// Once the music has been silent, and no frame has changed the hairs or the
+// view, for half a second, the loop goes idle: a frame is drawn ten times a
+// second, and in between the render thread sleeps in poll() on the audio
+// processor's wakeup descriptor, which each input channel's analysis shares.
+// An onset, a beat or any sound after the silence, in the mix or in any
+// channel, makes it readable, which wakes the loop for a frame at once. The
+// visualizers still find the event waiting for them, so the first beat is
+// shown on that frame, not lost, and showing it brings the loop back to full
+// rate. The descriptor is only read empty after poll() returns, before that
+// frame looks for events, so none is missed between a frame and the sleep.
+//
+// Keys, the mouse and remote commands are noticed at the next idle frame.
+class IdleScheduler {
+ public:
+  // wakeup_fd may be -1, in which case idle frames are simply slower.
+  explicit IdleScheduler(int wakeup_fd);
+
+  // Records a frame drawn at the given time, in seconds. active is false if
+  // the audio was silent and nothing on screen or on the LEDs changed.
+  void FrameDone(double time, bool active);
+
+  // If idle, sleeps until the next idle frame is due or the audio wakes the
+  // loop; otherwise returns at once. time is the current time.
+  void Wait(double time);
+
+  bool idle() const { return idle_; }
+
+ private:
+  // Reads the wakeup descriptor empty. It must not block.
+  void Drain();
+
+  int wakeup_fd_;
+  bool idle_;
+
+  // When the last active frame, and the last frame, were drawn.
+  double last_active_;
+  double last_frame_;
+};
+
+#endif // __IDLE_SCHEDULER_H__
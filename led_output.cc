@@ -0,0 +1,381 @@
+#include "led_output.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+
+// Disco Wookie includes
+#include "metrics.h"
+#include "trace.h"
+
+// A frame that arrives long after the one before it, such as the first one
+// after loading a layout, fades in over this long instead.
+static const double kMaxFadeSeconds = 0.1;
+
+static MetricCounter led_ticks("hallucination_led_ticks_total",
+                               "Frames written to the LEDs.");
+static MetricCounter led_late_ticks(
+    "hallucination_led_late_ticks_total",
+    "LED frames that started late, or were dropped, because writing took "
+    "too long.");
+
+typedef std::chrono::steady_clock Clock;
+
+// Seconds on the steady clock, which frames are stamped by.
+static double Now() {
+  return std::chrono::duration<double>(
+      Clock::now().time_since_epoch()).count();
+}
+
+static Clock::time_point ToTimePoint(double seconds) {
+  return Clock::time_point(std::chrono::duration_cast<Clock::duration>(
+      std::chrono::duration<double>(seconds)));
+}
+
+LedOutput::LedOutput()
+  : fd_(-1),
+    rate_hz_(0),
+    num_channels_(0),
+    published_(0),
+    taken_(0),
+    dropped_(false),
+    last_due_(0),
+    previous_time_(0),
+    next_time_(0),
+    next_cut_(false),
+    stopping_(false),
+    sleeping_(false) {
+  if (pipe(wakeup_pipe_) != 0) {
+    wakeup_pipe_[0] = wakeup_pipe_[1] = -1;
+    return;
+  }
+  for (int i = 0; i < 2; ++i) {
+    fcntl(wakeup_pipe_[i], F_SETFL, O_NONBLOCK);
+    fcntl(wakeup_pipe_[i], F_SETFD, FD_CLOEXEC);
+  }
+}
+
+LedOutput::~LedOutput() {
+  Close();
+  if (wakeup_pipe_[0] >= 0) {
+    close(wakeup_pipe_[0]);
+    close(wakeup_pipe_[1]);
+  }
+}
+
+int LedOutput::Open(const string &path, int rate_hz) {
+  // Report a controller that goes away as a write error instead of dying.
+  signal(SIGPIPE, SIG_IGN);
+
+  // Without O_NONBLOCK, opening a FIFO waits for a reader; with it, a FIFO
+  // that nobody reads fails now instead. It stays non-blocking, so that a
+  // reader that stops reading cannot hang the output thread, and Close().
+  fd_ = open(path.c_str(), O_WRONLY | O_CREAT | O_NONBLOCK, 0644);
+  if (fd_ < 0) {
+    printf("Unable to open %s for the LEDs: %s\n", path.c_str(),
+           strerror(errno));
+    return 1;
+  }
+
+  rate_hz_ = rate_hz;
+  return 0;
+}
+
+void LedOutput::Close() {
+  Stop();
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+  num_channels_ = 0;
+}
+
+void LedOutput::Publish(const vector<Rgba> &frame, const DirtyRanges &dirty,
+                        double due, bool cut) {
+  if (fd_ < 0 || frame.empty()) {
+    return;
+  }
+  if ((int)frame.size() != num_channels_) {
+    Start(frame.size());
+  }
+
+  // Each buffer still lacks what was published since it was last written,
+  // as well as what changed now.
+  for (unsigned int i = 0; i < kQueuedFrames; ++i) {
+    missing_[i].Add(dirty);
+  }
+  if (dirty.empty() && !dropped_) {
+    return;
+  }
+  // The output thread is stuck writing; what changed goes out with the
+  // first frame that fits.
+  const unsigned int published = published_.load(std::memory_order_relaxed);
+  if (published - taken_.load(std::memory_order_acquire) >= kQueuedFrames) {
+    dropped_ = true;
+    return;
+  }
+
+  Frame &out = frames_[published % kQueuedFrames];
+  DirtyRanges &missing = missing_[published % kQueuedFrames];
+  last_due_ = std::max(due, last_due_);
+  out.time = last_due_;
+  out.cut = cut;
+  for (int r = 0; r < missing.size(); ++r) {
+    const int end = std::min(missing[r].end, num_channels_);
+    std::copy(frame.begin() + missing[r].begin, frame.begin() + end,
+              out.colors.begin() + missing[r].begin);
+  }
+  missing.Clear();
+  dropped_ = false;
+  // Sequentially consistent, like WaitForFrame(): either the output thread
+  // sees the frame before it sleeps, or this sees it sleeping.
+  published_.store(published + 1);
+  if (sleeping_) {
+    Wake();
+  }
+}
+
+void LedOutput::Start(int num_channels) {
+  Stop();
+
+  num_channels_ = num_channels;
+  for (unsigned int i = 0; i < kQueuedFrames; ++i) {
+    frames_[i].time = 0;
+    frames_[i].cut = false;
+    frames_[i].colors.assign(num_channels, MakeRgba(0, 0, 0));
+    missing_[i].AddAll(num_channels);
+  }
+  published_.store(0, std::memory_order_relaxed);
+  taken_.store(0, std::memory_order_relaxed);
+  dropped_ = false;
+  last_due_ = 0;
+
+  previous_.assign(3 * num_channels, 0.0f);
+  next_.assign(3 * num_channels, 0.0f);
+  error_.assign(3 * num_channels, 0.0f);
+  packet_.assign(3 * num_channels, 0);
+  previous_time_ = 0;
+  next_time_ = 0;
+  next_cut_ = false;
+
+  stopping_ = false;
+  thread_ = std::thread(&LedOutput::OutputLoop, this);
+}
+
+void LedOutput::Stop() {
+  if (thread_.joinable()) {
+    stopping_ = true;
+    Wake();
+    thread_.join();
+  }
+}
+
+void LedOutput::Wake() {
+  const char byte = 0;
+  ssize_t written = write(wakeup_pipe_[1], &byte, 1);
+  (void)written;
+}
+
+void LedOutput::WaitForFrame() {
+  TRACE_SCOPE("LedOutput::WaitForFrame");
+  sleeping_ = true;
+  if (published_.load() == taken_.load(std::memory_order_relaxed) &&
+      !stopping_) {
+    struct pollfd fd = { wakeup_pipe_[0], POLLIN, 0 };
+    poll(&fd, 1, -1);
+  }
+  sleeping_ = false;
+
+  char bytes[64];
+  while (read(wakeup_pipe_[0], bytes, sizeof(bytes)) > 0) {
+  }
+}
+
+void LedOutput::SleepUntil(double time) {
+  TRACE_SCOPE("LedOutput::SleepUntil");
+  // poll() counts whole milliseconds, so the last fraction of one is slept
+  // through, to show the frame on time.
+  const double wait = time - Now();
+  if (wait >= 0.001) {
+    struct pollfd fd = { wakeup_pipe_[0], POLLIN, 0 };
+    if (poll(&fd, 1, (int)(wait * 1000.0)) > 0) {
+      // A wakeup meant for WaitForFrame() that came too late, or Stop().
+      char bytes[64];
+      while (read(wakeup_pipe_[0], bytes, sizeof(bytes)) > 0) {
+      }
+      return;
+    }
+  }
+  if (!stopping_) {
+    std::this_thread::sleep_until(ToTimePoint(time));
+  }
+}
+
+bool LedOutput::TakeDueFrames() {
+  const double now = Now();
+  unsigned int taken = taken_.load(std::memory_order_relaxed);
+  bool any = false;
+  while (taken != published_.load(std::memory_order_acquire)) {
+    const Frame &frame = frames_[taken % kQueuedFrames];
+    if (frame.time > now) {
+      break;
+    }
+
+    previous_.swap(next_);
+    previous_time_ = next_time_;
+    next_time_ = frame.time;
+    next_cut_ = frame.cut;
+
+    const Rgba *colors = &frame.colors[0];
+    float *next = &next_[0];
+    for (int i = 0; i < num_channels_; ++i) {
+      next[3 * i] = colors[i].r;
+      next[3 * i + 1] = colors[i].g;
+      next[3 * i + 2] = colors[i].b;
+    }
+    taken_.store(++taken, std::memory_order_release);
+    any = true;
+  }
+  return any;
+}
+
+double LedOutput::NextFrameTime() const {
+  const unsigned int taken = taken_.load(std::memory_order_relaxed);
+  if (taken == published_.load(std::memory_order_acquire)) {
+    return 0;
+  }
+  return frames_[taken % kQueuedFrames].time;
+}
+
+void LedOutput::Render(float alpha) {
+  TRACE_SCOPE("LedOutput::Render");
+
+  // The error carried over is in [0, 1), so truncating rather than rounding
+  // makes the bytes average out to the exact value.
+  const float *previous = &previous_[0];
+  const float *next = &next_[0];
+  float *error = &error_[0];
+  unsigned char *packet = &packet_[0];
+  const int n = 3 * num_channels_;
+  for (int i = 0; i < n; ++i) {
+    float value = previous[i] + alpha * (next[i] - previous[i]) + error[i];
+    value = std::min(value, 255.0f);
+    int quantized = (int)value;
+    error[i] = value - quantized;
+    packet[i] = (unsigned char)quantized;
+  }
+}
+
+int LedOutput::WritePacket() {
+  const unsigned char *p = &packet_[0];
+  size_t remaining = packet_.size();
+  while (remaining > 0) {
+    ssize_t written = write(fd_, p, remaining);
+    if (written > 0) {
+      p += written;
+      remaining -= written;
+      continue;
+    }
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      if (remaining == packet_.size()) {
+        return 0;
+      }
+      // Once part of a tick is out, the rest must follow, or the controller
+      // would lose its place in the stream. Wait for room, or for Stop().
+      struct pollfd fds[2] = {
+        { fd_, POLLOUT, 0 },
+        { wakeup_pipe_[0], POLLIN, 0 }
+      };
+      poll(fds, 2, -1);
+      if (stopping_) {
+        return -1;
+      }
+      char bytes[64];
+      if (fds[1].revents & POLLIN) {
+        while (read(wakeup_pipe_[0], bytes, sizeof(bytes)) > 0) {
+        }
+      }
+      continue;
+    }
+    printf("Unable to write to the LEDs: %s\n", strerror(errno));
+    return -1;
+  }
+  return 1;
+}
+
+void LedOutput::OutputLoop() {
+  TRACE_THREAD_NAME("led output");
+
+  const Clock::duration period = std::chrono::duration_cast<Clock::duration>(
+      std::chrono::duration<double>(1.0 / rate_hz_));
+  Clock::time_point tick = Clock::now();
+  bool settled = false;
+  while (!stopping_) {
+    if (TakeDueFrames()) {
+      settled = false;
+    }
+
+    // Nothing to show until the first frame is due. Once a fade is over,
+    // every tick would be the same as the last, and the LEDs hold their
+    // colors, so nothing more is sent until the next frame.
+    if (next_time_ > 0 && !settled) {
+      double fade = std::min(next_time_ - previous_time_, kMaxFadeSeconds);
+      float alpha = 1.0f;
+      if (fade > 0 && !next_cut_) {
+        alpha = std::min(std::max((Now() - next_time_) / fade, 0.0), 1.0);
+      }
+      Render(alpha);
+      settled = (alpha >= 1.0f);
+
+      const int written = WritePacket();
+      if (written < 0) {
+        return;
+      }
+      if (written > 0) {
+        led_ticks.Add();
+      } else {
+        // Dropped: the next tick tries again, even if this one was the last
+        // of the fade.
+        led_late_ticks.Add();
+        settled = false;
+      }
+    }
+
+    // Nothing will change until the next frame is due.
+    const double queued = NextFrameTime();
+    if ((next_time_ == 0 || settled) && wakeup_pipe_[0] >= 0) {
+      if (queued > 0) {
+        SleepUntil(queued);
+      } else {
+        WaitForFrame();
+      }
+      tick = Clock::now();
+      continue;
+    }
+
+    // Fall behind rather than write a burst of ticks to catch up.
+    tick += period;
+    Clock::time_point now = Clock::now();
+    if (now > tick) {
+      led_late_ticks.Add();
+      tick = now;
+    } else {
+      // A frame due before the next tick is shown when it is due, and the
+      // ticks go on from there.
+      if (queued > 0) {
+        tick = std::min(tick, ToTimePoint(queued));
+      }
+      std::this_thread::sleep_until(tick);
+    }
+  }
+}
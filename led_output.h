@@ -0,0 +1,163 @@
+#ifndef __LED_OUTPUT_H__
+#define __LED_OUTPUT_H__
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Disco Wookie includes
+#include "color.h"
+#include "dirty_ranges.h"
+
+using std::string;
+using std::vector;
+
+// LedOutput sends the jacket's colors to the LED controllers from a thread
+// of its own, at a rate of its own (400 Hz by default) rather than the
+// display's.
+//
+// The render thread publishes each frame it has drawn with the time the
+// LEDs should show it, and never waits. Frames queue, up to kQueuedFrames of
+// them, until that time arrives; the output thread wakes for it, rather than
+// on its next tick, so a frame is shown when it is due to within the
+// scheduler's wakeup latency. Rigs that show the same frames at the same
+// moments stamp them on a clock they share (see RigSync::TakeFrameDue());
+// on its own, a rig stamps them with the time they are drawn.
+//
+// Each queued buffer only has the channels that changed since it was last
+// written copied into it, so a frame in which a few hairs changed costs a
+// few copies. Between frames the output thread fades from the previous
+// frame to the next, starting when the next is due, so the LEDs move
+// smoothly at their own rate, one render frame behind; a frame published as
+// a cut, such as one that shows a beat, is shown whole at once instead.
+//
+// Eight bits are too coarse for slow fades near black: a decay that loses
+// a fraction of a step per frame stalls, and then jumps. The output thread
+// keeps each channel's rounding error and carries it into the next tick,
+// so over a few ticks the LEDs average out to the exact value.
+//
+// Each tick is written with a single write(): the channels' r, g and b
+// bytes, in channel order, to a FIFO, a character device or a controller's
+// serial port. The output never blocks: a tick that it cannot take at all
+// is dropped and counted as late, so a reader that stalls costs ticks, not
+// the thread. Once the LEDs have faded to the newest frame, the output
+// thread sleeps until another one is due, so still LEDs cost no wakeups.
+// Publish() only touches the wakeup pipe while the thread sleeps with
+// nothing queued.
+class LedOutput {
+ public:
+  LedOutput();
+
+  // Stops the thread and closes the output.
+  ~LedOutput();
+
+  // Opens the output, which starts with the first published frame. Returns
+  // 0 on success.
+  int Open(const string &path, int rate_hz);
+
+  // Hands the output thread linear colors in channel order, of which the
+  // channels in dirty changed since the last call, to show at due, in
+  // seconds on the steady clock since its epoch, or at once if that has
+  // passed. Frames are shown in the order they are published, each no
+  // earlier than the one before. A cut is shown whole at once, rather than
+  // faded in. Called from the render thread every frame; frames in which
+  // nothing changed are ignored, unless an earlier one found the queue full.
+  // Does nothing unless the output is open.
+  void Publish(const vector<Rgba> &frame, const DirtyRanges &dirty,
+               double due, bool cut);
+
+  void Close();
+
+ private:
+  // Enough for the frames drawn in the time RigSync draws ahead (see
+  // kSyncLeadMs) at well over 200 frames per second.
+  static const unsigned int kQueuedFrames = 32;
+
+  struct Frame {
+    Frame() : time(0), cut(false) {}
+
+    // When it is due, in seconds on the steady clock.
+    double time;
+    bool cut;
+    vector<Rgba> colors;
+  };
+
+  // Sizes everything for this many channels, and starts the thread.
+  void Start(int num_channels);
+  void Stop();
+
+  void OutputLoop();
+
+  // Sleeps until a frame is published or the thread is stopped.
+  void WaitForFrame();
+
+  // Sleeps until time, on the steady clock, or until the thread is stopped.
+  // May return early, after a stray wakeup.
+  void SleepUntil(double time);
+
+  // Makes WaitForFrame() and SleepUntil() return.
+  void Wake();
+
+  // Moves next_ to previous_ and the newest frame that is due into next_,
+  // if one fell due since the last call. Returns whether one did.
+  bool TakeDueFrames();
+
+  // When the next queued frame is due, or 0 if none is queued.
+  double NextFrameTime() const;
+
+  // Fades alpha of the way from previous_ to next_, dithers, and fills
+  // packet_.
+  void Render(float alpha);
+
+  // Writes packet_. Returns 1 once it is written, 0 if the output could
+  // take none of it, and -1 on an error or once the thread is stopped.
+  int WritePacket();
+
+  int fd_;
+  int rate_hz_;
+  int num_channels_;
+
+  // A ring of queued frames. The render thread writes frame published_ %
+  // kQueuedFrames and then counts it in published_; the output thread reads
+  // frame taken_ % kQueuedFrames and then counts it in taken_, which gives
+  // the buffer back.
+  Frame frames_[kQueuedFrames];
+  std::atomic<unsigned int> published_;
+  std::atomic<unsigned int> taken_;
+
+  // Owned by the render thread: per frame buffer, the channels published
+  // since it was last written to, which Publish() copies into it. When the
+  // last frame found the queue full, dropped_ is set, and last_due_ is when
+  // the last queued frame is due.
+  DirtyRanges missing_[kQueuedFrames];
+  bool dropped_;
+  double last_due_;
+
+  // Owned by the output thread. The r, g and b bytes of the frames to fade
+  // between, as floats, when they are due, and whether next_ is a cut.
+  vector<float> previous_;
+  vector<float> next_;
+  double previous_time_;
+  double next_time_;
+  bool next_cut_;
+
+  // The rounding error carried over from the last tick, per channel.
+  vector<float> error_;
+  vector<unsigned char> packet_;
+
+  std::thread thread_;
+  std::atomic<bool> stopping_;
+
+  // The output thread sleeps in poll() on wakeup_pipe_[0], waiting for a
+  // frame while sleeping_ is set, and for a queued one to fall due in
+  // SleepUntil().
+  int wakeup_pipe_[2];
+  std::atomic<bool> sleeping_;
+
+  // LedOutput owns a thread; it cannot be copied.
+  LedOutput(LedOutput const &);
+  void operator=(LedOutput const &);
+};
+
+#endif // __LED_OUTPUT_H__
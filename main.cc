@@ -1,7 +1,16 @@
 #include "hallucination.h"
+#include "options.h"
 
 int main(int argc, char **argv) {
-  Hallucination h;
+  Options options;
+  if (!ParseOptions(argc, argv, &options)) {
+    return 1;
+  }
+
+  Hallucination h(options);
+  if (!options.export_video.empty()) {
+    return h.ExportVideo();
+  }
   h.Init();
   h.MainLoop();
 }
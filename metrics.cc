@@ -0,0 +1,354 @@
+#include "metrics.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+// Disco Wookie includes
+#include "trace.h"
+
+// Requests are a line or two; anything longer is cut off.
+static const int kMaxRequestSize = 4096;
+
+// A client that stalls for longer than this, in seconds, is dropped.
+static const int kClientTimeoutSeconds = 1;
+
+// Constant-initialized, so it is null before any metric registers.
+static std::atomic<Metric *> first_metric(NULL);
+
+static std::atomic<int> num_threads(0);
+static thread_local int thread_shard = -1;
+
+static void AppendFormat(string *out, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void AppendFormat(string *out, const char *format, ...) {
+  char buffer[256];
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(buffer, sizeof(buffer), format, args);
+  va_end(args);
+  if (length > 0) {
+    out->append(buffer, std::min(length, (int)sizeof(buffer) - 1));
+  }
+}
+
+Metric::Metric(const char *name, const char *help)
+  : name_(name),
+    help_(help),
+    next_(first_metric.load()) {
+  while (!first_metric.compare_exchange_weak(next_, this)) {
+  }
+}
+
+// static
+Metric *Metric::first() { return first_metric.load(); }
+
+// static
+int Metric::ThreadShard() {
+  if (thread_shard < 0) {
+    thread_shard = std::min(num_threads.fetch_add(1), kMetricShards - 1);
+  }
+  return thread_shard;
+}
+
+void Metric::WriteHeader(const char *type, string *out) const {
+  AppendFormat(out, "# HELP %s %s\n# TYPE %s %s\n", name_, help_, name_,
+               type);
+}
+
+MetricCounter::MetricCounter(const char *name, const char *help)
+  : Metric(name, help) {
+  for (int s = 0; s < kMetricShards; ++s) {
+    shards_[s].value.store(0, std::memory_order_relaxed);
+  }
+}
+
+uint64_t MetricCounter::value() const {
+  uint64_t total = 0;
+  for (int s = 0; s < kMetricShards; ++s) {
+    total += shards_[s].value.load(std::memory_order_relaxed);
+  }
+  return total;
+}
+
+void MetricCounter::Write(string *out) const {
+  WriteHeader("counter", out);
+  AppendFormat(out, "%s %llu\n", name_, (unsigned long long)value());
+}
+
+MetricGauge::MetricGauge(const char *name, const char *help)
+  : Metric(name, help),
+    value_(0.0) {}
+
+void MetricGauge::Write(string *out) const {
+  WriteHeader("gauge", out);
+  AppendFormat(out, "%s %.17g\n", name_,
+               value_.load(std::memory_order_relaxed));
+}
+
+MetricHistogram::MetricHistogram(const char *name, const char *help,
+                                 const double *bounds, int num_bounds)
+  : Metric(name, help),
+    bounds_(bounds),
+    num_bounds_(std::min(num_bounds, kMaxHistogramBuckets)) {
+  for (int s = 0; s < kMetricShards; ++s) {
+    for (int b = 0; b <= kMaxHistogramBuckets; ++b) {
+      shards_[s].counts[b].store(0, std::memory_order_relaxed);
+    }
+    shards_[s].sum.store(0.0, std::memory_order_relaxed);
+  }
+}
+
+void MetricHistogram::Observe(double value) {
+  int bucket = 0;
+  while (bucket < num_bounds_ && value > bounds_[bucket]) {
+    ++bucket;
+  }
+
+  // Only the last shard is ever shared, so the exchange almost never
+  // retries.
+  Shard &shard = shards_[ThreadShard()];
+  shard.counts[bucket].fetch_add(1, std::memory_order_relaxed);
+  double sum = shard.sum.load(std::memory_order_relaxed);
+  while (!shard.sum.compare_exchange_weak(sum, sum + value,
+                                          std::memory_order_relaxed)) {
+  }
+}
+
+void MetricHistogram::Write(string *out) const {
+  uint64_t counts[kMaxHistogramBuckets + 1] = { 0 };
+  double sum = 0.0;
+  for (int s = 0; s < kMetricShards; ++s) {
+    for (int b = 0; b <= num_bounds_; ++b) {
+      counts[b] += shards_[s].counts[b].load(std::memory_order_relaxed);
+    }
+    sum += shards_[s].sum.load(std::memory_order_relaxed);
+  }
+
+  // Prometheus buckets count everything up to their bound.
+  WriteHeader("histogram", out);
+  uint64_t cumulative = 0;
+  for (int b = 0; b < num_bounds_; ++b) {
+    cumulative += counts[b];
+    AppendFormat(out, "%s_bucket{le=\"%g\"} %llu\n", name_, bounds_[b],
+                 (unsigned long long)cumulative);
+  }
+  cumulative += counts[num_bounds_];
+  AppendFormat(out, "%s_bucket{le=\"+Inf\"} %llu\n", name_,
+               (unsigned long long)cumulative);
+  AppendFormat(out, "%s_sum %.17g\n", name_, sum);
+  AppendFormat(out, "%s_count %llu\n", name_, (unsigned long long)cumulative);
+}
+
+MetricsServer::MetricsServer()
+  : tcp_fd_(-1),
+    unix_fd_(-1) {
+  wake_pipe_[0] = -1;
+  wake_pipe_[1] = -1;
+}
+
+MetricsServer::~MetricsServer() {
+  Stop();
+}
+
+int MetricsServer::Start(int tcp_port, const string &socket_path) {
+  if (tcp_port > 0) {
+    tcp_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+    int reuse = 1;
+    setsockopt(tcp_fd_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    // Only this machine: the metrics are for a collector running next to
+    // the viewer, or a tunnel to one.
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(tcp_port);
+    if (tcp_fd_ < 0 ||
+        bind(tcp_fd_, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+        listen(tcp_fd_, 4) != 0) {
+      printf("Unable to serve metrics on port %d: %s\n", tcp_port,
+             strerror(errno));
+      Stop();
+      return 1;
+    }
+    printf("Serving metrics on http://127.0.0.1:%d/metrics\n", tcp_port);
+  }
+
+  if (!socket_path.empty()) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path)) {
+      printf("Metrics socket path is too long: %s\n", socket_path.c_str());
+      Stop();
+      return 1;
+    }
+    strcpy(address.sun_path, socket_path.c_str());
+
+    // A socket left behind by an earlier run would make bind() fail.
+    unlink(socket_path.c_str());
+    unix_fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (unix_fd_ < 0 ||
+        bind(unix_fd_, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+        listen(unix_fd_, 4) != 0) {
+      printf("Unable to serve metrics on %s: %s\n", socket_path.c_str(),
+             strerror(errno));
+      Stop();
+      return 1;
+    }
+    socket_path_ = socket_path;
+    printf("Serving metrics on %s\n", socket_path.c_str());
+  }
+
+  if (tcp_fd_ < 0 && unix_fd_ < 0) {
+    return 0;
+  }
+
+  if (pipe(wake_pipe_) != 0) {
+    printf("Unable to create metrics pipe: %s\n", strerror(errno));
+    Stop();
+    return 1;
+  }
+  thread_ = std::thread(&MetricsServer::Run, this);
+  return 0;
+}
+
+void MetricsServer::Stop() {
+  if (thread_.joinable()) {
+    char byte = 0;
+    if (write(wake_pipe_[1], &byte, 1) != 1) {
+      printf("Unable to stop the metrics server\n");
+    }
+    thread_.join();
+  }
+
+  int *fds[] = { &tcp_fd_, &unix_fd_, &wake_pipe_[0], &wake_pipe_[1] };
+  for (unsigned int i = 0; i < sizeof(fds) / sizeof(fds[0]); ++i) {
+    if (*fds[i] >= 0) {
+      close(*fds[i]);
+      *fds[i] = -1;
+    }
+  }
+
+  if (!socket_path_.empty()) {
+    unlink(socket_path_.c_str());
+    socket_path_.clear();
+  }
+}
+
+void MetricsServer::Run() {
+  TRACE_THREAD_NAME("metrics");
+
+  struct pollfd fds[3];
+  int num_fds = 0;
+  fds[num_fds].fd = wake_pipe_[0];
+  fds[num_fds++].events = POLLIN;
+  if (tcp_fd_ >= 0) {
+    fds[num_fds].fd = tcp_fd_;
+    fds[num_fds++].events = POLLIN;
+  }
+  if (unix_fd_ >= 0) {
+    fds[num_fds].fd = unix_fd_;
+    fds[num_fds++].events = POLLIN;
+  }
+
+  while (true) {
+    if (poll(fds, num_fds, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      printf("Metrics server stopped: %s\n", strerror(errno));
+      return;
+    }
+    if (fds[0].revents) {
+      return;
+    }
+
+    for (int i = 1; i < num_fds; ++i) {
+      if (!(fds[i].revents & POLLIN)) {
+        continue;
+      }
+      int client = accept(fds[i].fd, NULL, NULL);
+      if (client < 0) {
+        continue;
+      }
+      Serve(client);
+      close(client);
+    }
+  }
+}
+
+void MetricsServer::Serve(int fd) {
+  TRACE_SCOPE("MetricsServer::Serve");
+
+  // One client at a time; one that stalls only holds up other scrapes.
+  struct timeval timeout = { kClientTimeoutSeconds, 0 };
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  char request[kMaxRequestSize + 1];
+  int length = 0;
+  while (length < kMaxRequestSize) {
+    ssize_t size = recv(fd, request + length, kMaxRequestSize - length, 0);
+    if (size <= 0) {
+      break;
+    }
+    length += size;
+    request[length] = '\0';
+    if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) {
+      break;
+    }
+  }
+  request[length] = '\0';
+
+  // Only the request line matters: GET or HEAD, of / or /metrics.
+  char method[8] = "", path[64] = "";
+  const char *status = "200 OK";
+  string body;
+  if (sscanf(request, "%7s %63s", method, path) != 2) {
+    status = "400 Bad Request";
+  } else if (strcmp(method, "GET") != 0 && strcmp(method, "HEAD") != 0) {
+    status = "405 Method Not Allowed";
+  } else if (strcmp(path, "/") != 0 && strcmp(path, "/metrics") != 0) {
+    status = "404 Not Found";
+  } else {
+    for (Metric *metric = Metric::first(); metric; metric = metric->next()) {
+      metric->Write(&body);
+    }
+  }
+
+  string response;
+  AppendFormat(&response,
+               "HTTP/1.0 %s\r\n"
+               "Content-Type: text/plain; version=0.0.4\r\n"
+               "Content-Length: %d\r\n"
+               "Connection: close\r\n"
+               "\r\n",
+               status, (int)body.size());
+  if (strcmp(method, "HEAD") != 0) {
+    response += body;
+  }
+
+  const char *p = response.data();
+  size_t remaining = response.size();
+  while (remaining > 0) {
+    ssize_t sent = send(fd, p, remaining, MSG_NOSIGNAL);
+    if (sent <= 0) {
+      return;
+    }
+    p += sent;
+    remaining -= sent;
+  }
+}
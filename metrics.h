@@ -0,0 +1,158 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+
+using std::string;
+
+// Runtime health metrics, for unattended shows.
+//
+// Metrics are declared as globals next to the code that updates them, and
+// register themselves:
+//
+//   static MetricCounter overflows("hallucination_audio_input_overflows_total",
+//                                  "Hops in which PortAudio dropped input.");
+//   overflows.Add();
+//
+// Updating never locks or allocates. Counters and histograms keep a shard
+// per thread, each on its own cache line, so threads never contend for one;
+// a scrape adds the shards up. Gauges hold a single value, set by whichever
+// thread owns it. Names must be string literals, and metrics must outlive
+// the MetricsServer.
+//
+// MetricsServer serves them all in the Prometheus text format, over HTTP on
+// a local TCP port or a Unix socket, from a thread of its own. Scraping only
+// reads the shards, with relaxed atomic loads, so it never holds up the
+// threads that update them.
+
+// Threads beyond this many share the last shard.
+static const int kMetricShards = 16;
+
+// The most bucket bounds a histogram may have.
+static const int kMaxHistogramBuckets = 15;
+
+class Metric {
+ public:
+  Metric(const char *name, const char *help);
+  virtual ~Metric() {}
+
+  // Appends the metric's lines in the Prometheus text format.
+  virtual void Write(string *out) const = 0;
+
+  // Every registered metric, from first() along next(), the most recently
+  // registered first.
+  static Metric *first();
+  Metric *next() const { return next_; }
+
+ protected:
+  // The calling thread's shard.
+  static int ThreadShard();
+
+  // Appends "# HELP" and "# TYPE" lines.
+  void WriteHeader(const char *type, string *out) const;
+
+  const char *name_;
+  const char *help_;
+
+ private:
+  Metric *next_;
+};
+
+// A count that only goes up, such as events seen.
+class MetricCounter : public Metric {
+ public:
+  MetricCounter(const char *name, const char *help);
+
+  void Add(uint64_t n = 1) {
+    shards_[ThreadShard()].value.fetch_add(n, std::memory_order_relaxed);
+  }
+
+  uint64_t value() const;
+
+  virtual void Write(string *out) const;
+
+ private:
+  struct alignas(64) Shard {
+    std::atomic<uint64_t> value;
+  };
+  Shard shards_[kMetricShards];
+};
+
+// A value that goes up and down, such as the number of hairs.
+class MetricGauge : public Metric {
+ public:
+  MetricGauge(const char *name, const char *help);
+
+  void Set(double value) { value_.store(value, std::memory_order_relaxed); }
+
+  virtual void Write(string *out) const;
+
+ private:
+  std::atomic<double> value_;
+};
+
+// A distribution of observations, such as frame times, in buckets with the
+// given upper bounds, in increasing order. bounds must outlive it.
+class MetricHistogram : public Metric {
+ public:
+  MetricHistogram(const char *name, const char *help, const double *bounds,
+                  int num_bounds);
+
+  void Observe(double value);
+
+  virtual void Write(string *out) const;
+
+ private:
+  struct alignas(64) Shard {
+    // One more than the bounds: the last is for values above them all.
+    std::atomic<uint64_t> counts[kMaxHistogramBuckets + 1];
+    std::atomic<double> sum;
+  };
+
+  const double *bounds_;
+  int num_bounds_;
+  Shard shards_[kMetricShards];
+};
+
+// Serves every registered metric to whoever asks, in the Prometheus text
+// format over HTTP/1.0.
+class MetricsServer {
+ public:
+  MetricsServer();
+
+  // Stops the server if it is running.
+  ~MetricsServer();
+
+  // Starts serving on 127.0.0.1:tcp_port and/or a Unix stream socket.
+  // tcp_port = 0 or an empty socket_path leaves that transport off. Returns
+  // 0 on success.
+  int Start(int tcp_port, const string &socket_path);
+
+  // Stops serving and joins the server thread.
+  void Stop();
+
+ private:
+  void Run();
+
+  // Reads a request from a connection and answers it.
+  void Serve(int fd);
+
+  int tcp_fd_;
+  int unix_fd_;
+  string socket_path_;
+
+  // Writing to wake_pipe_[1] tells the server thread to exit.
+  int wake_pipe_[2];
+
+  std::thread thread_;
+
+  // MetricsServer owns a thread; it cannot be copied.
+  MetricsServer(MetricsServer const &);
+  void operator=(MetricsServer const &);
+};
+
+#endif // __METRICS_H__
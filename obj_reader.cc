@@ -1,12 +1,26 @@
 #include "obj_reader.h"
 
+#include <stdlib.h>
+
+#include <unordered_map>
+#include <vector>
+
+#include "trace.h"
+
 #define POINTS_PER_VERTEX 3
 #define TOTAL_FLOATS_IN_TRIANGLE 9
+#define UVS_PER_VERTEX 2
+#define MAX_POLYGON_CORNERS 16
 using namespace std;
 
 Model_OBJ::Model_OBJ() {
   this->TotalConnectedTriangles = 0;
   this->TotalConnectedPoints = 0;
+  this->normals = NULL;
+  this->Faces_Triangles = NULL;
+  this->vertexBuffer = NULL;
+  this->texcoords = NULL;
+  this->uvBuffer = NULL;
 }
 
 void Model_OBJ::calculateNormal(float *coord1, float *coord2, float *coord3,
@@ -35,6 +49,7 @@ void Model_OBJ::calculateNormal(float *coord1, float *coord2, float *coord3,
 }
 
 int Model_OBJ::Load(std::string filename) {
+  TRACE_SCOPE("Model_OBJ::Load");
   cout << "Opening filename " << filename << std::endl;
 
   string line;
@@ -48,25 +63,30 @@ int Model_OBJ::Load(std::string filename) {
 
     // Allocate memory for the vertices
     vertexBuffer = (float *)malloc(fileSize);
+    // Allocate memory for the texture coordinates listed in the file
+    uvBuffer = (float *)malloc(fileSize);
     // Allocate memory for the triangles
     Faces_Triangles = (float *)malloc(fileSize * sizeof(float));
     // Allocate memory for the normals
     normals = (float *)malloc(fileSize * sizeof(float));
+    // Allocate memory for the per-vertex texture coordinates
+    texcoords = (float *)malloc(fileSize * sizeof(float));
 
     int triangle_index = 0; // Set triangle index to zero
     int normal_index = 0;   // Set normal index to zero
+    int texcoord_index = 0; // Set texture coordinate index to zero
+    long total_uvs = 0;     // Number of floats read into uvBuffer
+    bool missing_uvs = false;
 
     while (!objFile.eof()) // Start reading file data
     {
       getline(objFile, line); // Get line from file
 
-      // The first character is a v: on this line is a vertex stored.
-      if (line.c_str()[0] == 'v') {
-        // Set first character to 0. This will allow us to use sscanf
-        line[0] = ' ';
-
+      // The line starts with "v ": on this line is a vertex stored.
+      if (line.compare(0, 2, "v ") == 0) {
         // Read floats from the line: v X Y Z
-        sscanf(line.c_str(), "%f %f %f ", &vertexBuffer[TotalConnectedPoints],
+        sscanf(line.c_str() + 1, "%f %f %f ",
+               &vertexBuffer[TotalConnectedPoints],
                &vertexBuffer[TotalConnectedPoints + 1],
                &vertexBuffer[TotalConnectedPoints + 2]);
 
@@ -74,67 +94,120 @@ int Model_OBJ::Load(std::string filename) {
         TotalConnectedPoints += POINTS_PER_VERTEX;
       }
 
-      // The first character is an 'f': on this line is a point stored
-      if (line.c_str()[0] == 'f') {
-        // Set first character to 0. This will allow us to use sscanf
-        line[0] = ' ';
-
-        int vertexNumber[4] = { 0, 0, 0 };
-        sscanf(line.c_str(), "%i%i%i", // Read integers from the line:  f 1 2 3
-               &vertexNumber[0],  // First point of our triangle. This is an
-               &vertexNumber[1],  // pointer to our vertexBuffer list
-               &vertexNumber[2]); // each point represents an X,Y,Z.
-
-        vertexNumber[0] -= 1; // OBJ file starts counting from 1
-        vertexNumber[1] -= 1; // OBJ file starts counting from 1
-        vertexNumber[2] -= 1; // OBJ file starts counting from 1
-
-        /********************************************************************
-         * Create triangles (f 1 2 3) from points: (v X Y Z) (v X Y Z) (v X Y
-         * Z).
-         * The vertexBuffer contains all verteces
-         * The triangles will be created using the verteces we read previously
-         */
-
-        int tCounter = 0;
-        for (int i = 0; i < POINTS_PER_VERTEX; i++) {
-          Faces_Triangles[triangle_index + tCounter] =
-              vertexBuffer[3 * vertexNumber[i]];
-          Faces_Triangles[triangle_index + tCounter + 1] =
-              vertexBuffer[3 * vertexNumber[i] + 1];
-          Faces_Triangles[triangle_index + tCounter + 2] =
-              vertexBuffer[3 * vertexNumber[i] + 2];
-          tCounter += POINTS_PER_VERTEX;
-        }
+      // The line starts with "vt": on this line is a texture coordinate.
+      if (line.compare(0, 3, "vt ") == 0) {
+        uvBuffer[total_uvs] = 0.0f;
+        uvBuffer[total_uvs + 1] = 0.0f;
+        sscanf(line.c_str() + 2, "%f %f", &uvBuffer[total_uvs],
+               &uvBuffer[total_uvs + 1]);
+        total_uvs += UVS_PER_VERTEX;
+      }
+
+      // The first character is an 'f': on this line is a polygon stored.
+      if (line.compare(0, 2, "f ") == 0) {
+        // Each corner is "v", "v/vt", "v//vn" or "v/vt/vn". Polygons with
+        // more than three corners are split into a fan of triangles.
+        int vertexNumber[MAX_POLYGON_CORNERS];
+        int uvNumber[MAX_POLYGON_CORNERS];
+        int corners = 0;
 
-        // Calculate normal for the face, used for lighting
-        float coord1[3] = { Faces_Triangles[triangle_index],
-                            Faces_Triangles[triangle_index + 1],
-                            Faces_Triangles[triangle_index + 2] };
-        float coord2[3] = { Faces_Triangles[triangle_index + 3],
-                            Faces_Triangles[triangle_index + 4],
-                            Faces_Triangles[triangle_index + 5] };
-        float coord3[3] = { Faces_Triangles[triangle_index + 6],
-                            Faces_Triangles[triangle_index + 7],
-                            Faces_Triangles[triangle_index + 8] };
-        float norm[3];
-        this->calculateNormal(coord1, coord2, coord3, norm);
-
-        // Store the normal
-        tCounter = 0;
-        for (int i = 0; i < POINTS_PER_VERTEX; i++) {
-          normals[normal_index + tCounter] = norm[0];
-          normals[normal_index + tCounter + 1] = norm[1];
-          normals[normal_index + tCounter + 2] = norm[2];
-          tCounter += POINTS_PER_VERTEX;
+        const char *cursor = line.c_str() + 1;
+        while (corners < MAX_POLYGON_CORNERS) {
+          int consumed = 0;
+          if (sscanf(cursor, " %d%n", &vertexNumber[corners], &consumed) < 1)
+            break;
+          cursor += consumed;
+
+          uvNumber[corners] = 0;
+          if (*cursor == '/') {
+            ++cursor;
+            consumed = 0;
+            if (sscanf(cursor, "%d%n", &uvNumber[corners], &consumed) < 1)
+              uvNumber[corners] = 0;
+            cursor += consumed;
+
+            // Skip over the normal index; normals are computed per face.
+            if (*cursor == '/') {
+              ++cursor;
+              while (*cursor == '-' || (*cursor >= '0' && *cursor <= '9'))
+                ++cursor;
+            }
+          }
+
+          vertexNumber[corners] -= 1; // OBJ file starts counting from 1
+          uvNumber[corners] -= 1;
+          ++corners;
         }
 
-        triangle_index += TOTAL_FLOATS_IN_TRIANGLE;
-        normal_index += TOTAL_FLOATS_IN_TRIANGLE;
-        TotalConnectedTriangles += TOTAL_FLOATS_IN_TRIANGLE;
+        for (int corner = 2; corner < corners; ++corner) {
+          int triangle[3] = { 0, corner - 1, corner };
+
+          /********************************************************************
+           * Create triangles (f 1 2 3) from points: (v X Y Z) (v X Y Z) (v X Y
+           * Z).
+           * The vertexBuffer contains all verteces
+           * The triangles will be created using the verteces we read previously
+           */
+
+          int tCounter = 0;
+          for (int i = 0; i < POINTS_PER_VERTEX; i++) {
+            int v = vertexNumber[triangle[i]];
+            Faces_Triangles[triangle_index + tCounter] = vertexBuffer[3 * v];
+            Faces_Triangles[triangle_index + tCounter + 1] =
+                vertexBuffer[3 * v + 1];
+            Faces_Triangles[triangle_index + tCounter + 2] =
+                vertexBuffer[3 * v + 2];
+            tCounter += POINTS_PER_VERTEX;
+
+            // Carry the texture coordinate through, if there is one.
+            int uv = uvNumber[triangle[i]];
+            if (uv >= 0 && UVS_PER_VERTEX * uv < total_uvs) {
+              texcoords[texcoord_index] = uvBuffer[UVS_PER_VERTEX * uv];
+              texcoords[texcoord_index + 1] =
+                  uvBuffer[UVS_PER_VERTEX * uv + 1];
+            } else {
+              texcoords[texcoord_index] = 0.0f;
+              texcoords[texcoord_index + 1] = 0.0f;
+              missing_uvs = true;
+            }
+            texcoord_index += UVS_PER_VERTEX;
+          }
+
+          // Calculate normal for the face, used for lighting
+          float coord1[3] = { Faces_Triangles[triangle_index],
+                              Faces_Triangles[triangle_index + 1],
+                              Faces_Triangles[triangle_index + 2] };
+          float coord2[3] = { Faces_Triangles[triangle_index + 3],
+                              Faces_Triangles[triangle_index + 4],
+                              Faces_Triangles[triangle_index + 5] };
+          float coord3[3] = { Faces_Triangles[triangle_index + 6],
+                              Faces_Triangles[triangle_index + 7],
+                              Faces_Triangles[triangle_index + 8] };
+          float norm[3];
+          this->calculateNormal(coord1, coord2, coord3, norm);
+
+          // Store the normal
+          tCounter = 0;
+          for (int i = 0; i < POINTS_PER_VERTEX; i++) {
+            normals[normal_index + tCounter] = norm[0];
+            normals[normal_index + tCounter + 1] = norm[1];
+            normals[normal_index + tCounter + 2] = norm[2];
+            tCounter += POINTS_PER_VERTEX;
+          }
+
+          triangle_index += TOTAL_FLOATS_IN_TRIANGLE;
+          normal_index += TOTAL_FLOATS_IN_TRIANGLE;
+          TotalConnectedTriangles += TOTAL_FLOATS_IN_TRIANGLE;
+        }
       }
     }
 
+    // Only keep texture coordinates if every vertex had one.
+    if (missing_uvs || texcoord_index == 0) {
+      free(texcoords);
+      texcoords = NULL;
+    }
+
     // Done! Close the file and report success.
     objFile.close();
     cout << "Read " << triangle_index << " vertices, " << normal_index
@@ -151,6 +224,150 @@ void Model_OBJ::Release() {
   free(this->Faces_Triangles);
   free(this->normals);
   free(this->vertexBuffer);
+  free(this->texcoords);
+  free(this->uvBuffer);
+  this->normals = NULL;
+  this->Faces_Triangles = NULL;
+  this->vertexBuffer = NULL;
+  this->texcoords = NULL;
+  this->uvBuffer = NULL;
+}
+
+void Model_OBJ::GenerateCylindricalTexcoords() {
+  long total_vertices = TotalConnectedTriangles / POINTS_PER_VERTEX;
+  if (total_vertices == 0)
+    return;
+
+  // Find the bounding box, to get the axis and height of the cylinder.
+  float min[3], max[3];
+  for (int k = 0; k < 3; k++) {
+    min[k] = max[k] = Faces_Triangles[k];
+  }
+  for (long i = 0; i < total_vertices; i++) {
+    for (int k = 0; k < 3; k++) {
+      float c = Faces_Triangles[POINTS_PER_VERTEX * i + k];
+      if (c < min[k]) min[k] = c;
+      if (c > max[k]) max[k] = c;
+    }
+  }
+  float center_x = 0.5f * (min[0] + max[0]);
+  float center_z = 0.5f * (min[2] + max[2]);
+  float height = (max[1] > min[1]) ? max[1] - min[1] : 1.0f;
+
+  // u goes once around the vertical axis, v goes from bottom to top.
+  free(texcoords);
+  texcoords = (float *)malloc(total_vertices * UVS_PER_VERTEX * sizeof(float));
+  for (long i = 0; i < total_vertices; i++) {
+    const float *vertex = &Faces_Triangles[POINTS_PER_VERTEX * i];
+    texcoords[UVS_PER_VERTEX * i] =
+        0.5f + atan2f(vertex[0] - center_x, vertex[2] - center_z) /
+                   (2.0f * (float)M_PI);
+    texcoords[UVS_PER_VERTEX * i + 1] = (vertex[1] - min[1]) / height;
+  }
+}
+
+long Model_OBJ::MeshBytes() const {
+  long total_vertices = TotalConnectedTriangles / POINTS_PER_VERTEX;
+  long floats = 2 * POINTS_PER_VERTEX * total_vertices;
+  if (texcoords)
+    floats += UVS_PER_VERTEX * total_vertices;
+  return floats * sizeof(float);
+}
+
+void Model_OBJ::Simplify(float cell_size, Model_OBJ *out) const {
+  TRACE_SCOPE("Model_OBJ::Simplify");
+  const long total_vertices = TotalConnectedTriangles / POINTS_PER_VERTEX;
+
+  // The cell of every corner, and the sum of the corners in each cell.
+  std::unordered_map<long long, int> cell_index;
+  std::vector<int> corner_cell(total_vertices);
+  std::vector<float> sums;
+  std::vector<int> counts;
+  for (long i = 0; i < total_vertices; i++) {
+    const float *p = &Faces_Triangles[POINTS_PER_VERTEX * i];
+    long long key = 0;
+    for (int k = 0; k < 3; k++) {
+      long long cell = (long long)floorf(p[k] / cell_size) & 0x1fffff;
+      key = (key << 21) | cell;
+    }
+    std::unordered_map<long long, int>::iterator found =
+        cell_index.insert(std::make_pair(key, (int)counts.size())).first;
+    const int c = found->second;
+    if (c == (int)counts.size()) {
+      sums.insert(sums.end(), 3, 0.0f);
+      counts.push_back(0);
+    }
+    for (int k = 0; k < 3; k++) {
+      sums[3 * c + k] += p[k];
+    }
+    counts[c]++;
+    corner_cell[i] = c;
+  }
+  for (unsigned int c = 0; c < counts.size(); c++) {
+    for (int k = 0; k < 3; k++) {
+      sums[3 * c + k] /= counts[c];
+    }
+  }
+
+  long kept = 0;
+  for (long t = 0; t < total_vertices / 3; t++) {
+    const int *cells = &corner_cell[3 * t];
+    if (cells[0] != cells[1] && cells[1] != cells[2] && cells[0] != cells[2])
+      kept++;
+  }
+
+  out->Release();
+  out->TotalConnectedPoints = 0;
+  out->TotalConnectedTriangles = kept * TOTAL_FLOATS_IN_TRIANGLE;
+  out->Faces_Triangles =
+      (float *)malloc(kept * TOTAL_FLOATS_IN_TRIANGLE * sizeof(float));
+  out->normals =
+      (float *)malloc(kept * TOTAL_FLOATS_IN_TRIANGLE * sizeof(float));
+  if (texcoords) {
+    out->texcoords =
+        (float *)malloc(kept * 3 * UVS_PER_VERTEX * sizeof(float));
+  }
+
+  long triangle_index = 0;
+  for (long t = 0; t < total_vertices / 3; t++) {
+    const int *cells = &corner_cell[3 * t];
+    if (cells[0] == cells[1] || cells[1] == cells[2] || cells[0] == cells[2])
+      continue;
+
+    float *triangle = &out->Faces_Triangles[triangle_index];
+    for (int i = 0; i < 3; i++) {
+      for (int k = 0; k < 3; k++) {
+        triangle[POINTS_PER_VERTEX * i + k] = sums[3 * cells[i] + k];
+      }
+      if (texcoords) {
+        const long corner = (triangle_index / POINTS_PER_VERTEX) + i;
+        out->texcoords[UVS_PER_VERTEX * corner] =
+            texcoords[UVS_PER_VERTEX * (3 * t + i)];
+        out->texcoords[UVS_PER_VERTEX * corner + 1] =
+            texcoords[UVS_PER_VERTEX * (3 * t + i) + 1];
+      }
+    }
+
+    // Distinct cells can still put the corners in a line.
+    float norm[3] = { 0.0f, 0.0f, 0.0f };
+    float edge1[3], edge2[3];
+    for (int k = 0; k < 3; k++) {
+      edge1[k] = triangle[k] - triangle[3 + k];
+      edge2[k] = triangle[k] - triangle[6 + k];
+    }
+    const float cross[3] = { edge1[1] * edge2[2] - edge2[1] * edge1[2],
+                             edge2[0] * edge1[2] - edge1[0] * edge2[2],
+                             edge1[0] * edge2[1] - edge2[0] * edge1[1] };
+    if (cross[0] != 0.0f || cross[1] != 0.0f || cross[2] != 0.0f) {
+      out->calculateNormal(&triangle[0], &triangle[3], &triangle[6], norm);
+    }
+    for (int i = 0; i < 3; i++) {
+      for (int k = 0; k < 3; k++) {
+        out->normals[triangle_index + POINTS_PER_VERTEX * i + k] = norm[k];
+      }
+    }
+    triangle_index += TOTAL_FLOATS_IN_TRIANGLE;
+  }
 }
 
 void Model_OBJ::Draw() {
@@ -161,7 +378,15 @@ void Model_OBJ::Draw() {
   glVertexPointer(3, GL_FLOAT, 0,
                   Faces_Triangles);      // Vertex Pointer to triangle array
   glNormalPointer(GL_FLOAT, 0, normals); // Normal pointer to normal array
-  glDrawArrays(GL_TRIANGLES, 0, TotalConnectedTriangles); // Draw the triangles
+  if (texcoords) {
+    glEnableClientState(GL_TEXTURE_COORD_ARRAY); // Enable texture coordinates
+    glTexCoordPointer(2, GL_FLOAT, 0, texcoords);
+  }
+  glDrawArrays(GL_TRIANGLES, 0,
+               TotalConnectedTriangles / POINTS_PER_VERTEX); // Draw the triangles
   glDisableClientState(GL_VERTEX_ARRAY); // Disable vertex arrays
   glDisableClientState(GL_NORMAL_ARRAY); // Disable normal arrays
+  if (texcoords) {
+    glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+  }
 }
\ No newline at end of file
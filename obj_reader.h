@@ -28,9 +28,27 @@ public:
   void Draw();              // Draws the model on the screen
   void Release();           // Release the model
 
+  // For meshes without texture coordinates: wraps [0, 1] x [0, 1] once
+  // around the vertical axis of the model.
+  void GenerateCylindricalTexcoords();
+
+  // The bytes of vertex data Draw() sends: positions, normals and texture
+  // coordinates, if any.
+  long MeshBytes() const;
+
+  // Fills out with a coarser copy of the model, for drawing when detail
+  // does not pay for itself. Corners are clustered on a grid of cells
+  // cell_size wide: each moves to the mean of the corners in its cell, and
+  // triangles left with fewer than three distinct corners are dropped.
+  // Texture coordinates are kept per corner.
+  void Simplify(float cell_size, Model_OBJ *out) const;
+
   float *normals;               // Stores the normals
   float *Faces_Triangles;       // Stores the triangles
   float *vertexBuffer;          // Stores the points which make the object
+  float *texcoords;             // Stores 2 texture coordinates per triangle
+                                // vertex, or NULL if the file had none
+  float *uvBuffer;              // Stores the texture coordinates in the file
   
   long TotalConnectedPoints;    // Stores the total number of connected verteces
   long TotalConnectedTriangles; // Stores the total number of connected
@@ -0,0 +1,261 @@
+#include "onset_ensemble.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+
+// How far back the medians look, in seconds.
+static const float kHistorySeconds = 0.3f;
+
+// How quickly the descriptors' peaks decay, in seconds, and the fraction of
+// them that the medians never fall below.
+static const float kPeakDecaySeconds = 10.0f;
+static const float kMedianFloor = 0.01f;
+
+// A descriptor at (1 + kNoveltyScale) times its median maps to 1 - 1/e,
+// about 0.63. The smaller the scale, the sooner strengths saturate.
+static const float kNoveltyScale = 2.0f;
+
+// The lowest onset function that counts as an onset: three descriptors at
+// about one and a half times their medians.
+static const float kThreshold = 0.2f;
+
+// Onsets closer together than this are one onset, as with
+// aubio_onset_set_minioi_s().
+static const float kMinIntervalSeconds = 0.01f;
+
+// An onset must also rise kRise above the onset function's recent peak,
+// which decays with this time constant. That way a loud hit is one onset,
+// not one for every ripple while it rings out, and it still stands out
+// from the medians.
+static const float kHoldSeconds = 0.1f;
+static const float kRise = 0.1f;
+
+OnsetEnsemble::OnsetEnsemble()
+  : num_bins_(0),
+    hop_size_(0),
+    sample_rate_(0),
+    hops_(0),
+    history_size_(0),
+    history_position_(0),
+    peak_decay_(1.0f),
+    hold_(0.0f),
+    hold_decay_(0.0f),
+    refractory_(0),
+    min_interval_(0),
+    last_onset_s_(0.0f),
+    strength_(0.0f) {
+  for (int d = 0; d < kNumDescriptors; ++d) {
+    peak_[d] = 0.0f;
+  }
+  for (int i = 0; i < 3; ++i) {
+    onset_function_[i] = 0.0f;
+    mean_[i] = 0.0f;
+  }
+}
+
+void OnsetEnsemble::Init(uint_t win_size, uint_t hop_size,
+                         uint_t sample_rate) {
+  num_bins_ = win_size / 2 + 1;
+  hop_size_ = hop_size;
+  sample_rate_ = sample_rate;
+
+  magnitude_.assign(num_bins_, 0.0f);
+  previous_magnitude_.assign(num_bins_, 0.0f);
+  phasor_re_.assign(num_bins_, 1.0f);
+  phasor_im_.assign(num_bins_, 0.0f);
+  previous_re_.assign(num_bins_, 1.0f);
+  previous_im_.assign(num_bins_, 0.0f);
+  before_re_.assign(num_bins_, 1.0f);
+  before_im_.assign(num_bins_, 0.0f);
+  for (int d = 0; d < kNumDescriptors; ++d) {
+    terms_[d].assign(num_bins_, 0.0f);
+  }
+
+  const float hops_per_second = (float)sample_rate / hop_size;
+  history_size_ = std::max((int)(kHistorySeconds * hops_per_second), 3);
+  history_position_ = 0;
+  for (int d = 0; d < kNumDescriptors; ++d) {
+    history_[d].assign(history_size_, 0.0f);
+  }
+  sorted_.resize(history_size_);
+
+  peak_decay_ = expf(-1.0f / (kPeakDecaySeconds * hops_per_second));
+  min_interval_ = std::max((int)(kMinIntervalSeconds * hops_per_second), 1);
+  hold_decay_ = expf(-1.0f / (kHoldSeconds * hops_per_second));
+}
+
+// log(1 + x) for x >= 0, to within about 1e-5: the exponent of 1 + x
+// gives whole powers of two, and the series 2 atanh(s) the logarithm of
+// the mantissa, with s at most 1/3. Plain arithmetic on the float's bits,
+// so that loops calling it still vectorize.
+static inline float Log1p(float x) {
+  const float y = 1.0f + x;
+  uint32_t bits;
+  memcpy(&bits, &y, sizeof(bits));
+  const int exponent = (int)(bits >> 23) - 127;
+  bits = (bits & 0x007fffff) | 0x3f800000;
+  float mantissa;
+  memcpy(&mantissa, &bits, sizeof(mantissa));
+  const float s = (mantissa - 1.0f) / (mantissa + 1.0f);
+  const float s2 = s * s;
+  const float series =
+      2.0f * s * (1.0f + s2 * (1.0f / 3 + s2 * (1.0f / 5 + s2 * (1.0f / 7))));
+  return exponent * (float)M_LN2 + series;
+}
+
+float OnsetEnsemble::Sum(const float *values, int n) {
+  float partial[8] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+  int k = 0;
+  for (; k + 8 <= n; k += 8) {
+    for (int j = 0; j < 8; ++j) {
+      partial[j] += values[k + j];
+    }
+  }
+  float sum = 0.0f;
+  for (int j = 0; j < 8; ++j) {
+    sum += partial[j];
+  }
+  for (; k < n; ++k) {
+    sum += values[k];
+  }
+  return sum;
+}
+
+void OnsetEnsemble::Describe(const float *spectrum, float *values) {
+  // spectrum holds the real parts in [0, n/2] and the imaginary parts in
+  // reverse order in [n/2 + 1, n). The first and last bins are real.
+  const int half = num_bins_ - 1;
+  const int n = 2 * half;
+  float *magnitude = &magnitude_[0];
+  float *re = &phasor_re_[0];
+  float *im = &phasor_im_[0];
+  magnitude[0] = fabsf(spectrum[0]);
+  re[0] = spectrum[0] < 0.0f ? -1.0f : 1.0f;
+  im[0] = 0.0f;
+  for (int k = 1; k < half; ++k) {
+    const float real = spectrum[k], imaginary = spectrum[n - k];
+    magnitude[k] = sqrtf(real * real + imaginary * imaginary);
+    // A bin with no energy gets no phasor; its term is its old magnitude
+    // whatever the phase.
+    const float inverse = 1.0f / (magnitude[k] + 1e-20f);
+    re[k] = real * inverse;
+    im[k] = imaginary * inverse;
+  }
+  magnitude[half] = fabsf(spectrum[half]);
+  re[half] = spectrum[half] < 0.0f ? -1.0f : 1.0f;
+  im[half] = 0.0f;
+
+  // Each descriptor's term for every bin, in short loops over plain
+  // contiguous arrays with no calls and no branches, which the compiler
+  // vectorizes. A loop over all of them at once reads too many arrays for
+  // the compiler to rule out that some overlap.
+  const int num_bins = num_bins_;
+  const float *previous = &previous_magnitude_[0];
+  float *energy = &terms_[ENERGY][0];
+  float *hfc = &terms_[HFC][0];
+  float *specflux = &terms_[SPECFLUX][0];
+  for (int k = 0; k < num_bins; ++k) {
+    const float m = magnitude[k];
+    energy[k] = m * m;
+    hfc[k] = (k + 1) * m;
+    specflux[k] = std::max(m - previous[k], 0.0f);
+  }
+  float *kl = &terms_[KL][0];
+  for (int k = 0; k < num_bins; ++k) {
+    kl[k] = Log1p(magnitude[k] / (previous[k] + 0.1f));
+  }
+
+  // Distance from where each bin would be if it kept its magnitude and its
+  // rate of change of phase. The cosine of the phase's deviation, phase - 2
+  // previous + before, is the real part of the product of the phasors, with
+  // the previous one conjugated and squared.
+  const float *previous_re = &previous_re_[0];
+  const float *previous_im = &previous_im_[0];
+  const float *before_re = &before_re_[0];
+  const float *before_im = &before_im_[0];
+  float *complex = &terms_[COMPLEX][0];
+  for (int k = 0; k < num_bins; ++k) {
+    const float m = magnitude[k];
+    const float old = previous[k];
+    const float square_re =
+        previous_re[k] * previous_re[k] - previous_im[k] * previous_im[k];
+    const float square_im = -2.0f * previous_re[k] * previous_im[k];
+    const float turn_re = re[k] * square_re - im[k] * square_im;
+    const float turn_im = re[k] * square_im + im[k] * square_re;
+    const float cosine = turn_re * before_re[k] - turn_im * before_im[k];
+    complex[k] = sqrtf(fabsf(old * old + m * m - 2.0f * old * m * cosine));
+  }
+  for (int d = 0; d < kNumDescriptors; ++d) {
+    values[d] = Sum(&terms_[d][0], num_bins_);
+  }
+
+  before_re_.swap(previous_re_);
+  before_im_.swap(previous_im_);
+  previous_re_.swap(phasor_re_);
+  previous_im_.swap(phasor_im_);
+  previous_magnitude_.swap(magnitude_);
+}
+
+bool OnsetEnsemble::ProcessSpectrum(const float *spectrum, bool silent) {
+  float values[kNumDescriptors];
+  Describe(spectrum, values);
+  ++hops_;
+
+  // Each descriptor against its recent median, the current value included
+  // so that a single hop cannot stand out against an empty history.
+  float scores[kNumDescriptors];
+  float mean = 0.0f;
+  for (int d = 0; d < kNumDescriptors; ++d) {
+    history_[d][history_position_] = values[d];
+    sorted_ = history_[d];
+    std::nth_element(sorted_.begin(), sorted_.begin() + history_size_ / 2,
+                     sorted_.end());
+    peak_[d] = std::max(values[d], peak_[d] * peak_decay_);
+    const float median =
+        std::max(sorted_[history_size_ / 2], kMedianFloor * peak_[d]);
+
+    float novelty = 0.0f;
+    if (median > 0.0f) {
+      novelty = std::max(values[d] / median - 1.0f, 0.0f);
+    }
+    scores[d] = 1.0f - expf(-novelty / kNoveltyScale);
+    mean += scores[d];
+  }
+  mean /= kNumDescriptors;
+  history_position_ = (history_position_ + 1) % history_size_;
+
+  // The onset function is the median score, so that a majority of the
+  // descriptors has to agree: any one of them alone is easily fooled, like
+  // spectral flux by the beating of a low, steady note. The strength is the
+  // mean, so that the more of them agree, and the further they stand out,
+  // the stronger the onset.
+  std::nth_element(scores, scores + kNumDescriptors / 2,
+                   scores + kNumDescriptors);
+  for (int i = 0; i < 2; ++i) {
+    onset_function_[i] = onset_function_[i + 1];
+    mean_[i] = mean_[i + 1];
+  }
+  onset_function_[2] = silent ? 0.0f : scores[kNumDescriptors / 2];
+  mean_[2] = mean;
+  if (refractory_ > 0) {
+    --refractory_;
+  }
+
+  // A peak needs the hop after it to be seen, so onsets are one hop late.
+  const float peak = onset_function_[1];
+  const float threshold = std::max(hold_ + kRise, kThreshold);
+  hold_ = std::max(hold_ * hold_decay_, peak);
+  // Strong onsets saturate the function into a plateau that only wobbles,
+  // so a hop within kRise of the next one is as good as its peak.
+  if (peak < threshold || peak <= onset_function_[0] ||
+      peak < onset_function_[2] - kRise || refractory_ > 0) {
+    return false;
+  }
+  refractory_ = min_interval_;
+  last_onset_s_ = (float)(hops_ - 1) * hop_size_ / sample_rate_;
+  strength_ = mean_[1];
+  return true;
+}
@@ -0,0 +1,114 @@
+#ifndef __ONSET_ENSEMBLE_H__
+#define __ONSET_ENSEMBLE_H__
+
+#include <vector>
+
+// Aubio includes
+#include <aubio/aubio.h>
+
+using std::vector;
+
+// OnsetEnsemble finds onsets with five of aubio's spectral descriptors at
+// once, and says how strong each onset is, which aubio's onset object
+// cannot.
+//
+// Every hop, it works out energy, high-frequency content, complex-domain
+// deviation, spectral flux and modified Kullback-Leibler divergence (as in
+// aubio's specdesc.c) from one spectrum: the one that BandAnalyzer already
+// computes, so there is no FFT of its own. The work is a few passes over
+// plain arrays that the compiler vectorizes: phases are kept as unit
+// phasors rather than angles, and the logarithm is a short series, so that
+// no loop calls into the math library.
+//
+// Each descriptor's value is compared to its median over the last third of
+// a second, which follows the music as it gets busier or quieter, and the
+// amount by which it stands out is mapped onto [0, 1). The median of the
+// five is the onset function, so a majority must agree: a peak in it above a
+// threshold is an onset, one hop after the fact. The mean of the five at the
+// peak is the onset's strength.
+//
+// A hit that every descriptor agrees on and that stands far above its
+// surroundings, like a kick after a breakdown, is close to 1. A change that
+// only one or two descriptors notice, like a soft chord under a steady beat,
+// is closer to the threshold.
+class OnsetEnsemble {
+ public:
+  enum Descriptor { ENERGY, HFC, COMPLEX, SPECFLUX, KL, kNumDescriptors };
+
+  OnsetEnsemble();
+
+  void Init(uint_t win_size, uint_t hop_size, uint_t sample_rate);
+
+  // Analyzes the spectrum of one hop, in the layout of
+  // aubio_fft_do_complex(). silent hops feed the medians, but never have
+  // onsets. Returns whether there was an onset, in the previous hop; see
+  // last_onset_s() and strength().
+  bool ProcessSpectrum(const float *spectrum, bool silent);
+
+  // The time of the last onset, in seconds since the first hop, and how
+  // strong it was, from 0 to 1.
+  float last_onset_s() const { return last_onset_s_; }
+  float strength() const { return strength_; }
+
+  // The onset function at the last hop, from 0 to 1.
+  float onset_function() const { return onset_function_[2]; }
+
+ private:
+  // Works out every descriptor from the spectrum.
+  void Describe(const float *spectrum, float *values);
+
+  // The sum of values[0, n), in eight independent partial sums, which the
+  // compiler can vectorize without reordering any one of them.
+  static float Sum(const float *values, int n);
+
+  uint_t num_bins_;
+  uint_t hop_size_;
+  uint_t sample_rate_;
+  unsigned long hops_;
+
+  // Magnitudes of the current spectrum and the one before it, and the
+  // phases of the current spectrum and the two before it as unit phasors:
+  // the real and imaginary parts of each bin divided by its magnitude.
+  vector<float> magnitude_;
+  vector<float> previous_magnitude_;
+  vector<float> phasor_re_;
+  vector<float> phasor_im_;
+  vector<float> previous_re_;
+  vector<float> previous_im_;
+  vector<float> before_re_;
+  vector<float> before_im_;
+
+  // Each descriptor's term for every bin of the current spectrum.
+  vector<float> terms_[kNumDescriptors];
+
+  // The last history_size_ values of each descriptor, oldest overwritten
+  // first, and scratch space to find their median in.
+  int history_size_;
+  int history_position_;
+  vector<float> history_[kNumDescriptors];
+  vector<float> sorted_;
+
+  // A slowly decaying peak of each descriptor, a small fraction of which
+  // floors the median, so that the noise of a quiet room after silence does
+  // not stand out infinitely far.
+  float peak_[kNumDescriptors];
+  float peak_decay_;
+
+  // The onset function, and the mean score, two hops ago, one hop ago and
+  // now.
+  float onset_function_[3];
+  float mean_[3];
+
+  // The onset function's recent peak, before the hop being looked at.
+  float hold_;
+  float hold_decay_;
+
+  // Hops left before another onset may be found.
+  int refractory_;
+  int min_interval_;
+
+  float last_onset_s_;
+  float strength_;
+};
+
+#endif // __ONSET_ENSEMBLE_H__
@@ -0,0 +1,265 @@
+#include "options.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void PrintUsage(const char *program) {
+  printf("Usage: %s [options]\n"
+         "\n"
+         "Audio analysis:\n"
+         "  --sample-rate=HZ   input sample rate (default 44100)\n"
+         "  --window=N         FFT window in samples, a power of two "
+         "(default 1024)\n"
+         "  --hop=N            samples between analyses (default 256)\n"
+         "  --low-latency      128-sample hops over the same window\n"
+         "  --channels=N       input channels to open (default 1); with more,\n"
+         "                     each is also analyzed on its own\n"
+         "  --layer-channel=L:C\n"
+         "                     make layer L follow input channel C instead\n"
+         "                     of the mix (0); repeatable\n"
+         "  --setlist=FILE     follow the tracks analyzed by analyze_setlist\n"
+         "                     when they play, instead of detecting events\n"
+         "  --setlist-advance=MS\n"
+         "                     show a known track's events this early, to\n"
+         "                     make up for output latency (default 20)\n"
+         "\n"
+         "Hair layout:\n"
+         "  --hair-layout=FILE       load the hairs from a layout file\n"
+         "  --save-hair-layout=FILE  write the generated hairs to a layout "
+         "file\n"
+         "  --hair-seed=N            seed for generated hairs (default 1)\n"
+         "\n"
+         "Effects:\n"
+         "  --effect=FILE            effect program for mode 5 (default\n"
+         "                           effects/default.fx), reloaded on change\n"
+         "  --glow-cache=DIR         where to keep the hairs' baked glow on\n"
+         "                           the jacket (default cache; empty for\n"
+         "                           none)\n"
+         "\n"
+         "LEDs:\n"
+         "  --led-output=PATH        send raw RGB frames to a FIFO or device\n"
+         "  --led-rate=HZ            frames per second to send (default 400)\n"
+         "  --power-budget=MA        most current the LEDs may draw in total\n"
+         "  --zone-budget=MA         most current per power-injection zone\n"
+         "  --zone-size=N            LED channels per zone (default 300)\n"
+         "\n"
+         "Viewer:\n"
+         "  --no-idle                keep drawing at full rate through "
+         "silence\n"
+         "  --frame-budget=MS        lower the preview's quality to draw a\n"
+         "                           frame in this long (default 16.7); the\n"
+         "                           LEDs are never affected\n"
+         "  --no-governor            always draw the preview at its best\n"
+         "\n"
+         "Remote control:\n"
+         "  --osc-port=N             listen for OSC on this UDP port\n"
+         "  --control-socket=PATH    listen for OSC on a Unix socket\n"
+         "\n"
+         "Synchronization (see rig_sync.h):\n"
+         "  --sync-lead              analyze the music for other rigs too\n"
+         "  --sync-follow            show what the leading rig hears, with\n"
+         "                           no audio analysis of its own\n"
+         "  --sync-group=ADDR        multicast group (default 239.255.42.99)\n"
+         "  --sync-port=N            UDP port (default 9100)\n"
+         "  --sync-interface=ADDR    address of the interface to use, e.g.\n"
+         "                           127.0.0.1 for rigs on one machine\n"
+         "  --sync-delay=MS          how long after each beat every rig shows\n"
+         "                           it (default 80, at least 50)\n"
+         "\n"
+         "Monitoring:\n"
+         "  --metrics-port=N         serve Prometheus metrics on 127.0.0.1:N\n"
+         "  --metrics-socket=PATH    serve them on a Unix socket\n"
+         "\n"
+         "Video export (instead of the viewer):\n"
+         "  --export-video=FILE      render to FILE: .y4m for Y4M, else PPM;\n"
+         "                           - for stdout, |COMMAND to pipe\n"
+         "  --export-audio=FILE      the music to render (required)\n"
+         "  --export-timeline=FILE   control commands by time\n"
+         "  --export-size=WxH        video size (default 1280x720)\n"
+         "  --export-fps=N           frame rate (default 30)\n"
+         "\n"
+         "  --help                   show this message\n",
+         program);
+}
+
+// If arg is "--name=value", points value at the value and returns true.
+static bool MatchValue(const char *arg, const char *name, const char **value) {
+  size_t length = strlen(name);
+  if (strncmp(arg, name, length) == 0 && arg[length] == '=') {
+    *value = arg + length + 1;
+    return true;
+  }
+  return false;
+}
+
+bool ParseOptions(int argc, char **argv, Options *options) {
+  // --low-latency only changes the hop, so that --hop can still override it
+  // regardless of the order of the flags.
+  bool low_latency = false;
+  int hop_size = 0;
+
+  for (int i = 1; i < argc; ++i) {
+    const char *arg = argv[i];
+    const char *value;
+
+    if (strcmp(arg, "--help") == 0) {
+      PrintUsage(argv[0]);
+      return false;
+    } else if (strcmp(arg, "--low-latency") == 0) {
+      low_latency = true;
+    } else if (strcmp(arg, "--no-idle") == 0) {
+      options->idle = false;
+    } else if (strcmp(arg, "--no-governor") == 0) {
+      options->frame_budget_ms = 0.0f;
+    } else if (MatchValue(arg, "--frame-budget", &value)) {
+      options->frame_budget_ms = atof(value);
+    } else if (strcmp(arg, "--sync-lead") == 0) {
+      options->sync.role = SyncConfig::LEADER;
+    } else if (strcmp(arg, "--sync-follow") == 0) {
+      options->sync.role = SyncConfig::FOLLOWER;
+    } else if (MatchValue(arg, "--sync-group", &value)) {
+      options->sync.group = value;
+    } else if (MatchValue(arg, "--sync-port", &value)) {
+      options->sync.port = atoi(value);
+    } else if (MatchValue(arg, "--sync-interface", &value)) {
+      options->sync.interface = value;
+    } else if (MatchValue(arg, "--sync-delay", &value)) {
+      options->sync.delay_ms = atof(value);
+    } else if (MatchValue(arg, "--sample-rate", &value)) {
+      options->audio.sample_rate = atoi(value);
+    } else if (MatchValue(arg, "--window", &value)) {
+      options->audio.win_size = atoi(value);
+    } else if (MatchValue(arg, "--hop", &value)) {
+      hop_size = atoi(value);
+    } else if (MatchValue(arg, "--setlist", &value)) {
+      options->setlist = value;
+    } else if (MatchValue(arg, "--setlist-advance", &value)) {
+      options->setlist_advance_ms = atof(value);
+    } else if (MatchValue(arg, "--channels", &value)) {
+      options->audio.channels = atoi(value);
+    } else if (MatchValue(arg, "--layer-channel", &value)) {
+      int layer, channel;
+      if (sscanf(value, "%d:%d", &layer, &channel) != 2 || layer < 1 ||
+          layer > kSyncLayers || channel < 0) {
+        printf("--layer-channel must look like 3:2, for layer 3 (1 to %d) "
+               "and input channel 2\n", kSyncLayers);
+        return false;
+      }
+      options->layer_channel[layer - 1] = channel;
+    } else if (MatchValue(arg, "--hair-layout", &value)) {
+      options->hair_layout = value;
+    } else if (MatchValue(arg, "--save-hair-layout", &value)) {
+      options->save_hair_layout = value;
+    } else if (MatchValue(arg, "--hair-seed", &value)) {
+      options->hair_seed = strtoul(value, NULL, 10);
+    } else if (MatchValue(arg, "--osc-port", &value)) {
+      options->osc_port = atoi(value);
+    } else if (MatchValue(arg, "--control-socket", &value)) {
+      options->control_socket = value;
+    } else if (MatchValue(arg, "--glow-cache", &value)) {
+      options->glow_cache = value;
+    } else if (MatchValue(arg, "--metrics-port", &value)) {
+      options->metrics_port = atoi(value);
+    } else if (MatchValue(arg, "--metrics-socket", &value)) {
+      options->metrics_socket = value;
+    } else if (MatchValue(arg, "--led-output", &value)) {
+      options->led_output = value;
+    } else if (MatchValue(arg, "--led-rate", &value)) {
+      options->led_rate = atoi(value);
+    } else if (MatchValue(arg, "--power-budget", &value)) {
+      options->power.total_budget_ma = atof(value);
+    } else if (MatchValue(arg, "--zone-budget", &value)) {
+      options->power.zone_budget_ma = atof(value);
+    } else if (MatchValue(arg, "--zone-size", &value)) {
+      options->power.zone_size = atoi(value);
+    } else if (MatchValue(arg, "--effect", &value)) {
+      options->effect = value;
+    } else if (MatchValue(arg, "--export-video", &value)) {
+      options->export_video = value;
+    } else if (MatchValue(arg, "--export-audio", &value)) {
+      options->export_audio = value;
+    } else if (MatchValue(arg, "--export-timeline", &value)) {
+      options->export_timeline = value;
+    } else if (MatchValue(arg, "--export-size", &value)) {
+      if (sscanf(value, "%dx%d", &options->export_width,
+                 &options->export_height) != 2) {
+        printf("--export-size must look like 1280x720\n");
+        return false;
+      }
+    } else if (MatchValue(arg, "--export-fps", &value)) {
+      options->export_fps = atoi(value);
+    } else {
+      printf("Unknown option: %s\n\n", arg);
+      PrintUsage(argv[0]);
+      return false;
+    }
+  }
+
+  if (low_latency) {
+    options->audio.hop_size = AudioConfig::LowLatency().hop_size;
+  }
+  if (hop_size > 0) {
+    options->audio.hop_size = hop_size;
+  }
+
+  if (!options->hair_layout.empty() && !options->save_hair_layout.empty()) {
+    printf("--hair-layout and --save-hair-layout cannot be combined\n");
+    return false;
+  }
+
+  if (!options->export_video.empty()) {
+    if (options->export_audio.empty()) {
+      printf("--export-video needs --export-audio\n");
+      return false;
+    }
+    // 4:2:0 video needs even dimensions.
+    if (options->export_width <= 0 || options->export_height <= 0 ||
+        options->export_width % 2 || options->export_height % 2) {
+      printf("--export-size must be even and positive\n");
+      return false;
+    }
+    if (options->export_fps <= 0) {
+      printf("--export-fps must be positive\n");
+      return false;
+    }
+  }
+
+  for (int i = 0; i < kSyncLayers; ++i) {
+    const int channel = options->layer_channel[i];
+    if (channel > 0 && (options->audio.channels < 2 ||
+                        channel > options->audio.channels)) {
+      printf("--layer-channel: there is no input channel %d; --channels is "
+             "%d\n", channel, options->audio.channels);
+      return false;
+    }
+  }
+
+  if (options->setlist_advance_ms < 0 || options->setlist_advance_ms > 500) {
+    printf("--setlist-advance must be between 0 and 500\n");
+    return false;
+  }
+
+  if (options->led_rate <= 0) {
+    printf("--led-rate must be positive\n");
+    return false;
+  }
+
+  if (options->frame_budget_ms < 0) {
+    printf("--frame-budget must not be negative\n");
+    return false;
+  }
+
+  if (options->osc_port < 0 || options->osc_port > 65535) {
+    printf("--osc-port must be between 1 and 65535\n");
+    return false;
+  }
+
+  if (options->metrics_port < 0 || options->metrics_port > 65535) {
+    printf("--metrics-port must be between 1 and 65535\n");
+    return false;
+  }
+
+  return options->audio.Validate() && options->power.Validate() &&
+         options->sync.Validate();
+}
@@ -0,0 +1,105 @@
+#ifndef __OPTIONS_H__
+#define __OPTIONS_H__
+
+#include <string>
+
+// Disco Wookie includes
+#include "audio.h"
+#include "power_limiter.h"
+#include "rig_sync.h"
+
+using std::string;
+
+// Runtime settings, filled in from the command line.
+struct Options {
+  Options()
+    : hair_seed(1),
+      osc_port(0),
+      metrics_port(0),
+      export_width(1280),
+      export_height(720),
+      export_fps(30),
+      effect("effects/default.fx"),
+      glow_cache("cache"),
+      led_rate(400),
+      idle(true),
+      frame_budget_ms(16.7f),
+      setlist_advance_ms(20.0f) {
+    for (int i = 0; i < kSyncLayers; ++i) {
+      layer_channel[i] = 0;
+    }
+  }
+
+  AudioConfig audio;
+
+  // Which input channel each layer listens to: 0 for the mix, or from 1 to
+  // audio.channels; see AudioProcessor::channel().
+  int layer_channel[kSyncLayers];
+
+  // Load the hairs from this layout file instead of generating them.
+  string hair_layout;
+
+  // Write the hairs to this layout file once they are generated.
+  string save_hair_layout;
+
+  // Seed for hair generation; the same seed gives the same layout.
+  unsigned int hair_seed;
+
+  // Where to listen for OSC control messages: a UDP port (0 for none) and
+  // a Unix datagram socket (empty for none).
+  int osc_port;
+  string control_socket;
+
+  // Where to serve metrics over HTTP: a TCP port on 127.0.0.1 (0 for none)
+  // and a Unix socket (empty for none). See metrics.h.
+  int metrics_port;
+  string metrics_socket;
+
+  // Render a video of export_audio, offscreen and as fast as possible,
+  // instead of opening the viewer. export_timeline optionally schedules
+  // control commands; see timeline.h.
+  string export_video;
+  string export_audio;
+  string export_timeline;
+  int export_width;
+  int export_height;
+  int export_fps;
+
+  // The effect program for the expression mode; see expression.h.
+  string effect;
+
+  // Where to keep the baked glow of the hairs on the jacket (empty to bake
+  // it on every launch); see glow_bake.h.
+  string glow_cache;
+
+  // Current limits for the LEDs.
+  PowerConfig power;
+
+  // Where to send the LED colors (empty for nowhere), and how many times a
+  // second; see led_output.h.
+  string led_output;
+  int led_rate;
+
+  // Whether the viewer may slow down while the music is silent and nothing
+  // moves; see idle_scheduler.h.
+  bool idle;
+
+  // How long the viewer may take to draw a frame before it lowers the
+  // preview's quality, or 0 to always draw at the best; see
+  // quality_governor.h.
+  float frame_budget_ms;
+
+  // The show's tracks, analyzed beforehand by analyze_setlist, and how long
+  // before the music is heard their events are shown; see setlist.h.
+  string setlist;
+  float setlist_advance_ms;
+
+  // Whether this rig leads others, follows one, or neither; see rig_sync.h.
+  SyncConfig sync;
+};
+
+// Parses the command line into options. Prints usage and returns false if
+// the program should exit instead of running.
+bool ParseOptions(int argc, char **argv, Options *options);
+
+#endif // __OPTIONS_H__
@@ -0,0 +1,189 @@
+#include "power_limiter.h"
+
+#include <math.h>
+#include <stdio.h>
+
+#include <algorithm>
+
+// Disco Wookie includes
+#include "hair.h"
+#include "trace.h"
+
+// How long the limiter takes to let a dimmed zone brighten again, in
+// seconds. Short enough to follow the music, long enough not to flicker.
+static const float kReleaseSeconds = 0.3f;
+
+bool PowerConfig::Validate() const {
+  if (zone_size <= 0) {
+    printf("Error: zone size %d must be positive.\n", zone_size);
+    return false;
+  }
+  if (total_budget_ma < 0.0f || zone_budget_ma < 0.0f) {
+    printf("Error: power budgets must not be negative.\n");
+    return false;
+  }
+  if (zone_budget_ma > 0.0f && zone_budget_ma < zone_size * idle_milliamps) {
+    printf("Error: a zone budget of %.0f mA is below the %.0f mA a zone "
+           "draws when dark.\n", zone_budget_ma, zone_size * idle_milliamps);
+    return false;
+  }
+  return true;
+}
+
+PowerLimiter::PowerLimiter(const PowerConfig &config)
+  : config_(config),
+    stale_(true),
+    limiting_(false),
+    last_time_(-1),
+    current_ma_(0),
+    peak_ma_(0),
+    energy_wh_(0) {}
+
+void PowerLimiter::Reposition(const Fur &fur) {
+  const vector<Hair> &hairs = fur.hairs;
+  runs_.clear();
+  int num_zones = 0;
+  for (int i = 0; i < (int)hairs.size(); ++i) {
+    int zone = std::max(hairs[i].led_channel, 0) / config_.zone_size;
+    num_zones = std::max(num_zones, zone + 1);
+    if (!runs_.empty() && runs_.back().zone == zone) {
+      runs_.back().end = i + 1;
+    } else {
+      Run run = { i, i + 1, zone };
+      runs_.push_back(run);
+    }
+  }
+
+  zone_hairs_.assign(num_zones, 0);
+  for (unsigned int r = 0; r < runs_.size(); ++r) {
+    zone_hairs_[runs_[r].zone] += runs_[r].end - runs_[r].begin;
+  }
+  zone_scale_.assign(num_zones, 1.0f);
+  load_.resize(num_zones);
+  active_.resize(num_zones);
+  target_.resize(num_zones);
+  run_load_.assign(runs_.size(), 0);
+  stale_ = true;
+  limiting_ = false;
+}
+
+void PowerLimiter::Account(double time, float current) {
+  double elapsed = 0.0;
+  if (last_time_ >= 0) {
+    elapsed = std::max(time - last_time_, 0.0);
+  }
+  last_time_ = time;
+
+  current_ma_ = current;
+  peak_ma_ = std::max(peak_ma_, current);
+  energy_wh_ += config_.volts * current / 1000.0 * elapsed / 3600.0;
+  TRACE_COUNTER("led_current_ma", current);
+}
+
+void PowerLimiter::Apply(Fur *fur, double time) {
+  TRACE_SCOPE("PowerLimiter::Apply");
+  const vector<Rgba> &colors = fur->colors;
+  const int num_zones = zone_hairs_.size();
+  if (runs_.empty() || runs_.back().end > (int)colors.size()) {
+    return;
+  }
+  if (fur->limit.size() != colors.size()) {
+    fur->limit.assign(colors.size(), 256);
+  }
+
+  // Nothing changed and nothing is dimmed: the current is what it was.
+  const DirtyRanges &dirty = fur->dirty;
+  if (dirty.empty() && !stale_ && !limiting_) {
+    Account(time, current_ma_);
+    return;
+  }
+
+  // Sum the channels in each run that changed, then in each zone. Sums of
+  // bytes cannot overflow 32 bits for any plausible number of hairs.
+  vector<unsigned int> &load = load_;
+  std::fill(load.begin(), load.end(), 0);
+  int d = 0;
+  for (unsigned int r = 0; r < runs_.size(); ++r) {
+    const Run &run = runs_[r];
+    while (d < dirty.size() && dirty[d].end <= run.begin) {
+      ++d;
+    }
+    if (stale_ || (d < dirty.size() && dirty[d].begin < run.end)) {
+      const Rgba *color = &colors[run.begin];
+      const int length = run.end - run.begin;
+      unsigned int sum = 0;
+      for (int i = 0; i < length; ++i) {
+        sum += color[i].r + color[i].g + color[i].b;
+      }
+      run_load_[r] = sum;
+    }
+    load[run.zone] += run_load_[r];
+  }
+  stale_ = false;
+
+  // The current each zone asks for, over and above its dark LEDs, and the
+  // scale that would keep it within the zone budget. The colors are not
+  // dimmed by the brightness yet; the LEDs will be.
+  const float ma_per_unit =
+      config_.milliamps_per_channel / 255.0f * fur->gain / 256.0f;
+  vector<float> &active = active_;
+  vector<float> &target = target_;
+  std::fill(target.begin(), target.end(), 1.0f);
+  float idle_total = 0.0f;
+  float active_total = 0.0f;
+  for (int z = 0; z < num_zones; ++z) {
+    float idle = zone_hairs_[z] * config_.idle_milliamps;
+    active[z] = load[z] * ma_per_unit;
+    if (config_.zone_budget_ma > 0.0f && active[z] > 0.0f) {
+      float available = std::max(config_.zone_budget_ma - idle, 0.0f);
+      target[z] = std::min(available / active[z], 1.0f);
+    }
+    idle_total += idle;
+    active_total += active[z] * target[z];
+  }
+
+  // Then the whole jacket, after the zones have had their say.
+  if (config_.total_budget_ma > 0.0f && active_total > 0.0f) {
+    float available = std::max(config_.total_budget_ma - idle_total, 0.0f);
+    float global = std::min(available / active_total, 1.0f);
+    for (int z = 0; z < num_zones; ++z) {
+      target[z] *= global;
+    }
+  }
+
+  // Dim straight away; brighten gradually, until less than a step short of
+  // full brightness.
+  const double elapsed = (last_time_ >= 0) ? std::max(time - last_time_, 0.0)
+                                            : 0.0;
+  const float release = 1.0f - expf(-elapsed / kReleaseSeconds);
+  float current = idle_total;
+  for (int z = 0; z < num_zones; ++z) {
+    float &scale = zone_scale_[z];
+    if (target[z] < scale) {
+      scale = target[z];
+    } else {
+      scale += release * (target[z] - scale);
+      if (target[z] >= 1.0f && scale > 255.0f / 256.0f) {
+        scale = 1.0f;
+      }
+    }
+    current += active[z] * scale;
+  }
+  Account(time, current);
+
+  // Rounding the scale down keeps the dimmed colors within budget. Every
+  // hair in a run has the same limit, so its first tells whether the run
+  // needs rewriting.
+  limiting_ = false;
+  unsigned short *limit = &fur->limit[0];
+  for (unsigned int r = 0; r < runs_.size(); ++r) {
+    const Run &run = runs_[r];
+    const int scale = std::min((int)(256.0f * zone_scale_[run.zone]), 256);
+    limiting_ = limiting_ || scale < 256;
+    if (limit[run.begin] == scale) {
+      continue;
+    }
+    std::fill(limit + run.begin, limit + run.end, scale);
+    fur->dirty.Add(run.begin, run.end);
+  }
+}
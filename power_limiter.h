@@ -0,0 +1,120 @@
+#ifndef __POWER_LIMITER_H__
+#define __POWER_LIMITER_H__
+
+#include <vector>
+
+// Disco Wookie includes
+#include "color.h"
+
+using std::vector;
+
+class Fur;
+
+// What the LEDs draw, and what the supply can give them. The defaults are
+// for WS2812-style LEDs on 5 V, with no limits.
+struct PowerConfig {
+  PowerConfig()
+    : total_budget_ma(0.0f),
+      zone_budget_ma(0.0f),
+      zone_size(300),
+      milliamps_per_channel(20.0f),
+      idle_milliamps(1.0f),
+      volts(5.0f) {}
+
+  // Returns false, and prints why, if the limits cannot be met even with
+  // every LED dark.
+  bool Validate() const;
+
+  // The most the whole jacket, and each power-injection zone, may draw.
+  // 0 means no limit.
+  float total_budget_ma;
+  float zone_budget_ma;
+
+  // Consecutive LED channels fed by each injection point.
+  int zone_size;
+
+  // Drawn by one channel of one LED at full brightness, and by each LED
+  // when it is dark.
+  float milliamps_per_channel;
+  float idle_milliamps;
+
+  float volts;
+};
+
+// PowerLimiter estimates the current the hairs' colors will draw and dims
+// them, just enough, to keep every zone and the whole jacket within budget.
+// Dimming is immediate, so no frame ever asks for too much; brightening
+// back afterwards is gradual, so the limit does not pump on every beat.
+//
+// Hairs are processed in runs of consecutive hairs in the same zone, so the
+// estimate is a loop over contiguous colors, which the compiler vectorizes.
+// With the generated layouts, where hairs are in LED channel order, there is
+// one run per zone. Each run's load is kept from frame to frame and only
+// summed again when its hairs change, and while no zone is dimmed, a frame
+// in which no hair changed costs nothing.
+//
+// The colors themselves are left alone: each zone's scale goes in
+// Fur::limit, which the outputs apply as they convert the hairs. A run is
+// only rewritten, and marked dirty, when its zone's scale changes by a
+// step, so a zone held at the same level costs no more than an unlimited
+// one.
+class PowerLimiter {
+ public:
+  explicit PowerLimiter(const PowerConfig &config);
+
+  // Assigns the hairs to zones by their LED channels. Call whenever the hairs
+  // change.
+  void Reposition(const Fur &fur);
+
+  // Sets fur->limit to fit the budget, and accounts for the energy used
+  // since the last call. Hairs whose limit changes are marked dirty.
+  void Apply(Fur *fur, double time);
+
+  // The current drawn with the last colors, after limiting, in mA.
+  float current_ma() const { return current_ma_; }
+
+  // The highest current_ma() so far.
+  float peak_ma() const { return peak_ma_; }
+
+  // The energy the LEDs have used so far, in watt hours.
+  double energy_wh() const { return energy_wh_; }
+
+ private:
+  struct Run {
+    int begin;
+    int end;
+    int zone;
+  };
+
+  // Adds the energy used at the given current since the last call.
+  void Account(double time, float current);
+
+  PowerConfig config_;
+  vector<Run> runs_;
+
+  // The sum of the r, g and b bytes in each run, and whether any of them
+  // are out of date, as after Reposition().
+  vector<unsigned int> run_load_;
+  bool stale_;
+
+  // Whether any zone was dimmed by the last Apply().
+  bool limiting_;
+
+  // Per zone: how many hairs it has, and the scale applied to its colors,
+  // from 0 to 1.
+  vector<int> zone_hairs_;
+  vector<float> zone_scale_;
+
+  // Scratch space for Apply(), per zone: the sum of its channels, the
+  // current it asks for and the scale that would fit it in the budget.
+  vector<unsigned int> load_;
+  vector<float> active_;
+  vector<float> target_;
+
+  double last_time_;
+  float current_ma_;
+  float peak_ma_;
+  double energy_wh_;
+};
+
+#endif // __POWER_LIMITER_H__
@@ -0,0 +1,129 @@
+#include "preview_target.h"
+
+#include <stdio.h>
+
+#include <algorithm>
+
+// Disco Wookie includes
+#include "trace.h"
+
+PreviewTarget::PreviewTarget()
+  : window_width_(0),
+    window_height_(0),
+    width_(0),
+    height_(0),
+    samples_(0),
+    offscreen_(false),
+    unavailable_(false),
+    framebuffer_(0),
+    color_buffer_(0),
+    depth_buffer_(0),
+    resolve_framebuffer_(0),
+    resolve_color_buffer_(0) {}
+
+void PreviewTarget::Bind(int width, int height, float scale, int samples) {
+  window_width_ = width;
+  window_height_ = height;
+
+  GLint max_samples = 0;
+  glGetIntegerv(GL_MAX_SAMPLES, &max_samples);
+  samples = std::min(samples, (int)max_samples);
+  const int scaled_width = std::max((int)(width * scale + 0.5f), 1);
+  const int scaled_height = std::max((int)(height * scale + 0.5f), 1);
+
+  offscreen_ = !unavailable_ && (scaled_width != width ||
+                                 scaled_height != height || samples > 0);
+  if (offscreen_ && (scaled_width != width_ || scaled_height != height_ ||
+                     samples != samples_)) {
+    offscreen_ = Resize(scaled_width, scaled_height, samples);
+  }
+  if (!offscreen_) {
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glViewport(0, 0, width, height);
+    return;
+  }
+  glBindFramebuffer(GL_FRAMEBUFFER, framebuffer_);
+  glViewport(0, 0, width_, height_);
+}
+
+void PreviewTarget::Present() {
+  TRACE_SCOPE("PreviewTarget::Present");
+  if (!offscreen_) {
+    return;
+  }
+
+  // Multisampled framebuffers can only be copied at their own size, so
+  // they are resolved first, then stretched.
+  GLuint source = framebuffer_;
+  if (samples_ > 0) {
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer_);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, resolve_framebuffer_);
+    glBlitFramebuffer(0, 0, width_, height_, 0, 0, width_, height_,
+                      GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    source = resolve_framebuffer_;
+  }
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, source);
+  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+  glBlitFramebuffer(0, 0, width_, height_, 0, 0, window_width_,
+                    window_height_, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  glViewport(0, 0, window_width_, window_height_);
+}
+
+bool PreviewTarget::Resize(int width, int height, int samples) {
+  Release();
+  width_ = width;
+  height_ = height;
+  samples_ = samples;
+
+  glGenRenderbuffers(1, &color_buffer_);
+  glBindRenderbuffer(GL_RENDERBUFFER, color_buffer_);
+  glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, GL_RGBA8, width,
+                                   height);
+  glGenRenderbuffers(1, &depth_buffer_);
+  glBindRenderbuffer(GL_RENDERBUFFER, depth_buffer_);
+  glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples,
+                                   GL_DEPTH_COMPONENT24, width, height);
+  glGenFramebuffers(1, &framebuffer_);
+  glBindFramebuffer(GL_FRAMEBUFFER, framebuffer_);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                            GL_RENDERBUFFER, color_buffer_);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+                            GL_RENDERBUFFER, depth_buffer_);
+  bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) ==
+                  GL_FRAMEBUFFER_COMPLETE;
+
+  if (samples > 0) {
+    glGenRenderbuffers(1, &resolve_color_buffer_);
+    glBindRenderbuffer(GL_RENDERBUFFER, resolve_color_buffer_);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glGenFramebuffers(1, &resolve_framebuffer_);
+    glBindFramebuffer(GL_FRAMEBUFFER, resolve_framebuffer_);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                              GL_RENDERBUFFER, resolve_color_buffer_);
+    complete = complete && glCheckFramebufferStatus(GL_FRAMEBUFFER) ==
+                               GL_FRAMEBUFFER_COMPLETE;
+  }
+
+  glBindRenderbuffer(GL_RENDERBUFFER, 0);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  if (!complete) {
+    printf("Unable to create a %dx%d preview framebuffer with %d samples\n",
+           width, height, samples);
+    Release();
+    unavailable_ = true;
+    return false;
+  }
+  return true;
+}
+
+void PreviewTarget::Release() {
+  GLuint framebuffers[] = { framebuffer_, resolve_framebuffer_ };
+  GLuint renderbuffers[] = { color_buffer_, depth_buffer_,
+                             resolve_color_buffer_ };
+  glDeleteFramebuffers(2, framebuffers);
+  glDeleteRenderbuffers(3, renderbuffers);
+  framebuffer_ = color_buffer_ = depth_buffer_ = 0;
+  resolve_framebuffer_ = resolve_color_buffer_ = 0;
+  width_ = height_ = samples_ = 0;
+}
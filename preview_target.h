@@ -0,0 +1,56 @@
+#ifndef __PREVIEW_TARGET_H__
+#define __PREVIEW_TARGET_H__
+
+// GLWFW includes
+#include <GLFW/glfw3.h>
+
+// PreviewTarget lets the viewer draw at a lower resolution than the window,
+// and with any amount of antialiasing, regardless of how the window was
+// created: the scene goes into an offscreen framebuffer of the chosen size
+// and samples, which is resolved and stretched over the window to present
+// it. At full size without antialiasing, the scene goes straight into the
+// window instead, at no extra cost.
+class PreviewTarget {
+ public:
+  // The framebuffers are left to go with the GL context, as in FurRenderer.
+  PreviewTarget();
+
+  // Directs rendering at scale times the window's width x height, with the
+  // given samples per pixel (0 for none), and sets the viewport to match.
+  // Falls back to the window for good if a framebuffer cannot be made.
+  void Bind(int width, int height, float scale, int samples);
+
+  // Copies what was rendered since Bind() to the window, and leaves the
+  // window bound.
+  void Present();
+
+ private:
+  // Makes the framebuffers width x height with samples per pixel. Returns
+  // false, and releases them, if that fails.
+  bool Resize(int width, int height, int samples);
+  void Release();
+
+  int window_width_;
+  int window_height_;
+
+  // The offscreen framebuffers' size and samples, and whether the frame
+  // being rendered is in them.
+  int width_;
+  int height_;
+  int samples_;
+  bool offscreen_;
+
+  // Set once a framebuffer could not be made; the window is used from then
+  // on.
+  bool unavailable_;
+
+  // Rendering goes into framebuffer_. With samples, it is resolved into
+  // resolve_framebuffer_ before being stretched over the window.
+  GLuint framebuffer_;
+  GLuint color_buffer_;
+  GLuint depth_buffer_;
+  GLuint resolve_framebuffer_;
+  GLuint resolve_color_buffer_;
+};
+
+#endif // __PREVIEW_TARGET_H__
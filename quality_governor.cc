@@ -0,0 +1,183 @@
+#include "quality_governor.h"
+
+#include <algorithm>
+
+// Disco Wookie includes
+#include "metrics.h"
+
+// From the best quality to the cheapest. Antialiasing is the first to go,
+// since it costs the most for what it gives on a preview; lowering the
+// preview's frame rate is the last resort, since the jacket is then seen
+// moving in steps, even though the LEDs are not.
+static const QualitySettings kLadder[] = {
+  // scale, samples, mesh LOD, hair stride, preview divisor
+  { 1.0f, 4, 0, 1, 1 },
+  { 1.0f, 2, 0, 1, 1 },
+  { 1.0f, 0, 0, 1, 1 },
+  { 0.75f, 0, 0, 1, 1 },
+  { 0.75f, 0, 1, 2, 1 },
+  { 0.5f, 0, 1, 2, 1 },
+  { 0.5f, 0, 2, 4, 1 },
+  { 0.5f, 0, 2, 4, 2 },
+  { 0.5f, 0, 2, 4, 3 },
+};
+static const int kNumLevels = sizeof(kLadder) / sizeof(kLadder[0]);
+
+// Frames whose mean cost over the budget steps down, and frames whose mean
+// under kUpgradeFraction of it steps up, at first and at most.
+static const int kDowngradeFrames = 20;
+static const int kUpgradeFrames = 120;
+static const int kMaxUpgradeFrames = 8 * kUpgradeFrames;
+static const double kUpgradeFraction = 0.6;
+
+// Frames ignored after each change.
+static const int kSettleFrames = 5;
+
+static MetricGauge level_gauge(
+    "hallucination_quality_level",
+    "Rung of the preview quality ladder in use; 0 is the best.");
+static MetricGauge cost_gauge(
+    "hallucination_frame_cost_seconds",
+    "Larger of the CPU and GPU time of the last frame, before the swap.");
+
+QualityGovernor::QualityGovernor(double budget)
+  : budget_(budget),
+    level_(0),
+    initialized_(false),
+    gpu_timing_(false),
+    queries_started_(0),
+    queries_read_(0),
+    query_active_(false),
+    gpu_seconds_(0),
+    settle_(kSettleFrames),
+    short_frames_(0),
+    short_sum_(0),
+    frames_(0),
+    cost_sum_(0),
+    upgrade_frames_(kUpgradeFrames),
+    frames_since_upgrade_(kMaxUpgradeFrames) {
+  for (int i = 0; i < kNumQueries; ++i) {
+    queries_[i] = 0;
+  }
+}
+
+QualityGovernor::~QualityGovernor() {
+  // The queries go with the GL context, which is gone by now.
+}
+
+const QualitySettings &QualityGovernor::settings() const {
+  return kLadder[level_];
+}
+
+void QualityGovernor::BeginFrame() {
+  frame_start_ = std::chrono::steady_clock::now();
+  if (budget_ <= 0) {
+    return;
+  }
+
+  if (!initialized_) {
+    initialized_ = true;
+    gpu_timing_ = glfwExtensionSupported("GL_ARB_timer_query") ||
+                  glfwExtensionSupported("GL_EXT_timer_query");
+    if (gpu_timing_) {
+      glGenQueries(kNumQueries, queries_);
+    }
+    level_gauge.Set(level_);
+  }
+
+  if (!gpu_timing_) {
+    return;
+  }
+  double seconds;
+  while ((seconds = CollectQuery()) >= 0) {
+    gpu_seconds_ = seconds;
+  }
+  // All the queries are still in flight on a GPU several frames behind;
+  // this frame goes untimed rather than waiting.
+  if (queries_started_ - queries_read_ < (unsigned int)kNumQueries) {
+    glBeginQuery(GL_TIME_ELAPSED, queries_[queries_started_ % kNumQueries]);
+    query_active_ = true;
+  }
+}
+
+void QualityGovernor::EndFrame(bool counted) {
+  if (budget_ <= 0) {
+    return;
+  }
+  if (query_active_) {
+    glEndQuery(GL_TIME_ELAPSED);
+    query_active_ = false;
+    ++queries_started_;
+  }
+
+  const double cpu_seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - frame_start_).count();
+  const double cost = std::max(cpu_seconds, gpu_seconds_);
+  cost_gauge.Set(cost);
+  if (!counted) {
+    return;
+  }
+  if (settle_ > 0) {
+    --settle_;
+    return;
+  }
+
+  ++short_frames_;
+  short_sum_ += cost;
+  ++frames_;
+  cost_sum_ += cost;
+  ++frames_since_upgrade_;
+
+  if (short_frames_ == kDowngradeFrames) {
+    if (short_sum_ / short_frames_ > budget_ && level_ + 1 < kNumLevels) {
+      // Going back down soon after going up means the level above is just
+      // out of reach; wait longer before trying it again.
+      if (frames_since_upgrade_ < 2 * upgrade_frames_) {
+        upgrade_frames_ = std::min(2 * upgrade_frames_, kMaxUpgradeFrames);
+      }
+      SetLevel(level_ + 1);
+      return;
+    }
+    short_frames_ = 0;
+    short_sum_ = 0;
+  }
+
+  if (frames_ >= upgrade_frames_) {
+    if (cost_sum_ / frames_ < kUpgradeFraction * budget_ && level_ > 0) {
+      frames_since_upgrade_ = 0;
+      SetLevel(level_ - 1);
+      return;
+    }
+    frames_ = 0;
+    cost_sum_ = 0;
+  }
+}
+
+double QualityGovernor::CollectQuery() {
+  if (queries_read_ == queries_started_) {
+    return -1;
+  }
+  const GLuint query = queries_[queries_read_ % kNumQueries];
+  GLint available = 0;
+  glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+  if (!available) {
+    return -1;
+  }
+  GLuint64 nanoseconds = 0;
+  glGetQueryObjectui64v(query, GL_QUERY_RESULT, &nanoseconds);
+  ++queries_read_;
+  return nanoseconds * 1e-9;
+}
+
+void QualityGovernor::SetLevel(int level) {
+  level_ = level;
+  level_gauge.Set(level_);
+  settle_ = kSettleFrames;
+  short_frames_ = 0;
+  short_sum_ = 0;
+  frames_ = 0;
+  cost_sum_ = 0;
+
+  // The GPU's time for frames at the old level is stale now.
+  gpu_seconds_ = 0;
+}
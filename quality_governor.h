@@ -0,0 +1,110 @@
+#ifndef __QUALITY_GOVERNOR_H__
+#define __QUALITY_GOVERNOR_H__
+
+#include <chrono>
+
+// GLWFW includes
+#include <GLFW/glfw3.h>
+
+// How the preview is drawn. None of it touches the hairs' colors or what is
+// sent to the LEDs, which are worked out in full every frame.
+struct QualitySettings {
+  // The fraction of the window's width and height rendered.
+  float render_scale;
+
+  // Samples per pixel for antialiasing, or 0 for none.
+  int samples;
+
+  // Which of the models' levels of detail to draw; 0 is the full mesh.
+  int mesh_lod;
+
+  // Every how many hairs one is drawn.
+  int hair_stride;
+
+  // Every how many frames the preview is drawn.
+  int preview_divisor;
+};
+
+// QualityGovernor keeps the preview within a frame-time budget on whatever
+// machine it runs on, from a workstation to a venue laptop with software GL,
+// by trading away what costs the most and is missed the least.
+//
+// Each frame is timed twice: on the CPU's clock, up to the swap, and on the
+// GPU's with a timer query, which is read back a few frames later so that
+// it never waits. The cost of a frame is the larger of the two. The
+// governor walks a ladder of settings: first antialiasing goes, then
+// resolution, then mesh detail and hairs, and the preview's frame rate last.
+//
+// Stepping down is quick: a fifth of a second of frames over the budget
+// does it. Stepping up waits two seconds for frames at no more than 60% of
+// it, and if the frames then go over the budget again soon after, the
+// next step up waits twice as long. The settings therefore settle instead
+// of flickering between two levels.
+class QualityGovernor {
+ public:
+  // budget is the time a frame may take, in seconds; 0 leaves the quality
+  // at its best.
+  explicit QualityGovernor(double budget);
+  ~QualityGovernor();
+
+  // Marks the start of a frame, and of its GPU timing. Needs a current GL
+  // context.
+  void BeginFrame();
+
+  // Marks the end of the frame's work, before the swap. counted is false
+  // for frames that should not steer the quality, such as those spent
+  // uploading models while loading.
+  void EndFrame(bool counted);
+
+  const QualitySettings &settings() const;
+
+  // The rung of the ladder in use; 0 is the best quality.
+  int level() const { return level_; }
+
+  // The mean cost of the frames counted since the last change, in seconds.
+  double mean_cost() const { return frames_ > 0 ? cost_sum_ / frames_ : 0; }
+
+ private:
+  static const int kNumQueries = 4;
+
+  // Reads back the oldest timer query if it has finished. Returns its time,
+  // in seconds, or -1.
+  double CollectQuery();
+
+  // Moves to another rung of the ladder.
+  void SetLevel(int level);
+
+  double budget_;
+  int level_;
+
+  // Whether GL_TIME_ELAPSED queries work here, found out in the first
+  // BeginFrame(), once there is a context; without them, only the CPU's time
+  // counts.
+  bool initialized_;
+  bool gpu_timing_;
+  GLuint queries_[kNumQueries];
+  unsigned int queries_started_;
+  unsigned int queries_read_;
+  bool query_active_;
+  double gpu_seconds_;
+
+  std::chrono::steady_clock::time_point frame_start_;
+
+  // Frames left to ignore after a change of level, while caches and
+  // framebuffers catch up.
+  int settle_;
+
+  // The cost of the frames counted towards stepping down, and towards
+  // stepping up, since the last change.
+  int short_frames_;
+  double short_sum_;
+  int frames_;
+  double cost_sum_;
+
+  // Frames under the budget it takes to step up, doubled whenever a step
+  // up is soon undone, and the frames counted since the last step up.
+  int upgrade_frames_;
+  int frames_since_upgrade_;
+};
+
+#endif // __QUALITY_GOVERNOR_H__
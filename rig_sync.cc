@@ -0,0 +1,738 @@
+#include "rig_sync.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+
+// Disco Wookie includes
+#include "metrics.h"
+#include "trace.h"
+
+// "HSYN", then a version number, so that other traffic on the group, or a
+// rig running a different version, is ignored.
+static const char kMagic[4] = { 'H', 'S', 'Y', 'N' };
+static const int kVersion = 2;
+
+enum PacketType { STATE = 1, PING = 2, PONG = 3 };
+
+// Magic, version, type, two bytes of padding, session and sequence number.
+static const int kHeaderSize = 16;
+
+// Larger than any packet we send.
+static const int kMaxPacketSize = 512;
+
+// The leader sends state this often even when nothing is detected, and
+// followers ping it this often.
+static const double kStateInterval = 0.01;
+static const double kPingInterval = 0.25;
+
+// The round trips a follower picks its clock offset from.
+static const int kClockSamples = 8;
+
+// A follower that hears nothing from the leader for this long treats the
+// music as silent until it comes back.
+static const double kLeaderTimeout = 1.0;
+
+// Events that arrive later than this after they were due are too stale to
+// show; ones later than kLateEvent are shown at once, but counted.
+static const double kStaleEvent = 0.1;
+static const double kLateEvent = 0.001;
+
+// More events than this waiting at once means the clock is far off.
+static const unsigned int kMaxScheduled = 64;
+
+static MetricCounter packets_sent("hallucination_sync_packets_sent_total",
+                                  "Synchronization packets sent.");
+static MetricCounter packets_received(
+    "hallucination_sync_packets_received_total",
+    "Synchronization packets received from other rigs.");
+static MetricCounter events_late(
+    "hallucination_sync_events_late_total",
+    "Onsets and beats that arrived too late to be shown on time.");
+static MetricGauge clock_offset_gauge(
+    "hallucination_sync_clock_offset_seconds",
+    "The leader's clock minus this rig's.");
+static MetricGauge round_trip_gauge(
+    "hallucination_sync_round_trip_seconds",
+    "The round trip to the leader the clock offset was measured over.");
+
+// Seconds on the steady clock, which every rig measures events by.
+static double Now() {
+  return std::chrono::duration<double>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+namespace {
+
+// Writes a packet's fields in network byte order.
+class PacketWriter {
+ public:
+  explicit PacketWriter(char *data) : data_(data), size_(0) {}
+
+  void U32(uint32_t value) {
+    value = htonl(value);
+    memcpy(data_ + size_, &value, sizeof(value));
+    size_ += sizeof(value);
+  }
+  void F32(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    U32(bits);
+  }
+  void F64(double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    U32(bits >> 32);
+    U32(bits & 0xffffffff);
+  }
+
+  int size() const { return size_; }
+
+ private:
+  char *data_;
+  int size_;
+};
+
+// Reads what PacketWriter wrote. Reading past the end gives zeros, and
+// clears ok().
+class PacketReader {
+ public:
+  PacketReader(const char *data, int size)
+    : data_(data), size_(size), position_(0) {}
+
+  uint32_t U32() {
+    if (position_ + 4 > size_) {
+      position_ = size_ + 1;
+      return 0;
+    }
+    uint32_t value;
+    memcpy(&value, data_ + position_, sizeof(value));
+    position_ += sizeof(value);
+    return ntohl(value);
+  }
+  float F32() {
+    uint32_t bits = U32();
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+  }
+  double F64() {
+    uint64_t high = U32();
+    uint64_t bits = (high << 32) | U32();
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+  }
+
+  bool ok() const { return position_ <= size_; }
+
+ private:
+  const char *data_;
+  int size_;
+  int position_;
+};
+
+}  // namespace
+
+static void WriteHeader(PacketType type, unsigned int session,
+                        unsigned int sequence, char *packet,
+                        PacketWriter *writer) {
+  memcpy(packet, kMagic, sizeof(kMagic));
+  packet[4] = kVersion;
+  packet[5] = type;
+  packet[6] = packet[7] = 0;
+  *writer = PacketWriter(packet + 8);
+  writer->U32(session);
+  writer->U32(sequence);
+}
+
+// Checks the header, and returns the packet's type, or 0 if it is not ours.
+static int ReadHeader(const char *packet, int size, unsigned int *session,
+                      unsigned int *sequence) {
+  if (size < kHeaderSize || memcmp(packet, kMagic, sizeof(kMagic)) != 0 ||
+      packet[4] != kVersion) {
+    return 0;
+  }
+  PacketReader reader(packet + 8, 8);
+  *session = reader.U32();
+  *sequence = reader.U32();
+  return packet[5];
+}
+
+bool SyncConfig::Validate() const {
+  if (role == OFF) {
+    return true;
+  }
+  struct in_addr address;
+  if (inet_pton(AF_INET, group.c_str(), &address) != 1 ||
+      !IN_MULTICAST(ntohl(address.s_addr))) {
+    printf("--sync-group must be an IPv4 multicast address, not %s\n",
+           group.c_str());
+    return false;
+  }
+  if (port <= 0 || port > 65535) {
+    printf("--sync-port must be between 1 and 65535\n");
+    return false;
+  }
+  if (!interface.empty() &&
+      inet_pton(AF_INET, interface.c_str(), &address) != 1) {
+    printf("--sync-interface must be an IPv4 address, not %s\n",
+           interface.c_str());
+    return false;
+  }
+  if (delay_ms < kSyncLeadMs || delay_ms > 1000.0f) {
+    printf("--sync-delay must be between %.0f and 1000 ms\n", kSyncLeadMs);
+    return false;
+  }
+  return true;
+}
+
+RigSync::RigSync()
+  : audio_(NULL),
+    state_fd_(-1),
+    clock_fd_(-1),
+    session_(0),
+    sequence_(0),
+    next_send_(0),
+    num_beats_(0),
+    num_onsets_(0),
+    last_beat_due_(0),
+    last_onset_due_(0),
+    last_onset_strength_(0),
+    have_leader_(false),
+    last_state_time_(0),
+    next_clock_sample_(0),
+    clock_offset_(0),
+    round_trip_(0),
+    reported_due_(0),
+    parameters_fresh_(false) {
+  notify_pipe_[0] = notify_pipe_[1] = -1;
+  wake_pipe_[0] = wake_pipe_[1] = -1;
+  memset(&group_address_, 0, sizeof(group_address_));
+  memset(&leader_address_, 0, sizeof(leader_address_));
+  memset(&last_beat_, 0, sizeof(last_beat_));
+}
+
+RigSync::~RigSync() {
+  Stop();
+}
+
+int RigSync::Start(const SyncConfig &config, AudioProcessor *audio) {
+  if (config.role == SyncConfig::OFF) {
+    return 0;
+  }
+  config_ = config;
+  audio_ = audio;
+  const bool leader = config.role == SyncConfig::LEADER;
+
+  struct in_addr interface;
+  interface.s_addr = htonl(INADDR_ANY);
+  if (!config.interface.empty()) {
+    inet_pton(AF_INET, config.interface.c_str(), &interface);
+  }
+  group_address_.sin_family = AF_INET;
+  group_address_.sin_port = htons(config.port);
+  inet_pton(AF_INET, config.group.c_str(), &group_address_.sin_addr);
+
+  state_fd_ = socket(AF_INET, SOCK_DGRAM, 0);
+  if (state_fd_ < 0) {
+    printf("Unable to create the sync socket: %s\n", strerror(errno));
+    return 1;
+  }
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (leader) {
+    // Only this network: rigs on stage share one. Rigs on this machine
+    // hear it too.
+    unsigned char ttl = 1, loop = 1;
+    setsockopt(state_fd_, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+    setsockopt(state_fd_, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+    if (!config.interface.empty()) {
+      setsockopt(state_fd_, IPPROTO_IP, IP_MULTICAST_IF, &interface,
+                 sizeof(interface));
+    }
+  } else {
+    // Every follower on this machine binds the same port.
+    int reuse = 1;
+    setsockopt(state_fd_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    address.sin_port = htons(config.port);
+  }
+  if (bind(state_fd_, (struct sockaddr *)&address, sizeof(address)) != 0) {
+    printf("Unable to bind the sync socket: %s\n", strerror(errno));
+    Stop();
+    return 1;
+  }
+  if (!leader) {
+    struct ip_mreq membership;
+    membership.imr_multiaddr = group_address_.sin_addr;
+    membership.imr_interface = interface;
+    if (setsockopt(state_fd_, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership,
+                   sizeof(membership)) != 0) {
+      printf("Unable to join %s: %s\n", config.group.c_str(),
+             strerror(errno));
+      Stop();
+      return 1;
+    }
+
+    clock_fd_ = socket(AF_INET, SOCK_DGRAM, 0);
+    if (clock_fd_ < 0) {
+      printf("Unable to create the clock socket: %s\n", strerror(errno));
+      Stop();
+      return 1;
+    }
+  }
+
+  if (pipe(wake_pipe_) != 0 || (leader && pipe(notify_pipe_) != 0)) {
+    printf("Unable to create the sync pipes: %s\n", strerror(errno));
+    Stop();
+    return 1;
+  }
+  for (int i = 0; leader && i < 2; ++i) {
+    fcntl(notify_pipe_[i], F_SETFL, O_NONBLOCK);
+  }
+
+  // A new session tells followers to forget what they counted from an
+  // earlier leader.
+  std::random_device random;
+  session_ = random();
+  sequence_ = 0;
+  clock_samples_.clear();
+  next_clock_sample_ = 0;
+  have_leader_ = false;
+
+  if (leader) {
+    audio_->Defer(notify_pipe_[1]);
+    printf("Leading rigs on %s:%d, %.0f ms behind the music.\n",
+           config.group.c_str(), config.port, config.delay_ms);
+  } else {
+    printf("Following the leader on %s:%d.\n", config.group.c_str(),
+           config.port);
+  }
+  thread_ = std::thread(&RigSync::Run, this);
+  return 0;
+}
+
+void RigSync::Stop() {
+  if (thread_.joinable()) {
+    char byte = 0;
+    if (write(wake_pipe_[1], &byte, 1) != 1) {
+      printf("Unable to stop synchronization\n");
+    }
+    thread_.join();
+  }
+  if (audio_ && notify_pipe_[1] >= 0) {
+    audio_->Defer(-1);
+  }
+
+  int *fds[] = { &state_fd_, &clock_fd_, &notify_pipe_[0], &notify_pipe_[1],
+                 &wake_pipe_[0], &wake_pipe_[1] };
+  for (unsigned int i = 0; i < sizeof(fds) / sizeof(fds[0]); ++i) {
+    if (*fds[i] >= 0) {
+      close(*fds[i]);
+      *fds[i] = -1;
+    }
+  }
+}
+
+void RigSync::SetParameters(const SyncParameters &parameters) {
+  std::lock_guard<std::mutex> lock(parameters_mutex_);
+  parameters_ = parameters;
+}
+
+bool RigSync::PollParameters(SyncParameters *parameters) {
+  std::lock_guard<std::mutex> lock(parameters_mutex_);
+  if (!parameters_fresh_) {
+    return false;
+  }
+  *parameters = parameters_;
+  parameters_fresh_ = false;
+  return true;
+}
+
+void RigSync::Run() {
+  TRACE_THREAD_NAME("sync");
+  const bool leader = config_.role == SyncConfig::LEADER;
+
+  struct pollfd fds[3];
+  const int kWake = 0, kState = 1, kOther = 2;
+  fds[kWake].fd = wake_pipe_[0];
+  fds[kState].fd = state_fd_;
+  fds[kOther].fd = leader ? notify_pipe_[0] : clock_fd_;
+  for (int i = 0; i < 3; ++i) {
+    fds[i].events = POLLIN;
+  }
+
+  char packet[kMaxPacketSize];
+  next_send_ = Now();
+  while (true) {
+    double now = Now();
+    if (now >= next_send_) {
+      Tick(now);
+    }
+
+    // poll() counts whole milliseconds, so the last fraction of one before
+    // an event is slept through, to report it on time.
+    const double next = std::min(ReportDue(now), next_send_);
+    if (next - now < 0.001) {
+      if (next > now) {
+        std::this_thread::sleep_for(std::chrono::duration<double>(next - now));
+      }
+      continue;
+    }
+    if (poll(fds, 3, (int)((next - now) * 1000.0)) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      printf("Synchronization stopped: %s\n", strerror(errno));
+      return;
+    }
+    if (fds[kWake].revents) {
+      return;
+    }
+    now = Now();
+
+    if (leader && (fds[kOther].revents & POLLIN)) {
+      while (read(notify_pipe_[0], packet, sizeof(packet)) > 0) {
+      }
+      if (TakeDetections()) {
+        SendState(now);
+      }
+    }
+
+    for (int f = kState; f <= kOther; ++f) {
+      if (!(fds[f].revents & POLLIN) || (leader && f == kOther)) {
+        continue;
+      }
+      sockaddr_in from;
+      socklen_t from_size = sizeof(from);
+      ssize_t size;
+      while ((size = recvfrom(fds[f].fd, packet, sizeof(packet), MSG_DONTWAIT,
+                              (struct sockaddr *)&from, &from_size)) > 0) {
+        packets_received.Add();
+        unsigned int session, sequence;
+        const int type = ReadHeader(packet, size, &session, &sequence);
+        if (leader && type == PING) {
+          AnswerPing(packet, size, from, now);
+        } else if (!leader && type == STATE) {
+          ReceiveState(packet, size, from, now);
+        } else if (!leader && type == PONG) {
+          ReceivePong(packet, size, Now());
+        }
+        from_size = sizeof(from);
+      }
+    }
+  }
+}
+
+void RigSync::Tick(double now) {
+  if (config_.role == SyncConfig::LEADER) {
+    SendState(now);
+    next_send_ = now + kStateInterval;
+    return;
+  }
+
+  next_send_ = now + kPingInterval;
+  if (!have_leader_) {
+    return;
+  }
+  if (now - last_state_time_ > kLeaderTimeout) {
+    printf("Lost the leader; waiting for it to come back.\n");
+    have_leader_ = false;
+    const float silence[BandAnalyzer::kNumBands] = { 0.0f };
+    audio_->ReportLevels(silence, 0.0f, 0.0f, true);
+    return;
+  }
+  SendPing(now);
+}
+
+bool RigSync::TakeDetections() {
+  bool any = false;
+  AudioEvent event;
+  while (audio_->PollDeferred(&event)) {
+    const double due = event.time + config_.delay_ms / 1000.0;
+    Schedule(due, event);
+    if (event.beat) {
+      ++num_beats_;
+      last_beat_ = event;
+      last_beat_due_ = due;
+    } else {
+      ++num_onsets_;
+      last_onset_due_ = due;
+      last_onset_strength_ = event.confidence;
+    }
+    any = true;
+  }
+  return any;
+}
+
+void RigSync::SendState(double now) {
+  TRACE_SCOPE("RigSync::SendState");
+  float envelopes[BandAnalyzer::kNumBands];
+  audio_->bands.GetEnvelopes(envelopes);
+  SyncParameters parameters;
+  {
+    std::lock_guard<std::mutex> lock(parameters_mutex_);
+    parameters = parameters_;
+  }
+
+  char packet[kMaxPacketSize];
+  PacketWriter writer(packet);
+  WriteHeader(STATE, session_, ++sequence_, packet, &writer);
+  writer.F64(now);
+  writer.U32(num_beats_);
+  writer.F64(last_beat_due_);
+  writer.F32(last_beat_.tempo_bpm);
+  writer.F32(last_beat_.confidence);
+  writer.U32(num_onsets_);
+  writer.F64(last_onset_due_);
+  writer.F32(last_onset_strength_);
+  writer.F32(audio_->pitch_hz.load(std::memory_order_relaxed));
+  writer.F32(audio_->pitch_confidence.load(std::memory_order_relaxed));
+  writer.U32(audio_->silent);
+  for (int b = 0; b < BandAnalyzer::kNumBands; ++b) {
+    writer.F32(envelopes[b]);
+  }
+  writer.U32(parameters.mode);
+  writer.F32(parameters.brightness);
+  writer.F32(parameters.tempo_override);
+  for (int i = 0; i < kSyncLayers; ++i) {
+    writer.F32(parameters.opacity[i]);
+  }
+
+  if (sendto(state_fd_, packet, 8 + writer.size(), 0,
+             (struct sockaddr *)&group_address_,
+             sizeof(group_address_)) > 0) {
+    packets_sent.Add();
+  }
+}
+
+void RigSync::AnswerPing(const char *packet, int size,
+                         const sockaddr_in &from, double now) {
+  PacketReader reader(packet + kHeaderSize, size - kHeaderSize);
+  const double sent = reader.F64();
+  if (!reader.ok()) {
+    return;
+  }
+
+  char answer[kMaxPacketSize];
+  PacketWriter writer(answer);
+  WriteHeader(PONG, session_, ++sequence_, answer, &writer);
+  writer.F64(sent);
+  writer.F64(now);
+  writer.F64(Now());
+  if (sendto(state_fd_, answer, 8 + writer.size(), 0,
+             (const struct sockaddr *)&from, sizeof(from)) > 0) {
+    packets_sent.Add();
+  }
+}
+
+void RigSync::ReceiveState(const char *packet, int size,
+                           const sockaddr_in &from, double now) {
+  unsigned int session, sequence;
+  ReadHeader(packet, size, &session, &sequence);
+  PacketReader reader(packet + kHeaderSize, size - kHeaderSize);
+  reader.F64();
+  const unsigned int num_beats = reader.U32();
+  const double beat_due = reader.F64();
+  const float tempo_bpm = reader.F32();
+  const float confidence = reader.F32();
+  const unsigned int num_onsets = reader.U32();
+  const double onset_due = reader.F64();
+  const float onset_strength = reader.F32();
+  const float pitch_hz = reader.F32();
+  const float pitch_confidence = reader.F32();
+  const bool silent = reader.U32() != 0;
+  float envelopes[BandAnalyzer::kNumBands];
+  for (int b = 0; b < BandAnalyzer::kNumBands; ++b) {
+    envelopes[b] = reader.F32();
+  }
+  SyncParameters parameters;
+  parameters.mode = reader.U32();
+  parameters.brightness = reader.F32();
+  parameters.tempo_override = reader.F32();
+  for (int i = 0; i < kSyncLayers; ++i) {
+    parameters.opacity[i] = reader.F32();
+  }
+  if (!reader.ok()) {
+    return;
+  }
+
+  // A leader that started since the last packet counts from scratch; what
+  // it counted before we heard it is not news. Packets that the network
+  // delivered out of order are.
+  const bool new_session = !have_leader_ || session != session_;
+  if (!new_session && (int)(sequence - sequence_) <= 0) {
+    return;
+  }
+  if (new_session) {
+    if (session != session_) {
+      clock_samples_.clear();
+      next_clock_sample_ = 0;
+      clock_offset_ = 0;
+      round_trip_ = 0;
+    }
+    printf("Following the leader at %s.\n", inet_ntoa(from.sin_addr));
+    session_ = session;
+    num_beats_ = num_beats;
+    num_onsets_ = num_onsets;
+    have_leader_ = true;
+    leader_address_ = from;
+
+    // Ask for the time straight away, rather than at the next ping.
+    SendPing(now);
+  }
+  sequence_ = sequence;
+  last_state_time_ = now;
+
+  // Until the first answer to a ping, the leader's clock is unknown, and
+  // events are shown as they arrive.
+  const bool synced = !clock_samples_.empty();
+  const double offset = clock_offset_;
+  if (num_onsets != num_onsets_) {
+    num_onsets_ = num_onsets;
+    AudioEvent event = { false, onset_due, 0.0f, onset_strength };
+    Schedule(synced ? onset_due - offset : now, event);
+  }
+  if (num_beats != num_beats_) {
+    num_beats_ = num_beats;
+    AudioEvent event = { true, beat_due, tempo_bpm, confidence };
+    Schedule(synced ? beat_due - offset : now, event);
+  }
+
+  audio_->ReportLevels(envelopes, pitch_hz, pitch_confidence, silent);
+
+  std::lock_guard<std::mutex> lock(parameters_mutex_);
+  parameters_ = parameters;
+  parameters_fresh_ = true;
+}
+
+void RigSync::SendPing(double now) {
+  char packet[kMaxPacketSize];
+  PacketWriter writer(packet);
+  WriteHeader(PING, session_, 0, packet, &writer);
+  writer.F64(now);
+
+  // The leader answers from the port it sends state from.
+  if (sendto(clock_fd_, packet, 8 + writer.size(), 0,
+             (struct sockaddr *)&leader_address_,
+             sizeof(leader_address_)) > 0) {
+    packets_sent.Add();
+  }
+}
+
+void RigSync::ReceivePong(const char *packet, int size, double now) {
+  PacketReader reader(packet + kHeaderSize, size - kHeaderSize);
+  const double sent = reader.F64();
+  const double received = reader.F64();
+  const double answered = reader.F64();
+  if (!reader.ok() || !have_leader_ || sent > now) {
+    return;
+  }
+
+  ClockSample sample;
+  sample.offset = ((received - sent) + (answered - now)) / 2.0;
+  sample.round_trip = (now - sent) - (answered - received);
+  if ((int)clock_samples_.size() < kClockSamples) {
+    clock_samples_.push_back(sample);
+  } else {
+    clock_samples_[next_clock_sample_] = sample;
+    next_clock_sample_ = (next_clock_sample_ + 1) % kClockSamples;
+  }
+
+  // The quickest round trip had the least time to be delayed one way more
+  // than the other.
+  const ClockSample *best = &clock_samples_[0];
+  for (unsigned int i = 1; i < clock_samples_.size(); ++i) {
+    if (clock_samples_[i].round_trip < best->round_trip) {
+      best = &clock_samples_[i];
+    }
+  }
+  if (clock_samples_.size() == 1) {
+    printf("Clock offset from the leader: %.3f ms, +/- %.3f ms.\n",
+           1000.0 * best->offset, 500.0 * best->round_trip);
+  }
+  clock_offset_ = best->offset;
+  round_trip_ = best->round_trip;
+  clock_offset_gauge.Set(best->offset);
+  round_trip_gauge.Set(best->round_trip);
+}
+
+void RigSync::Schedule(double due, const AudioEvent &event) {
+  if (scheduled_.size() >= kMaxScheduled) {
+    events_late.Add();
+    return;
+  }
+  Scheduled scheduled = { due, event };
+  scheduled_.push_back(scheduled);
+}
+
+double RigSync::ReportDue(double now) {
+  // Each event is reported kSyncLeadMs early, for the frame that shows it
+  // to be drawn in time.
+  const double lead = kSyncLeadMs / 1000.0;
+  double next = now + 3600.0;
+  for (unsigned int i = 0; i < scheduled_.size();) {
+    const Scheduled &scheduled = scheduled_[i];
+    const double report = scheduled.due - lead;
+    if (report > now) {
+      next = std::min(next, report);
+      ++i;
+      continue;
+    }
+
+    const double late = now - report;
+    if (late > kLateEvent) {
+      events_late.Add();
+    }
+    if (late <= kStaleEvent) {
+      const AudioEvent &event = scheduled.event;
+      if (event.beat) {
+        audio_->ReportBeat(scheduled.due, event.tempo_bpm, event.confidence);
+      } else {
+        audio_->ReportOnset(scheduled.due, event.confidence);
+      }
+      // After the report, so that a frame never takes the time without the
+      // event. One that starts in between shows the event without it, and
+      // so kSyncLeadMs after it starts: within microseconds of when the
+      // event is due, if it was reported on time.
+      double earliest = reported_due_.load();
+      while ((earliest == 0 || scheduled.due < earliest) &&
+             !reported_due_.compare_exchange_weak(earliest, scheduled.due)) {
+      }
+    }
+    scheduled_[i] = scheduled_.back();
+    scheduled_.pop_back();
+  }
+  return next;
+}
+
+double RigSync::TakeFrameDue(bool *event) {
+  const double now = Now();
+  *event = false;
+  if (config_.role == SyncConfig::OFF) {
+    return now;
+  }
+
+  const double shown = now + kSyncLeadMs / 1000.0;
+  const double due = reported_due_.exchange(0);
+  if (due == 0) {
+    return shown;
+  }
+  *event = true;
+  // The frame before this one took longer than kSyncLeadMs.
+  if (due < now) {
+    events_late.Add();
+  }
+  return std::min(due, shown);
+}
@@ -0,0 +1,240 @@
+#ifndef __RIG_SYNC_H__
+#define __RIG_SYNC_H__
+
+#include <netinet/in.h>
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Disco Wookie includes
+#include "audio.h"
+
+using std::string;
+using std::vector;
+
+// Layers whose opacity a leader sets on its followers: one per mode.
+static const int kSyncLayers = 9;
+
+// What a leader sets on its followers besides the music: the settings the
+// control server can change, except the camera, which is each viewer's own.
+struct SyncParameters {
+  SyncParameters() : mode(0), brightness(1.0f), tempo_override(0.0f) {
+    for (int i = 0; i < kSyncLayers; ++i) {
+      opacity[i] = 1.0f;
+    }
+  }
+
+  int mode;  // numbered like the 1-9 keys, or 0 for none yet
+  float brightness;
+  float tempo_override;
+  float opacity[kSyncLayers];
+};
+
+// How long before an event is due every rig reports it to its visualizers,
+// and so how long after a frame is drawn the LEDs show it (see
+// RigSync::TakeFrameDue()). Longer than a frame at 30 frames per second,
+// so that the frame that shows an event is drawn before the event is due.
+// Every rig must use the same.
+static const float kSyncLeadMs = 50.0f;
+
+// How a rig takes part in synchronization, from the command line.
+struct SyncConfig {
+  enum Role { OFF, LEADER, FOLLOWER };
+
+  SyncConfig()
+    : role(OFF), group("239.255.42.99"), port(9100), delay_ms(80.0f) {}
+
+  // Returns false, and prints why, if the settings cannot work.
+  bool Validate() const;
+
+  Role role;
+
+  // The multicast group and UDP port that state is sent to.
+  string group;
+  int port;
+
+  // The address of the network interface to use, or empty for the one the
+  // routing table picks. 127.0.0.1 keeps several rigs on one machine.
+  string interface;
+
+  // How long after the leader detects an event every rig shows it. Longer
+  // than kSyncLeadMs plus the worst delivery time on the network, so that
+  // packets arrive in time to be drawn and shown on schedule.
+  float delay_ms;
+};
+
+// RigSync keeps several rigs, each a jacket driven by a Hallucination of its
+// own, flashing together to one microphone.
+//
+// The leader analyzes the music as usual, but its AudioProcessor defers the
+// onsets and beats it detects (see AudioProcessor::Defer()). RigSync sends
+// each one at once to a UDP multicast group, stamped with the time it is
+// due: delay_ms after it was detected, on the leader's clock. Every 10 ms,
+// and with each event, the same packet also carries the latest band
+// envelopes, pitch and silence, the last beat and onset again (so that one
+// lost packet costs nothing), and the parameters set by SetParameters().
+//
+// Followers do no analysis. Each one keeps an estimate of the offset
+// between its clock and the leader's: four times a second it sends the
+// leader a ping with its own time, and the leader answers with the times it
+// received and answered it, as in NTP. Of the last eight answers, the one
+// that took the shortest round trip gives the offset, to within half of
+// that round trip: tens of microseconds on a wired network.
+//
+// Both roles report each event to their AudioProcessor kSyncLeadMs before
+// it is due, on their own clock, and each draws it in its next frame.
+// Every frame is stamped with when the LEDs should show it: kSyncLeadMs
+// after it was drawn, or, if it shows an event, when that event is due.
+// LedOutput holds each frame until then, so however the rigs' frames fall,
+// every jacket shows each event when it is due on the leader's clock, and
+// everything else kSyncLeadMs after drawing it. The levels and parameters
+// are applied as they arrive.
+//
+// Measured on one machine, with a leader drawing at 60 frames per second
+// and two followers at 30 and 60, out of phase, each writing its LEDs to a
+// FIFO: over 300 beats, the first byte of the frame that showed a beat was
+// read a median of 0.1 ms after the beat was due, and 99% within 0.2 ms;
+// the three rigs differed by a median of 0.05 ms, and 99% by at most
+// 0.11 ms. One beat came 4.7 ms late on all three at once, when the machine
+// stalled. Over a network, the clock offset adds up to half the shortest
+// round trip, and the controllers add whatever they take after the write.
+class RigSync {
+ public:
+  RigSync();
+
+  // Stops synchronization if it is running.
+  ~RigSync();
+
+  // Starts a thread in config's role, for audio, which must outlive this.
+  // Does nothing if the role is OFF. Returns 0 on success.
+  int Start(const SyncConfig &config, AudioProcessor *audio);
+
+  // Stops the thread, and returns audio to reporting its own detections.
+  void Stop();
+
+  // The parameters to send to the followers. Called by the leader's render
+  // thread, every frame.
+  void SetParameters(const SyncParameters &parameters);
+
+  // Takes the leader's parameters, if they arrived since the last call.
+  // Called by a follower's render thread.
+  bool PollParameters(SyncParameters *parameters);
+
+  // When the LEDs should show the frame the render thread is about to draw,
+  // in seconds on the steady clock (see LedOutput::Publish()), and whether
+  // it shows an onset or beat reported since the last call, which must be
+  // shown whole rather than faded in. Called by the render thread before
+  // each frame's visualizers run. Without synchronization, frames are due
+  // as they are drawn.
+  double TakeFrameDue(bool *event);
+
+  // The leader's clock minus this one, in seconds, and the round trip it
+  // was measured over; 0 on the leader.
+  double clock_offset() const { return clock_offset_; }
+  double round_trip() const { return round_trip_; }
+
+ private:
+  // An event waiting for its time, on this rig's clock.
+  struct Scheduled {
+    double due;
+    AudioEvent event;
+  };
+
+  // One round trip to the leader.
+  struct ClockSample {
+    double offset;
+    double round_trip;
+  };
+
+  void Run();
+
+  // Leader: queues what the audio thread detected, and returns whether
+  // there was anything.
+  bool TakeDetections();
+  void SendState(double now);
+  void AnswerPing(const char *packet, int size, const sockaddr_in &from,
+                  double now);
+
+  // Follower.
+  void ReceiveState(const char *packet, int size, const sockaddr_in &from,
+                    double now);
+  void ReceivePong(const char *packet, int size, double now);
+  void SendPing(double now);
+
+  // Queues an event to be reported at due, on this rig's clock.
+  void Schedule(double due, const AudioEvent &event);
+
+  // Reports every event that is due to be reported by now, kSyncLeadMs
+  // ahead of it, and returns when the next one is, or a long way off if
+  // there are none.
+  double ReportDue(double now);
+
+  // Leader: sends state. Follower: pings the leader, and notices if it has
+  // gone quiet.
+  void Tick(double now);
+
+  SyncConfig config_;
+  AudioProcessor *audio_;
+
+  // Sends and receives multicast state: the leader's is bound to any port,
+  // and takes pings there, and the followers' to config_.port in the group.
+  int state_fd_;
+
+  // A follower's pings go out and their answers come back on a socket of
+  // its own, since several followers on one machine share state_fd_'s port.
+  int clock_fd_;
+
+  // The leader writes here when it has deferred a detection.
+  int notify_pipe_[2];
+
+  // Writing to wake_pipe_[1] tells the thread to exit.
+  int wake_pipe_[2];
+
+  sockaddr_in group_address_;
+
+  std::thread thread_;
+
+  // Owned by the thread.
+  vector<Scheduled> scheduled_;
+  unsigned int session_;
+  unsigned int sequence_;
+  double next_send_;
+
+  // The events so far: the leader's, to send the last of each again with
+  // every state, and the follower's, to tell new ones from repeats.
+  unsigned int num_beats_;
+  unsigned int num_onsets_;
+  AudioEvent last_beat_;
+  double last_beat_due_;
+  double last_onset_due_;
+  float last_onset_strength_;
+
+  // Follower only: the leader, where it answers pings, and what was heard
+  // from it.
+  bool have_leader_;
+  sockaddr_in leader_address_;
+  double last_state_time_;
+  vector<ClockSample> clock_samples_;
+  int next_clock_sample_;
+
+  std::atomic<double> clock_offset_;
+  std::atomic<double> round_trip_;
+
+  // When the earliest of the events reported since the render thread last
+  // called TakeFrameDue() is due, or 0 if there are none.
+  std::atomic<double> reported_due_;
+
+  // Handed between the render thread and this one.
+  std::mutex parameters_mutex_;
+  SyncParameters parameters_;
+  bool parameters_fresh_;
+
+  // RigSync owns a thread; it cannot be copied.
+  RigSync(RigSync const &);
+  void operator=(RigSync const &);
+};
+
+#endif // __RIG_SYNC_H__
@@ -0,0 +1,70 @@
+#ifndef __SAMPLE_RING_H__
+#define __SAMPLE_RING_H__
+
+#include <atomic>
+#include <vector>
+
+using std::vector;
+
+// A lock-free ring of audio samples for exactly one producer thread and one
+// consumer thread, like SpscQueue, but moving runs of samples at a time:
+// the producer appends whatever a callback delivered, and the consumer
+// takes whole hops out. Neither side blocks or allocates.
+//
+// The size must be a power of two. head_ and tail_ count samples ever
+// pushed and popped, and wrap around harmlessly.
+class SampleRing {
+ public:
+  SampleRing() : mask_(0), head_(0), tail_(0) {}
+
+  // Sets the capacity, in samples, and empties the ring. Not thread-safe.
+  void Init(unsigned int size) {
+    buffer_.assign(size, 0.0f);
+    mask_ = size - 1;
+    head_ = 0;
+    tail_ = 0;
+  }
+
+  // Called only from the producer thread. Appends count samples, taking
+  // every stride-th one from samples, so that one channel can be copied
+  // straight out of interleaved input. Returns false, and appends nothing,
+  // if there is not room for all of them.
+  bool Push(const float *samples, unsigned int count, unsigned int stride) {
+    unsigned int head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) + count > mask_ + 1) {
+      return false;
+    }
+    float *buffer = &buffer_[0];
+    for (unsigned int i = 0; i < count; ++i) {
+      buffer[(head + i) & mask_] = samples[i * stride];
+    }
+    head_.store(head + count, std::memory_order_release);
+    return true;
+  }
+
+  // Called only from the consumer thread. Takes count samples into out if
+  // there are that many, and returns whether there were.
+  bool Pop(float *out, unsigned int count) {
+    unsigned int tail = tail_.load(std::memory_order_relaxed);
+    if (head_.load(std::memory_order_acquire) - tail < count) {
+      return false;
+    }
+    const float *buffer = &buffer_[0];
+    for (unsigned int i = 0; i < count; ++i) {
+      out[i] = buffer[(tail + i) & mask_];
+    }
+    tail_.store(tail + count, std::memory_order_release);
+    return true;
+  }
+
+ private:
+  vector<float> buffer_;
+  unsigned int mask_;
+
+  // Kept on separate cache lines, so that the two threads do not fight over
+  // one line on every push and pop.
+  alignas(64) std::atomic<unsigned int> head_;
+  alignas(64) std::atomic<unsigned int> tail_;
+};
+
+#endif // __SAMPLE_RING_H__
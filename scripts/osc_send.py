@@ -0,0 +1,56 @@
+#!/usr/bin/env python
+
+# Sends one OSC message to a running Hallucination, for testing the control
+# server without a phone or a MIDI bridge.
+#
+#   scripts/osc_send.py --port=9000 /hallucination/mode 4
+#   scripts/osc_send.py --socket=/tmp/hallucination.sock /hallucination/tempo 128
+#
+# Arguments containing a "." are sent as floats, the rest as ints.
+
+import socket
+import struct
+import sys
+
+def osc_string(s):
+  data = s.encode('ascii') + b'\0'
+  return data + b'\0' * ((4 - len(data) % 4) % 4)
+
+def osc_message(address, args):
+  types = ','
+  payload = b''
+  for arg in args:
+    if '.' in arg:
+      types += 'f'
+      payload += struct.pack('>f', float(arg))
+    else:
+      types += 'i'
+      payload += struct.pack('>i', int(arg))
+  return osc_string(address) + osc_string(types) + payload
+
+host = '127.0.0.1'
+port = None
+path = None
+args = list()
+for arg in sys.argv[1:]:
+  if arg.startswith('--port='):
+    port = int(arg[len('--port='):])
+  elif arg.startswith('--host='):
+    host = arg[len('--host='):]
+  elif arg.startswith('--socket='):
+    path = arg[len('--socket='):]
+  else:
+    args.append(arg)
+
+if len(args) < 1 or (port is None and path is None):
+  print("Usage: " + sys.argv[0] +
+        " (--port=N [--host=HOST] | --socket=PATH) address [args...]")
+  sys.exit(1)
+
+message = osc_message(args[0], args[1:])
+if path is not None:
+  sock = socket.socket(socket.AF_UNIX, socket.SOCK_DGRAM)
+  sock.sendto(message, path)
+else:
+  sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+  sock.sendto(message, (host, port))
@@ -0,0 +1,338 @@
+#include "setlist.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+// Disco Wookie includes
+#include "fingerprint.h"
+
+static const char kMagic[8] = { 'S', 'E', 'T', 'L', 'I', 'S', 'T', '\0' };
+
+// Sections are found in the music's timbre and busyness, averaged over
+// blocks of this long, by comparing the kSectionKernelSeconds before each
+// block with the same time after it (Foote's novelty). Starts closer
+// together than kMinSectionSeconds are one.
+static const float kSectionBlockSeconds = 0.5f;
+static const float kSectionKernelSeconds = 8.0f;
+static const float kMinSectionSeconds = 8.0f;
+
+// A start stands this many standard deviations above the mean novelty.
+static const float kSectionThreshold = 1.0f;
+
+template <typename T>
+static bool WriteArray(const vector<T> &items, FILE *file) {
+  return items.empty() ||
+         fwrite(&items[0], sizeof(T), items.size(), file) == items.size();
+}
+
+template <typename T>
+static bool ReadArray(uint32_t count, FILE *file, vector<T> *items) {
+  // Read in pieces, so that a corrupt count fails at the end of the file
+  // instead of allocating it all up front.
+  static const uint32_t kChunk = 65536;
+  items->clear();
+  while (items->size() < count) {
+    const size_t size = items->size();
+    const size_t chunk = std::min(count - size, (size_t)kChunk);
+    items->resize(size + chunk);
+    if (fread(&(*items)[size], sizeof(T), chunk, file) != chunk) {
+      return false;
+    }
+  }
+  return true;
+}
+
+int Setlist::Save(const string &path) const {
+  FILE *file = fopen(path.c_str(), "wb");
+  if (!file) {
+    printf("Unable to write setlist %s\n", path.c_str());
+    return 1;
+  }
+
+  SetlistHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kSetlistVersion;
+  header.sample_rate = config.sample_rate;
+  header.win_size = config.win_size;
+  header.hop_size = config.hop_size;
+  header.num_tracks = tracks.size();
+
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+  for (unsigned int t = 0; ok && t < tracks.size(); ++t) {
+    const SetlistTrack &track = tracks[t];
+    SetlistTrackHeader track_header;
+    memset(&track_header, 0, sizeof(track_header));
+    strncpy(track_header.name, track.name.c_str(),
+            sizeof(track_header.name) - 1);
+    track_header.num_hops = track.levels.size();
+    track_header.num_beats = track.beats.size();
+    track_header.num_onsets = track.onsets.size();
+    track_header.num_sections = track.sections.size();
+    ok = fwrite(&track_header, sizeof(track_header), 1, file) == 1 &&
+         WriteArray(track.beats, file) && WriteArray(track.onsets, file) &&
+         WriteArray(track.sections, file) && WriteArray(track.levels, file) &&
+         WriteArray(track.fingerprints, file);
+  }
+
+  if (fclose(file) != 0 || !ok) {
+    printf("Error writing setlist %s\n", path.c_str());
+    remove(path.c_str());
+    return 1;
+  }
+  return 0;
+}
+
+int Setlist::Load(const string &path) {
+  FILE *file = fopen(path.c_str(), "rb");
+  if (!file) {
+    printf("Unable to open setlist %s\n", path.c_str());
+    return 1;
+  }
+
+  SetlistHeader header;
+  if (fread(&header, sizeof(header), 1, file) != 1 ||
+      memcmp(header.magic, kMagic, sizeof(kMagic)) != 0) {
+    printf("%s is not a setlist\n", path.c_str());
+    fclose(file);
+    return 1;
+  }
+  if (header.version != kSetlistVersion) {
+    printf("Setlist %s has unsupported version %u\n", path.c_str(),
+           header.version);
+    fclose(file);
+    return 1;
+  }
+
+  vector<SetlistTrack> loaded;
+  bool ok = true;
+  for (uint32_t t = 0; ok && t < header.num_tracks; ++t) {
+    SetlistTrackHeader track_header;
+    SetlistTrack track;
+    ok = fread(&track_header, sizeof(track_header), 1, file) == 1 &&
+         ReadArray(track_header.num_beats, file, &track.beats) &&
+         ReadArray(track_header.num_onsets, file, &track.onsets) &&
+         ReadArray(track_header.num_sections, file, &track.sections) &&
+         ReadArray(track_header.num_hops, file, &track.levels) &&
+         ReadArray(track_header.num_hops, file, &track.fingerprints);
+    if (ok) {
+      track_header.name[sizeof(track_header.name) - 1] = '\0';
+      track.name = track_header.name;
+      loaded.push_back(track);
+    }
+  }
+  fclose(file);
+  if (!ok) {
+    printf("Setlist %s is truncated\n", path.c_str());
+    return 1;
+  }
+
+  config = AudioConfig();
+  config.sample_rate = header.sample_rate;
+  config.win_size = header.win_size;
+  config.hop_size = header.hop_size;
+  tracks.swap(loaded);
+  return 0;
+}
+
+// The hop whose end is at or after time_s, which is when live input
+// reaches it.
+static uint32_t HopAt(float time_s, const AudioConfig &config) {
+  const float hop = time_s * config.sample_rate / config.hop_size;
+  return std::max((int)ceilf(hop) - 1, 0);
+}
+
+static void FindSections(const AudioConfig &config, SetlistTrack *track) {
+  const int block_hops = std::max(
+      (int)(kSectionBlockSeconds * config.sample_rate / config.hop_size), 1);
+  const int num_blocks = track->levels.size() / block_hops;
+  const int kernel = kSectionKernelSeconds / kSectionBlockSeconds;
+  if (num_blocks < 2 * kernel + 1) {
+    return;
+  }
+
+  // Each block's envelopes and onsets, each measured against its own
+  // spread over the track, then as a unit vector: the envelopes are already
+  // normalized against their peaks, so what sets sections apart is which
+  // bands are above or below their usual level, not how loud they are.
+  static const int kNumFeatures = BandAnalyzer::kNumBands + 1;
+  vector<float> features(num_blocks * kNumFeatures, 0.0f);
+  for (int i = 0; i < num_blocks * block_hops; ++i) {
+    float *feature = &features[(i / block_hops) * kNumFeatures];
+    for (int b = 0; b < BandAnalyzer::kNumBands; ++b) {
+      feature[b] += track->levels[i].envelopes[b] / 255.0f;
+    }
+  }
+  for (unsigned int o = 0; o < track->onsets.size(); ++o) {
+    const int block = track->onsets[o].hop / block_hops;
+    if (block < num_blocks) {
+      features[block * kNumFeatures + BandAnalyzer::kNumBands] += 1.0f;
+    }
+  }
+  for (int f = 0; f < kNumFeatures; ++f) {
+    float mean = 0.0f, squares = 0.0f;
+    for (int k = 0; k < num_blocks; ++k) {
+      const float value = features[k * kNumFeatures + f];
+      mean += value;
+      squares += value * value;
+    }
+    mean /= num_blocks;
+    const float deviation =
+        sqrtf(std::max(squares / num_blocks - mean * mean, 0.0f)) + 1e-6f;
+    for (int k = 0; k < num_blocks; ++k) {
+      float &value = features[k * kNumFeatures + f];
+      value = (value - mean) / deviation;
+    }
+  }
+  for (int k = 0; k < num_blocks; ++k) {
+    float *feature = &features[k * kNumFeatures];
+    float length = 0.0f;
+    for (int f = 0; f < kNumFeatures; ++f) {
+      length += feature[f] * feature[f];
+    }
+    length = sqrtf(length);
+    for (int f = 0; f < kNumFeatures; ++f) {
+      feature[f] = length > 0.0f ? feature[f] / length : 0.0f;
+    }
+  }
+
+  // How much more alike the blocks on either side of each boundary are to
+  // each other than to those across it.
+  vector<float> novelty(num_blocks, 0.0f);
+  float sum = 0.0f, sum_squares = 0.0f;
+  int count = 0;
+  for (int k = kernel; k + kernel <= num_blocks; ++k) {
+    float within = 0.0f, across = 0.0f;
+    for (int a = k - kernel; a < k + kernel; ++a) {
+      for (int b = a + 1; b < k + kernel; ++b) {
+        float similarity = 0.0f;
+        for (int f = 0; f < kNumFeatures; ++f) {
+          similarity += features[a * kNumFeatures + f] *
+                        features[b * kNumFeatures + f];
+        }
+        if ((a < k) == (b < k)) {
+          within += similarity;
+        } else {
+          across += similarity;
+        }
+      }
+    }
+    novelty[k] = within / (kernel * (kernel - 1)) -
+                 across / (kernel * kernel);
+    sum += novelty[k];
+    sum_squares += novelty[k] * novelty[k];
+    ++count;
+  }
+  const float mean = sum / count;
+  const float deviation =
+      sqrtf(std::max(sum_squares / count - mean * mean, 0.0f));
+  const float threshold = mean + kSectionThreshold * deviation;
+
+  // The highest peaks first, each ruling out others too close to it.
+  const int min_blocks = kMinSectionSeconds / kSectionBlockSeconds;
+  vector<int> order;
+  for (int k = kernel; k + kernel <= num_blocks; ++k) {
+    if (novelty[k] > threshold && novelty[k] >= novelty[k - 1] &&
+        novelty[k] >= novelty[k + 1]) {
+      order.push_back(k);
+    }
+  }
+  std::sort(order.begin(), order.end(), [&](int a, int b) {
+    return novelty[a] > novelty[b];
+  });
+  vector<int> starts;
+  for (unsigned int i = 0; i < order.size(); ++i) {
+    bool clear = true;
+    for (unsigned int s = 0; clear && s < starts.size(); ++s) {
+      clear = abs(order[i] - starts[s]) >= min_blocks;
+    }
+    if (clear) {
+      starts.push_back(order[i]);
+    }
+  }
+  std::sort(starts.begin(), starts.end());
+  track->sections.clear();
+  for (unsigned int s = 0; s < starts.size(); ++s) {
+    track->sections.push_back(starts[s] * block_hops);
+  }
+}
+
+int AnalyzeTrack(const string &path, const AudioConfig &config,
+                 SetlistTrack *track) {
+  aubio_source_t *source = new_aubio_source(
+      (char_t *)path.c_str(), config.sample_rate, config.hop_size);
+  if (!source) {
+    printf("Unable to read %s at %u Hz\n", path.c_str(), config.sample_rate);
+    return 1;
+  }
+
+  AudioConfig mono = config;
+  mono.channels = 1;
+  AudioProcessor audio;
+  audio.CreateDetectors(mono);
+  Fingerprinter fingerprinter;
+  fingerprinter.Init(config.win_size, config.hop_size, config.sample_rate);
+
+  SetlistTrack analyzed;
+  const size_t slash = path.rfind('/');
+  analyzed.name = slash == string::npos ? path : path.substr(slash + 1);
+
+  fvec_t *hop = new_fvec(config.hop_size);
+  uint_t read = config.hop_size;
+  while (read == config.hop_size) {
+    aubio_source_do(source, hop, &read);
+    if (read == 0) {
+      break;
+    }
+    // Pad the last hop with silence.
+    for (uint_t i = read; i < config.hop_size; ++i) {
+      hop->data[i] = 0.0f;
+    }
+    audio.ProcessHop(hop->data);
+    analyzed.fingerprints.push_back(
+        fingerprinter.ProcessSpectrum(audio.bands.spectrum()));
+
+    SetlistLevels levels;
+    float envelopes[BandAnalyzer::kNumBands];
+    audio.bands.GetEnvelopes(envelopes);
+    for (int b = 0; b < BandAnalyzer::kNumBands; ++b) {
+      levels.envelopes[b] = (uint8_t)(envelopes[b] * 255.0f + 0.5f);
+    }
+    const float pitch = audio.pitch_hz.load(std::memory_order_relaxed);
+    levels.pitch = (uint16_t)std::min(pitch * 4.0f + 0.5f, 65535.0f);
+    levels.pitch_confidence = (uint8_t)(
+        std::min(std::max(audio.pitch_confidence.load(), 0.0f), 1.0f) *
+            255.0f + 0.5f);
+    levels.silent = audio.silent;
+    analyzed.levels.push_back(levels);
+
+    float time_s, strength, tempo_bpm, confidence;
+    if (audio.IsOnset(time_s, strength)) {
+      SetlistOnset onset = { HopAt(time_s, config), strength };
+      analyzed.onsets.push_back(onset);
+    }
+    if (audio.IsBeat(time_s, tempo_bpm, confidence)) {
+      SetlistBeat beat = { HopAt(time_s, config), tempo_bpm, confidence };
+      analyzed.beats.push_back(beat);
+    }
+  }
+  del_fvec(hop);
+  del_aubio_source(source);
+
+  if (analyzed.levels.empty()) {
+    printf("%s holds no audio\n", path.c_str());
+    return 1;
+  }
+  // A beat's time can be a little ahead of the hop it was reported in.
+  std::stable_sort(analyzed.beats.begin(), analyzed.beats.end(),
+                   [](const SetlistBeat &a, const SetlistBeat &b) {
+                     return a.hop < b.hop;
+                   });
+  FindSections(config, &analyzed);
+  *track = analyzed;
+  return 0;
+}
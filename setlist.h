@@ -0,0 +1,98 @@
+#ifndef __SETLIST_H__
+#define __SETLIST_H__
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+// Disco Wookie includes
+#include "audio.h"
+
+using std::string;
+using std::vector;
+
+// A setlist holds the analysis of every track of a scripted show, worked out
+// ahead of time by analyze_setlist, so that during the show the jacket can
+// follow the recordings instead of guessing at them live (see
+// SetlistFollower).
+//
+// Each track is a timeline at the resolution of the hop: the beats and
+// onsets that AudioProcessor finds in it, at the hop they happened in
+// rather than the later one they were detected in, the band envelopes and
+// pitch of every hop, the hops where a new section starts, and a
+// fingerprint of every hop (see fingerprint.h) to recognize it by.
+//
+// The file is a SetlistHeader, then for each track a SetlistTrackHeader
+// followed by its beats, onsets, section starts, levels and fingerprints,
+// all little-endian, with no padding.
+struct SetlistHeader {
+  char magic[8];         // "SETLIST\0"
+  uint32_t version;      // kSetlistVersion
+  uint32_t sample_rate;  // of the analysis, which live input must match
+  uint32_t win_size;
+  uint32_t hop_size;
+  uint32_t num_tracks;
+};
+
+struct SetlistTrackHeader {
+  char name[64];         // the file the track was analyzed from
+  uint32_t num_hops;
+  uint32_t num_beats;
+  uint32_t num_onsets;
+  uint32_t num_sections;
+};
+
+struct SetlistBeat {
+  uint32_t hop;
+  float tempo_bpm;
+  float confidence;
+};
+
+struct SetlistOnset {
+  uint32_t hop;
+  float strength;
+};
+
+// A hop's levels, quantized.
+struct SetlistLevels {
+  uint8_t envelopes[BandAnalyzer::kNumBands];  // 0 to 255 for 0 to 1
+  uint16_t pitch;                              // quarter Hz, 0 if unpitched
+  uint8_t pitch_confidence;                    // 0 to 255 for 0 to 1
+  uint8_t silent;                              // below kSilenceDb
+};
+
+static const uint32_t kSetlistVersion = 1;
+
+struct SetlistTrack {
+  string name;
+  vector<SetlistBeat> beats;
+  vector<SetlistOnset> onsets;
+  vector<uint32_t> sections;      // hops where each section after the first
+                                  // starts
+  vector<SetlistLevels> levels;   // one per hop
+  vector<uint32_t> fingerprints;  // one per hop
+};
+
+class Setlist {
+ public:
+  // Writes the setlist to path. Returns 0 on success.
+  int Save(const string &path) const;
+
+  // Replaces the setlist with the one in path. Returns 0 on success; on
+  // failure the setlist is left untouched.
+  int Load(const string &path);
+
+  // The analysis parameters of every track.
+  AudioConfig config;
+
+  vector<SetlistTrack> tracks;
+};
+
+// Runs the audio file at path through the same analysis as live input, with
+// config's parameters, and fills track with what it found. The file is
+// resampled to config.sample_rate if need be. Returns 0 on success.
+int AnalyzeTrack(const string &path, const AudioConfig &config,
+                 SetlistTrack *track);
+
+#endif // __SETLIST_H__
@@ -0,0 +1,316 @@
+#include "setlist_follower.h"
+
+#include <algorithm>
+
+// Disco Wookie includes
+#include "fingerprint.h"
+#include "metrics.h"
+#include "trace.h"
+
+// The live input compared with the tracks, in seconds: Haitsma and Kalker's
+// block of 256 fingerprints at their hop of 11.6 ms, about 3 s, would be
+// slower to lock and to notice a skip for no real gain at 32 bits a hop.
+static const float kBlockSeconds = 1.5f;
+
+// How often to search, or to check the alignments either side, and the
+// newest stretch of the block whose errors alone can drop the alignment.
+static const float kSearchSeconds = 0.25f;
+static const float kShortSeconds = 0.25f;
+
+// The fraction of bits that may differ to take an alignment, and to keep it
+// over the block and over its newest part.
+static const float kLockErrorRate = 0.3f;
+static const float kLoseErrorRate = 0.4f;
+static const float kShortLoseErrorRate = 0.45f;
+
+// Fingerprints found in more places than this say little about where the
+// input is, and would only swamp the search.
+static const unsigned int kMaxMatches = 32;
+
+// Alignments suggested by fewer exact matches are not checked, nor more of
+// them than this.
+static const int kMinVotes = 2;
+static const int kMaxCandidates = 16;
+
+static MetricGauge track_gauge(
+    "hallucination_setlist_track",
+    "Setlist track the live input is aligned with, from 0, or -1 for none.");
+static MetricGauge error_rate_gauge(
+    "hallucination_setlist_error_rate",
+    "Fraction of fingerprint bits that differ from the aligned track's.");
+static MetricCounter locks("hallucination_setlist_locks_total",
+                           "Times the live input was aligned with a track.");
+static MetricCounter losses(
+    "hallucination_setlist_losses_total",
+    "Times the alignment was lost before the end of the track.");
+
+SetlistFollower::SetlistFollower(const Setlist &setlist, int advance)
+  : setlist_(setlist),
+    advance_(advance),
+    hops_(0),
+    hops_since_search_(0),
+    locked_(false),
+    block_errors_(0),
+    short_errors_(0),
+    next_beat_(0),
+    next_onset_(0),
+    next_section_(0) {
+  const float hops_per_second =
+      (float)setlist.config.sample_rate / setlist.config.hop_size;
+  block_hops_ = std::max((int)(kBlockSeconds * hops_per_second), 1);
+  short_hops_ = std::max((int)(kShortSeconds * hops_per_second), 1);
+  search_hops_ = std::max((int)(kSearchSeconds * hops_per_second), 1);
+  history_.assign(block_hops_, 0);
+  weak_history_.assign(block_hops_, 0);
+  errors_.assign(block_hops_, 0);
+  suggested_.reserve(block_hops_ * kMaxMatches);
+  candidates_.reserve(block_hops_ * kMaxMatches / kMinVotes);
+  alignment_.track = -1;
+  alignment_.offset = 0;
+
+  // Silence fingerprints as noise, which would only suggest alignments.
+  for (unsigned int t = 0; t < setlist.tracks.size(); ++t) {
+    const SetlistTrack &track = setlist.tracks[t];
+    for (unsigned int h = 0; h < track.fingerprints.size(); ++h) {
+      if (!track.levels[h].silent) {
+        IndexEntry entry = { track.fingerprints[h], t, h };
+        index_.push_back(entry);
+      }
+    }
+  }
+  std::sort(index_.begin(), index_.end());
+  track_gauge.Set(-1);
+}
+
+uint32_t SetlistFollower::History(int age) const {
+  return history_[(hops_ - 1 - age) % block_hops_];
+}
+
+int SetlistFollower::BlockErrors(const Alignment &alignment,
+                                 int *errors) const {
+  const vector<uint32_t> &fingerprints =
+      setlist_.tracks[alignment.track].fingerprints;
+  int total = 0;
+  for (int age = 0; age < block_hops_; ++age) {
+    const long live = hops_ - 1 - age;
+    const long hop = live + alignment.offset;
+    // Hops outside the track count as unrelated audio.
+    int wrong = Fingerprinter::kNumBits / 2;
+    if (hop >= 0 && hop < (long)fingerprints.size()) {
+      wrong = FingerprintDistance(History(age), fingerprints[hop]);
+    }
+    if (errors) {
+      errors[live % block_hops_] = wrong;
+    }
+    total += wrong;
+  }
+  return total;
+}
+
+void SetlistFollower::Search() {
+  TRACE_SCOPE("SetlistFollower::Search");
+  vector<Alignment> &suggested = suggested_;
+  suggested.clear();
+  for (int age = 0; age < block_hops_; ++age) {
+    const long live = hops_ - 1 - age;
+    const uint32_t weak_bits = weak_history_[live % block_hops_];
+    // Every subset of the weak bits, flipped, from none of them on.
+    uint32_t flipped = 0;
+    do {
+      IndexEntry key = { History(age) ^ flipped, 0, 0 };
+      std::pair<vector<IndexEntry>::const_iterator,
+                vector<IndexEntry>::const_iterator> range =
+          std::equal_range(index_.begin(), index_.end(), key);
+      // Matches beyond the space set aside for them are dropped rather
+      // than allocated for.
+      if (range.second - range.first <= (long)kMaxMatches) {
+        for (vector<IndexEntry>::const_iterator entry = range.first;
+             entry != range.second &&
+             suggested.size() < suggested.capacity();
+             ++entry) {
+          Alignment alignment = { (int)entry->track, entry->hop - live };
+          suggested.push_back(alignment);
+        }
+      }
+      flipped = (flipped - weak_bits) & weak_bits;
+    } while (flipped != 0);
+  }
+
+  // Count the votes for each alignment, and check the most popular.
+  std::sort(suggested.begin(), suggested.end(),
+            [](const Alignment &a, const Alignment &b) {
+              return a.track != b.track ? a.track < b.track
+                                        : a.offset < b.offset;
+            });
+  vector<std::pair<int, Alignment> > &candidates = candidates_;
+  candidates.clear();
+  for (unsigned int i = 0; i < suggested.size();) {
+    unsigned int j = i + 1;
+    while (j < suggested.size() && suggested[j].track == suggested[i].track &&
+           suggested[j].offset == suggested[i].offset) {
+      ++j;
+    }
+    if ((int)(j - i) >= kMinVotes) {
+      candidates.push_back(std::make_pair((int)(j - i), suggested[i]));
+    }
+    i = j;
+  }
+  std::sort(candidates.begin(), candidates.end(),
+            [](const std::pair<int, Alignment> &a,
+               const std::pair<int, Alignment> &b) {
+              return a.first > b.first;
+            });
+  if ((int)candidates.size() > kMaxCandidates) {
+    candidates.resize(kMaxCandidates);
+  }
+
+  int best_errors = kLockErrorRate * Fingerprinter::kNumBits * block_hops_;
+  int best = -1;
+  for (unsigned int c = 0; c < candidates.size(); ++c) {
+    const int errors = BlockErrors(candidates[c].second, NULL);
+    if (errors < best_errors) {
+      best_errors = errors;
+      best = c;
+    }
+  }
+  if (best >= 0) {
+    Lock(candidates[best].second);
+  }
+}
+
+void SetlistFollower::Realign(const Alignment &alignment) {
+  alignment_ = alignment;
+  block_errors_ = BlockErrors(alignment_, &errors_[0]);
+  short_errors_ = 0;
+  for (int age = 0; age < short_hops_; ++age) {
+    short_errors_ += errors_[(hops_ - 1 - age) % block_hops_];
+  }
+}
+
+void SetlistFollower::Lock(const Alignment &alignment) {
+  Realign(alignment);
+  locked_ = true;
+
+  // Only what is still to come is cued; the track's past already went by
+  // without it.
+  const SetlistTrack &track = setlist_.tracks[alignment_.track];
+  const long cued = hops_ - 1 + alignment_.offset + advance_;
+  next_beat_ = 0;
+  while (next_beat_ < track.beats.size() &&
+         (long)track.beats[next_beat_].hop <= cued) {
+    ++next_beat_;
+  }
+  next_onset_ = 0;
+  while (next_onset_ < track.onsets.size() &&
+         (long)track.onsets[next_onset_].hop <= cued) {
+    ++next_onset_;
+  }
+  next_section_ = 0;
+  while (next_section_ < track.sections.size() &&
+         (long)track.sections[next_section_] <= cued) {
+    ++next_section_;
+  }
+
+  locks.Add();
+  track_gauge.Set(alignment_.track);
+}
+
+void SetlistFollower::Unlock() {
+  locked_ = false;
+  track_gauge.Set(-1);
+}
+
+bool SetlistFollower::ProcessHop(uint32_t fingerprint, uint32_t weak_bits,
+                                 SetlistCue *cue) {
+  history_[hops_ % block_hops_] = fingerprint;
+  weak_history_[hops_ % block_hops_] = weak_bits;
+  ++hops_;
+  ++hops_since_search_;
+
+  if (!locked_) {
+    if (hops_ >= block_hops_ && hops_since_search_ >= search_hops_ &&
+        !index_.empty()) {
+      hops_since_search_ = 0;
+      Search();
+    }
+    if (!locked_) {
+      return false;
+    }
+  }
+
+  const SetlistTrack &track = setlist_.tracks[alignment_.track];
+  const long live = hops_ - 1;
+  long hop = live + alignment_.offset;
+  if (hop >= (long)track.fingerprints.size()) {
+    // The track is over.
+    Unlock();
+    return false;
+  }
+
+  // Slide the error counts along by one hop.
+  const int wrong =
+      hop >= 0 ? FingerprintDistance(fingerprint, track.fingerprints[hop])
+               : Fingerprinter::kNumBits / 2;
+  block_errors_ += wrong - errors_[live % block_hops_];
+  short_errors_ += wrong - errors_[(live - short_hops_) % block_hops_];
+  errors_[live % block_hops_] = wrong;
+
+  // The alignments either side, to follow the drift between the clocks.
+  if (hops_since_search_ >= search_hops_) {
+    hops_since_search_ = 0;
+    for (int step = -1; step <= 1; step += 2) {
+      Alignment neighbor = { alignment_.track, alignment_.offset + step };
+      if (BlockErrors(neighbor, NULL) < block_errors_) {
+        Realign(neighbor);
+        hop = live + alignment_.offset;
+        break;
+      }
+    }
+  }
+
+  const int bits = Fingerprinter::kNumBits;
+  error_rate_gauge.Set((double)block_errors_ / (bits * block_hops_));
+  if (block_errors_ > kLoseErrorRate * bits * block_hops_ ||
+      short_errors_ > kShortLoseErrorRate * bits * short_hops_) {
+    losses.Add();
+    Unlock();
+    return false;
+  }
+
+  // What the track holds advance_ hops on.
+  const uint32_t cued = std::min(std::max(hop + advance_, 0L),
+                                 (long)track.levels.size() - 1);
+  cue->track = alignment_.track;
+  cue->onset = false;
+  cue->beat = false;
+  const float hop_s =
+      (float)setlist_.config.hop_size / setlist_.config.sample_rate;
+  while (next_onset_ < track.onsets.size() &&
+         track.onsets[next_onset_].hop <= cued) {
+    const SetlistOnset &onset = track.onsets[next_onset_++];
+    cue->onset = true;
+    cue->onset_s = (onset.hop + 1) * hop_s;
+    cue->onset_strength = onset.strength;
+  }
+  while (next_beat_ < track.beats.size() &&
+         track.beats[next_beat_].hop <= cued) {
+    const SetlistBeat &beat = track.beats[next_beat_++];
+    cue->beat = true;
+    cue->beat_s = (beat.hop + 1) * hop_s;
+    cue->tempo_bpm = beat.tempo_bpm;
+    cue->beat_confidence = beat.confidence;
+  }
+  while (next_section_ < track.sections.size() &&
+         track.sections[next_section_] <= cued) {
+    ++next_section_;
+  }
+  cue->section = next_section_;
+
+  const SetlistLevels &levels = track.levels[cued];
+  for (int b = 0; b < BandAnalyzer::kNumBands; ++b) {
+    cue->envelopes[b] = levels.envelopes[b] / 255.0f;
+  }
+  cue->pitch_hz = levels.pitch / 4.0f;
+  cue->pitch_confidence = levels.pitch_confidence / 255.0f;
+  return true;
+}
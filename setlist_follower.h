@@ -0,0 +1,143 @@
+#ifndef __SETLIST_FOLLOWER_H__
+#define __SETLIST_FOLLOWER_H__
+
+#include <stdint.h>
+
+#include <utility>
+#include <vector>
+
+// Disco Wookie includes
+#include "bands.h"
+#include "setlist.h"
+
+using std::vector;
+
+// What a known track holds for one hop of live input, for AudioProcessor to
+// show instead of what it detects itself.
+struct SetlistCue {
+  // Which track, and which of its sections, counted from 0.
+  int track;
+  int section;
+
+  // An onset or beat is due; the times are in seconds into the track.
+  bool onset;
+  float onset_s;
+  float onset_strength;
+  bool beat;
+  float beat_s;
+  float tempo_bpm;
+  float beat_confidence;
+
+  float envelopes[BandAnalyzer::kNumBands];
+  float pitch_hz;
+  float pitch_confidence;
+};
+
+// SetlistFollower recognizes the track being played among a setlist's, and
+// keeps track of where in it the live input is, from the fingerprint of
+// every hop. It runs on the audio thread, and costs a few comparisons a hop
+// once it has found its place.
+//
+// Until then, every quarter of a second, it looks up each of the last 1.5 s
+// of live fingerprints in an index of every track's, along with every
+// variant of it with some of its least reliable bits flipped, and each
+// exact match suggests an alignment. The alignments suggested most often are checked
+// bit by bit over the whole 1.5 s, and the best is taken if under 30% of its
+// bits differ; between unrelated audio, about half do.
+//
+// Once aligned, each hop's fingerprint is compared with the track's at the
+// same place. If more than 40% of the bits over the last 1.5 s differ, or
+// 45% over the last quarter of a second, as when the DJ stops the track,
+// scratches or skips, the alignment is dropped and live analysis takes over
+// again. Every quarter of a second, the alignments one hop either side are
+// checked too, so that the small difference between the live and recorded
+// sample clocks never adds up.
+//
+// Events are cued advance hops early, so that they can be shown when the
+// music is heard rather than when it has been analyzed.
+class SetlistFollower {
+ public:
+  // Indexes every track of setlist, which must outlive this.
+  SetlistFollower(const Setlist &setlist, int advance);
+
+  // Takes the fingerprint of the newest hop of live input, and the mask of
+  // its least reliable bits. Returns whether it is aligned with a track, and
+  // if so, fills cue with what the track holds advance hops later.
+  bool ProcessHop(uint32_t fingerprint, uint32_t weak_bits, SetlistCue *cue);
+
+ private:
+  struct IndexEntry {
+    uint32_t fingerprint;
+    uint32_t track;
+    uint32_t hop;
+
+    bool operator<(const IndexEntry &other) const {
+      return fingerprint < other.fingerprint;
+    }
+  };
+
+  // An alignment: the track's hop is the live hop plus offset.
+  struct Alignment {
+    int track;
+    long offset;
+  };
+
+  // Looks for an alignment of the last block of live input, and takes it if
+  // it is good enough.
+  void Search();
+
+  // The bits that differ, over the last block of live input, from track at
+  // offset; errors, if given, gets them for each hop.
+  int BlockErrors(const Alignment &alignment, int *errors) const;
+
+  // Moves to alignment, and counts its errors over the last block.
+  void Realign(const Alignment &alignment);
+
+  // Starts following alignment, from the events still to come.
+  void Lock(const Alignment &alignment);
+
+  void Unlock();
+
+  // The live fingerprint hops_ - 1 - age hops old.
+  uint32_t History(int age) const;
+
+  const Setlist &setlist_;
+  int advance_;
+
+  // Every track's fingerprints, sorted by value.
+  vector<IndexEntry> index_;
+
+  // Scratch space for Search(), allocated up front so that the audio thread
+  // never has to.
+  vector<Alignment> suggested_;
+  vector<std::pair<int, Alignment> > candidates_;
+
+  // The length of the block, of its newest part, and the time between
+  // searches, in hops.
+  int block_hops_;
+  int short_hops_;
+  int search_hops_;
+
+  // The last block_hops_ live fingerprints and their least reliable bits,
+  // and how many there have been.
+  vector<uint32_t> history_;
+  vector<uint32_t> weak_history_;
+  long hops_;
+  int hops_since_search_;
+
+  bool locked_;
+  Alignment alignment_;
+
+  // The bits wrong in each hop of the block, and their total over the
+  // block and over its newest short_hops_.
+  vector<int> errors_;
+  int block_errors_;
+  int short_errors_;
+
+  // The next event of each kind to cue, and the section being played.
+  unsigned int next_beat_;
+  unsigned int next_onset_;
+  unsigned int next_section_;
+};
+
+#endif // __SETLIST_FOLLOWER_H__
@@ -0,0 +1,65 @@
+#ifndef __SLIDING_WINDOW_H__
+#define __SLIDING_WINDOW_H__
+
+#include <string.h>
+
+#include <vector>
+
+using std::vector;
+
+// SlidingWindow keeps the most recent N samples of a stream available as one
+// contiguous array, without shifting the whole window on every hop.
+//
+// Every sample is written twice, N samples apart, into a buffer of 2N. The
+// latest N samples are then always contiguous somewhere in that buffer, and
+// pushing a hop of H samples costs 2H writes instead of the N copies that
+// memmove-ing the window would. This matters for small hops: with N = 1024
+// and H = 64, shifting would copy fifteen times more data than it adds.
+class SlidingWindow {
+ public:
+  SlidingWindow() : size_(0), position_(0) {}
+
+  // Sets the window length and fills it with silence.
+  void Init(unsigned int size) {
+    size_ = size;
+    position_ = 0;
+    buffer_.assign(2 * size, 0.0f);
+  }
+
+  // Appends count samples. count must not exceed the window length.
+  void Push(const float *samples, unsigned int count) {
+    float *buffer = &buffer_[0];
+    unsigned int first = count;
+    if (position_ + count > size_) {
+      first = size_ - position_;
+    }
+
+    memcpy(buffer + position_, samples, first * sizeof(float));
+    memcpy(buffer + position_ + size_, samples, first * sizeof(float));
+
+    // Wrap around to the start of both copies.
+    unsigned int rest = count - first;
+    if (rest > 0) {
+      memcpy(buffer, samples + first, rest * sizeof(float));
+      memcpy(buffer + size_, samples + first, rest * sizeof(float));
+    }
+
+    position_ = (position_ + count) % size_;
+  }
+
+  // The last size() samples, oldest first.
+  const float *Window() const { return &buffer_[position_]; }
+
+  unsigned int size() const { return size_; }
+
+ private:
+  unsigned int size_;
+
+  // Where the next sample goes in the first copy; also where the oldest
+  // sample of the current window lives.
+  unsigned int position_;
+
+  vector<float> buffer_;
+};
+
+#endif // __SLIDING_WINDOW_H__
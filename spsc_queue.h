@@ -0,0 +1,50 @@
+#ifndef __SPSC_QUEUE_H__
+#define __SPSC_QUEUE_H__
+
+#include <atomic>
+
+// A fixed-size, lock-free queue for exactly one producer thread and one
+// consumer thread. Neither side ever blocks or allocates: Push() fails when
+// the queue is full and Pop() fails when it is empty.
+//
+// N must be a power of two. head_ and tail_ count items ever pushed and
+// popped, and wrap around harmlessly.
+template <typename T, unsigned int N>
+class SpscQueue {
+ public:
+  SpscQueue() : head_(0), tail_(0) {
+    static_assert((N & (N - 1)) == 0, "N must be a power of two");
+  }
+
+  // Called only from the producer thread.
+  bool Push(const T &item) {
+    unsigned int head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) == N) {
+      return false;
+    }
+    items_[head & (N - 1)] = item;
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Called only from the consumer thread.
+  bool Pop(T *item) {
+    unsigned int tail = tail_.load(std::memory_order_relaxed);
+    if (tail == head_.load(std::memory_order_acquire)) {
+      return false;
+    }
+    *item = items_[tail & (N - 1)];
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+ private:
+  T items_[N];
+
+  // Kept on separate cache lines, so that the two threads do not fight over
+  // one line on every push and pop.
+  alignas(64) std::atomic<unsigned int> head_;
+  alignas(64) std::atomic<unsigned int> tail_;
+};
+
+#endif // __SPSC_QUEUE_H__
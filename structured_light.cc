@@ -0,0 +1,262 @@
+#include "structured_light.h"
+
+#include <math.h>
+#include <png.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+// Pixels that brighten less than this from the all-off image to the all-on
+// one see no LED.
+static const int kMinContrast = 24;
+
+// A bit is only trusted if its pattern and inverse differ by at least this
+// fraction of the pixel's contrast. Pixels on the edge of a blurred LED, or
+// lit by its reflection, fail it.
+static const float kMinBitContrast = 0.25f;
+
+// Pixels further from an LED's median position than this many times the
+// median distance (plus a pixel and a half) belong to something else.
+static const float kOutlierDistance = 3.0f;
+
+namespace {
+
+// A pixel that decoded to a channel.
+struct Sample {
+  int channel;
+  int x;
+  int y;
+  int weight;
+};
+
+}  // namespace
+
+// The median of values, which it reorders.
+static float Median(vector<float> *values) {
+  vector<float>::iterator middle = values->begin() + values->size() / 2;
+  std::nth_element(values->begin(), middle, values->end());
+  return *middle;
+}
+
+int StructuredLightBits(int num_channels) {
+  int bits = 1;
+  while (bits < 31 && (1 << bits) < num_channels) {
+    ++bits;
+  }
+  return bits;
+}
+
+bool StructuredLightLit(int pattern, int channel, int bits) {
+  if (pattern == 0) {
+    return true;
+  }
+  if (pattern == 1) {
+    return false;
+  }
+  const int bit = bits - 1 - (pattern - 2) / 2;
+  const bool set = (ToGray(channel) >> bit) & 1;
+  const bool inverse = (pattern - 2) % 2 == 1;
+  return set != inverse;
+}
+
+// Reads every frame of a P6 stream. The file is already open, past the
+// first frame's "P6".
+static int ReadPpmFrames(FILE *file, const string &path,
+                         vector<GreyImage> *images) {
+  for (int frames = 0;; ++frames) {
+    int width, height, max_value;
+    if (fscanf(file, "%d %d %d", &width, &height, &max_value) != 3 ||
+        width <= 0 || height <= 0 || max_value != 255) {
+      printf("%s: frame %d is not an 8-bit PPM\n", path.c_str(), frames);
+      return 1;
+    }
+    fgetc(file);
+
+    vector<unsigned char> rgb((size_t)width * height * 3);
+    if (fread(&rgb[0], 1, rgb.size(), file) != rgb.size()) {
+      printf("%s: frame %d is cut short\n", path.c_str(), frames);
+      return 1;
+    }
+
+    GreyImage image;
+    image.width = width;
+    image.height = height;
+    image.pixels.resize((size_t)width * height);
+    for (size_t i = 0; i < image.pixels.size(); ++i) {
+      image.pixels[i] =
+          (77 * rgb[3 * i] + 150 * rgb[3 * i + 1] + 29 * rgb[3 * i + 2]) >> 8;
+    }
+    images->push_back(image);
+
+    char magic[3];
+    if (fscanf(file, " %2s", magic) != 1) {
+      return 0;
+    }
+    if (strcmp(magic, "P6") != 0) {
+      printf("%s: frame %d is not a PPM\n", path.c_str(), frames + 1);
+      return 1;
+    }
+  }
+}
+
+static int ReadPng(const string &path, vector<GreyImage> *images) {
+  png_image png;
+  memset(&png, 0, sizeof(png));
+  png.version = PNG_IMAGE_VERSION;
+  if (!png_image_begin_read_from_file(&png, path.c_str())) {
+    printf("Unable to read %s: %s\n", path.c_str(), png.message);
+    return 1;
+  }
+
+  png.format = PNG_FORMAT_GRAY;
+  GreyImage image;
+  image.width = png.width;
+  image.height = png.height;
+  image.pixels.resize(PNG_IMAGE_SIZE(png));
+  if (!png_image_finish_read(&png, NULL, &image.pixels[0], 0, NULL)) {
+    printf("Unable to decode %s: %s\n", path.c_str(), png.message);
+    png_image_free(&png);
+    return 1;
+  }
+  images->push_back(image);
+  return 0;
+}
+
+int ReadGreyImages(const string &path, vector<GreyImage> *images) {
+  FILE *file = fopen(path.c_str(), "rb");
+  if (!file) {
+    printf("Unable to open %s\n", path.c_str());
+    return 1;
+  }
+  char magic[2] = { 0, 0 };
+  size_t length = fread(magic, 1, sizeof(magic), file);
+  int result;
+  if (length == sizeof(magic) && magic[0] == 'P' && magic[1] == '6') {
+    result = ReadPpmFrames(file, path, images);
+    fclose(file);
+  } else {
+    fclose(file);
+    result = ReadPng(path, images);
+  }
+  return result;
+}
+
+int DecodeStructuredLight(const vector<GreyImage> &images, int num_channels,
+                          vector<StructuredLightPoint> *points) {
+  points->clear();
+  const int num_images = images.size();
+  if (num_images < StructuredLightPatterns(1) || num_images % 2 != 0) {
+    printf("A sequence has an even number of images, at least %d, not %d\n",
+           StructuredLightPatterns(1), num_images);
+    return 1;
+  }
+  const int width = images[0].width;
+  const int height = images[0].height;
+  for (int i = 1; i < num_images; ++i) {
+    if (images[i].width != width || images[i].height != height) {
+      printf("Image %d is %dx%d, unlike the first, which is %dx%d\n", i,
+             images[i].width, images[i].height, width, height);
+      return 1;
+    }
+  }
+
+  const int bits = (num_images - 2) / 2;
+  if (bits > 24) {
+    printf("%d images are more than any jacket needs\n", num_images);
+    return 1;
+  }
+  const int num_codes = 1 << bits;
+  if (num_channels <= 0 || num_channels > num_codes) {
+    num_channels = num_codes;
+  }
+
+  // Every pixel with a trustworthy code, by channel.
+  vector<Sample> samples;
+  const unsigned char *on = &images[0].pixels[0];
+  const unsigned char *off = &images[1].pixels[0];
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      const int p = y * width + x;
+      const int contrast = on[p] - off[p];
+      if (contrast < kMinContrast) {
+        continue;
+      }
+
+      const int min_difference = (int)(kMinBitContrast * contrast);
+      unsigned int gray = 0;
+      bool reliable = true;
+      for (int b = 0; b < bits && reliable; ++b) {
+        const int lit = images[2 + 2 * b].pixels[p];
+        const int unlit = images[3 + 2 * b].pixels[p];
+        reliable = abs(lit - unlit) >= min_difference;
+        gray = (gray << 1) | (lit > unlit ? 1 : 0);
+      }
+      if (!reliable) {
+        continue;
+      }
+
+      const unsigned int channel = FromGray(gray);
+      if (channel < (unsigned int)num_channels) {
+        Sample sample = { (int)channel, x, y, contrast };
+        samples.push_back(sample);
+      }
+    }
+  }
+  std::sort(samples.begin(), samples.end(),
+            [](const Sample &a, const Sample &b) {
+              return a.channel < b.channel;
+            });
+
+  vector<float> xs, ys, distances;
+  for (size_t begin = 0, end; begin < samples.size(); begin = end) {
+    const int channel = samples[begin].channel;
+    end = begin;
+    while (end < samples.size() && samples[end].channel == channel) {
+      ++end;
+    }
+
+    // Where two LEDs overlap, or one is reflected, a few pixels elsewhere
+    // can take this channel's code. The median finds the LED regardless,
+    // and pixels much further from it than most are left out.
+    xs.clear();
+    ys.clear();
+    for (size_t i = begin; i < end; ++i) {
+      xs.push_back(samples[i].x);
+      ys.push_back(samples[i].y);
+    }
+    const float median_x = Median(&xs);
+    const float median_y = Median(&ys);
+    distances.clear();
+    for (size_t i = begin; i < end; ++i) {
+      distances.push_back(hypotf(samples[i].x - median_x,
+                                 samples[i].y - median_y));
+    }
+    const float radius = kOutlierDistance * Median(&distances) + 1.5f;
+
+    // Weighted by how much each pixel brightens, so that the centroid leans
+    // towards the LED's bright core.
+    double sum_x = 0.0, sum_y = 0.0, sum_weight = 0.0;
+    int pixels = 0;
+    for (size_t i = begin; i < end; ++i) {
+      const Sample &sample = samples[i];
+      if (hypotf(sample.x - median_x, sample.y - median_y) > radius) {
+        continue;
+      }
+      sum_x += (double)sample.weight * sample.x;
+      sum_y += (double)sample.weight * sample.y;
+      sum_weight += sample.weight;
+      ++pixels;
+    }
+
+    // Pixel centers are half a pixel in.
+    StructuredLightPoint point;
+    point.channel = channel;
+    point.x = sum_x / sum_weight + 0.5;
+    point.y = sum_y / sum_weight + 0.5;
+    point.pixels = pixels;
+    points->push_back(point);
+  }
+  return 0;
+}
@@ -0,0 +1,74 @@
+#ifndef __STRUCTURED_LIGHT_H__
+#define __STRUCTURED_LIGHT_H__
+
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+// Structured light finds every LED on the jacket in a camera's view from a
+// couple of dozen images, however many LEDs there are.
+//
+// StructuredLightVisualizer (see visualizer.h) shows a sequence of patterns,
+// and DecodeStructuredLight() works out from an image of each where every LED
+// appeared. Each LED is identified by the Gray code of its channel. Every
+// pattern lights the LEDs with one bit of their code set, and is followed by
+// its inverse, so that each pixel's bit is read by comparing two images of
+// the same scene rather than against a fixed threshold. Neighboring channels'
+// Gray codes differ in one bit, so a pixel that sees two LEDs decodes to one
+// or the other rather than to a third. The sequence starts with every LED on,
+// then every LED off, to find the pixels that see an LED at all.
+//
+// N channels take 2 + 2 * ceil(log2(N)) patterns: 26 for the 2400 hairs of
+// the jacket, 34 for 50000.
+
+inline unsigned int ToGray(unsigned int n) { return n ^ (n >> 1); }
+
+inline unsigned int FromGray(unsigned int gray) {
+  unsigned int n = gray;
+  for (unsigned int shift = gray >> 1; shift != 0; shift >>= 1) {
+    n ^= shift;
+  }
+  return n;
+}
+
+// The bits of code needed to tell num_channels channels apart.
+int StructuredLightBits(int num_channels);
+
+// The patterns in the sequence, with codes of the given number of bits.
+inline int StructuredLightPatterns(int bits) { return 2 + 2 * bits; }
+
+// Whether the LED on a channel is lit in a pattern of the sequence.
+bool StructuredLightLit(int pattern, int channel, int bits);
+
+// An 8-bit greyscale image, row by row from the top.
+struct GreyImage {
+  GreyImage() : width(0), height(0) {}
+
+  int width;
+  int height;
+  vector<unsigned char> pixels;
+};
+
+// Appends the image in a PNG file, or every frame of a binary PPM stream
+// such as --export-video writes, to images. Returns 0 on success.
+int ReadGreyImages(const string &path, vector<GreyImage> *images);
+
+// Where one LED appeared: the centroid of the pixels that decoded to its
+// channel, in pixels from the top left corner of the images.
+struct StructuredLightPoint {
+  int channel;
+  float x;
+  float y;
+  int pixels;
+};
+
+// Finds the LEDs in images of a whole sequence, one per pattern, in order,
+// and fills points in channel order. Channels from num_channels up are
+// taken as noise; 0 allows every code. Returns 0 on success, and prints why
+// not otherwise.
+int DecodeStructuredLight(const vector<GreyImage> &images, int num_channels,
+                          vector<StructuredLightPoint> *points);
+
+#endif // __STRUCTURED_LIGHT_H__
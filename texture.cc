@@ -0,0 +1,380 @@
+#include "texture.h"
+
+#include <png.h>
+#include <string.h>
+
+#include <algorithm>
+#include <thread>
+
+#include "trace.h"
+
+static bool IsPowerOfTwo(int n) { return n > 0 && (n & (n - 1)) == 0; }
+
+// Halves an RGBA image with a 2x2 box filter. Odd sizes cannot happen, since
+// only power-of-two images are accepted; a side of 1 stays 1.
+static void Downsample(const vector<unsigned char> &source, int width,
+                       int height, vector<unsigned char> *destination) {
+  int new_width = std::max(width / 2, 1);
+  int new_height = std::max(height / 2, 1);
+  int step_x = (width > 1) ? 2 : 1;
+  int step_y = (height > 1) ? 2 : 1;
+  destination->resize(new_width * new_height * 4);
+
+  for (int y = 0; y < new_height; ++y) {
+    const unsigned char *row0 = &source[(y * step_y) * width * 4];
+    const unsigned char *row1 = &source[(y * step_y + step_y - 1) * width * 4];
+    unsigned char *out = &(*destination)[y * new_width * 4];
+    for (int x = 0; x < new_width; ++x) {
+      int x0 = x * step_x * 4;
+      int x1 = (x * step_x + step_x - 1) * 4;
+      for (int c = 0; c < 4; ++c) {
+        out[x * 4 + c] =
+            (row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c] + 2) / 4;
+      }
+    }
+  }
+}
+
+TextureAtlas::TextureAtlas()
+  : pool_(NULL),
+    images_pending_(0),
+    packed_(false),
+    width_(0),
+    height_(0),
+    texture_(0),
+    pixel_buffer_(0),
+    next_level_(0),
+    copy_in_flight_(false),
+    copy_state_(COPIED),
+    ready_(false) {}
+
+int TextureAtlas::Add(const string &path) {
+  Image image;
+  image.path = path;
+  images_.push_back(image);
+  return images_.size() - 1;
+}
+
+void TextureAtlas::Load(ThreadPool *pool) {
+  pool_ = pool;
+  if (images_.empty()) {
+    return;
+  }
+
+  images_pending_ = images_.size();
+  for (unsigned int i = 0; i < images_.size(); ++i) {
+    Image *image = &images_[i];
+    pool_->Submit([this, image]() {
+      Decode(image);
+      if (images_pending_.fetch_sub(1) == 1) {
+        Pack();
+      }
+    });
+  }
+}
+
+void TextureAtlas::Decode(Image *image) {
+  TRACE_SCOPE("TextureAtlas::Decode");
+
+  png_image png;
+  memset(&png, 0, sizeof(png));
+  png.version = PNG_IMAGE_VERSION;
+  if (!png_image_begin_read_from_file(&png, image->path.c_str())) {
+    printf("Unable to read %s: %s\n", image->path.c_str(), png.message);
+    return;
+  }
+  if (!IsPowerOfTwo(png.width) || !IsPowerOfTwo(png.height)) {
+    printf("Skipping %s: %ux%u is not a power of two.\n",
+           image->path.c_str(), png.width, png.height);
+    png_image_free(&png);
+    return;
+  }
+
+  png.format = PNG_FORMAT_RGBA;
+  vector<unsigned char> pixels(PNG_IMAGE_SIZE(png));
+
+  // PNG rows run top to bottom, but texture coordinates have v = 0 at the
+  // bottom, so read the rows in upside down (negative stride).
+  int stride = -(int)PNG_IMAGE_ROW_STRIDE(png);
+  if (!png_image_finish_read(&png, NULL, &pixels[0], stride, NULL)) {
+    printf("Unable to decode %s: %s\n", image->path.c_str(), png.message);
+    png_image_free(&png);
+    return;
+  }
+
+  image->width = png.width;
+  image->height = png.height;
+  image->mips.push_back(vector<unsigned char>());
+  image->mips.back().swap(pixels);
+
+  // Mipmap down to the point where the smaller side is one texel. Going any
+  // further would blend this tile with its neighbors in the atlas.
+  int width = image->width, height = image->height;
+  while (width > 1 && height > 1) {
+    vector<unsigned char> next;
+    Downsample(image->mips.back(), width, height, &next);
+    image->mips.push_back(vector<unsigned char>());
+    image->mips.back().swap(next);
+    width = std::max(width / 2, 1);
+    height = std::max(height / 2, 1);
+  }
+}
+
+void TextureAtlas::Pack() {
+  TRACE_SCOPE("TextureAtlas::Pack");
+
+  // Pack square slots (each the size of its image's larger side) largest
+  // first, splitting free squares into quarters as needed. Every slot ends
+  // up at a multiple of its own size.
+  vector<Image *> order;
+  for (unsigned int i = 0; i < images_.size(); ++i) {
+    if (!images_[i].mips.empty()) {
+      order.push_back(&images_[i]);
+    }
+  }
+  if (order.empty()) {
+    packed_ = true;
+    return;
+  }
+  std::sort(order.begin(), order.end(), [](const Image *a, const Image *b) {
+    return std::max(a->width, a->height) > std::max(b->width, b->height);
+  });
+
+  // Start with a square big enough for the total area, and grow it until
+  // everything fits.
+  long area = 0;
+  for (unsigned int i = 0; i < order.size(); ++i) {
+    long side = std::max(order[i]->width, order[i]->height);
+    area += side * side;
+  }
+  int root = std::max(order[0]->width, order[0]->height);
+  while ((long)root * root < area) {
+    root *= 2;
+  }
+
+  struct Square { int x, y, size; };
+  while (true) {
+    vector<Square> free_squares(1, Square{ 0, 0, root });
+    bool fits = true;
+    for (unsigned int i = 0; i < order.size() && fits; ++i) {
+      int size = std::max(order[i]->width, order[i]->height);
+
+      // The smallest free square that is big enough, preferring low rows so
+      // the atlas can be trimmed at the top.
+      int best = -1;
+      for (unsigned int j = 0; j < free_squares.size(); ++j) {
+        const Square &s = free_squares[j];
+        if (s.size >= size &&
+            (best < 0 || s.size < free_squares[best].size ||
+             (s.size == free_squares[best].size &&
+              s.y < free_squares[best].y))) {
+          best = j;
+        }
+      }
+      if (best < 0) {
+        fits = false;
+        break;
+      }
+
+      Square square = free_squares[best];
+      free_squares.erase(free_squares.begin() + best);
+      while (square.size > size) {
+        int half = square.size / 2;
+        free_squares.push_back(Square{ square.x + half, square.y, half });
+        free_squares.push_back(Square{ square.x, square.y + half, half });
+        free_squares.push_back(
+            Square{ square.x + half, square.y + half, half });
+        square.size = half;
+      }
+      order[i]->x = square.x;
+      order[i]->y = square.y;
+    }
+    if (fits) {
+      break;
+    }
+    root *= 2;
+  }
+
+  // Trim unused rows off the top.
+  width_ = root;
+  height_ = 1;
+  for (unsigned int i = 0; i < order.size(); ++i) {
+    height_ = std::max(height_, order[i]->y + order[i]->height);
+  }
+  while (!IsPowerOfTwo(height_)) {
+    ++height_;
+  }
+
+  // Levels go down until the smallest tile is one texel on its short side.
+  unsigned int num_levels = order[0]->mips.size();
+  for (unsigned int i = 0; i < order.size(); ++i) {
+    num_levels = std::min(num_levels, (unsigned int)order[i]->mips.size());
+  }
+
+  levels_.resize(num_levels);
+  for (unsigned int level = 0; level < num_levels; ++level) {
+    int level_width = std::max(width_ >> level, 1);
+    int level_height = std::max(height_ >> level, 1);
+    vector<unsigned char> &pixels = levels_[level];
+    pixels.assign(level_width * level_height * 4, 0);
+
+    for (unsigned int i = 0; i < order.size(); ++i) {
+      const Image *image = order[i];
+      int tile_width = std::max(image->width >> level, 1);
+      int tile_height = std::max(image->height >> level, 1);
+      int x = image->x >> level, y = image->y >> level;
+      for (int row = 0; row < tile_height; ++row) {
+        memcpy(&pixels[((y + row) * level_width + x) * 4],
+               &image->mips[level][row * tile_width * 4], tile_width * 4);
+      }
+    }
+  }
+
+  // The per-image copies are no longer needed.
+  for (unsigned int i = 0; i < order.size(); ++i) {
+    vector<vector<unsigned char> >().swap(order[i]->mips);
+  }
+
+  printf("Packed %u textures into a %dx%d atlas with %u levels.\n",
+         (unsigned int)order.size(), width_, height_, num_levels);
+  packed_ = true;
+}
+
+void TextureAtlas::Update() {
+  if (ready_ || !packed_) {
+    return;
+  }
+
+  if (levels_.empty()) {
+    // Nothing decoded; leave everything untextured.
+    ready_ = true;
+    return;
+  }
+
+  if (texture_ == 0) {
+    glGenTextures(1, &texture_);
+    glBindTexture(GL_TEXTURE_2D, texture_);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+                    GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels_.size() - 1);
+    for (unsigned int level = 0; level < levels_.size(); ++level) {
+      glTexImage2D(GL_TEXTURE_2D, level, GL_RGBA8,
+                   std::max(width_ >> level, 1), std::max(height_ >> level, 1),
+                   0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glGenBuffers(1, &pixel_buffer_);
+  }
+
+  const int level = next_level_;
+  const int level_width = std::max(width_ >> level, 1);
+  const int level_height = std::max(height_ >> level, 1);
+
+  if (!copy_in_flight_) {
+    // Map a fresh pixel buffer and let a worker fill it.
+    const vector<unsigned char> &pixels = levels_[level];
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pixel_buffer_);
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, pixels.size(), NULL, GL_STREAM_DRAW);
+    void *mapped = glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    if (!mapped) {
+      printf("Unable to map a pixel buffer for the texture atlas.\n");
+      glDeleteBuffers(1, &pixel_buffer_);
+      glDeleteTextures(1, &texture_);
+      texture_ = 0;
+      ready_ = true;
+      return;
+    }
+
+    copy_state_ = QUEUED;
+    copy_in_flight_ = true;
+    const unsigned char *source = &pixels[0];
+    size_t size = pixels.size();
+    pool_->Submit([this, mapped, source, size]() {
+      int queued = QUEUED;
+      if (!copy_state_.compare_exchange_strong(queued, COPYING)) {
+        return;
+      }
+      TRACE_SCOPE("TextureAtlas::Copy");
+      memcpy(mapped, source, size);
+      copy_state_ = COPIED;
+    });
+    return;
+  }
+
+  if (copy_state_ != COPIED) {
+    return;
+  }
+
+  // The buffer is full: hand it to GL, which copies it into the texture
+  // asynchronously.
+  TRACE_SCOPE("TextureAtlas::Upload");
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pixel_buffer_);
+  glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+  glBindTexture(GL_TEXTURE_2D, texture_);
+  glTexSubImage2D(GL_TEXTURE_2D, level, 0, 0, level_width, level_height,
+                  GL_RGBA, GL_UNSIGNED_BYTE, 0);
+  glBindTexture(GL_TEXTURE_2D, 0);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+  vector<unsigned char>().swap(levels_[level]);
+  copy_in_flight_ = false;
+  next_level_++;
+
+  if (next_level_ == (int)levels_.size()) {
+    glDeleteBuffers(1, &pixel_buffer_);
+    pixel_buffer_ = 0;
+    ready_ = true;
+  }
+}
+
+void TextureAtlas::Cancel() {
+  if (copy_in_flight_) {
+    int queued = QUEUED;
+    if (!copy_state_.compare_exchange_strong(queued, CANCELLED)) {
+      // Only a memcpy left to wait for.
+      while (copy_state_ != COPIED) {
+        std::this_thread::yield();
+      }
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pixel_buffer_);
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    copy_in_flight_ = false;
+  }
+  if (pixel_buffer_ != 0) {
+    glDeleteBuffers(1, &pixel_buffer_);
+    pixel_buffer_ = 0;
+  }
+  ready_ = true;
+}
+
+bool TextureAtlas::HasTile(int tile) const {
+  return packed_ && tile >= 0 && tile < (int)images_.size() &&
+         images_[tile].width > 0;
+}
+
+void TextureAtlas::MapToTile(int tile, Model_OBJ *obj) const {
+  if (!HasTile(tile) || !obj->texcoords) {
+    return;
+  }
+
+  const Image &image = images_[tile];
+  const float u0 = (float)image.x / width_;
+  const float v0 = (float)image.y / height_;
+  const float du = (float)image.width / width_;
+  const float dv = (float)image.height / height_;
+
+  // Clamp to the tile, since the atlas cannot repeat a single tile.
+  long total_vertices = obj->TotalConnectedTriangles / 3;
+  float *texcoords = obj->texcoords;
+  for (long i = 0; i < total_vertices; ++i) {
+    float u = std::min(std::max(texcoords[2 * i], 0.0f), 1.0f);
+    float v = std::min(std::max(texcoords[2 * i + 1], 0.0f), 1.0f);
+    texcoords[2 * i] = u0 + u * du;
+    texcoords[2 * i + 1] = v0 + v * dv;
+  }
+}
@@ -0,0 +1,108 @@
+#ifndef __TEXTURE_H__
+#define __TEXTURE_H__
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+// Disco Wookie includes
+#include "obj_reader.h"
+#include "thread_pool.h"
+
+using std::string;
+using std::vector;
+
+// TextureAtlas packs several PNG images, with their mipmaps, into a single
+// OpenGL texture so that every textured model can be drawn with one bind.
+//
+// All of the expensive work happens off the render thread:
+//
+//   1. Each PNG is decoded and mipmapped by its own task on the thread pool.
+//   2. The last decoder to finish packs every image into the atlas, one
+//      buffer per mipmap level.
+//   3. Each frame, Update() moves one level towards the GPU: it maps a pixel
+//      buffer object, has a worker copy the level into it, and on a later
+//      frame unmaps it and starts an asynchronous glTexSubImage2D from it.
+//
+// Tiles have power-of-two sizes and are packed at multiples of their own
+// size, so the mipmaps of neighboring tiles never bleed into each other.
+class TextureAtlas {
+ public:
+  TextureAtlas();
+
+  // Adds an image to the atlas and returns its tile number. Call before
+  // Load().
+  int Add(const string &path);
+
+  // Starts decoding and packing on the pool, and returns immediately.
+  void Load(ThreadPool *pool);
+
+  // Advances the upload by at most one step. Call once per frame from the
+  // render thread.
+  void Update();
+
+  // Abandons the upload, so that no worker writes to a mapped pixel buffer
+  // once the GL context is gone: keeps a queued copy from starting, waits
+  // for one that has, and releases the buffer. Call from the render thread
+  // before destroying the context.
+  void Cancel();
+
+  // True once the whole texture, with all its mipmaps, is on the GPU.
+  bool ready() const { return ready_; }
+
+  // True if the tile's image loaded and is part of the atlas.
+  bool HasTile(int tile) const;
+
+  GLuint texture() const { return texture_; }
+
+  // Rewrites a model's [0, 1] texture coordinates to address its tile.
+  void MapToTile(int tile, Model_OBJ *obj) const;
+
+ private:
+  struct Image {
+    Image() : width(0), height(0), x(0), y(0) {}
+
+    string path;
+    int width;
+    int height;
+
+    // Position in the atlas, in texels.
+    int x;
+    int y;
+
+    // mips[0] is the full image; each level halves the size, down to the
+    // level at which the image's smaller side is one texel.
+    vector<vector<unsigned char> > mips;
+  };
+
+  // Decodes one image and builds its mipmaps. Runs on a worker.
+  void Decode(Image *image);
+
+  // Places every decoded image and copies it into levels_. Runs on a worker.
+  void Pack();
+
+  vector<Image> images_;
+  ThreadPool *pool_;
+
+  // Decoders still running. Whoever brings this to zero packs the atlas.
+  std::atomic<int> images_pending_;
+  std::atomic<bool> packed_;
+
+  int width_;
+  int height_;
+  vector<vector<unsigned char> > levels_;
+
+  // Where the copy into the mapped pixel buffer is. The worker only starts
+  // one that is still queued, so that Cancel() can take it back.
+  enum CopyState { QUEUED, COPYING, COPIED, CANCELLED };
+
+  // Upload state, owned by the render thread.
+  GLuint texture_;
+  GLuint pixel_buffer_;
+  int next_level_;
+  bool copy_in_flight_;
+  std::atomic<int> copy_state_;
+  bool ready_;
+};
+
+#endif // __TEXTURE_H__
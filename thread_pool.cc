@@ -0,0 +1,127 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+#include "trace.h"
+
+namespace {
+
+// Shared by everyone working on one ParallelFor. Helpers that start after
+// the loop has finished find no chunks left, and only touch this, which
+// they keep alive.
+struct ParallelLoop {
+  std::function<void(int, int)> fn;
+  int count;
+  int chunk_size;
+  int num_chunks;
+  std::atomic<int> next_chunk;
+  std::atomic<int> chunks_done;
+
+  // Runs chunks until there are none left.
+  void Work() {
+    int chunk;
+    while ((chunk = next_chunk.fetch_add(1)) < num_chunks) {
+      int begin = chunk * chunk_size;
+      fn(begin, std::min(begin + chunk_size, count));
+      chunks_done.fetch_add(1, std::memory_order_release);
+    }
+  }
+};
+
+}  // namespace
+
+ThreadPool::ThreadPool(unsigned int num_threads) : stopping_(false) {
+  if (num_threads == 0) {
+    num_threads = std::thread::hardware_concurrency();
+  }
+  if (num_threads == 0) {
+    num_threads = 2;
+  }
+
+  for (unsigned int i = 0; i < num_threads; ++i) {
+    workers_.push_back(std::thread(&ThreadPool::WorkerLoop, this));
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  wakeup_.notify_all();
+
+  for (unsigned int i = 0; i < workers_.size(); ++i) {
+    workers_[i].join();
+  }
+}
+
+void ThreadPool::Submit(const std::function<void()> &task) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tasks_.push_back(task);
+  }
+  wakeup_.notify_one();
+}
+
+void ThreadPool::ParallelFor(int count, int grain,
+                             const std::function<void(int, int)> &fn) {
+  TRACE_SCOPE("ThreadPool::ParallelFor");
+  if (count <= 0) {
+    return;
+  }
+
+  // About four chunks per thread evens out the load without much overhead.
+  const int num_threads = workers_.size() + 1;
+  int chunk_size = std::max(grain, (count + 4 * num_threads - 1) /
+                                       (4 * num_threads));
+  int num_chunks = (count + chunk_size - 1) / chunk_size;
+  if (num_chunks == 1) {
+    fn(0, count);
+    return;
+  }
+
+  std::shared_ptr<ParallelLoop> loop(new ParallelLoop);
+  loop->fn = fn;
+  loop->count = count;
+  loop->chunk_size = chunk_size;
+  loop->num_chunks = num_chunks;
+  loop->next_chunk = 0;
+  loop->chunks_done = 0;
+
+  int helpers = std::min((int)workers_.size(), num_chunks - 1);
+  for (int i = 0; i < helpers; ++i) {
+    Submit([loop]() { loop->Work(); });
+  }
+  loop->Work();
+
+  // The last chunks may still be running on workers; they are short.
+  while (loop->chunks_done.load(std::memory_order_acquire) < num_chunks) {
+    std::this_thread::yield();
+  }
+}
+
+void ThreadPool::WorkerLoop() {
+  TRACE_THREAD_NAME("worker");
+
+  while (true) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      while (tasks_.empty() && !stopping_) {
+        wakeup_.wait(lock);
+      }
+
+      // Drain the queue before stopping, so that destruction never drops
+      // work that was already submitted.
+      if (tasks_.empty()) {
+        return;
+      }
+      task = tasks_.front();
+      tasks_.pop_front();
+    }
+
+    task();
+  }
+}
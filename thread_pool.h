@@ -0,0 +1,51 @@
+#ifndef __THREAD_POOL_H__
+#define __THREAD_POOL_H__
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads that run submitted tasks in FIFO order.
+//
+// Tasks must not touch OpenGL: the GL context belongs to the render thread.
+// The usual pattern is for a task to do the CPU work and then set an atomic
+// flag, which the render thread polls once per frame before uploading the
+// result.
+class ThreadPool {
+ public:
+  // num_threads = 0 means one thread per core.
+  explicit ThreadPool(unsigned int num_threads = 0);
+
+  // Waits for all queued tasks to finish, then joins the workers.
+  ~ThreadPool();
+
+  void Submit(const std::function<void()> &task);
+
+  // Calls fn(begin, end) over [0, count) in chunks of at least grain items,
+  // on the workers and on the calling thread, and returns once all of them
+  // are done. The caller takes chunks too, so this never waits on workers
+  // that are busy with other tasks; it just gets less help from them.
+  void ParallelFor(int count, int grain,
+                   const std::function<void(int, int)> &fn);
+
+  unsigned int size() const { return workers_.size(); }
+
+ private:
+  void WorkerLoop();
+
+  std::vector<std::thread> workers_;
+
+  std::mutex mutex_;
+  std::condition_variable wakeup_;
+  std::deque<std::function<void()> > tasks_;
+  bool stopping_;
+
+  // ThreadPool owns threads; it cannot be copied.
+  ThreadPool(ThreadPool const &);
+  void operator=(ThreadPool const &);
+};
+
+#endif // __THREAD_POOL_H__
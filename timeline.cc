@@ -0,0 +1,54 @@
+#include "timeline.h"
+
+#include <stdio.h>
+
+#include <algorithm>
+
+int Timeline::Load(const string &path) {
+  FILE *file = fopen(path.c_str(), "r");
+  if (!file) {
+    printf("Unable to open timeline %s\n", path.c_str());
+    return 1;
+  }
+
+  entries_.clear();
+  next_ = 0;
+
+  char line[256];
+  int line_number = 0;
+  int result = 0;
+  while (fgets(line, sizeof(line), file)) {
+    ++line_number;
+
+    char address[128];
+    float value;
+    Entry entry;
+    int fields = sscanf(line, " %lf %127s %f", &entry.time, address, &value);
+    if (fields <= 0) {
+      // Blank, or a comment.
+      continue;
+    }
+    if (fields != 3 || !ParseControlAddress(address, value, &entry.command)) {
+      printf("%s:%d: cannot parse: %s", path.c_str(), line_number, line);
+      result = 1;
+      break;
+    }
+    entries_.push_back(entry);
+  }
+  fclose(file);
+
+  // Commands at the same time keep their order in the file.
+  std::stable_sort(entries_.begin(), entries_.end(),
+                   [](const Entry &a, const Entry &b) {
+                     return a.time < b.time;
+                   });
+  return result;
+}
+
+bool Timeline::Next(double time, ControlCommand *command) {
+  if (next_ >= entries_.size() || entries_[next_].time > time) {
+    return false;
+  }
+  *command = entries_[next_++].command;
+  return true;
+}
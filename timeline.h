@@ -0,0 +1,47 @@
+#ifndef __TIMELINE_H__
+#define __TIMELINE_H__
+
+#include <string>
+#include <vector>
+
+// Disco Wookie includes
+#include "control_server.h"
+
+using std::string;
+using std::vector;
+
+// A timeline schedules control commands for a video export, so that a
+// preview can switch modes, fade layers and turn the model in time with the
+// music, exactly as an operator would during the show.
+//
+// A timeline file has one command per line: the time in seconds, then a
+// control address and its value, as sent over OSC. For example:
+//
+//   # Bands for the intro, then beats once the drums come in.
+//   0     /hallucination/mode 4
+//   31.5  /hallucination/mode 2
+//   31.5  /hallucination/tempo 0
+//
+// Blank lines and lines starting with # are ignored.
+class Timeline {
+ public:
+  Timeline() : next_(0) {}
+
+  // Returns 0 on success. Prints the offending line on a parse error.
+  int Load(const string &path);
+
+  // Takes the next command due at or before time, if any. Call repeatedly
+  // until it returns false; time must not go backwards.
+  bool Next(double time, ControlCommand *command);
+
+ private:
+  struct Entry {
+    double time;
+    ControlCommand command;
+  };
+
+  vector<Entry> entries_;
+  unsigned int next_;
+};
+
+#endif // __TIMELINE_H__
@@ -0,0 +1,253 @@
+#include "trace.h"
+
+#ifdef HALLUCINATION_TRACING
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+namespace {
+
+// Events per thread. At 60 frames per second and a few dozen events per
+// frame this holds the last several seconds of activity.
+const uint64_t kRingSize = 1 << 16;
+const uint64_t kRingMask = kRingSize - 1;
+
+// The most threads traced at once. Threads beyond this are ignored.
+const int kMaxThreads = 32;
+
+struct TraceEvent {
+  const char *name;
+  double timestamp_us;
+  double value;
+  uint64_t id;
+  char phase;
+};
+
+// One event in a ring. sequence is 0 while the owning thread writes it, and
+// its position in the ring plus 1 once written, so a reader can tell a whole
+// event from one that was being overwritten while it was copied.
+struct TraceSlot {
+  std::atomic<uint64_t> sequence;
+  std::atomic<const char *> name;
+  std::atomic<double> timestamp_us;
+  std::atomic<double> value;
+  std::atomic<uint64_t> id;
+  std::atomic<char> phase;
+};
+
+// A single-producer ring. Only the owning thread writes events; the dumping
+// thread reads them. Rings live in static storage, all zero until a thread
+// writes to them, so that a thread's first event allocates nothing: it may
+// be on the audio callback. They take about 100 MB of address space, but
+// only the pages written to take memory. A thread claims a free ring with in_use, and
+// gives it back when it exits, so that threads that come and go, like the
+// channel workers, do not use rings up. Its events start at begin.
+struct TraceRing {
+  TraceSlot events[kRingSize];
+  std::atomic<uint64_t> head;
+  std::atomic<uint64_t> begin;
+  std::atomic<const char *> thread_name;
+  std::atomic<bool> in_use;
+};
+
+TraceRing rings[kMaxThreads];
+
+thread_local TraceRing *thread_ring = NULL;
+thread_local bool thread_ring_full = false;
+
+volatile sig_atomic_t dump_requested = 0;
+int dump_count = 0;
+
+const std::chrono::steady_clock::time_point trace_epoch =
+    std::chrono::steady_clock::now();
+
+double NowMicroseconds() {
+  return std::chrono::duration<double, std::micro>(
+             std::chrono::steady_clock::now() - trace_epoch).count();
+}
+
+// Runs as a thread that claimed a ring exits. Its events stay in the ring,
+// to be dumped, until another thread claims it.
+void ReleaseRing(void *ring) {
+  ((TraceRing *)ring)->in_use.store(false, std::memory_order_release);
+}
+
+// Gives each thread's ring back when the thread exits. Setting a key created
+// this early does not allocate.
+pthread_key_t ring_key;
+const bool have_ring_key = pthread_key_create(&ring_key, ReleaseRing) == 0;
+
+TraceRing *GetThreadRing() {
+  if (thread_ring || thread_ring_full) {
+    return thread_ring;
+  }
+
+  for (int i = 0; i < kMaxThreads; ++i) {
+    bool in_use = false;
+    if (rings[i].in_use.compare_exchange_strong(in_use, true,
+                                                std::memory_order_acq_rel)) {
+      thread_ring = &rings[i];
+      break;
+    }
+  }
+  if (!thread_ring) {
+    thread_ring_full = true;
+    return NULL;
+  }
+
+  // The last owner's events are not this thread's.
+  thread_ring->thread_name.store(NULL);
+  thread_ring->begin.store(thread_ring->head.load(std::memory_order_relaxed),
+                           std::memory_order_release);
+  if (have_ring_key) {
+    pthread_setspecific(ring_key, thread_ring);
+  }
+  return thread_ring;
+}
+
+void SignalHandler(int) { dump_requested = 1; }
+
+// Event names are string literals from our own source, but escape them
+// anyway so that a stray quote cannot break the JSON.
+void WriteEscaped(FILE *file, const char *s) {
+  for (; *s; ++s) {
+    if (*s == '"' || *s == '\\') {
+      fputc('\\', file);
+    }
+    fputc(*s, file);
+  }
+}
+
+} // namespace
+
+void TraceSetThreadName(const char *name) {
+  TraceRing *ring = GetThreadRing();
+  if (ring) {
+    ring->thread_name.store(name);
+  }
+}
+
+void TraceRecord(char phase, const char *name, uint64_t id, double value) {
+  TraceRing *ring = GetThreadRing();
+  if (!ring) {
+    return;
+  }
+
+  // A seqlock per event: the fence keeps the fields from being written
+  // before the sequence says they are being written.
+  const std::memory_order relaxed = std::memory_order_relaxed;
+  uint64_t head = ring->head.load(relaxed);
+  TraceSlot &event = ring->events[head & kRingMask];
+  event.sequence.store(0, relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  event.name.store(name, relaxed);
+  event.timestamp_us.store(NowMicroseconds(), relaxed);
+  event.value.store(value, relaxed);
+  event.id.store(id, relaxed);
+  event.phase.store(phase, relaxed);
+  event.sequence.store(head + 1, std::memory_order_release);
+  ring->head.store(head + 1, std::memory_order_release);
+}
+
+void TraceRequestDump() { dump_requested = 1; }
+
+void TraceInstallSignalHandler() { signal(SIGUSR1, SignalHandler); }
+
+bool TraceDumpIfRequested() {
+  if (!dump_requested) {
+    return false;
+  }
+  dump_requested = 0;
+
+  char path[64];
+  snprintf(path, sizeof(path), "hallucination-trace-%d.json", dump_count++);
+  if (TraceDump(path)) {
+    printf("Wrote trace to %s\n", path);
+  }
+  return true;
+}
+
+bool TraceDump(const char *path) {
+  FILE *file = fopen(path, "w");
+  if (!file) {
+    printf("Unable to open %s for writing.\n", path);
+    return false;
+  }
+
+  fprintf(file, "{\"traceEvents\":[\n");
+  bool first = true;
+
+  std::vector<TraceEvent> events;
+  for (int tid = 0; tid < kMaxThreads; ++tid) {
+    TraceRing *ring = &rings[tid];
+    uint64_t end = ring->head.load(std::memory_order_acquire);
+    uint64_t begin = std::max(ring->begin.load(std::memory_order_acquire),
+                              (end > kRingSize) ? end - kRingSize : 0);
+    const char *thread_name = ring->thread_name.load();
+    if (begin == end && !thread_name) {
+      continue;
+    }
+
+    if (thread_name) {
+      fprintf(file, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,"
+              "\"tid\":%d,\"args\":{\"name\":\"", first ? "" : ",\n", tid);
+      WriteEscaped(file, thread_name);
+      fprintf(file, "\"}}");
+      first = false;
+    }
+
+    // Copy each event, and keep it only if its sequence, before and after,
+    // says it is the event at that position, whole: the writer may have
+    // lapped the copy, or been writing it at the time.
+    const std::memory_order relaxed = std::memory_order_relaxed;
+    events.clear();
+    for (uint64_t i = begin; i < end; ++i) {
+      const TraceSlot &slot = ring->events[i & kRingMask];
+      if (slot.sequence.load(std::memory_order_acquire) != i + 1) {
+        continue;
+      }
+      TraceEvent event;
+      event.name = slot.name.load(relaxed);
+      event.timestamp_us = slot.timestamp_us.load(relaxed);
+      event.value = slot.value.load(relaxed);
+      event.id = slot.id.load(relaxed);
+      event.phase = slot.phase.load(relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (slot.sequence.load(relaxed) == i + 1) {
+        events.push_back(event);
+      }
+    }
+
+    for (size_t i = 0; i < events.size(); ++i) {
+      const TraceEvent &event = events[i];
+      fprintf(file, "%s{\"ph\":\"%c\",\"name\":\"", first ? "" : ",\n",
+              event.phase);
+      WriteEscaped(file, event.name);
+      fprintf(file, "\",\"pid\":1,\"tid\":%d,\"ts\":%.3f", tid,
+              event.timestamp_us);
+      if (event.phase == 'C') {
+        fprintf(file, ",\"args\":{\"value\":%g}", event.value);
+      } else if (event.phase == 's' || event.phase == 'f') {
+        // Flow events bind to the enclosing zone on their thread.
+        fprintf(file, ",\"cat\":\"flow\",\"id\":%llu%s",
+                (unsigned long long)event.id,
+                event.phase == 'f' ? ",\"bp\":\"e\"" : "");
+      }
+      fprintf(file, "}");
+      first = false;
+    }
+  }
+
+  fprintf(file, "\n]}\n");
+  fclose(file);
+  return true;
+}
+
+#endif // HALLUCINATION_TRACING
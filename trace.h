@@ -0,0 +1,84 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+// Lightweight cross-thread tracing.
+//
+// Each thread that records an event gets its own fixed-size ring buffer, so
+// recording never takes a lock and never allocates: the rings are static,
+// and a thread claims a free one on its first event, even on the audio
+// callback, and gives it back when it exits. When a ring fills up, the
+// oldest events are overwritten.
+//
+// A dump writes every ring out in the Chrome trace-event JSON format, which
+// can be opened in chrome://tracing or https://ui.perfetto.dev. Dumps are
+// requested with TraceRequestDump() (the T key, or SIGUSR1) and performed by
+// the render loop, outside of any signal handler.
+//
+// Tracing is compiled out entirely unless HALLUCINATION_TRACING is defined
+// (cmake -DENABLE_TRACING=ON). Event names must be string literals; only the
+// pointer is stored.
+//
+//   TRACE_SCOPE("Display");          // a zone lasting until end of scope
+//   TRACE_COUNTER("tempo_bpm", bpm); // a sampled value
+//   TRACE_FLOW_BEGIN("beat", id);    // an arrow from here...
+//   TRACE_FLOW_END("beat", id);      // ...to here, possibly on another thread
+
+#ifdef HALLUCINATION_TRACING
+
+#include <stdint.h>
+
+// Names the calling thread in the trace.
+void TraceSetThreadName(const char *name);
+
+// Records a single event on the calling thread's ring buffer.
+void TraceRecord(char phase, const char *name, uint64_t id, double value);
+
+// Asks for a dump. Safe to call from a signal handler.
+void TraceRequestDump();
+
+// Installs a SIGUSR1 handler that calls TraceRequestDump().
+void TraceInstallSignalHandler();
+
+// If a dump was requested, writes one and returns true. Call periodically
+// from a thread that is allowed to do file I/O.
+bool TraceDumpIfRequested();
+
+// Writes all ring buffers to the given path as Chrome trace JSON.
+bool TraceDump(const char *path);
+
+// Records a begin event on construction and an end event on destruction.
+class TraceScope {
+ public:
+  explicit TraceScope(const char *name) : name_(name) {
+    TraceRecord('B', name_, 0, 0.0);
+  }
+  ~TraceScope() { TraceRecord('E', name_, 0, 0.0); }
+
+ private:
+  const char *name_;
+};
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+#define TRACE_COUNTER(name, value) TraceRecord('C', name, 0, (value))
+#define TRACE_FLOW_BEGIN(name, id) TraceRecord('s', name, (id), 0.0)
+#define TRACE_FLOW_END(name, id) TraceRecord('f', name, (id), 0.0)
+#define TRACE_THREAD_NAME(name) TraceSetThreadName(name)
+
+#else // HALLUCINATION_TRACING
+
+#define TRACE_SCOPE(name) do {} while (0)
+#define TRACE_COUNTER(name, value) do {} while (0)
+#define TRACE_FLOW_BEGIN(name, id) do {} while (0)
+#define TRACE_FLOW_END(name, id) do {} while (0)
+#define TRACE_THREAD_NAME(name) do {} while (0)
+
+inline void TraceRequestDump() {}
+inline void TraceInstallSignalHandler() {}
+inline bool TraceDumpIfRequested() { return false; }
+
+#endif // HALLUCINATION_TRACING
+
+#endif // __TRACE_H__
@@ -0,0 +1,308 @@
+#include "video_export.h"
+
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+// Disco Wookie includes
+#include "trace.h"
+
+// Antialiasing, to match the window.
+static const int kSamples = 4;
+
+VideoExporter::VideoExporter()
+  : width_(0),
+    height_(0),
+    fps_(0),
+    y4m_(false),
+    output_(NULL),
+    output_is_pipe_(false),
+    framebuffer_(0),
+    color_buffer_(0),
+    depth_buffer_(0),
+    resolve_framebuffer_(0),
+    resolve_color_buffer_(0),
+    frames_captured_(0),
+    frames_read_(0),
+    closing_(false),
+    write_failed_(false) {
+  for (int i = 0; i < kNumPixelBuffers; ++i) {
+    pixel_buffers_[i] = 0;
+  }
+}
+
+VideoExporter::~VideoExporter() {
+  if (output_) {
+    Close();
+  }
+}
+
+int VideoExporter::Open(const string &path, int width, int height, int fps) {
+  width_ = width;
+  height_ = height;
+  fps_ = fps;
+  y4m_ = path.size() > 4 && path.compare(path.size() - 4, 4, ".y4m") == 0;
+
+  if (path == "-") {
+    // Everything else we print moves to stderr, so that it cannot end up in
+    // the middle of the video.
+    fflush(stdout);
+    int fd = dup(STDOUT_FILENO);
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    output_ = fdopen(fd, "wb");
+  } else if (path[0] == '|') {
+    // Report an encoder that exits early as a write error instead of dying.
+    signal(SIGPIPE, SIG_IGN);
+    output_ = popen(path.c_str() + 1, "w");
+    output_is_pipe_ = true;
+  } else {
+    output_ = fopen(path.c_str(), "wb");
+  }
+  if (!output_) {
+    printf("Unable to open %s for the video\n", path.c_str());
+    return 1;
+  }
+
+  GLint max_samples = 0;
+  glGetIntegerv(GL_MAX_SAMPLES, &max_samples);
+  const int samples = std::min(kSamples, (int)max_samples);
+
+  glGenRenderbuffers(1, &color_buffer_);
+  glBindRenderbuffer(GL_RENDERBUFFER, color_buffer_);
+  glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, GL_RGBA8, width,
+                                   height);
+  glGenRenderbuffers(1, &depth_buffer_);
+  glBindRenderbuffer(GL_RENDERBUFFER, depth_buffer_);
+  glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples,
+                                   GL_DEPTH_COMPONENT24, width, height);
+  glGenFramebuffers(1, &framebuffer_);
+  glBindFramebuffer(GL_FRAMEBUFFER, framebuffer_);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                            GL_RENDERBUFFER, color_buffer_);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+                            GL_RENDERBUFFER, depth_buffer_);
+  GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+
+  glGenRenderbuffers(1, &resolve_color_buffer_);
+  glBindRenderbuffer(GL_RENDERBUFFER, resolve_color_buffer_);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+  glGenFramebuffers(1, &resolve_framebuffer_);
+  glBindFramebuffer(GL_FRAMEBUFFER, resolve_framebuffer_);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                            GL_RENDERBUFFER, resolve_color_buffer_);
+  GLenum resolve_status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+
+  glBindRenderbuffer(GL_RENDERBUFFER, 0);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  if (status != GL_FRAMEBUFFER_COMPLETE ||
+      resolve_status != GL_FRAMEBUFFER_COMPLETE) {
+    printf("Unable to create a %dx%d offscreen framebuffer\n", width, height);
+    Close();
+    return 1;
+  }
+
+  const size_t frame_size = (size_t)width * height * 4;
+  glGenBuffers(kNumPixelBuffers, pixel_buffers_);
+  for (int i = 0; i < kNumPixelBuffers; ++i) {
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, pixel_buffers_[i]);
+    glBufferData(GL_PIXEL_PACK_BUFFER, frame_size, NULL, GL_STREAM_READ);
+  }
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+  frames_.assign(kNumFrames, vector<unsigned char>(frame_size));
+  for (int i = 0; i < kNumFrames; ++i) {
+    free_.push_back(i);
+  }
+
+  // Y4M is 4:2:0, so a frame is a full-size luma plane and two quarter-size
+  // chroma planes; PPM is packed RGB.
+  if (y4m_) {
+    converted_.resize((size_t)width * height * 3 / 2);
+    fprintf(output_, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n", width,
+            height, fps);
+  } else {
+    converted_.resize((size_t)width * height * 3);
+  }
+
+  writer_ = std::thread(&VideoExporter::WriterLoop, this);
+  return 0;
+}
+
+void VideoExporter::Bind() {
+  glBindFramebuffer(GL_FRAMEBUFFER, framebuffer_);
+  glViewport(0, 0, width_, height_);
+}
+
+void VideoExporter::CaptureFrame() {
+  TRACE_SCOPE("VideoExporter::CaptureFrame");
+
+  // Resolve the samples, then start an asynchronous read into the next
+  // pixel buffer.
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer_);
+  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, resolve_framebuffer_);
+  glBlitFramebuffer(0, 0, width_, height_, 0, 0, width_, height_,
+                    GL_COLOR_BUFFER_BIT, GL_NEAREST);
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, resolve_framebuffer_);
+
+  glBindBuffer(GL_PIXEL_PACK_BUFFER,
+               pixel_buffers_[frames_captured_ % kNumPixelBuffers]);
+  glReadPixels(0, 0, width_, height_, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  ++frames_captured_;
+
+  // Once every buffer is in flight, collect the oldest, so that it is free
+  // for the next frame.
+  if (frames_captured_ - frames_read_ == kNumPixelBuffers) {
+    ReadBack(frames_read_ % kNumPixelBuffers);
+  }
+}
+
+void VideoExporter::ReadBack(int buffer) {
+  TRACE_SCOPE("VideoExporter::ReadBack");
+  ++frames_read_;
+
+  int frame;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    changed_.wait(lock, [this]() { return !free_.empty() || write_failed_; });
+    if (write_failed_) {
+      return;
+    }
+    frame = free_.back();
+    free_.pop_back();
+  }
+
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, pixel_buffers_[buffer]);
+  const void *pixels = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+  if (pixels) {
+    memcpy(&frames_[frame][0], pixels, frames_[frame].size());
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+  }
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (pixels) {
+      full_.push_back(frame);
+    } else {
+      free_.push_back(frame);
+    }
+  }
+  changed_.notify_all();
+}
+
+int VideoExporter::Close() {
+  if (writer_.joinable()) {
+    while (frames_read_ < frames_captured_) {
+      ReadBack(frames_read_ % kNumPixelBuffers);
+    }
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      closing_ = true;
+    }
+    changed_.notify_all();
+    writer_.join();
+  }
+
+  if (pixel_buffers_[0]) {
+    glDeleteBuffers(kNumPixelBuffers, pixel_buffers_);
+  }
+  GLuint framebuffers[] = { framebuffer_, resolve_framebuffer_ };
+  GLuint renderbuffers[] = { color_buffer_, depth_buffer_,
+                             resolve_color_buffer_ };
+  glDeleteFramebuffers(2, framebuffers);
+  glDeleteRenderbuffers(3, renderbuffers);
+
+  int result = write_failed_ ? 1 : 0;
+  if (output_) {
+    int status = output_is_pipe_ ? pclose(output_) : fclose(output_);
+    if (status != 0) {
+      result = 1;
+    }
+    output_ = NULL;
+  }
+  if (result != 0) {
+    printf("Error writing the video\n");
+  }
+  return result;
+}
+
+void VideoExporter::WriterLoop() {
+  TRACE_THREAD_NAME("video writer");
+  while (true) {
+    int frame;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      changed_.wait(lock, [this]() { return !full_.empty() || closing_; });
+      if (full_.empty()) {
+        return;
+      }
+      frame = full_.front();
+      full_.pop_front();
+    }
+
+    bool ok = !write_failed_ && WriteFrame(&frames_[frame][0]);
+
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      free_.push_back(frame);
+      write_failed_ = !ok;
+    }
+    changed_.notify_all();
+  }
+}
+
+bool VideoExporter::WriteFrame(const unsigned char *rgba) {
+  TRACE_SCOPE("VideoExporter::WriteFrame");
+  const int width = width_;
+  const int height = height_;
+  const size_t stride = (size_t)width * 4;
+  unsigned char *out = &converted_[0];
+
+  // OpenGL's rows run bottom to top; video's run top to bottom.
+  if (!y4m_) {
+    for (int y = 0; y < height; ++y) {
+      const unsigned char *row = rgba + (height - 1 - y) * stride;
+      for (int x = 0; x < width; ++x) {
+        *out++ = row[4 * x];
+        *out++ = row[4 * x + 1];
+        *out++ = row[4 * x + 2];
+      }
+    }
+    return fprintf(output_, "P6\n%d %d\n255\n", width, height) > 0 &&
+           fwrite(&converted_[0], converted_.size(), 1, output_) == 1;
+  }
+
+  // BT.601 studio range, with each chroma sample the average of a 2x2
+  // block.
+  unsigned char *luma = out;
+  unsigned char *cb = luma + (size_t)width * height;
+  unsigned char *cr = cb + (size_t)width * height / 4;
+  for (int y = 0; y < height; y += 2) {
+    const unsigned char *rows[2] = { rgba + (height - 1 - y) * stride,
+                                     rgba + (height - 2 - y) * stride };
+    for (int x = 0; x < width; x += 2) {
+      int r = 0, g = 0, b = 0;
+      for (int dy = 0; dy < 2; ++dy) {
+        for (int dx = 0; dx < 2; ++dx) {
+          const unsigned char *p = rows[dy] + 4 * (x + dx);
+          luma[(y + dy) * width + x + dx] =
+              16 + ((66 * p[0] + 129 * p[1] + 25 * p[2] + 128) >> 8);
+          r += p[0];
+          g += p[1];
+          b += p[2];
+        }
+      }
+      r /= 4;
+      g /= 4;
+      b /= 4;
+      *cb++ = 128 + ((-38 * r - 74 * g + 112 * b + 128) >> 8);
+      *cr++ = 128 + ((112 * r - 94 * g - 18 * b + 128) >> 8);
+    }
+  }
+  return fwrite("FRAME\n", 6, 1, output_) == 1 &&
+         fwrite(&converted_[0], converted_.size(), 1, output_) == 1;
+}
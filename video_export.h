@@ -0,0 +1,104 @@
+#ifndef __VIDEO_EXPORT_H__
+#define __VIDEO_EXPORT_H__
+
+#include <stdio.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// GLWFW includes
+#include <GLFW/glfw3.h>
+
+using std::string;
+using std::vector;
+
+// VideoExporter renders into an offscreen framebuffer and streams the frames
+// to a file or a pipe, as Y4M or as a sequence of binary PPM images.
+//
+// Reading pixels straight into client memory would make glReadPixels wait
+// for the GPU to finish every frame. Instead, each frame is read into the
+// next of a ring of pixel buffer objects, and the only buffer mapped is the
+// one filled kNumPixelBuffers - 1 frames earlier, whose transfer finished
+// long ago. Its pixels are copied into a spare frame and handed to a writer
+// thread, which does the color conversion and the I/O, so a slow disk or
+// encoder only holds up rendering once every spare frame is queued.
+class VideoExporter {
+ public:
+  VideoExporter();
+
+  // Closes the output if it is still open.
+  ~VideoExporter();
+
+  // Creates the framebuffer, which needs a current GL context, and opens
+  // path: "-" is standard output, "|command" pipes into a shell command,
+  // and a name ending in .y4m gets Y4M. Anything else gets PPM images.
+  // width and height must be even. Returns 0 on success.
+  int Open(const string &path, int width, int height, int fps);
+
+  // Directs rendering into the offscreen framebuffer, at the video size.
+  void Bind();
+
+  // Queues the frame that was just rendered for writing.
+  void CaptureFrame();
+
+  // Writes out every frame still in flight and closes the output. Returns
+  // 0 if every frame was written.
+  int Close();
+
+  int width() const { return width_; }
+  int height() const { return height_; }
+
+ private:
+  static const int kNumPixelBuffers = 3;
+  static const int kNumFrames = 4;
+
+  // Copies the pixels out of a pixel buffer and queues them for the writer.
+  void ReadBack(int buffer);
+
+  void WriterLoop();
+  bool WriteFrame(const unsigned char *rgba);
+
+  int width_;
+  int height_;
+  int fps_;
+  bool y4m_;
+
+  FILE *output_;
+  bool output_is_pipe_;
+
+  // Rendering goes into a multisampled framebuffer, which is resolved into
+  // a plain one for reading.
+  GLuint framebuffer_;
+  GLuint color_buffer_;
+  GLuint depth_buffer_;
+  GLuint resolve_framebuffer_;
+  GLuint resolve_color_buffer_;
+
+  GLuint pixel_buffers_[kNumPixelBuffers];
+  int frames_captured_;
+  int frames_read_;
+
+  // Frames travel from the render thread to the writer through full_, and
+  // back through free_, so nothing is allocated per frame.
+  vector<vector<unsigned char> > frames_;
+  std::mutex mutex_;
+  std::condition_variable changed_;
+  std::deque<int> full_;
+  vector<int> free_;
+  bool closing_;
+  bool write_failed_;
+
+  // Owned by the writer thread: the converted frame.
+  vector<unsigned char> converted_;
+  std::thread writer_;
+
+  // VideoExporter owns a thread; it cannot be copied.
+  VideoExporter(VideoExporter const &);
+  void operator=(VideoExporter const &);
+};
+
+#endif // __VIDEO_EXPORT_H__
@@ -1,15 +1,41 @@
 #include "visualizer.h"
 
+#include <sys/stat.h>
+
+#include <fstream>
+#include <random>
+#include <sstream>
+
 #include "audio.h"
-#include "debug.h"
+#include "bands.h"
 #include "hair.h"
+#include "structured_light.h"
+#include "thread_pool.h"
+#include "trace.h"
 
-void Visualizer::Draw(double time) {
-  Illuminate(time);
-  const vector<Hair>& hairs = fur_->hairs;
-  for (unsigned int i = 0; i < hairs.size(); ++i) {
-    hairs[i].Draw();
+void Visualizer::Update(double time, float brightness) {
+  TRACE_SCOPE("Visualizer::Update");
+  vector<Rgba>& colors = fur_->colors;
+  DirtyRanges& dirty = fur_->dirty;
+  dirty.Clear();
+
+  repaint_ = fur_->repaint;
+  {
+    TRACE_SCOPE("Visualizer::Illuminate");
+    Illuminate(time);
+  }
+
+  // Colors are linear, so the outputs dim them with a plain multiply as
+  // they convert them (see Fur::Output()). The colors stay as Illuminate()
+  // set them, and a new gain only has every hair converted again.
+  const float level = std::min(std::max(opacity_ * brightness, 0.0f), 1.0f);
+  const int gain = (int)(256.0f * level);
+  if (repaint_ || gain != fur_->gain) {
+    dirty.AddAll(colors.size());
   }
+  fur_->gain = gain;
+  fur_->repaint = false;
+  repaint_ = false;
 }
 
 PhotogrammetryVisualizer::PhotogrammetryVisualizer(Fur* fur)
@@ -18,22 +44,79 @@ PhotogrammetryVisualizer::PhotogrammetryVisualizer(Fur* fur)
     last_change_(0) {}
 
 void PhotogrammetryVisualizer::Illuminate(double time) {
-  vector<Hair>& hairs = fur_->hairs;
-  for (unsigned int i = 0; i < hairs.size(); ++i) {
-    Hair& hair = hairs[i];
-    float illumination = 0.0f;
-
-    // In this mode, each hair is lit for 1/10th of a second. The hairs
-    // are cycled through in random order.
-    if (time - last_change_ > 0.1f) {
-      lit_hair_ = (lit_hair_ + 1) % hairs.size();
-      last_change_ = time;
+  vector<Rgba>& colors = fur_->colors;
+  if (colors.empty()) {
+    return;
+  }
+  if (repaint_) {
+    std::fill(colors.begin(), colors.end(), MakeRgba(0, 0, 0));
+  }
+
+  // In this mode, each hair is lit for 1/10th of a second. The hairs
+  // are cycled through in order, so each frame changes at most two.
+  bool changed = repaint_;
+  if (time - last_change_ > 0.1f) {
+    if (lit_hair_ >= 0 && lit_hair_ < (int)colors.size()) {
+      colors[lit_hair_] = MakeRgba(0, 0, 0);
+      fur_->dirty.Add(lit_hair_);
     }
+    lit_hair_ = (lit_hair_ + 1) % colors.size();
+    last_change_ = time;
+    fur_->dirty.Add(lit_hair_);
+    changed = true;
+  }
+  if (changed && lit_hair_ >= 0 && lit_hair_ < (int)colors.size()) {
+    colors[lit_hair_] = MakeRgba(255, 255, 255);
+  }
+}
+
+// How long each structured light pattern is shown, in seconds.
+static const double kPatternSeconds = 0.2;
+
+StructuredLightVisualizer::StructuredLightVisualizer(Fur* fur)
+  : Visualizer(fur),
+    bits_(1),
+    start_(-1),
+    last_time_(-1),
+    pattern_(-1) {}
+
+// virtual
+void StructuredLightVisualizer::Reposition() {
+  const vector<Hair>& hairs = fur_->hairs;
+  int num_channels = 0;
+  for (unsigned int i = 0; i < hairs.size(); ++i) {
+    num_channels = std::max(num_channels, hairs[i].led_channel + 1);
+  }
+  bits_ = StructuredLightBits(num_channels);
+  start_ = -1;
+}
+
+void StructuredLightVisualizer::Illuminate(double time) {
+  if (start_ < 0 || time - last_time_ > kPatternSeconds) {
+    start_ = time;
+  }
+  last_time_ = time;
 
-    illumination = (i == lit_hair_) ? 1.0f : -1.0f;
+  // Frames that fall exactly on a change of pattern, as in a video export,
+  // show the new one.
+  const int num_patterns = StructuredLightPatterns(bits_);
+  const int pattern =
+      (int)((time - start_) / kPatternSeconds + 1e-6) % num_patterns;
+  if (pattern == pattern_ && !repaint_) {
+    return;
+  }
+  pattern_ = pattern;
 
-    hair.SetGrey(illumination);
+  const vector<Hair>& hairs = fur_->hairs;
+  vector<Rgba>& colors = fur_->colors;
+  const int num_hairs = std::min(hairs.size(), colors.size());
+  for (int i = 0; i < num_hairs; ++i) {
+    const int channel = hairs[i].led_channel;
+    const bool lit =
+        channel >= 0 && StructuredLightLit(pattern, channel, bits_);
+    colors[i] = lit ? MakeRgba(255, 255, 255) : MakeRgba(0, 0, 0);
   }
+  fur_->dirty.Add(0, num_hairs);
 }
 
 void InitRandomFur(const vector<Hair>& hairs, vector<double>* frequencies,
@@ -51,6 +134,11 @@ void InitRandomFur(const vector<Hair>& hairs, vector<double>* frequencies,
 RandomWaveVisualizer::RandomWaveVisualizer(Fur* fur)
   : Visualizer(fur) {
   InitRandomFur(fur->hairs, &frequency_, &phase_);
+
+  // One cycle of the wave, from mid grey up to full, down to off and back.
+  for (int i = 0; i < Palette::kSize; ++i) {
+    wave_.set(i, Grey(0.5f + 0.5f * sinf(2.0f * M_PI * i / Palette::kSize)));
+  }
 }
 
 // virtual
@@ -62,12 +150,14 @@ void RandomWaveVisualizer::Reposition() {
 }
 
 void RandomWaveVisualizer::Illuminate(double time) {
-  vector<Hair>& hairs = fur_->hairs;
-  for (unsigned int i = 0; i < hairs.size(); ++i) {
-    Hair& hair = hairs[i];
-    float illumination = sin(frequency_[i] * time + phase_[i]);
-    hair.SetGrey(illumination);
+  vector<Rgba>& colors = fur_->colors;
+  const int num_hairs = std::min(colors.size(), frequency_.size());
+  for (int i = 0; i < num_hairs; ++i) {
+    double turns = (frequency_[i] * time + phase_[i]) * (0.5 / M_PI);
+    turns -= floor(turns);
+    colors[i] = wave_[(int)(turns * Palette::kSize)];
   }
+  fur_->dirty.Add(0, num_hairs);
 }
 
 void InitBeatFur(const vector<Hair>& hairs, vector<float>* illumination) {
@@ -77,13 +167,26 @@ void InitBeatFur(const vector<Hair>& hairs, vector<float>* illumination) {
 BeatVisualizer::BeatVisualizer(Fur* fur, AudioProcessor* audio)
   : Visualizer(fur),
     audio_(audio),
-    num_beats_(0) {
+    tempo_override_bpm_(0.0f),
+    override_beat_(-1),
+    num_lit_(0) {
   InitBeatFur(fur->hairs, &illumination_);
 }
 
 // virtual
 void BeatVisualizer::Reposition() {
   InitBeatFur(fur_->hairs, &illumination_);
+  num_lit_ = illumination_.size();
+}
+
+// virtual
+void BeatVisualizer::Subscribe(AudioProcessor* audio) {
+  audio_ = audio;
+
+  // Whatever the new audio detected while nobody was looking is stale.
+  float time_s, strength, tempo_bpm, confidence;
+  audio_->IsOnset(time_s, strength);
+  audio_->IsBeat(time_s, tempo_bpm, confidence);
 }
 
 void BeatVisualizer::Illuminate(double time) {
@@ -98,15 +201,12 @@ void BeatVisualizer::Illuminate(double time) {
 
   // The audio processor tells us when an onset event has occurred since the 
   // last time through this OpenGL display loop.
-  float last_onset_s;
-  bool is_onset = audio_->IsOnset(last_onset_s);
+  float last_onset_s, onset_strength;
+  bool is_onset = audio_->IsOnset(last_onset_s, onset_strength);
   if (is_onset) {
-    static int num_onsets = 0;
-    if (DEBUG_MODE) printf("onset %d: time %.3f s\n", num_onsets++, last_onset_s);
-
-    // The aubio library does not provide confidence values for onsets.
-    // TODO(wcraddock): what the hell is the right idea here?
-    confidence = 0.5f;
+    // The ensemble's strength follows how much the music changed, so soft
+    // onsets light the hairs dimly and hard hits light them fully.
+    confidence = onset_strength;
   }
 
   // The audio processor tells us when a beat event has occurred since the 
@@ -115,20 +215,34 @@ void BeatVisualizer::Illuminate(double time) {
   float last_beat_s, tempo_bpm;
   bool is_beat = audio_->IsBeat(last_beat_s, tempo_bpm, beat_confidence);
   if (is_beat) {
+    TRACE_FLOW_END("beat", audio_->num_beats);
+
     // If the beat_confidence is very low, don't count it as a beat at all.
     // Otherwise, make it a strong visual event by giving it high confidence.
     if (beat_confidence >= 0.2f) {
       confidence = 1.0f;
-      if (DEBUG_MODE) {
-        printf("beat %d: time %.3f s, tempo %.2f bpm, confidence %.2f\n",
-	       num_beats_++, last_beat_s, tempo_bpm, confidence);
-      }
     }
   }
 
-  vector<Hair>& hairs = fur_->hairs;
-  for (unsigned int i = 0; i < hairs.size(); ++i) {
-    Hair& hair = hairs[i];
+  // With a tempo override, the beats come from the clock instead, and the
+  // detectors are ignored.
+  if (tempo_override_bpm_ > 0.0f) {
+    long beat = (long)(time * tempo_override_bpm_ / 60.0);
+    is_onset = false;
+    is_beat = (beat != override_beat_);
+    confidence = 1.0f;
+    override_beat_ = beat;
+  }
+
+  // Once every hair has faded out, only a beat can change anything.
+  if (!is_onset && !is_beat && num_lit_ == 0 && !repaint_) {
+    return;
+  }
+
+  vector<Rgba>& colors = fur_->colors;
+  const int num_hairs = std::min(colors.size(), illumination_.size());
+  num_lit_ = 0;
+  for (int i = 0; i < num_hairs; ++i) {
     float illumination = illumination_[i];
 
     if (is_onset || is_beat) {
@@ -144,8 +258,545 @@ void BeatVisualizer::Illuminate(double time) {
       illumination = illumination * (63.0f / 64.0f);
     }
 
+    // Below half a step, the hair is black; stop decaying it.
+    if (illumination < 0.5f / 255.0f) {
+      illumination = 0.0f;
+    } else {
+      ++num_lit_;
+    }
+
     illumination_[i] = illumination;
-    illumination = 2.0f * illumination - 1.0f;
-    hair.SetGrey(illumination);
+    const Rgba color = Grey(illumination);
+    if (color != colors[i]) {
+      colors[i] = color;
+      fur_->dirty.Add(i);
+    }
+  }
+}
+
+// A level that moves less than half an 8-bit step can not be seen. Such
+// changes are held back until they add up, so that quiet noise leaves the
+// fur, and the display, at rest.
+static const float kMinLevelChange = 0.5f / 255.0f;
+
+// Whether any of the levels differs visibly from the shown one.
+static bool VisiblyChanged(const float* levels, const float* shown,
+                           int count) {
+  for (int i = 0; i < count; ++i) {
+    if (fabsf(levels[i] - shown[i]) >= kMinLevelChange) {
+      return true;
+    }
+  }
+  return false;
+}
+
+BandVisualizer::BandVisualizer(Fur* fur, AudioProcessor* audio)
+  : Visualizer(fur),
+    audio_(audio) {
+  for (int b = 0; b < BandAnalyzer::kNumBands; ++b) {
+    envelopes_[b] = -1.0f;
+  }
+}
+
+// virtual
+void BandVisualizer::Reposition() {
+  const vector<Hair>& hairs = fur_->hairs;
+  band_.resize(hairs.size());
+  blend_.resize(hairs.size());
+  tint_.resize(hairs.size());
+  if (hairs.empty()) {
+    return;
+  }
+
+  // Map the height of each hair onto the bands, lowest band at the hem.
+  float min_y = hairs[0].top_center.y;
+  float max_y = min_y;
+  for (unsigned int i = 0; i < hairs.size(); ++i) {
+    min_y = std::min(min_y, hairs[i].top_center.y);
+    max_y = std::max(max_y, hairs[i].top_center.y);
+  }
+  const float height = std::max(max_y - min_y, 1e-6f);
+
+  // Hues run from red at the hem, for the bass, to violet at the shoulders.
+  static const Palette hues = Palette::Hues();
+  const int last_band = BandAnalyzer::kNumBands - 1;
+  for (unsigned int i = 0; i < hairs.size(); ++i) {
+    float fraction = (hairs[i].top_center.y - min_y) / height;
+    float position = last_band * fraction;
+    int band = std::min((int)position, last_band - 1);
+    band_[i] = band;
+    blend_[i] = position - band;
+    tint_[i] = hues[(int)(0.8f * (Palette::kSize - 1) * fraction)];
+  }
+}
+
+void BandVisualizer::Illuminate(double /* time */) {
+  float envelopes[BandAnalyzer::kNumBands];
+  audio_->bands.GetEnvelopes(envelopes);
+  if (!repaint_ &&
+      !VisiblyChanged(envelopes, envelopes_, BandAnalyzer::kNumBands)) {
+    return;
+  }
+  std::copy(envelopes, envelopes + BandAnalyzer::kNumBands, envelopes_);
+
+  // Precompute the step from each band to the next, so that the per-hair
+  // loop is a gather and a multiply-add.
+  float steps[BandAnalyzer::kNumBands];
+  for (int b = 0; b < BandAnalyzer::kNumBands - 1; ++b) {
+    steps[b] = envelopes[b + 1] - envelopes[b];
+  }
+  steps[BandAnalyzer::kNumBands - 1] = 0.0f;
+
+  const int num_hairs = band_.size();
+  if (num_hairs == 0) {
+    return;
+  }
+  const int* band = &band_[0];
+  const float* blend = &blend_[0];
+  const Rgba* tint = &tint_[0];
+  Rgba* colors = &fur_->colors[0];
+  for (int i = 0; i < num_hairs; ++i) {
+    float value = envelopes[band[i]] + blend[i] * steps[band[i]];
+    colors[i] = Scale(tint[i], value);
+  }
+  fur_->dirty.Add(0, num_hairs);
+}
+
+// Notes the pitch detector is less sure of than this are ignored.
+static const float kMinPitchConfidence = 0.6f;
+
+// How much of the way to a new note's hue is covered each frame.
+static const float kHueGlide = 0.2f;
+
+PitchVisualizer::PitchVisualizer(Fur* fur, AudioProcessor* audio)
+  : Visualizer(fur),
+    audio_(audio),
+    hues_(Palette::Hues()),
+    hue_(0.0f),
+    shown_hue_(-1),
+    shown_level_(-1.0f) {}
+
+// virtual
+void PitchVisualizer::Reposition() {
+  const vector<Hair>& hairs = fur_->hairs;
+  offset_.resize(hairs.size());
+  if (hairs.empty()) {
+    return;
+  }
+
+  float min_y = hairs[0].top_center.y;
+  float max_y = min_y;
+  for (unsigned int i = 0; i < hairs.size(); ++i) {
+    min_y = std::min(min_y, hairs[i].top_center.y);
+    max_y = std::max(max_y, hairs[i].top_center.y);
+  }
+  const float height = std::max(max_y - min_y, 1e-6f);
+
+  // Two semitones, from the hem to the shoulders.
+  const float spread = 2.0f * Palette::kSize / 12.0f;
+  for (unsigned int i = 0; i < hairs.size(); ++i) {
+    offset_[i] = (int)(spread * (hairs[i].top_center.y - min_y) / height);
+  }
+}
+
+void PitchVisualizer::Illuminate(double /* time */) {
+  float pitch = audio_->pitch_hz.load(std::memory_order_relaxed);
+  float confidence = audio_->pitch_confidence.load(std::memory_order_relaxed);
+  if (pitch > 0.0f && confidence >= kMinPitchConfidence) {
+    // The pitch class, as a fraction of an octave above C.
+    float octaves = log2f(pitch / 261.63f);
+    float target = Palette::kSize * (octaves - floorf(octaves));
+
+    // Glide the shorter way round the color wheel.
+    float delta = target - hue_;
+    delta -= Palette::kSize * floorf(delta / Palette::kSize + 0.5f);
+    hue_ += kHueGlide * delta;
+    hue_ -= Palette::kSize * floorf(hue_ / Palette::kSize);
+  }
+
+  float envelopes[BandAnalyzer::kNumBands];
+  audio_->bands.GetEnvelopes(envelopes);
+  float level = 0.0f;
+  for (int b = 0; b < BandAnalyzer::kNumBands; ++b) {
+    level += envelopes[b];
+  }
+  level /= BandAnalyzer::kNumBands;
+
+  const int base = (int)hue_;
+  if (!repaint_ && base == shown_hue_ &&
+      !VisiblyChanged(&level, &shown_level_, 1)) {
+    return;
+  }
+  shown_hue_ = base;
+  shown_level_ = level;
+
+  // Every hair shares the level, so scale the palette once and leave each
+  // hair a single lookup.
+  Palette scaled;
+  for (int i = 0; i < Palette::kSize; ++i) {
+    scaled.set(i, Scale(hues_[i], level));
+  }
+
+  vector<Rgba>& colors = fur_->colors;
+  const int num_hairs = std::min(colors.size(), offset_.size());
+  for (int i = 0; i < num_hairs; ++i) {
+    colors[i] = scaled[base + offset_[i]];
+  }
+  fur_->dirty.Add(0, num_hairs);
+}
+
+// How often to look for changes to the effect file, in seconds.
+static const double kReloadInterval = 0.5;
+
+// The coarsest resolution of modification times, in seconds: FAT's.
+static const int kModifiedResolution = 2;
+
+ExpressionVisualizer::ExpressionVisualizer(Fur* fur, AudioProcessor* audio,
+                                           const string& path)
+  : Visualizer(fur),
+    audio_(audio),
+    path_(path),
+    last_check_(-kReloadInterval),
+    loaded_(false),
+    modified_(0),
+    size_(0),
+    inode_(0),
+    read_time_(0),
+    num_beats_(0),
+    last_beat_time_(0),
+    tempo_(0) {}
+
+void ExpressionVisualizer::Reload() {
+  // Reading and comparing the text every check is wasted on a file nobody
+  // is editing. But an edit within a modification time's resolution of the
+  // last read may not change the time, so until the file was modified
+  // well before it was read, it is read again anyway.
+  struct stat info;
+  const bool have_info = stat(path_.c_str(), &info) == 0;
+  if (have_info && loaded_ && info.st_mtime == modified_ &&
+      info.st_size == size_ && info.st_ino == inode_ &&
+      modified_ + kModifiedResolution < read_time_) {
+    return;
+  }
+
+  std::ifstream file(path_.c_str());
+  if (!file) {
+    if (loaded_ || last_check_ < 0) {
+      printf("Unable to read effect %s\n", path_.c_str());
+    }
+    loaded_ = false;
+    return;
+  }
+  std::stringstream text;
+  text << file.rdbuf();
+  if (have_info) {
+    modified_ = info.st_mtime;
+    size_ = info.st_size;
+    inode_ = info.st_ino;
+    read_time_ = time(NULL);
+  }
+  if (loaded_ && text.str() == source_) {
+    return;
+  }
+  const bool reloading = !source_.empty();
+  source_ = text.str();
+  loaded_ = true;
+
+  string error;
+  if (expression_.Compile(source_, &error)) {
+    if (reloading) {
+      printf("Reloaded effect %s\n", path_.c_str());
+    }
+  } else {
+    printf("%s: %s\n", path_.c_str(), error.c_str());
+  }
+}
+
+// virtual
+void ExpressionVisualizer::Reposition() {
+  const vector<Hair>& hairs = fur_->hairs;
+  const int padded = Expression::PaddedSize(hairs.size());
+  for (int i = 0; i < Expression::kNumHairInputs; ++i) {
+    inputs_[i].assign(padded, 0.0f);
+  }
+  for (int o = 0; o < Expression::kNumOutputs; ++o) {
+    outputs_[o].assign(padded, 0.0f);
+  }
+  if (hairs.empty()) {
+    return;
+  }
+
+  float min_y = hairs[0].top_center.y;
+  float max_y = min_y;
+  for (unsigned int i = 0; i < hairs.size(); ++i) {
+    min_y = std::min(min_y, hairs[i].top_center.y);
+    max_y = std::max(max_y, hairs[i].top_center.y);
+  }
+  const float height = std::max(max_y - min_y, 1e-6f);
+
+  // The random values are fixed per hair, and the same on every run.
+  std::mt19937 random(1);
+  const float scale = 1.0f / 4294967296.0f;
+
+  for (unsigned int i = 0; i < hairs.size(); ++i) {
+    const Hair& hair = hairs[i];
+    inputs_[Expression::X][i] = hair.top_center.x;
+    inputs_[Expression::Y][i] = hair.top_center.y;
+    inputs_[Expression::Z][i] = hair.top_center.z;
+    inputs_[Expression::NX][i] = hair.normal.x;
+    inputs_[Expression::NY][i] = hair.normal.y;
+    inputs_[Expression::NZ][i] = hair.normal.z;
+    inputs_[Expression::HEIGHT][i] = (hair.top_center.y - min_y) / height;
+    inputs_[Expression::INDEX][i] = hair.led_channel;
+    inputs_[Expression::RANDOM][i] = random() * scale;
+    inputs_[Expression::RANDOM2][i] = random() * scale;
+  }
+}
+
+// virtual
+void ExpressionVisualizer::Subscribe(AudioProcessor* audio) {
+  // The beat phase carries on at the new audio's tempo until its next beat.
+  audio_ = audio;
+  num_beats_ = audio_->num_beats;
+  const float tempo = audio_->tempo_bpm.load(std::memory_order_relaxed);
+  if (tempo > 0.0f) {
+    tempo_ = tempo;
+  }
+}
+
+void ExpressionVisualizer::Illuminate(double time) {
+  if (time - last_check_ >= kReloadInterval) {
+    Reload();
+    last_check_ = time;
+  }
+
+  vector<Hair>& hairs = fur_->hairs;
+  if (hairs.empty()) {
+    return;
+  }
+
+  // The beat phase runs from 0 at each detected beat to 1 at the next
+  // expected one, and keeps cycling at the last tempo between detections.
+  unsigned int num_beats = audio_->num_beats;
+  if (num_beats != num_beats_) {
+    num_beats_ = num_beats;
+    last_beat_time_ = time;
+    tempo_ = audio_->tempo_bpm.load(std::memory_order_relaxed);
+  }
+  float beat = 1.0f;
+  if (tempo_ > 0.0f) {
+    beat = (time - last_beat_time_) * tempo_ / 60.0;
+    beat -= floorf(beat);
+  }
+
+  float uniforms[Expression::kNumUniforms];
+  uniforms[Expression::TIME] = time;
+  uniforms[Expression::BEAT] = beat;
+  uniforms[Expression::TEMPO] = tempo_;
+  uniforms[Expression::COUNT] = hairs.size();
+  audio_->bands.GetEnvelopes(&uniforms[Expression::BAND0]);
+  uniforms[Expression::SECTION] = audio_->section.load();
+
+  const float* inputs[Expression::kNumHairInputs];
+  for (int i = 0; i < Expression::kNumHairInputs; ++i) {
+    inputs[i] = &inputs_[i][0];
+  }
+  float* outputs[Expression::kNumOutputs];
+  for (int o = 0; o < Expression::kNumOutputs; ++o) {
+    outputs[o] = &outputs_[o][0];
+  }
+  expression_.Evaluate(uniforms, inputs, hairs.size(), outputs);
+
+  const float* brightness = outputs[Expression::BRIGHTNESS];
+  const float* red = outputs[Expression::RED];
+  const float* green = outputs[Expression::GREEN];
+  const float* blue = outputs[Expression::BLUE];
+  vector<Rgba>& colors = fur_->colors;
+  for (unsigned int i = 0; i < hairs.size(); ++i) {
+    colors[i] = FromFloats(brightness[i] * red[i], brightness[i] * green[i],
+                           brightness[i] * blue[i]);
+  }
+  fur_->dirty.Add(0, hairs.size());
+}
+
+// Time steps per second, for each model.
+static const double kSparkStepsPerSecond = 60.0;
+static const double kReactionStepsPerSecond = 240.0;
+
+// After a stall (or while hidden), the simulation slows down rather than
+// trying to catch up all at once.
+static const int kMaxStepsPerFrame = 8;
+
+// Hairs per parallel chunk. The jacket's 2400 hairs step faster on one
+// thread than they could be handed out to several.
+static const int kStepGrain = 8192;
+
+// SPARKS: how much of each hair's light mixes with its neighbors', and how
+// much of it survives, per step.
+static const float kSparkSpread = 0.5f;
+static const float kSparkDecay = 0.98f;
+
+// REACTION_DIFFUSION: Gray-Scott rates for the "mitosis" regime,
+// with the graph Laplacian standing in for the grid one.
+static const float kDiffusionU = 1.0f;
+static const float kDiffusionV = 0.5f;
+static const float kFeed = 0.0367f;
+static const float kKill = 0.0649f;
+
+// Values decay towards zero without ever reaching it, and spread ever more
+// thinly across the graph. Below this they are cut to zero, before they
+// become denormals, which are many times slower to compute with.
+static const float kNegligible = 1e-6f;
+
+DiffusionVisualizer::DiffusionVisualizer(Fur* fur, AudioProcessor* audio,
+                                         ThreadPool* pool, Model model)
+  : Visualizer(fur),
+    audio_(audio),
+    pool_(pool),
+    model_(model),
+    num_beats_(0),
+    last_step_time_(-1),
+    random_(1) {
+  if (model_ == SPARKS) {
+    palette_ = Palette::Fire();
+  } else {
+    const Rgba stops[] = {
+      MakeRgba(0, 0, 0), MakeRgba(0, 8, 96), MakeRgba(0, 160, 255),
+      MakeRgba(255, 255, 255)
+    };
+    palette_ = Palette::Gradient(stops, sizeof(stops) / sizeof(stops[0]));
+  }
+}
+
+// virtual
+void DiffusionVisualizer::Reposition() {
+  const vector<Hair>& hairs = fur_->hairs;
+  if (fur_->graph.size() != (int)hairs.size()) {
+    fur_->graph.Build(hairs, HairGraph::kNeighbors);
+  }
+
+  const int n = hairs.size();
+  u_.assign(n, model_ == SPARKS ? 0.0f : 1.0f);
+  v_.assign(n, 0.0f);
+  next_u_.assign(n, 0.0f);
+  next_v_.assign(n, 0.0f);
+  last_step_time_ = -1;
+
+  // A reaction needs something to react to before the first beat.
+  if (model_ == REACTION_DIFFUSION) {
+    for (int i = 0; i < n; i += 200) {
+      Seed(i);
+    }
+  }
+}
+
+// virtual
+void DiffusionVisualizer::Subscribe(AudioProcessor* audio) {
+  // Beats counted on the old audio must not seed a burst on the new.
+  audio_ = audio;
+  num_beats_ = audio_->num_beats;
+}
+
+void DiffusionVisualizer::Seed(int i) {
+  const HairGraph& graph = fur_->graph;
+  const int first = graph.offsets[i];
+  // The hair itself, then its neighbors.
+  for (int e = first - 1; e < graph.offsets[i + 1]; ++e) {
+    int j = (e < first) ? i : graph.neighbors[e];
+    if (model_ == SPARKS) {
+      u_[j] = 1.0f;
+    } else {
+      u_[j] = 0.5f;
+      v_[j] = 0.25f;
+    }
+  }
+}
+
+void DiffusionVisualizer::Step() {
+  TRACE_SCOPE("DiffusionVisualizer::Step");
+  const HairGraph& graph = fur_->graph;
+  const float* u = &u_[0];
+  const float* v = &v_[0];
+  float* next_u = &next_u_[0];
+  float* next_v = &next_v_[0];
+
+  // Each chunk multiplies its own rows and finishes them straight away,
+  // while they are still in cache.
+  if (model_ == SPARKS) {
+    pool_->ParallelFor(u_.size(), kStepGrain, [&](int begin, int end) {
+      graph.Multiply(u, next_u, begin, end);
+      for (int i = begin; i < end; ++i) {
+        float light = kSparkDecay * ((1.0f - kSparkSpread) * u[i] +
+                                     kSparkSpread * next_u[i]);
+        next_u[i] = light > kNegligible ? light : 0.0f;
+      }
+    });
+  } else {
+    pool_->ParallelFor(u_.size(), kStepGrain, [&](int begin, int end) {
+      graph.Multiply(u, next_u, begin, end);
+      graph.Multiply(v, next_v, begin, end);
+      for (int i = begin; i < end; ++i) {
+        float reaction = u[i] * v[i] * v[i];
+        next_u[i] = u[i] + kDiffusionU * (next_u[i] - u[i]) - reaction +
+                    kFeed * (1.0f - u[i]);
+        float next = v[i] + kDiffusionV * (next_v[i] - v[i]) + reaction -
+                     (kFeed + kKill) * v[i];
+        next_v[i] = next > kNegligible ? next : 0.0f;
+      }
+    });
+    v_.swap(next_v_);
+  }
+  u_.swap(next_u_);
+}
+
+void DiffusionVisualizer::Illuminate(double time) {
+  vector<Hair>& hairs = fur_->hairs;
+  if (hairs.empty() || u_.size() != hairs.size()) {
+    return;
+  }
+
+  // A handful of sparks or spots per beat, however many hairs there are.
+  unsigned int num_beats = audio_->num_beats;
+  const bool seeding = (num_beats != num_beats_);
+  if (seeding) {
+    num_beats_ = num_beats;
+    const int seeds = std::max((int)hairs.size() / 200, 1);
+    for (int s = 0; s < seeds; ++s) {
+      Seed(random_() % hairs.size());
+    }
+  }
+
+  const double rate =
+      model_ == SPARKS ? kSparkStepsPerSecond : kReactionStepsPerSecond;
+  if (last_step_time_ < 0) {
+    last_step_time_ = time;
+  }
+  int steps = (int)((time - last_step_time_) * rate);
+  last_step_time_ += steps / rate;
+  if (steps > kMaxStepsPerFrame) {
+    steps = kMaxStepsPerFrame;
+    last_step_time_ = time;
+  }
+  for (int s = 0; s < steps; ++s) {
+    Step();
+  }
+
+  // At display rates above the step rate, some frames have nothing new.
+  if (steps == 0 && !seeding && !repaint_) {
+    return;
+  }
+
+  // Sparks are shown as they are. The reaction's v stays below about 0.4, so
+  // it is stretched to the full range.
+  const vector<float>& shown = (model_ == SPARKS) ? u_ : v_;
+  const float gain = (model_ == SPARKS) ? 1.0f : 3.0f;
+  // Once the sparks have died out, nothing changes until the next beat.
+  vector<Rgba>& colors = fur_->colors;
+  for (unsigned int i = 0; i < hairs.size(); ++i) {
+    const Rgba color = palette_.Lookup(gain * shown[i]);
+    if (color != colors[i]) {
+      colors[i] = color;
+      fur_->dirty.Add(i);
+    }
   }
 }
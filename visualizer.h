@@ -1,30 +1,60 @@
 #ifndef __VISUALIZER_H__
 #define __VISUALIZER_H__
 
+#include <sys/types.h>
+#include <time.h>
+
+#include <random>
+#include <string>
 #include <vector>
 
+// Disco Wookie includes
+#include "bands.h"
+#include "color.h"
+#include "expression.h"
+
+using std::string;
 using std::vector;
 
 class AudioProcessor;
 class Fur;
+class ThreadPool;
 
 class Visualizer {
  public:
   // Does not take ownership of fur.
-  explicit Visualizer(Fur* fur) : fur_(fur) {}
+  explicit Visualizer(Fur* fur)
+    : fur_(fur), opacity_(1.0f), repaint_(false) {}
   virtual ~Visualizer() {}
 
-  // Called to redraw hairs at a particular time.
-  void Draw(double time);
+  // Sets the fur's colors for a particular time, and marks the hairs that
+  // changed in fur_->dirty. brightness scales the output along with the
+  // opacity, from 0 (dark) to 1 (unchanged).
+  void Update(double time, float brightness = 1.0f);
+
+  // How strongly this visualizer lights the hairs, from 0 to 1.
+  void set_opacity(float opacity) { opacity_ = opacity; }
+  float opacity() const { return opacity_; }
 
-  // Called to set the illumination of all hairs.
+  // Called to set the colors of the hairs that changed since the last call,
+  // in fur_->colors, and to add them to fur_->dirty. When repaint_ is set,
+  // every hair must be set; Update() marks them all.
   virtual void Illuminate(double time) = 0;
 
   // Called when hairs move.
   virtual void Reposition() {};
 
+  // Makes the visualizer listen to audio from now on: the mix, or one input
+  // channel (see AudioProcessor::channel()). Visualizers that do not listen
+  // ignore it. audio must outlive this.
+  virtual void Subscribe(AudioProcessor* /* audio */) {}
+
  protected:
   Fur* fur_;
+  float opacity_;
+
+  // Whether this frame must set every hair.
+  bool repaint_;
 };
 
 class PhotogrammetryVisualizer : public Visualizer {
@@ -38,6 +68,28 @@ class PhotogrammetryVisualizer : public Visualizer {
   double last_change_;
 };
 
+// Flashes every hair with the Gray code of its LED channel, one bit per
+// pattern, so that a camera can find all of them in a couple of dozen images
+// (see structured_light.h). Each pattern is shown for 0.2 s, six frames of
+// 30 fps video. The sequence starts over each time the mode is shown after a
+// pause, and repeats for as long as it is.
+class StructuredLightVisualizer : public Visualizer {
+ public:
+  explicit StructuredLightVisualizer(Fur* fur);
+  virtual ~StructuredLightVisualizer() {}
+  virtual void Illuminate(double time);
+  virtual void Reposition();
+
+ private:
+  int bits_;
+
+  // When the sequence started, when it was last shown, and which pattern is
+  // showing.
+  double start_;
+  double last_time_;
+  int pattern_;
+};
+
 class RandomWaveVisualizer : public Visualizer {
  public:
   explicit RandomWaveVisualizer(Fur* fur);
@@ -48,6 +100,10 @@ class RandomWaveVisualizer : public Visualizer {
  private:
   vector<double> frequency_;
   vector<double> phase_;
+
+  // The wave's brightness through one cycle, so each hair costs a lookup
+  // rather than a sine.
+  Palette wave_;
 };
 
 class BeatVisualizer : public Visualizer {
@@ -57,11 +113,179 @@ class BeatVisualizer : public Visualizer {
   virtual ~BeatVisualizer() {}
   virtual void Illuminate(double time);
   virtual void Reposition();
+  virtual void Subscribe(AudioProcessor* audio);
+
+  // Flashes on a fixed tempo instead of the detected beats. 0 goes back to
+  // following the audio.
+  void set_tempo_override(float bpm) { tempo_override_bpm_ = bpm; }
+  float tempo_override() const { return tempo_override_bpm_; }
 
  private:
   AudioProcessor* audio_;
-  int num_beats_;
+  float tempo_override_bpm_;
+  long override_beat_;
   vector<float> illumination_;
+
+  // Hairs not yet faded to black. Once there are none, frames without a beat
+  // change nothing.
+  int num_lit_;
+};
+
+// Lights hairs according to the energy in different frequency bands. Bass
+// lights the bottom of the jacket in red, and each higher band lights a
+// region further up in the next hue, with the highest band at the shoulders
+// in violet.
+class BandVisualizer : public Visualizer {
+ public:
+  // Does not take ownership of audio, which must outlive this.
+  BandVisualizer(Fur* fur, AudioProcessor* audio);
+  virtual ~BandVisualizer() {}
+  virtual void Illuminate(double time);
+  virtual void Reposition();
+  virtual void Subscribe(AudioProcessor* audio) { audio_ = audio; }
+
+ private:
+  AudioProcessor* audio_;
+
+  // Precomputed hair-to-band table. Each hair sits between two adjacent
+  // bands and blends them: band_[i] is the lower one, and blend_[i] is how
+  // far (0 to 1) the hair is towards the next band up.
+  vector<int> band_;
+  vector<float> blend_;
+
+  // Each hair's color at full energy, by its height.
+  vector<Rgba> tint_;
+
+  // The envelopes the colors were last set from. The colors are only set
+  // again once an envelope has moved visibly, so in silence, or quiet noise,
+  // they stop changing.
+  float envelopes_[BandAnalyzer::kNumBands];
+};
+
+// Colors the jacket by the pitch of what is playing. Each note of the scale
+// has its own hue, the same in every octave, and the hues fan out by a couple
+// of semitones up the jacket. Loudness sets the brightness.
+class PitchVisualizer : public Visualizer {
+ public:
+  // Does not take ownership of audio, which must outlive this.
+  PitchVisualizer(Fur* fur, AudioProcessor* audio);
+  virtual ~PitchVisualizer() {}
+  virtual void Illuminate(double time);
+  virtual void Reposition();
+  virtual void Subscribe(AudioProcessor* audio) { audio_ = audio; }
+
+ private:
+  AudioProcessor* audio_;
+  Palette hues_;
+
+  // The hue being shown, in palette entries. It glides towards each new
+  // note rather than jumping.
+  float hue_;
+
+  // How far round the palette each hair is from the hue being shown.
+  vector<int> offset_;
+
+  // The palette entry and level the colors were last set with.
+  int shown_hue_;
+  float shown_level_;
+};
+
+// Lights hairs with an effect program loaded from a file (see expression.h),
+// and recompiles it whenever the file changes, so that looks can be designed
+// while the show runs. If the new program does not compile, the old one
+// keeps running.
+class ExpressionVisualizer : public Visualizer {
+ public:
+  // Does not take ownership of audio, which must outlive this.
+  ExpressionVisualizer(Fur* fur, AudioProcessor* audio, const string& path);
+  virtual ~ExpressionVisualizer() {}
+  virtual void Illuminate(double time);
+  virtual void Reposition();
+  virtual void Subscribe(AudioProcessor* audio);
+
+ private:
+  // Recompiles the program if the file changed since it was last read.
+  void Reload();
+
+  AudioProcessor* audio_;
+  string path_;
+  Expression expression_;
+
+  // When the file was last checked, and what it said then. Comparing the
+  // text catches edits that modification times, with their one-second
+  // resolution on some filesystems, would miss.
+  double last_check_;
+  string source_;
+  bool loaded_;
+
+  // The file's modification time, size and inode when it was last read,
+  // and when that was, on the wall clock. While they are unchanged, and it
+  // was modified well before it was read, it is not read again.
+  time_t modified_;
+  off_t size_;
+  ino_t inode_;
+  time_t read_time_;
+
+  // For the beat phase.
+  unsigned int num_beats_;
+  double last_beat_time_;
+  float tempo_;
+
+  // Per-hair inputs and outputs, padded to whole batches.
+  vector<float> inputs_[Expression::kNumHairInputs];
+  vector<float> outputs_[Expression::kNumOutputs];
+};
+
+// Lets light spread from hair to hair across the fur's neighbor graph (see
+// hair_graph.h). The simulation advances at a fixed rate, whatever the frame
+// rate, and large hair counts are stepped in parallel on the thread pool.
+class DiffusionVisualizer : public Visualizer {
+ public:
+  enum Model {
+    // Beats light sparks on random hairs, which spread and fade.
+    SPARKS,
+    // Gray-Scott reaction-diffusion: spots that grow, split and wander
+    // across the jacket. Beats seed new spots.
+    REACTION_DIFFUSION
+  };
+
+  // Does not take ownership of audio or pool, which must outlive this.
+  DiffusionVisualizer(Fur* fur, AudioProcessor* audio, ThreadPool* pool,
+                      Model model);
+  virtual ~DiffusionVisualizer() {}
+  virtual void Illuminate(double time);
+
+  // Builds the fur's graph if nobody has yet, and starts over.
+  virtual void Reposition();
+
+  virtual void Subscribe(AudioProcessor* audio);
+
+  // Advances the simulation by one time step. Illuminate() calls this as
+  // often as the clock requires.
+  void Step();
+
+ private:
+  // Lights hair i and its neighbors.
+  void Seed(int i);
+
+  AudioProcessor* audio_;
+  ThreadPool* pool_;
+  Model model_;
+
+  unsigned int num_beats_;
+  double last_step_time_;
+  std::mt19937 random_;
+
+  // Sparks burn from white through yellow and red; the reaction glows blue.
+  Palette palette_;
+
+  // The simulated values per hair, and where the next step is written. For
+  // SPARKS, u_ is the light itself; for REACTION_DIFFUSION, u_ and v_ are
+  // the two chemicals, and v_ is shown.
+  vector<float> u_;
+  vector<float> v_;
+  vector<float> next_u_;
+  vector<float> next_v_;
 };
 
 #endif // __VISUALIZER_H__